@@ -0,0 +1,342 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <iopolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#define DEFAULT_MB  256
+#define DEFAULT_DIR "/var/tmp"
+#define CHUNK       (1024 * 1024)
+#define READ_BUF    (256 * 1024)
+
+/**
+ * @brief reads the other end of a socket pair until it is closed
+ *
+ * @param arg - pointer to the socket
+ *
+ * @return NULL
+ *
+ */
+static void *_bench_sink(void *arg);
+
+/**
+ * @brief sends the whole file over a socket pair the way proto_send_range
+ *        does, with the current iopolicy_cfg
+ *
+ * @return seconds taken; negative on error
+ *
+ */
+static double _bench_send(int fd, uint64_t size);
+
+/**
+ * @brief writes @param size bytes to a new file in chunks the way
+ *        upload_write does, then fsyncs it
+ *
+ * @param dirty - set to the most Dirty memory seen during the writes
+ *
+ * @return seconds taken including the fsync; negative on error
+ *
+ */
+static double _bench_write(const char *path,
+                           uint64_t    size,
+                           const char *buf,
+                           uint64_t *  dirty);
+
+/**
+ * @brief share of the file's pages in the page cache, in percent
+ *
+ */
+static double _bench_resident(int fd, uint64_t size);
+
+/**
+ * @brief Dirty plus Writeback from /proc/meminfo in bytes
+ *
+ */
+static uint64_t _bench_dirty(void);
+
+static double _bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+    const char *caches[] = { "cold", "warm" };
+    const char *modes[]  = { "off", "on" };
+    const char *dir      = DEFAULT_DIR;
+    long        mb       = DEFAULT_MB;
+    uint64_t    size     = 0;
+    uint64_t    dirty    = 0;
+    int         fd       = -1;
+    int         ret      = 0;
+    char *      buf      = NULL;
+    double      elapsed  = 0;
+    char        path[4096];
+    iopolicy    on;
+
+    if (1 < argc)
+    {
+        mb = strtol(argv[1], NULL, 10);
+    }
+    if (2 < argc)
+    {
+        dir = argv[2];
+    }
+    size = (uint64_t)mb << 20;
+    snprintf(path, sizeof(path), "%s/bench_iopolicy.%d", dir, (int)getpid());
+
+    // the file is as large as the drop threshold so streaming it once
+    // leaves it out of the page cache
+    on         = iopolicy_cfg;
+    on.dropmin = size;
+
+    buf = malloc(CHUNK);
+    if (NULL == buf)
+    {
+        fprintf(stderr, "! bench_iopolicy: couldn't malloc buffer\n");
+        ret = -1;
+        goto ERR;
+    }
+    memset(buf, 'x', CHUNK);
+
+    for (int m = 0; m < 2; m++)
+    {
+        memset(&iopolicy_cfg, 0, sizeof(iopolicy_cfg));
+        if (m)
+        {
+            iopolicy_cfg = on;
+        }
+
+        elapsed = _bench_write(path, size, buf, &dirty);
+        if (0 > elapsed)
+        {
+            ret = -1;
+            goto ERR;
+        }
+        printf("bench=iopolicy op=write policy=%s bytes=%" PRIu64
+               " gbps=%.2f peak_dirty_mb=%" PRIu64 "\n",
+               modes[m],
+               size,
+               size / elapsed / 1e9,
+               dirty >> 20);
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (0 > fd)
+        {
+            perror("! bench_iopolicy: couldn't open file");
+            ret = -1;
+            goto ERR;
+        }
+        for (int c = 0; c < 2; c++)
+        {
+            // clean pages are dropped without privileges; a warm run reads
+            // the file back in first
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            for (uint64_t off = 0; c && off < size; off += CHUNK)
+            {
+                if (0 >= pread(fd, buf, CHUNK, off))
+                {
+                    break;
+                }
+            }
+
+            elapsed = _bench_send(fd, size);
+            if (0 > elapsed)
+            {
+                ret = -1;
+                goto ERR;
+            }
+            printf("bench=iopolicy op=read cache=%s policy=%s bytes=%" PRIu64
+                   " gbps=%.2f resident_pct=%.0f\n",
+                   caches[c],
+                   modes[m],
+                   size,
+                   size / elapsed / 1e9,
+                   _bench_resident(fd, size));
+        }
+        close(fd);
+        fd = -1;
+        unlink(path);
+    }
+
+ERR:
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    unlink(path);
+    free(buf);
+    buf = NULL;
+    return ret;
+}
+
+static void *
+_bench_sink(void *arg)
+{
+    int   fd  = *(int *)arg;
+    char *buf = NULL;
+
+    buf = malloc(READ_BUF);
+    if (NULL == buf)
+    {
+        return NULL;
+    }
+    while (0 < read(fd, buf, READ_BUF))
+    {
+    }
+    free(buf);
+    return NULL;
+}
+
+static double
+_bench_send(int fd, uint64_t size)
+{
+    int           sv[2] = { -1, -1 };
+    off_t         pos   = 0;
+    ssize_t       slen  = 0;
+    double        start = 0;
+    iopolicy_read io    = { 0 };
+    pthread_t     sink;
+
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)
+        || 0 != pthread_create(&sink, NULL, _bench_sink, &sv[1]))
+    {
+        perror("! _bench_send: couldn't set up sink");
+        return -1;
+    }
+
+    start = _bench_now();
+    iopolicy_read_begin(&io, fd, 0, size, size);
+    while ((uint64_t)pos < size)
+    {
+        slen = sendfile(
+            sv[0], fd, &pos, iopolicy_read_next(&io, pos, size - pos));
+        if (0 >= slen)
+        {
+            perror("! _bench_send: sendfile error");
+            break;
+        }
+    }
+    iopolicy_read_end(&io, pos);
+    close(sv[0]);
+    pthread_join(sink, NULL);
+    close(sv[1]);
+
+    return ((uint64_t)pos == size) ? _bench_now() - start : -1;
+}
+
+static double
+_bench_write(const char *path,
+             uint64_t    size,
+             const char *buf,
+             uint64_t *  dirty)
+{
+    int            fd    = -1;
+    double         start = 0;
+    double         ret   = -1;
+    uint64_t       d     = 0;
+    iopolicy_write wb;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (0 > fd || 0 != iopolicy_write_init(&wb, fd))
+    {
+        perror("! _bench_write: couldn't create file");
+        goto ERR;
+    }
+
+    *dirty = 0;
+    start  = _bench_now();
+    for (uint64_t off = 0; off < size; off += CHUNK)
+    {
+        if (CHUNK != pwrite(fd, buf, CHUNK, off))
+        {
+            perror("! _bench_write: pwrite error");
+            iopolicy_write_destroy(&wb);
+            goto ERR;
+        }
+        iopolicy_written(&wb, off, CHUNK);
+        if (0 == (off / CHUNK) % 16 && (d = _bench_dirty()) > *dirty)
+        {
+            *dirty = d;
+        }
+    }
+    fsync(fd);
+    ret = _bench_now() - start;
+    iopolicy_write_destroy(&wb);
+
+ERR:
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+static double
+_bench_resident(int fd, uint64_t size)
+{
+    uint64_t       pages = (size + 4095) / 4096;
+    uint64_t       in    = 0;
+    unsigned char *vec   = NULL;
+    void *         map   = MAP_FAILED;
+
+    vec = malloc(pages);
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (NULL != vec && MAP_FAILED != map && 0 == mincore(map, size, vec))
+    {
+        for (uint64_t i = 0; i < pages; i++)
+        {
+            in += vec[i] & 1;
+        }
+    }
+    if (MAP_FAILED != map)
+    {
+        munmap(map, size);
+    }
+    free(vec);
+
+    return 100.0 * in / pages;
+}
+
+static uint64_t
+_bench_dirty(void)
+{
+    FILE *   f   = NULL;
+    uint64_t kb  = 0;
+    uint64_t ret = 0;
+    char     line[128];
+
+    f = fopen("/proc/meminfo", "r");
+    if (NULL == f)
+    {
+        return 0;
+    }
+    while (NULL != fgets(line, sizeof(line), f))
+    {
+        if (1 == sscanf(line, "Dirty: %" SCNu64, &kb)
+            || 1 == sscanf(line, "Writeback: %" SCNu64, &kb))
+        {
+            ret += kb << 10;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static double
+_bench_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
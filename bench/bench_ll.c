@@ -0,0 +1,143 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <ll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BATCH        64
+#define DEFAULT_WORK (1 << 24) // list nodes walked per depth, roughly
+
+/**
+ * @brief keeps @param list at @param depth nodes while timing batches of
+ *        BATCH push_backs and BATCH pop_fronts separately
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _bench_depth(ll *list, int depth, long iter, double *push,
+                        double *pop);
+
+/**
+ * @brief frees a node whose data is not heap allocated
+ *
+ */
+static void _bench_free_node(void *p);
+
+static double _bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+    static const int depths[] = { 0, 16, 256, 4096, 16384 };
+    long             work     = DEFAULT_WORK;
+    long             iter     = 0;
+    int              ret      = 0;
+    double           push     = 0;
+    double           pop      = 0;
+    ll *             list     = NULL;
+
+    if (1 < argc)
+    {
+        work = strtol(argv[1], NULL, 10);
+    }
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+    {
+        list = ll_init();
+        if (NULL == list)
+        {
+            fprintf(stderr, "! bench_ll: couldn't init list\n");
+            ret = -1;
+            goto ERR;
+        }
+
+        // push_back walks the list, so deeper lists get fewer rounds
+        iter = work / (depths[d] + BATCH) / BATCH;
+        iter = (0 == iter) ? 1 : iter;
+        if (0 != _bench_depth(list, depths[d], iter, &push, &pop))
+        {
+            ret = -1;
+            goto ERR;
+        }
+
+        printf("bench=ll op=push_back depth=%d iter=%ld ns_per_op=%.1f\n",
+               depths[d],
+               iter * BATCH,
+               push * 1e9 / (iter * BATCH));
+        printf("bench=ll op=pop_front depth=%d iter=%ld ns_per_op=%.1f\n",
+               depths[d],
+               iter * BATCH,
+               pop * 1e9 / (iter * BATCH));
+
+        ll_destroy(list);
+        list = NULL;
+    }
+
+ERR:
+    if (NULL != list)
+    {
+        ll_destroy(list);
+    }
+    return ret;
+}
+
+static int
+_bench_depth(ll *list, int depth, long iter, double *push, double *pop)
+{
+    static int token;
+    double     start = 0;
+
+    *push = 0;
+    *pop  = 0;
+
+    for (int i = 0; i < depth; i++)
+    {
+        if (0 != push_back(list, &token, _bench_free_node))
+        {
+            return -1;
+        }
+    }
+
+    for (long i = 0; i < iter; i++)
+    {
+        start = _bench_now();
+        for (int b = 0; b < BATCH; b++)
+        {
+            if (0 != push_back(list, &token, _bench_free_node))
+            {
+                return -1;
+            }
+        }
+        *push += _bench_now() - start;
+
+        start = _bench_now();
+        for (int b = 0; b < BATCH; b++)
+        {
+            if (NULL == pop_front(list))
+            {
+                return -1;
+            }
+        }
+        *pop += _bench_now() - start;
+    }
+
+    return 0;
+}
+
+static void
+_bench_free_node(void *p)
+{
+    free(p);
+}
+
+static double
+_bench_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,220 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <netpoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_MB 512
+#define WRITE_BUF  (256 * 1024)
+
+/**
+ * @brief what the writer thread sends
+ *
+ * @param lfd - listening socket to accept the reader's connection on
+ *
+ * @param bytes - bytes to write before closing
+ *
+ */
+typedef struct _bench_src_
+{
+    int      lfd;
+    uint64_t bytes;
+} _bench_src;
+
+/**
+ * @brief accepts one connection on the listening socket and writes
+ *        @param arg bytes to it with plain write(2)
+ *
+ * @param arg - pointer to a _bench_src
+ *
+ * @return NULL
+ *
+ */
+static void *_bench_source(void *arg);
+
+/**
+ * @brief opens a non-blocking loopback connection to @param port so the
+ *        reader sees EAGAIN whenever the writer falls behind
+ *
+ * @return socket on success; -1 on error
+ *
+ */
+static int _bench_connect(uint16_t port);
+
+static double _bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+    static const uint  sizes[] = { 512, 4096, 65536, 1 << 20 };
+    long               mb      = DEFAULT_MB;
+    uint64_t           total   = 0;
+    uint64_t           got     = 0;
+    int                lfd     = -1;
+    int                cfd     = -1;
+    int                ret     = 0;
+    char *             buf     = NULL;
+    double             start   = 0;
+    double             elapsed = 0;
+    socklen_t          addrlen = sizeof(struct sockaddr_in);
+    pthread_t          source;
+    _bench_src         src;
+    struct sockaddr_in addr;
+
+    if (1 < argc)
+    {
+        mb = strtol(argv[1], NULL, 10);
+    }
+    total = (uint64_t)mb << 20;
+
+    buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    if (NULL == buf)
+    {
+        fprintf(stderr, "! bench_netpoll_read: couldn't malloc buffer\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    lfd = tcp_socketsetup(0, AF_INET, 16);
+    if (0 >= lfd || 0 != getsockname(lfd, (struct sockaddr *)&addr, &addrlen))
+    {
+        fprintf(stderr, "! bench_netpoll_read: couldn't listen\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        // small reads are one system call each; keep their runs short
+        src.lfd   = lfd;
+        src.bytes = ((uint64_t)sizes[s] << 16 < total)
+                        ? (uint64_t)sizes[s] << 16
+                        : total / sizes[s] * sizes[s];
+
+        cfd = _bench_connect(ntohs(addr.sin_port));
+        if (0 > cfd || 0 != pthread_create(&source, NULL, _bench_source, &src))
+        {
+            ret = -1;
+            goto ERR;
+        }
+
+        start = _bench_now();
+        for (got = 0; got < src.bytes; got += sizes[s])
+        {
+            if (0 > tcp_read_handler(cfd, buf, sizes[s]))
+            {
+                ret = -1;
+                break;
+            }
+        }
+        elapsed = _bench_now() - start;
+        close(cfd);
+        cfd = -1;
+        pthread_join(source, NULL);
+        if (0 != ret)
+        {
+            goto ERR;
+        }
+
+        printf("bench=tcp_read msgsize=%u bytes=%" PRIu64 " gbps=%.2f\n",
+               sizes[s],
+               got,
+               got / elapsed / 1e9);
+    }
+
+ERR:
+    if (0 <= cfd)
+    {
+        close(cfd);
+    }
+    if (0 < lfd)
+    {
+        close(lfd);
+    }
+    free(buf);
+    buf = NULL;
+    return ret;
+}
+
+static void *
+_bench_source(void *arg)
+{
+    _bench_src *  src  = arg;
+    int           fd   = -1;
+    char *        buf  = NULL;
+    ssize_t       wlen = 0;
+    struct pollfd pfd  = { .fd = src->lfd, .events = POLLIN };
+
+    buf = malloc(WRITE_BUF);
+    if (NULL == buf)
+    {
+        return NULL;
+    }
+    memset(buf, 'x', WRITE_BUF);
+
+    // the listening socket from tcp_socketsetup is non-blocking
+    while (0 > (fd = accept(src->lfd, NULL, NULL)) && EAGAIN == errno)
+    {
+        poll(&pfd, 1, -1);
+    }
+
+    for (uint64_t left = src->bytes; 0 <= fd && 0 < left; left -= wlen)
+    {
+        wlen = write(fd, buf, (WRITE_BUF < left) ? WRITE_BUF : left);
+        if (0 >= wlen)
+        {
+            break;
+        }
+    }
+
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int
+_bench_connect(uint16_t port)
+{
+    struct sockaddr_in addr = { 0 };
+    int                fd   = -1;
+
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (0 > fd || 0 != connect(fd, (struct sockaddr *)&addr, sizeof(addr))
+        || 0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK))
+    {
+        perror("! _bench_connect: couldn't connect");
+        if (0 <= fd)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+static double
+_bench_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
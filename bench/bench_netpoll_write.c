@@ -0,0 +1,201 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <netpoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_MB 512
+#define READ_BUF   (256 * 1024)
+
+/**
+ * @brief accepts one connection on the listening socket and reads until
+ *        the writer closes it
+ *
+ * @param arg - pointer to the listening socket
+ *
+ * @return NULL
+ *
+ */
+static void *_bench_sink(void *arg);
+
+/**
+ * @brief opens a non-blocking loopback connection to @param port so the
+ *        writer sees EAGAIN whenever the receiver falls behind
+ *
+ * @return socket on success; -1 on error
+ *
+ */
+static int _bench_connect(uint16_t port);
+
+static double _bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+    static const uint  sizes[] = { 4096, 65536, 1 << 20, 16 << 20 };
+    const char *       modes[] = { "copy", "zerocopy" };
+    long               mb      = DEFAULT_MB;
+    uint64_t           total   = 0;
+    uint64_t           sent    = 0;
+    int                lfd     = -1;
+    int                cfd     = -1;
+    int                ret     = 0;
+    char *             buf     = NULL;
+    double             start   = 0;
+    double             elapsed = 0;
+    socklen_t          addrlen = sizeof(struct sockaddr_in);
+    pthread_t          sink;
+    struct sockaddr_in addr;
+
+    if (1 < argc)
+    {
+        mb = strtol(argv[1], NULL, 10);
+    }
+    total = (uint64_t)mb << 20;
+
+    buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    if (NULL == buf)
+    {
+        fprintf(stderr, "! bench_netpoll_write: couldn't malloc buffer\n");
+        ret = -1;
+        goto ERR;
+    }
+    memset(buf, 'x', sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+    lfd = tcp_socketsetup(0, AF_INET, 16);
+    if (0 >= lfd || 0 != getsockname(lfd, (struct sockaddr *)&addr, &addrlen))
+    {
+        fprintf(stderr, "! bench_netpoll_write: couldn't listen\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for (int m = 0; m < 2; m++)
+        {
+            netpoll_zcmin = m ? 1 : 0;
+
+            cfd = _bench_connect(ntohs(addr.sin_port));
+            if (0 > cfd || 0 != pthread_create(&sink, NULL, _bench_sink, &lfd))
+            {
+                ret = -1;
+                goto ERR;
+            }
+
+            start = _bench_now();
+            for (sent = 0; sent < total; sent += sizes[s])
+            {
+                if (0 > tcp_write_handler(cfd, buf, sizes[s]))
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+            close(cfd);
+            cfd = -1;
+            pthread_join(sink, NULL);
+            elapsed = _bench_now() - start;
+            if (0 != ret)
+            {
+                goto ERR;
+            }
+
+            printf("bench=tcp_write mode=%s msgsize=%u bytes=%" PRIu64
+                   " gbps=%.2f\n",
+                   modes[m],
+                   sizes[s],
+                   sent,
+                   sent / elapsed / 1e9);
+        }
+    }
+
+ERR:
+    if (0 <= cfd)
+    {
+        close(cfd);
+    }
+    if (0 < lfd)
+    {
+        close(lfd);
+    }
+    free(buf);
+    buf = NULL;
+    return ret;
+}
+
+static void *
+_bench_sink(void *arg)
+{
+    int           lfd = *(int *)arg;
+    int           fd  = -1;
+    char *        buf = NULL;
+    struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+
+    buf = malloc(READ_BUF);
+    if (NULL == buf)
+    {
+        return NULL;
+    }
+
+    // the listening socket from tcp_socketsetup is non-blocking
+    while (0 > (fd = accept(lfd, NULL, NULL)) && EAGAIN == errno)
+    {
+        poll(&pfd, 1, -1);
+    }
+
+    while (0 < fd && 0 < read(fd, buf, READ_BUF))
+    {
+    }
+
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int
+_bench_connect(uint16_t port)
+{
+    struct sockaddr_in addr = { 0 };
+    int                fd   = -1;
+
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (0 > fd || 0 != connect(fd, (struct sockaddr *)&addr, sizeof(addr))
+        || 0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK))
+    {
+        perror("! _bench_connect: couldn't connect");
+        if (0 <= fd)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+static double
+_bench_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,198 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pathres.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define MAX_DEPTH    16
+#define DEFAULT_ITER 20000
+
+/**
+ * @brief builds root/d0/d1/.../d<depth-1>/f style trees for every depth
+ *        up to MAX_DEPTH and fills @param rel with the relative path of
+ *        the file at each depth
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _bench_mktree(const char *root, char rel[][PATH_MAX]);
+
+/**
+ * @brief removes everything created by _bench_mktree
+ *
+ */
+static void _bench_rmtree(const char *root, char rel[][PATH_MAX]);
+
+/**
+ * @brief baseline: realpath(3) of root + path followed by a string prefix
+ *        check and open(2), the approach pathres replaces
+ *
+ */
+static int _bench_realpath(const char *root, const char *rel);
+
+static double _bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+    char   root[]  = "/tmp/bench_pathres.XXXXXX";
+    char   rel[MAX_DEPTH + 1][PATH_MAX];
+    long   iter    = DEFAULT_ITER;
+    int    rootfd  = -1;
+    int    fd      = -1;
+    int    ret     = 0;
+    double start   = 0;
+    double elapsed = 0;
+
+    memset(rel, 0, sizeof(rel));
+    if (1 < argc)
+    {
+        iter = strtol(argv[1], NULL, 10);
+    }
+
+    if (NULL == mkdtemp(root) || 0 != _bench_mktree(root, rel))
+    {
+        perror("! bench_pathres: couldn't create tree");
+        ret = -1;
+        goto ERR;
+    }
+
+    rootfd = pathres_rootopen(root);
+    if (0 > rootfd)
+    {
+        ret = -1;
+        goto ERR;
+    }
+
+    for (int depth = 1; depth <= MAX_DEPTH; depth *= 2)
+    {
+        start = _bench_now();
+        for (long i = 0; i < iter; i++)
+        {
+            close(_bench_realpath(root, rel[depth]));
+        }
+        elapsed = _bench_now() - start;
+        printf("bench=pathres method=realpath depth=%d iter=%ld ns_per_op=%.1f\n",
+               depth,
+               iter,
+               elapsed * 1e9 / iter);
+
+        start = _bench_now();
+        for (long i = 0; i < iter; i++)
+        {
+            fd = pathres_open(rootfd, rel[depth], O_RDONLY, 0);
+            close(fd);
+        }
+        elapsed = _bench_now() - start;
+        printf("bench=pathres method=openat2 depth=%d iter=%ld ns_per_op=%.1f\n",
+               depth,
+               iter,
+               elapsed * 1e9 / iter);
+
+        start = _bench_now();
+        for (long i = 0; i < iter; i++)
+        {
+            fd = pathres_walk(rootfd, rel[depth], O_RDONLY, 0);
+            close(fd);
+        }
+        elapsed = _bench_now() - start;
+        printf("bench=pathres method=walk depth=%d iter=%ld ns_per_op=%.1f\n",
+               depth,
+               iter,
+               elapsed * 1e9 / iter);
+    }
+
+ERR:
+    if (0 <= rootfd)
+    {
+        close(rootfd);
+    }
+    _bench_rmtree(root, rel);
+    return ret;
+}
+
+static int
+_bench_mktree(const char *root, char rel[][PATH_MAX])
+{
+    char   dir[PATH_MAX] = { 0 };
+    char   abs[PATH_MAX] = { 0 };
+    size_t len           = 0;
+    int    fd            = -1;
+
+    for (int depth = 1; depth <= MAX_DEPTH; depth++)
+    {
+        if (sizeof(abs) <= (size_t)snprintf(
+                abs, sizeof(abs), "%s/%sd%d", root, dir, depth - 1)
+            || 0 != mkdir(abs, 0755))
+        {
+            return -1;
+        }
+        len += snprintf(dir + len, sizeof(dir) - len, "d%d/", depth - 1);
+        if (PATH_MAX <= snprintf(rel[depth], PATH_MAX, "%sf", dir)
+            || sizeof(abs) <= (size_t)snprintf(
+                abs, sizeof(abs), "%s/%s", root, rel[depth]))
+        {
+            return -1;
+        }
+
+        fd = open(abs, O_CREAT | O_WRONLY, 0644);
+        if (0 > fd)
+        {
+            return -1;
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void
+_bench_rmtree(const char *root, char rel[][PATH_MAX])
+{
+    char abs[PATH_MAX] = { 0 };
+
+    for (int depth = MAX_DEPTH; depth >= 1; depth--)
+    {
+        if ('\0' == rel[depth][0])
+        {
+            continue;
+        }
+        snprintf(abs, sizeof(abs), "%s/%s", root, rel[depth]);
+        unlink(abs);
+        *strrchr(abs, '/') = '\0';
+        rmdir(abs);
+    }
+    rmdir(root);
+}
+
+static int
+_bench_realpath(const char *root, const char *rel)
+{
+    char abs[PATH_MAX]      = { 0 };
+    char resolved[PATH_MAX] = { 0 };
+
+    snprintf(abs, sizeof(abs), "%s/%s", root, rel);
+    if (NULL == realpath(abs, resolved)
+        || 0 != strncmp(resolved, root, strlen(root)))
+    {
+        return -1;
+    }
+
+    return open(resolved, O_RDONLY | O_CLOEXEC);
+}
+
+static double
+_bench_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
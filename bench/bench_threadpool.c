@@ -0,0 +1,234 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <threadpool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#define DEFAULT_JOBS    20000
+#define DEFAULT_WORKERS 4
+#define MAX_PRODUCERS   64
+
+/**
+ * @brief one queued job; records when it was added and when a worker
+ *        started it
+ *
+ */
+typedef struct _bench_job_
+{
+    uint64_t      added;
+    uint64_t      ran;
+    atomic_long * done;
+} _bench_job;
+
+/**
+ * @brief one producer thread and the slice of jobs it adds
+ *
+ */
+typedef struct _bench_producer_
+{
+    pthread_t    thread;
+    threadpool * pool;
+    _bench_job * jobs;
+    long         njobs;
+    atomic_int * go;
+    int          err;
+} _bench_producer;
+
+/**
+ * @brief job run by the pool; stamps its start time
+ *
+ */
+static void _bench_run(void *arg);
+
+/**
+ * @brief waits for the start signal, then adds every job of its slice
+ *
+ */
+static void *_bench_produce(void *arg);
+
+static int      _bench_cmp(const void *a, const void *b);
+static uint64_t _bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+    long            njobs    = DEFAULT_JOBS;
+    int             nworkers = DEFAULT_WORKERS;
+    int             ret      = 0;
+    int             started  = 0;
+    uint64_t        start    = 0;
+    uint64_t        elapsed  = 0;
+    uint64_t        added    = 0;
+    uint64_t *      lat      = NULL;
+    _bench_job *    jobs     = NULL;
+    threadpool *    pool     = NULL;
+    atomic_long     done     = 0;
+    atomic_int      go       = 0;
+    struct timespec req      = { 0, 100000 };
+    _bench_producer prod[MAX_PRODUCERS];
+
+    if (1 < argc)
+    {
+        njobs = strtol(argv[1], NULL, 10);
+    }
+    if (2 < argc)
+    {
+        nworkers = strtol(argv[2], NULL, 10);
+    }
+
+    jobs = calloc(njobs, sizeof(_bench_job));
+    lat  = calloc(njobs, sizeof(uint64_t));
+    if (NULL == jobs || NULL == lat)
+    {
+        fprintf(stderr, "! bench_threadpool: couldn't calloc jobs\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    for (int p = 1; p <= MAX_PRODUCERS; p *= 2)
+    {
+        pool = thpool_init(nworkers);
+        if (NULL == pool)
+        {
+            fprintf(stderr, "! bench_threadpool: couldn't init pool\n");
+            ret = -1;
+            goto ERR;
+        }
+
+        atomic_store(&done, 0);
+        atomic_store(&go, 0);
+        for (started = 0; started < p; started++)
+        {
+            prod[started].pool  = pool;
+            prod[started].jobs  = &jobs[njobs / p * started];
+            prod[started].njobs = njobs / p + ((p - 1 == started) ? njobs % p
+                                                                  : 0);
+            prod[started].go    = &go;
+            prod[started].err   = 0;
+            for (long i = 0; i < prod[started].njobs; i++)
+            {
+                prod[started].jobs[i].done = &done;
+            }
+            if (0 != pthread_create(&prod[started].thread,
+                                    NULL,
+                                    _bench_produce,
+                                    &prod[started]))
+            {
+                fprintf(stderr, "! bench_threadpool: couldn't start\n");
+                ret = -1;
+                break;
+            }
+        }
+
+        start = _bench_now();
+        atomic_store(&go, 1);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(prod[i].thread, NULL);
+            ret = prod[i].err ? -1 : ret;
+        }
+        added = _bench_now() - start;
+        while (0 == ret && atomic_load(&done) < njobs)
+        {
+            nanosleep(&req, NULL);
+        }
+        elapsed = _bench_now() - start;
+        thpool_destroy(pool);
+        pool = NULL;
+        if (0 != ret)
+        {
+            goto ERR;
+        }
+
+        for (long i = 0; i < njobs; i++)
+        {
+            lat[i] = jobs[i].ran - jobs[i].added;
+        }
+        qsort(lat, njobs, sizeof(uint64_t), _bench_cmp);
+
+        // add_ns_per_op is wall time over every producer, the inverse of
+        // the rate the pool accepts jobs at
+        printf("bench=threadpool producers=%d workers=%d jobs=%ld "
+               "add_ns_per_op=%.1f jobs_per_s=%.0f dispatch_p50_us=%.1f "
+               "dispatch_p99_us=%.1f dispatch_max_us=%.1f\n",
+               p,
+               nworkers,
+               njobs,
+               (double)added / njobs,
+               njobs / (elapsed / 1e9),
+               lat[njobs / 2] / 1e3,
+               lat[njobs / 100 * 99] / 1e3,
+               lat[njobs - 1] / 1e3);
+    }
+
+ERR:
+    if (NULL != pool)
+    {
+        thpool_destroy(pool);
+    }
+    free(jobs);
+    free(lat);
+    return ret;
+}
+
+static void
+_bench_run(void *arg)
+{
+    _bench_job *j = arg;
+
+    j->ran = _bench_now();
+    atomic_fetch_add(j->done, 1);
+}
+
+static void *
+_bench_produce(void *arg)
+{
+    _bench_producer *p = arg;
+
+    while (0 == atomic_load(p->go))
+    {
+        sched_yield();
+    }
+
+    for (long i = 0; i < p->njobs; i++)
+    {
+        p->jobs[i].added = _bench_now();
+        // a full queue pushes back; the wait counts towards the add
+        while (0 != thpool_add_job(p->pool, _bench_run, &p->jobs[i]))
+        {
+            if (EAGAIN != errno)
+            {
+                p->err = 1;
+                return NULL;
+            }
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static int
+_bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+_bench_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
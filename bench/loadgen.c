@@ -0,0 +1,1350 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <proto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define LG_FIXED_RESP 2048 // bin/example_server pads every response to this
+#define LG_REQ_MAX    2048 // largest request; keeps bin/example_server happy
+#define LG_IN_MAX     (64 * 1024)
+#define LG_MAX_DEPTH  16
+#define LG_SCRATCH    16   // files a session PUTs that DEL later removes
+#define LG_PATH_MAX   64
+#define LG_EVENTS     256
+#define LG_HIST_BITS  5 // 32 sub-buckets per power of two, under 3% error
+#define LG_HIST_SUB   (1 << LG_HIST_BITS)
+#define LG_HIST_LEN   (64 * LG_HIST_SUB)
+
+/**
+ * operations the generator issues; the index into mixes and histograms
+ */
+typedef enum lg_op_
+{
+    LG_USER,
+    LG_GET,
+    LG_PUT,
+    LG_LS,
+    LG_MK,
+    LG_DEL,
+    LG_NOPS,
+} lg_op;
+
+static const char *const _lg_names[LG_NOPS]
+    = { "user", "get", "put", "ls", "mk", "del" };
+
+/**
+ * file size distributions of PUT_OP bodies
+ */
+typedef enum lg_dist_
+{
+    LG_FIXED,
+    LG_UNIFORM,
+    LG_EXP,
+} lg_dist;
+
+/**
+ * @brief log-linear latency histogram in nanoseconds; values below
+ *        2 * LG_HIST_SUB are exact and larger ones keep LG_HIST_BITS bits
+ *        below the leading one
+ *
+ */
+typedef struct lg_hist_
+{
+    uint64_t counts[LG_HIST_LEN];
+    uint64_t n;
+    uint64_t max;
+} lg_hist;
+
+/**
+ * @brief run configuration shared read-only by every worker
+ *
+ * @param sessions - logins spread over the @param conns connections
+ *
+ * @param rate - total requests per second across every session; 0 runs
+ *        closed loop, each session sending as soon as it has room
+ *
+ * @param fixed - every response is LG_FIXED_RESP bytes, as with
+ *        bin/example_server; otherwise responses are framed by their
+ *        length fields
+ *
+ * @param mix - cumulative weights of each lg_op
+ *
+ */
+typedef struct lg_conf_
+{
+    struct sockaddr_in addr;
+    int                conns;
+    int                sessions;
+    int                threads;
+    int                depth;
+    double             secs;
+    double             rate;
+    int                fixed;
+    uint32_t           mix[LG_NOPS];
+    lg_dist            dist;
+    uint32_t           smin;
+    uint32_t           smax;
+    uint32_t           nfiles;
+    const char *       user;
+    const char *       pass;
+    const char *       dir;
+} lg_conf;
+
+/**
+ * @brief one request in flight
+ *
+ * @param slot - index of the session the request was sent as
+ *
+ * @param intended - CLOCK_MONOTONIC nanoseconds the request was due to be
+ *        sent; latency is measured from here rather than from when it was
+ *        actually sent, so a stalled server is charged for the requests it
+ *        held back (coordinated omission correction)
+ *
+ */
+typedef struct lg_pend_
+{
+    uint64_t intended;
+    uint8_t  op;
+    int      slot;
+} lg_pend;
+
+/**
+ * connection states
+ */
+typedef enum lg_state_
+{
+    LG_CONNECTING,
+    LG_LOGIN,
+    LG_RUN,
+    LG_DEAD,
+} lg_state;
+
+/**
+ * @brief one connection and the sessions multiplexed over it; every
+ *        request names its session, so a connection logs in several times
+ *        and takes turns sending as each
+ *
+ * @param sesids - session ids, the first @param nlogged of them valid
+ *
+ * @param slot - session the last request was sent as
+ *
+ * @param next - intended send time of the next request in open loop mode
+ *
+ * @param pend - requests sent and not yet answered, oldest at @param phead
+ *
+ * @param scratch - sequence numbers of files this session PUT and has not
+ *        yet DELeted
+ *
+ */
+typedef struct lg_conn_
+{
+    int      fd;
+    lg_state state;
+    uint32_t id;
+    uint32_t *sesids;
+    int       nses;
+    int       nlogged;
+    int       slot;
+    uint32_t seq;
+    uint64_t next;
+    uint64_t rng;
+    lg_pend  pend[LG_MAX_DEPTH];
+    int      phead;
+    int      npend;
+    uint32_t scratch[LG_SCRATCH];
+    int      nscratch;
+    size_t   outoff;
+    size_t   outlen;
+    size_t   inlen;
+    uint8_t  out[LG_MAX_DEPTH * LG_REQ_MAX];
+    uint8_t  in[LG_IN_MAX];
+} lg_conn;
+
+/**
+ * @brief one generator thread and the sessions it drives
+ *
+ * @param start - CLOCK_MONOTONIC nanoseconds measuring started, once every
+ *        connection had logged in its sessions or failed; 0 until then
+ *
+ * @param nready - connections that have logged in or failed
+ *
+ */
+typedef struct lg_worker_
+{
+    pthread_t      thread;
+    const lg_conf *conf;
+    lg_conn *      conns;
+    int            nconns;
+    int            epfd;
+    int            nready;
+    uint64_t       start;
+    uint64_t       end;
+    lg_hist        hist[LG_NOPS];
+    uint64_t       ok[LG_NOPS];
+    uint64_t       fail[LG_NOPS];
+    uint64_t       lost;
+    uint64_t       connerr;
+} lg_worker;
+
+static uint8_t _lg_body[LG_REQ_MAX];
+
+static void _lg_usage(const char *prog);
+
+/**
+ * @brief parses "get=60,put=20,ls=10,mk=5,del=5,user=0" into cumulative
+ *        weights; ops left out get weight 0
+ *
+ * @return 0 on success; nonzero on a malformed @param spec
+ *
+ */
+static int _lg_parse_mix(const char *spec, uint32_t *mix);
+
+/**
+ * @brief parses "fixed:N", "uniform:A-B" or "exp:MEAN"; sizes are clamped
+ *        to @param conf smax
+ *
+ * @return 0 on success; nonzero on a malformed @param spec
+ *
+ */
+static int _lg_parse_dist(const char *spec, lg_conf *conf);
+
+static uint64_t _lg_now(void);
+static uint64_t _lg_rand(uint64_t *state);
+static uint32_t _lg_size(const lg_conf *conf, uint64_t *rng);
+
+static void     _lg_hist_add(lg_hist *h, uint64_t v);
+static void     _lg_hist_merge(lg_hist *dst, const lg_hist *src);
+static uint64_t _lg_hist_pct(const lg_hist *h, double pct);
+
+/**
+ * @brief writes a request of the opcode, flag, path length, session id
+ *        layout at @param buf, followed by a 4 byte @param val when
+ *        @param word is set, the path and @param size bytes of body
+ *
+ * @return length of the request
+ *
+ */
+static size_t _lg_frame(uint8_t *   buf,
+                        uint8_t     opcode,
+                        uint8_t     flag,
+                        uint32_t    sesid,
+                        int         word,
+                        uint32_t    val,
+                        const char *path,
+                        uint32_t    size);
+
+/**
+ * @brief builds one request at @param buf
+ *
+ * @return length of the request
+ *
+ */
+static size_t _lg_build(const lg_conf *conf, lg_conn *c, lg_op op,
+                        uint8_t *buf);
+
+/**
+ * @brief length of the response to @param op at the front of @param buf
+ *
+ * @return length of the response; 0 if more bytes are needed first
+ *
+ */
+static size_t _lg_resplen(const lg_conf *conf, lg_op op, const uint8_t *buf,
+                          size_t len);
+
+/**
+ * @brief appends a request to the connection's send buffer and records it
+ *        as pending; a DEL with nothing of the session's left to remove is
+ *        sent as a PUT instead
+ *
+ * @return nothing
+ *
+ */
+static void _lg_queue(lg_worker *w, lg_conn *c, lg_op op, uint64_t intended);
+
+/**
+ * @brief sends what the connection has buffered without blocking
+ *
+ * @return 0 on success; nonzero if the connection failed
+ *
+ */
+static int _lg_flush(lg_worker *w, lg_conn *c);
+
+/**
+ * @brief reads and accounts every complete response on the connection
+ *
+ * @return 0 on success; nonzero if the connection failed
+ *
+ */
+static int _lg_recv(lg_worker *w, lg_conn *c);
+
+static void _lg_kill(lg_worker *w, lg_conn *c);
+
+/**
+ * @brief logs in, creates the working directory and the files GET reads
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _lg_setup(const lg_conf *conf);
+
+static void *_lg_run(void *arg);
+
+int
+main(int argc, char **argv)
+{
+    int           ret     = 1;
+    int           opt     = 0;
+    char *        colon   = NULL;
+    lg_worker *   workers = NULL;
+    lg_hist *     all     = NULL;
+    lg_hist *     op      = NULL;
+    lg_conn *     c       = NULL;
+    uint64_t      ok      = 0;
+    uint64_t      fail    = 0;
+    uint64_t      lost    = 0;
+    uint64_t      connerr = 0;
+    uint64_t      opok    = 0;
+    uint64_t      opfail  = 0;
+    uint64_t      first   = UINT64_MAX;
+    uint64_t      last    = 0;
+    double        secs    = 0;
+    int           per     = 0;
+    struct rlimit rl      = { 0 };
+    lg_conf       conf    = {
+        .conns   = 100,
+        .threads = 1,
+        .depth   = 1,
+        .secs    = 10,
+        .dist    = LG_UNIFORM,
+        .smin    = 64,
+        .smax    = 1000,
+        .nfiles  = 64,
+        .user    = "admin",
+        .pass    = "password",
+        .dir     = "lg",
+    };
+
+    conf.addr.sin_family      = AF_INET;
+    conf.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    _lg_parse_mix("get=60,put=25,ls=10,mk=5", conf.mix);
+
+    while (-1 != (opt = getopt(argc, argv, "a:p:c:s:t:d:r:P:m:z:S:n:u:D:xh")))
+    {
+        switch (opt)
+        {
+            case 'a':
+                if (1 != inet_pton(AF_INET, optarg, &conf.addr.sin_addr))
+                {
+                    fprintf(stderr, "! main: invalid address %s\n", optarg);
+                    goto ERR;
+                }
+                break;
+            case 'p':
+                conf.addr.sin_port = htons(strtoul(optarg, NULL, 10));
+                break;
+            case 'c':
+                conf.conns = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                conf.sessions = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                conf.threads = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                conf.secs = strtod(optarg, NULL);
+                break;
+            case 'r':
+                conf.rate = strtod(optarg, NULL);
+                break;
+            case 'P':
+                conf.depth = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (0 != _lg_parse_mix(optarg, conf.mix))
+                {
+                    fprintf(stderr, "! main: invalid op mix %s\n", optarg);
+                    goto ERR;
+                }
+                break;
+            case 'z':
+                if (0 != _lg_parse_dist(optarg, &conf))
+                {
+                    fprintf(stderr, "! main: invalid sizes %s\n", optarg);
+                    goto ERR;
+                }
+                break;
+            case 'S':
+                conf.smax = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                conf.nfiles = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                colon = strchr(optarg, ':');
+                if (NULL == colon)
+                {
+                    fprintf(stderr, "! main: -u takes user:password\n");
+                    goto ERR;
+                }
+                *colon    = '\0';
+                conf.user = optarg;
+                conf.pass = colon + 1;
+                break;
+            case 'D':
+                conf.dir = optarg;
+                break;
+            case 'x':
+                conf.fixed = 1;
+                break;
+            default:
+                _lg_usage(argv[0]);
+                goto ERR;
+        }
+    }
+
+    conf.sessions = (0 == conf.sessions) ? conf.conns : conf.sessions;
+    if (0 == conf.addr.sin_port || 0 >= conf.conns || 0 >= conf.threads
+        || conf.sessions < conf.conns
+        || 0 >= conf.secs || 0 > conf.rate || 0 == conf.nfiles
+        || 0 == conf.mix[LG_NOPS - 1])
+    {
+        _lg_usage(argv[0]);
+        goto ERR;
+    }
+    if (0 >= conf.depth || LG_MAX_DEPTH < conf.depth)
+    {
+        fprintf(stderr, "! main: depth must be 1 to %d\n", LG_MAX_DEPTH);
+        goto ERR;
+    }
+    if (conf.fixed && 1 != conf.depth)
+    {
+        // bin/example_server reads one request per recv
+        fprintf(stderr, "! main: -x does not pipeline; using depth 1\n");
+        conf.depth = 1;
+    }
+    if (conf.threads > conf.conns)
+    {
+        conf.threads = conf.conns;
+    }
+    conf.smax = (LG_REQ_MAX / 2 < conf.smax) ? LG_REQ_MAX / 2 : conf.smax;
+    conf.smin = (conf.smin > conf.smax) ? conf.smax : conf.smin;
+    memset(_lg_body, 'x', sizeof(_lg_body));
+
+    // thousands of sessions need as many descriptors
+    if (0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (0 != _lg_setup(&conf))
+    {
+        goto ERR;
+    }
+
+    workers = calloc(conf.threads, sizeof(lg_worker));
+    all     = calloc(1, sizeof(lg_hist));
+    op      = calloc(1, sizeof(lg_hist));
+    if (NULL == workers || NULL == all || NULL == op)
+    {
+        fprintf(stderr, "! main: couldn't calloc workers\n");
+        goto ERR;
+    }
+
+    for (int i = 0; i < conf.threads; i++)
+    {
+        per                = conf.conns / conf.threads;
+        workers[i].conf    = &conf;
+        workers[i].nconns  = per + (i < conf.conns % conf.threads);
+        workers[i].conns   = calloc(workers[i].nconns, sizeof(lg_conn));
+        workers[i].epfd    = -1;
+        if (NULL == workers[i].conns)
+        {
+            fprintf(stderr, "! main: couldn't calloc sessions\n");
+            goto ERR;
+        }
+        for (int j = 0; j < workers[i].nconns; j++)
+        {
+            c         = &workers[i].conns[j];
+            c->fd     = -1;
+            c->id     = j * conf.threads + i;
+            c->nses   = conf.sessions / conf.conns
+                        + (c->id < (uint32_t)(conf.sessions % conf.conns));
+            c->sesids = calloc(c->nses, sizeof(uint32_t));
+            if (NULL == c->sesids)
+            {
+                fprintf(stderr, "! main: couldn't calloc sessions\n");
+                goto ERR;
+            }
+        }
+    }
+
+    for (int i = 0; i < conf.threads; i++)
+    {
+        if (0 != pthread_create(&workers[i].thread, NULL, _lg_run,
+                                &workers[i]))
+        {
+            fprintf(stderr, "! main: couldn't start worker %d\n", i);
+            for (int j = 0; j < i; j++)
+            {
+                pthread_join(workers[j].thread, NULL);
+            }
+            goto ERR;
+        }
+    }
+    for (int i = 0; i < conf.threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        lost += workers[i].lost;
+        connerr += workers[i].connerr;
+        // workers start and stop at slightly different times; the run
+        // spans the earliest start to the latest end
+        first = (workers[i].start < first) ? workers[i].start : first;
+        last  = (workers[i].end > last) ? workers[i].end : last;
+    }
+    secs = (first < last) ? (last - first) / 1e9 : 0;
+    if (0 >= secs)
+    {
+        fprintf(stderr, "! main: sessions did not log in within %.0f s\n",
+                conf.secs);
+        goto ERR;
+    }
+
+    for (int k = 0; k < LG_NOPS; k++)
+    {
+        for (int i = 0; i < conf.threads; i++)
+        {
+            ok += workers[i].ok[k];
+            fail += workers[i].fail[k];
+            _lg_hist_merge(all, &workers[i].hist[k]);
+        }
+    }
+    printf("bench=loadgen conns=%d sessions=%d threads=%d depth=%d rate=%.0f "
+           "secs=%.2f ops=%llu ops_per_s=%.1f fail=%llu lost=%llu "
+           "connerr=%llu co_corrected=%d\n",
+           conf.conns, conf.sessions, conf.threads, conf.depth, conf.rate, secs,
+           (unsigned long long)(ok + fail), (ok + fail) / secs,
+           (unsigned long long)fail, (unsigned long long)lost,
+           (unsigned long long)connerr, 0 < conf.rate);
+
+    for (int k = -1; k < LG_NOPS; k++)
+    {
+        opok   = 0;
+        opfail = 0;
+        memset(op, 0, sizeof(lg_hist));
+        for (int i = 0; 0 <= k && i < conf.threads; i++)
+        {
+            opok += workers[i].ok[k];
+            opfail += workers[i].fail[k];
+            _lg_hist_merge(op, &workers[i].hist[k]);
+        }
+        if (0 > k)
+        {
+            memcpy(op, all, sizeof(lg_hist));
+            opok   = ok;
+            opfail = fail;
+        }
+        if (0 == op->n)
+        {
+            continue;
+        }
+        printf("bench=loadgen op=%s ok=%llu fail=%llu p50_us=%.1f "
+               "p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+               (0 > k) ? "all" : _lg_names[k], (unsigned long long)opok,
+               (unsigned long long)opfail, _lg_hist_pct(op, 50) / 1e3,
+               _lg_hist_pct(op, 90) / 1e3, _lg_hist_pct(op, 99) / 1e3,
+               _lg_hist_pct(op, 99.9) / 1e3, op->max / 1e3);
+    }
+    ret = 0;
+
+ERR:
+    for (int i = 0; NULL != workers && i < conf.threads; i++)
+    {
+        for (int j = 0; NULL != workers[i].conns && j < workers[i].nconns;
+             j++)
+        {
+            free(workers[i].conns[j].sesids);
+        }
+        free(workers[i].conns);
+    }
+    free(workers);
+    free(all);
+    free(op);
+    return ret;
+}
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_lg_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s -p port [-a addr] [-c conns] [-s sessions] "
+            "[-t threads]\n"
+            "          [-d secs] [-r total_ops_per_sec] [-P depth] [-m mix]\n"
+            "          [-z sizes] [-S max_size] [-n files] [-u user:pass] "
+            "[-D dir] [-x]\n"
+            "  -s  logins spread over the connections; defaults to -c\n"
+            "  -m  op weights, e.g. get=60,put=20,ls=10,mk=5,del=5,user=0\n"
+            "  -z  PUT sizes: fixed:N, uniform:A-B or exp:MEAN\n"
+            "  -r  open loop at this rate with coordinated omission "
+            "correction; 0 is closed loop\n"
+            "  -x  responses are padded to %d bytes (bin/example_server)\n",
+            prog, LG_FIXED_RESP);
+}
+
+static int
+_lg_parse_mix(const char *spec, uint32_t *mix)
+{
+    uint32_t    w[LG_NOPS] = { 0 };
+    const char *p          = spec;
+    char *      end        = NULL;
+    size_t      len        = 0;
+    int         k          = 0;
+
+    while ('\0' != *p)
+    {
+        len = strcspn(p, "=");
+        for (k = 0; k < LG_NOPS; k++)
+        {
+            if (strlen(_lg_names[k]) == len
+                && 0 == strncmp(p, _lg_names[k], len))
+            {
+                break;
+            }
+        }
+        if (LG_NOPS == k || '=' != p[len])
+        {
+            return -1;
+        }
+        w[k] = strtoul(&p[len + 1], &end, 10);
+        if (end == &p[len + 1] || (',' != *end && '\0' != *end))
+        {
+            return -1;
+        }
+        p = (',' == *end) ? end + 1 : end;
+    }
+
+    for (k = 0; k < LG_NOPS; k++)
+    {
+        mix[k] = w[k] + ((0 < k) ? mix[k - 1] : 0);
+    }
+    return 0;
+}
+
+static int
+_lg_parse_dist(const char *spec, lg_conf *conf)
+{
+    char *end = NULL;
+
+    if (0 == strncmp(spec, "fixed:", 6))
+    {
+        conf->dist = LG_FIXED;
+        conf->smin = strtoul(&spec[6], &end, 10);
+        return (end == &spec[6] || '\0' != *end);
+    }
+    if (0 == strncmp(spec, "uniform:", 8))
+    {
+        conf->dist = LG_UNIFORM;
+        conf->smin = strtoul(&spec[8], &end, 10);
+        if ('-' != *end)
+        {
+            return -1;
+        }
+        conf->smax = strtoul(end + 1, &end, 10);
+        return ('\0' != *end || conf->smin > conf->smax);
+    }
+    if (0 == strncmp(spec, "exp:", 4))
+    {
+        // smin holds the mean
+        conf->dist = LG_EXP;
+        conf->smin = strtoul(&spec[4], &end, 10);
+        return (end == &spec[4] || '\0' != *end || 0 == conf->smin);
+    }
+    return -1;
+}
+
+static uint64_t
+_lg_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+_lg_rand(uint64_t *state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t
+_lg_size(const lg_conf *conf, uint64_t *rng)
+{
+    double   u    = 0;
+    uint32_t size = 0;
+
+    switch (conf->dist)
+    {
+        case LG_FIXED:
+            size = conf->smin;
+            break;
+        case LG_UNIFORM:
+            size = conf->smin
+                   + _lg_rand(rng) % (conf->smax - conf->smin + 1);
+            break;
+        case LG_EXP:
+            u    = (_lg_rand(rng) >> 11) / 9007199254740992.0;
+            size = (uint32_t)(-log(1 - u) * conf->smin);
+            break;
+    }
+    return (size > conf->smax) ? conf->smax : size;
+}
+
+static void
+_lg_hist_add(lg_hist *h, uint64_t v)
+{
+    int msb   = 0;
+    int shift = 0;
+    int idx   = 0;
+
+    if (v < 2 * LG_HIST_SUB)
+    {
+        idx = v;
+    }
+    else
+    {
+        msb   = 63 - __builtin_clzll(v);
+        shift = msb - LG_HIST_BITS;
+        idx   = (shift + 1) * LG_HIST_SUB + (v >> shift) - LG_HIST_SUB;
+    }
+    h->counts[idx]++;
+    h->n++;
+    h->max = (v > h->max) ? v : h->max;
+}
+
+static void
+_lg_hist_merge(lg_hist *dst, const lg_hist *src)
+{
+    for (int i = 0; i < LG_HIST_LEN; i++)
+    {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->n += src->n;
+    dst->max = (src->max > dst->max) ? src->max : dst->max;
+}
+
+static uint64_t
+_lg_hist_pct(const lg_hist *h, double pct)
+{
+    uint64_t want  = (uint64_t)ceil(h->n * pct / 100);
+    uint64_t seen  = 0;
+    uint64_t top   = 0;
+    int      shift = 0;
+
+    want = (0 == want) ? 1 : want;
+    for (int i = 0; i < LG_HIST_LEN; i++)
+    {
+        seen += h->counts[i];
+        if (seen < want)
+        {
+            continue;
+        }
+        if (i < 2 * LG_HIST_SUB)
+        {
+            return i;
+        }
+        // report the top of the bucket so percentiles never read low
+        shift = i / LG_HIST_SUB - 1;
+        top   = ((uint64_t)(i % LG_HIST_SUB + LG_HIST_SUB + 1) << shift) - 1;
+        return (top > h->max) ? h->max : top;
+    }
+    return h->max;
+}
+
+static size_t
+_lg_frame(uint8_t *   buf,
+          uint8_t     opcode,
+          uint8_t     flag,
+          uint32_t    sesid,
+          int         word,
+          uint32_t    val,
+          const char *path,
+          uint32_t    size)
+{
+    uint16_t plen = htons(strlen(path));
+    size_t   len  = 8;
+
+    buf[0] = opcode;
+    buf[1] = flag;
+    memcpy(&buf[2], &plen, 2);
+    sesid = htonl(sesid);
+    memcpy(&buf[4], &sesid, 4);
+    if (word)
+    {
+        val = htonl(val);
+        memcpy(&buf[len], &val, 4);
+        len += 4;
+    }
+    memcpy(&buf[len], path, ntohs(plen));
+    len += ntohs(plen);
+    memcpy(&buf[len], _lg_body, size);
+    return len + size;
+}
+
+static size_t
+_lg_build(const lg_conf *conf, lg_conn *c, lg_op op, uint8_t *buf)
+{
+    char     path[LG_PATH_MAX];
+    uint16_t ulen  = htons(strlen(conf->user));
+    uint16_t plen  = htons(strlen(conf->pass));
+    uint32_t sesid = c->sesids[c->slot];
+    uint32_t size  = 0;
+    size_t   len   = 12;
+
+    switch (op)
+    {
+        case LG_USER:
+            // log in again; the server hands out a fresh session id
+            memset(buf, 0, len);
+            buf[0] = USER_OP;
+            memcpy(&buf[4], &ulen, 2);
+            memcpy(&buf[6], &plen, 2);
+            memcpy(&buf[len], conf->user, ntohs(ulen));
+            len += ntohs(ulen);
+            memcpy(&buf[len], conf->pass, ntohs(plen));
+            return len + ntohs(plen);
+        case LG_GET:
+            snprintf(path, sizeof(path), "%s/f%llu", conf->dir,
+                     (unsigned long long)(_lg_rand(&c->rng) % conf->nfiles));
+            return _lg_frame(buf, GET_OP, 0, sesid, 0, 0, path, 0);
+        case LG_PUT:
+            // half the PUTs overwrite the shared set GET reads, the rest
+            // create files for DEL to remove
+            if (0 == (_lg_rand(&c->rng) & 1) || LG_SCRATCH == c->nscratch)
+            {
+                snprintf(path, sizeof(path), "%s/f%llu", conf->dir,
+                         (unsigned long long)(_lg_rand(&c->rng)
+                                              % conf->nfiles));
+            }
+            else
+            {
+                c->scratch[c->nscratch++] = c->seq;
+                snprintf(path, sizeof(path), "%s/s%u_%u", conf->dir, c->id,
+                         c->seq++);
+            }
+            size = _lg_size(conf, &c->rng);
+            return _lg_frame(buf, PUT_OP, 1, sesid, 1, size, path, size);
+        case LG_LS:
+            return _lg_frame(buf, LS_OP, 0, sesid, 1, 0, conf->dir, 0);
+        case LG_MK:
+            snprintf(path, sizeof(path), "%s/d%u_%u", conf->dir, c->id,
+                     c->seq++);
+            return _lg_frame(buf, MK_OP, 0, sesid, 1, 0, path, 0);
+        case LG_DEL:
+            snprintf(path, sizeof(path), "%s/s%u_%u", conf->dir, c->id,
+                     c->scratch[--c->nscratch]);
+            return _lg_frame(buf, DEL_OP, 0, sesid, 0, 0, path, 0);
+        default:
+            return 0;
+    }
+}
+
+static size_t
+_lg_resplen(const lg_conf *conf, lg_op op, const uint8_t *buf, size_t len)
+{
+    uint32_t field = 0;
+
+    if (conf->fixed)
+    {
+        return (LG_FIXED_RESP <= len) ? LG_FIXED_RESP : 0;
+    }
+    if (0 == len)
+    {
+        return 0;
+    }
+    if (SUCCESS != buf[0])
+    {
+        return 1;
+    }
+
+    switch (op)
+    {
+        case LG_USER:
+            return (6 <= len) ? 6 : 0;
+        case LG_GET:
+            // return code, reserved, content length, content
+            if (6 > len)
+            {
+                return 0;
+            }
+            memcpy(&field, &buf[2], 4);
+            field = ntohl(field);
+            return (6 + (size_t)field <= len) ? 6 + (size_t)field : 0;
+        case LG_LS:
+            // return code, reserved, total, message length, position,
+            // content; only the first page is read
+            if (16 > len)
+            {
+                return 0;
+            }
+            memcpy(&field, &buf[8], 4);
+            field = ntohl(field);
+            return (16 + (size_t)field <= len) ? 16 + (size_t)field : 0;
+        default:
+            return 1;
+    }
+}
+
+static void
+_lg_queue(lg_worker *w, lg_conn *c, lg_op op, uint64_t intended)
+{
+    lg_pend *p = &c->pend[(c->phead + c->npend) % LG_MAX_DEPTH];
+
+    (void)w;
+    if (0 == c->outlen)
+    {
+        c->outoff = 0;
+    }
+    // keep room for a whole request so the buffer never has to wrap
+    if (sizeof(c->out) - c->outlen < LG_REQ_MAX)
+    {
+        memmove(c->out, &c->out[c->outoff], c->outlen - c->outoff);
+        c->outlen -= c->outoff;
+        c->outoff = 0;
+    }
+    // only DEL what exists; bin/example_server crashes on anything else
+    if (LG_DEL == op && 0 == c->nscratch)
+    {
+        op = LG_PUT;
+    }
+    // log the sessions in one at a time, then send as each in turn
+    c->slot = (LG_RUN == c->state) ? (c->slot + 1) % c->nses : c->nlogged;
+    c->outlen += _lg_build(w->conf, c, op, &c->out[c->outlen]);
+    p->intended = intended;
+    p->op       = op;
+    p->slot     = c->slot;
+    c->npend++;
+}
+
+static int
+_lg_flush(lg_worker *w, lg_conn *c)
+{
+    ssize_t            len = 0;
+    struct epoll_event ev  = { 0 };
+
+    while (c->outoff < c->outlen)
+    {
+        len = send(c->fd, &c->out[c->outoff], c->outlen - c->outoff,
+                   MSG_NOSIGNAL);
+        if (0 > len && EINTR == errno)
+        {
+            continue;
+        }
+        if (0 > len && EAGAIN == errno)
+        {
+            break;
+        }
+        if (0 > len)
+        {
+            return -1;
+        }
+        c->outoff += len;
+    }
+    if (c->outoff == c->outlen)
+    {
+        c->outoff = 0;
+        c->outlen = 0;
+    }
+
+    // only ask for writability while something is stuck in the buffer
+    ev.events  = EPOLLIN | ((0 < c->outlen) ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+static int
+_lg_recv(lg_worker *w, lg_conn *c)
+{
+    ssize_t  len  = 0;
+    size_t   rlen = 0;
+    size_t   off  = 0;
+    uint64_t now  = 0;
+    lg_pend *p    = NULL;
+
+    for (;;)
+    {
+        len = recv(c->fd, &c->in[c->inlen], sizeof(c->in) - c->inlen, 0);
+        if (0 > len && EINTR == errno)
+        {
+            continue;
+        }
+        if (0 > len && EAGAIN == errno)
+        {
+            break;
+        }
+        if (0 >= len)
+        {
+            return -1;
+        }
+        c->inlen += len;
+
+        now = _lg_now();
+        off = 0;
+        while (0 < c->npend)
+        {
+            p    = &c->pend[c->phead];
+            rlen = _lg_resplen(w->conf, p->op, &c->in[off], c->inlen - off);
+            if (0 == rlen)
+            {
+                break;
+            }
+            if (0 == p->intended)
+            {
+                // the logins a connection opens with are not measured
+            }
+            else if (SUCCESS == c->in[off])
+            {
+                w->ok[p->op]++;
+            }
+            else
+            {
+                w->fail[p->op]++;
+            }
+            if (0 != p->intended)
+            {
+                _lg_hist_add(&w->hist[p->op], now - p->intended);
+            }
+            if (LG_USER == p->op && SUCCESS == c->in[off])
+            {
+                memcpy(&c->sesids[p->slot], &c->in[off + 2], 4);
+                c->sesids[p->slot] = ntohl(c->sesids[p->slot]);
+            }
+            if (LG_LOGIN == c->state && SUCCESS != c->in[off])
+            {
+                fprintf(stderr, "! _lg_recv: login failed\n");
+                return -1;
+            }
+            if (LG_LOGIN == c->state && ++c->nlogged == c->nses)
+            {
+                c->state = LG_RUN;
+                w->nready++;
+            }
+            else if (LG_LOGIN == c->state)
+            {
+                _lg_queue(w, c, LG_USER, 0);
+            }
+            c->phead = (c->phead + 1) % LG_MAX_DEPTH;
+            c->npend--;
+            off += rlen;
+        }
+        if (0 == c->npend && off < c->inlen)
+        {
+            fprintf(stderr, "! _lg_recv: unexpected response bytes\n");
+            return -1;
+        }
+        memmove(c->in, &c->in[off], c->inlen - off);
+        c->inlen -= off;
+        if (sizeof(c->in) == c->inlen)
+        {
+            fprintf(stderr, "! _lg_recv: response too large\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+_lg_kill(lg_worker *w, lg_conn *c)
+{
+    if (LG_DEAD == c->state)
+    {
+        return;
+    }
+    w->lost += c->npend;
+    if (LG_CONNECTING == c->state)
+    {
+        w->connerr++;
+    }
+    if (LG_RUN != c->state)
+    {
+        w->nready++;
+    }
+    c->npend  = 0;
+    c->outlen = 0;
+    c->state  = LG_DEAD;
+    if (0 <= c->fd)
+    {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static int
+_lg_setup(const lg_conf *conf)
+{
+    int      ret  = -1;
+    int      fd   = -1;
+    uint64_t rng  = 0x9e3779b97f4a7c15ULL;
+    uint32_t size = 0;
+    size_t   len  = 0;
+    size_t   have = 0;
+    size_t   need = 0;
+    ssize_t  rlen = 0;
+    char     path[LG_PATH_MAX];
+    uint8_t  buf[LG_REQ_MAX];
+    uint32_t sesid = 0;
+    lg_conn  c     = { .sesids = &sesid, .nses = 1 };
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > fd
+        || 0 != connect(fd, (struct sockaddr *)&conf->addr,
+                        sizeof(conf->addr)))
+    {
+        perror("! _lg_setup: connect");
+        goto ERR;
+    }
+
+    // log in, make the working directory, then every file GET may ask for
+    for (int64_t i = -2; i < (int64_t)conf->nfiles; i++)
+    {
+        if (-2 == i)
+        {
+            len = _lg_build(conf, &c, LG_USER, buf);
+        }
+        else if (-1 == i)
+        {
+            len = _lg_frame(buf, MK_OP, 0, sesid, 1, 0, conf->dir, 0);
+        }
+        else
+        {
+            size = _lg_size(conf, &rng);
+            snprintf(path, sizeof(path), "%s/f%lld", conf->dir, (long long)i);
+            len = _lg_frame(buf, PUT_OP, 1, sesid, 1, size, path, size);
+        }
+
+        if ((ssize_t)len != send(fd, buf, len, MSG_NOSIGNAL))
+        {
+            perror("! _lg_setup: send");
+            goto ERR;
+        }
+        for (have = 0, need = 0; 0 == need; have += rlen)
+        {
+            rlen = recv(fd, &buf[have], sizeof(buf) - have, 0);
+            if (0 >= rlen)
+            {
+                fprintf(stderr, "! _lg_setup: connection closed\n");
+                goto ERR;
+            }
+            need = _lg_resplen(
+                conf, (-2 == i) ? LG_USER : LG_MK, buf, have + rlen);
+        }
+
+        if (-2 == i && SUCCESS != buf[0])
+        {
+            fprintf(stderr, "! _lg_setup: login as %s failed\n", conf->user);
+            goto ERR;
+        }
+        if (-2 == i)
+        {
+            memcpy(&sesid, &buf[2], 4);
+            sesid = ntohl(sesid);
+        }
+        // the directory may be left over from an earlier run
+        if (0 <= i && SUCCESS != buf[0])
+        {
+            fprintf(stderr, "! _lg_setup: couldn't PUT %s\n", path);
+            goto ERR;
+        }
+    }
+    ret = 0;
+
+ERR:
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    return ret;
+}
+
+static void *
+_lg_run(void *arg)
+{
+    lg_worker *        w        = arg;
+    const lg_conf *    conf     = w->conf;
+    lg_conn *          c        = NULL;
+    uint64_t           now      = 0;
+    uint64_t           stop     = 0;
+    uint64_t           interval = 0;
+    uint64_t           wake     = 0;
+    uint32_t           pick     = 0;
+    int                op       = 0;
+    int                n        = 0;
+    int                timeout  = 0;
+    int                err      = 0;
+    socklen_t          elen     = sizeof(err);
+    int                one      = 1;
+    struct epoll_event ev       = { 0 };
+    struct epoll_event evs[LG_EVENTS];
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (0 > w->epfd)
+    {
+        perror("! _lg_run: epoll_create1");
+        return NULL;
+    }
+
+    for (int i = 0; i < w->nconns; i++)
+    {
+        c      = &w->conns[i];
+        c->rng = 0x9e3779b97f4a7c15ULL * (c->id + 1);
+        c->fd  = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+        if (0 > c->fd)
+        {
+            perror("! _lg_run: socket");
+            _lg_kill(w, c);
+            continue;
+        }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (0 != connect(c->fd, (struct sockaddr *)&conf->addr,
+                         sizeof(conf->addr))
+            && EINPROGRESS != errno)
+        {
+            _lg_kill(w, c);
+            continue;
+        }
+        ev.events   = EPOLLOUT;
+        ev.data.ptr = c;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    // each session gets an equal share of the rate, phase shifted so the
+    // sessions do not fire in lockstep
+    interval = (0 < conf->rate) ? (uint64_t)(conf->conns * 1e9 / conf->rate)
+                                : 0;
+    // logging in gets as long as the run itself
+    stop = _lg_now() + (uint64_t)(conf->secs * 1e9);
+
+    while ((now = _lg_now()) < stop)
+    {
+        if (0 == w->start && w->nready == w->nconns)
+        {
+            w->start = now;
+            stop     = now + (uint64_t)(conf->secs * 1e9);
+            for (int i = 0; i < w->nconns; i++)
+            {
+                w->conns[i].next
+                    = now
+                      + ((0 < interval)
+                             ? _lg_rand(&w->conns[i].rng) % interval
+                             : 0);
+            }
+        }
+
+        wake = stop;
+        for (int i = 0; i < w->nconns; i++)
+        {
+            c = &w->conns[i];
+            while (0 != w->start && LG_RUN == c->state
+                   && c->npend < conf->depth
+                   && (0 == interval || c->next <= now))
+            {
+                pick = _lg_rand(&c->rng) % conf->mix[LG_NOPS - 1];
+                for (op = 0; pick >= conf->mix[op]; op++)
+                {
+                }
+                _lg_queue(w, c, op, (0 == interval) ? now : c->next);
+                c->next += interval;
+            }
+            if (0 < c->outlen && 0 != _lg_flush(w, c))
+            {
+                _lg_kill(w, c);
+                continue;
+            }
+            // a session at full depth waits for a response, not the clock
+            if (0 != w->start && LG_RUN == c->state && 0 < interval
+                && c->npend < conf->depth && c->next < wake)
+            {
+                wake = c->next;
+            }
+        }
+
+        timeout = (now < wake) ? (int)((wake - now + 999999) / 1000000) : 0;
+        n       = epoll_wait(w->epfd, evs, LG_EVENTS, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            c = evs[i].data.ptr;
+            if (LG_CONNECTING == c->state)
+            {
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+                if (0 != err)
+                {
+                    fprintf(stderr, "! _lg_run: connect: %s\n", strerror(err));
+                    _lg_kill(w, c);
+                    continue;
+                }
+                c->state = LG_LOGIN;
+                _lg_queue(w, c, LG_USER, 0);
+                if (0 != _lg_flush(w, c))
+                {
+                    _lg_kill(w, c);
+                }
+                continue;
+            }
+            if ((evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                && 0 != _lg_recv(w, c))
+            {
+                _lg_kill(w, c);
+                continue;
+            }
+            if ((evs[i].events & EPOLLOUT) && 0 != _lg_flush(w, c))
+            {
+                _lg_kill(w, c);
+            }
+        }
+    }
+    w->end   = _lg_now();
+    w->start = (0 == w->start) ? w->end : w->start;
+
+    for (int i = 0; i < w->nconns; i++)
+    {
+        // what is still in flight at the deadline is neither ok nor lost,
+        // and a session still waiting out a full listen backlog has not
+        // failed either
+        w->conns[i].npend = 0;
+        w->conns[i].state = (LG_CONNECTING == w->conns[i].state)
+                                ? LG_LOGIN
+                                : w->conns[i].state;
+        _lg_kill(w, &w->conns[i]);
+    }
+    close(w->epfd);
+    return NULL;
+}
+/* PRIVATE FUNCTION DEFINTIONS */
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Profile-guided Release build trained on the benchmark suite.
+#
+#   bench/pgo.sh [build_dir]
+#
+# Builds an instrumented Release tree, runs every bench_* program in it to
+# collect profiles, then rebuilds the same tree with the profiles applied.
+# The same build directory has to be used for both steps because gcc names
+# the profile of each object after the object's path.
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${1:-"$src/_pgo_build"}
+
+cmake -S "$src" -B "$build" -DCMAKE_BUILD_TYPE=Release -DPGO=GEN
+cmake --build "$build" --clean-first -j"$(nproc)"
+rm -rf "$build/pgo"
+
+for b in "$build"/bench/bench_*; do
+    [ -x "$b" ] || continue
+    echo "[*] training on $(basename "$b")"
+    "$b" > /dev/null
+done
+
+cmake -S "$src" -B "$build" -DCMAKE_BUILD_TYPE=Release -DPGO=USE
+cmake --build "$build" --clean-first -j"$(nproc)"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs every bench_* program of a build and tags each result line with the
+# commit and build type, so runs from different commits can be appended to
+# one file and compared.
+#
+#   bench/run.sh [build_dir] >> results.txt
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${1:-"$src/build"}
+
+commit=$(git -C "$src" rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git -C "$src" diff --quiet HEAD 2>/dev/null; then
+    commit="$commit-dirty"
+fi
+type=$(sed -n 's/^CMAKE_BUILD_TYPE:[A-Z]*=//p' "$build/CMakeCache.txt")
+
+for b in "$build"/bench/bench_*; do
+    [ -x "$b" ] || continue
+    "$b" | sed -n "s/^bench=.*/& commit=$commit build=${type:-Debug}/p"
+done
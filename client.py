@@ -9,6 +9,9 @@ import sys
 MAX_TCP_MSG = 4
 MAX_PORT = 65535
 MAX_MSG_SIZE = 2048
+# PROTO_MAX_FRAME in proto.h; a PUT_OP header, path and file share it
+MAX_FRAME = 64 * 1024 * 1024
+PUT_HDR_LEN = 12
 
 OPCODE = {
     "USER_OP":0x1,
@@ -16,7 +19,12 @@ OPCODE = {
     "LS_OP":0x3,
     "GET_OP":0x4,
     "MK_OP":0x5,
-    "PUT_OP":0x6
+    "PUT_OP":0x6,
+    "BATCH_OP":0x7,
+    "GETR_OP":0x8,
+    "UPOPEN_OP":0x9,
+    "UPCHUNK_OP":0xa,
+    "UPCOMMIT_OP":0xb
 }
 RETCODE = {
     "SUCCESS":0x1,
@@ -270,6 +278,10 @@ def putcmd(cmds, overwrite):
     ret += struct.pack('!L',sesid)
     try:
         f = open(CLIENT_ROOT+cmds[0], "rb").read()
+        if PUT_HDR_LEN + len(cmds[1]) + len(f) > MAX_FRAME:
+            print("[!] put failed: files over %d bytes must be sent as an "
+                  "upload (UPOPEN_OP)" % (MAX_FRAME - PUT_HDR_LEN - len(cmds[1])))
+            return None
         print(f)
         ret += struct.pack('!L',len(f))
         ret += bytearray(cmds[1], 'ascii')
@@ -0,0 +1,57 @@
+# Build profiles shared by the server, every library and the benchmarks.
+#
+#   Debug   (default)  -g, AddressSanitizer, internal libraries built shared
+#   Release            -O3 -DNDEBUG, LTO, internal libraries linked statically
+#
+# Release can be trained on the benchmarks with PGO=GEN, then rebuilt in the
+# same build directory with PGO=USE; bench/pgo.sh does both steps.
+include_guard(GLOBAL)
+
+if(NOT CMAKE_BUILD_TYPE AND NOT CMAKE_CONFIGURATION_TYPES)
+    set(CMAKE_BUILD_TYPE Debug CACHE STRING "Debug or Release" FORCE)
+endif()
+
+set(PGO "" CACHE STRING "GEN to instrument, USE to apply the profile")
+set(PGO_DIR ${CMAKE_BINARY_DIR}/pgo CACHE PATH "where profiles are kept")
+
+add_compile_options(-Werror -Wextra -Wall -pedantic)
+
+# USDT probes (src/trace/include/trace.h) are a nop each and are compiled in
+# whenever sys/sdt.h is installed; OFF compiles them out entirely
+option(USDT "compile in USDT probes when sys/sdt.h is available" ON)
+if(NOT USDT)
+    add_compile_definitions(TRACE_NO_USDT)
+endif()
+
+if(CMAKE_BUILD_TYPE STREQUAL "Release")
+    # static so calls into ll, threadpool and netpoll skip the PLT and can
+    # be inlined across libraries by LTO
+    set(BUILD_SHARED_LIBS OFF)
+    set(CMAKE_C_FLAGS_RELEASE "-O3 -DNDEBUG")
+
+    include(CheckIPOSupported)
+    check_ipo_supported(RESULT HAVE_IPO OUTPUT IPO_ERR LANGUAGES C)
+    if(HAVE_IPO)
+        set(CMAKE_INTERPROCEDURAL_OPTIMIZATION ON)
+    else()
+        message(WARNING "LTO not supported: ${IPO_ERR}")
+    endif()
+
+    if(PGO STREQUAL "GEN")
+        # atomic counters since the pool and poller profile concurrently
+        add_compile_options(-fprofile-generate=${PGO_DIR}
+                            -fprofile-update=atomic)
+        add_link_options(-fprofile-generate=${PGO_DIR})
+    elseif(PGO STREQUAL "USE")
+        # code the benchmarks never reach keeps its normal optimization
+        # instead of being treated as cold
+        add_compile_options(-fprofile-use=${PGO_DIR} -fprofile-correction
+                            -fprofile-partial-training -Wno-missing-profile)
+    elseif(NOT PGO STREQUAL "")
+        message(FATAL_ERROR "PGO must be GEN, USE or empty")
+    endif()
+else()
+    set(BUILD_SHARED_LIBS ON)
+    add_compile_options(-g -fsanitize=address)
+    add_link_options(-fsanitize=address)
+endif()
@@ -0,0 +1,142 @@
+#ifndef _CKSUM_H
+#define _CKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pathres.h>
+
+/**
+ * name of the checksum sidecar file beneath the server root; pathres
+ * refuses client paths that name it so a client can't plant forged CRCs
+ */
+#define CKSUM_INDEX_FILE PATHRES_CKSUM_FILE
+
+/**
+ * number of slots in the sidecar index; slots are direct mapped so a
+ * colliding file simply replaces the previous one
+ */
+#define CKSUM_INDEX_SLOTS 65536
+
+/**
+ * @brief one remembered checksum; the file is identified by inode, mtime
+ *        and size so any change to it misses the index
+ *
+ */
+typedef struct cksum_slot_
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t  mtime;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t valid;
+} cksum_slot;
+
+/**
+ * @brief checksum index kept in a memory mapped sidecar file so it
+ *        survives restarts
+ *
+ * @param lock - protects @param slots
+ *
+ * @param slots - mapped sidecar file
+ *
+ */
+typedef struct cksum_index_
+{
+    pthread_mutex_t lock;
+    cksum_slot *    slots;
+} cksum_index;
+
+/**
+ * @brief extends a CRC32C (Castagnoli) over @param buf; uses the SSE4.2
+ *        crc32 instruction when the CPU has it and a table otherwise
+ *
+ * @param crc - CRC of the data so far; 0 to start
+ *
+ * @param buf - next piece of data
+ *
+ * @param len - length of @param buf
+ *
+ * @return updated CRC
+ *
+ */
+uint32_t cksum_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief copies @param len bytes from @param infd to @param outfd,
+ *        computing the CRC32C of the data on the way through so the file
+ *        is never read twice
+ *
+ * @param infd - file to read from its current offset
+ *
+ * @param outfd - socket or file to write to; EAGAIN is waited out
+ *
+ * @param len - bytes to copy
+ *
+ * @param crc - set to the CRC32C of the copied data
+ *
+ * @return bytes copied on success; -1 on error
+ *
+ */
+int64_t cksum_copy(int infd, int outfd, uint64_t len, uint32_t *crc);
+
+/**
+ * @brief opens or creates the sidecar index beneath the server root
+ *
+ * @param rootfd - server root from pathres_rootopen
+ *
+ * @return pointer to the index; NULL on error
+ *
+ */
+cksum_index *cksum_index_open(int rootfd);
+
+/**
+ * @brief looks up the checksum of an open file
+ *
+ * @param idx - checksum index
+ *
+ * @param fd - open file
+ *
+ * @param crc - set to the remembered CRC32C on a hit
+ *
+ * @return 0 on a hit; nonzero on a miss
+ *
+ */
+int cksum_index_get(cksum_index *idx, int fd, uint32_t *crc);
+
+/**
+ * @brief remembers the checksum of an open file, unless the file changed
+ *        while it was being read; a write that lands mid-stream would
+ *        otherwise be stored under the new mtime with a CRC of the old
+ *        and mixed contents
+ *
+ * @param idx - checksum index
+ *
+ * @param fd - open file the checksum was computed over in full
+ *
+ * @param before - fstat of @param fd taken before the first byte was read
+ *
+ * @param crc - CRC32C of the whole file
+ *
+ * @return 0 on success; nonzero on error or if the file changed
+ *
+ */
+int cksum_index_put(cksum_index *      idx,
+                    int                fd,
+                    const struct stat *before,
+                    uint32_t           crc);
+
+/**
+ * @brief unmaps the index; remembered checksums stay in the sidecar file
+ *
+ * @param idx - checksum index
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int cksum_index_close(cksum_index *idx);
+
+#endif /* _CKSUM_H */
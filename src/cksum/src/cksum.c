@@ -0,0 +1,397 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for O_NOFOLLOW and O_CLOEXEC
+#endif
+#include <cksum.h>
+#include <flight.h>
+#include <netpoll.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CKSUM_POLY      0x82f63b78 // reflected Castagnoli polynomial
+#define CKSUM_COPY_BUF  65536
+#define CKSUM_INDEX_LEN (CKSUM_INDEX_SLOTS * sizeof(cksum_slot))
+
+/**
+ * byte at a time lookup table for CPUs without the crc32 instruction
+ */
+static uint32_t _crc_table[256];
+
+static pthread_once_t _crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * nonzero if the crc32 instruction can be used; set once by _crc_setup
+ */
+static int _crc_hw = 0;
+
+/**
+ * @brief builds the lookup table and probes the CPU
+ *
+ * @return nothing
+ *
+ */
+static void _crc_setup(void);
+
+/**
+ * @brief table driven CRC32C
+ *
+ * @return updated CRC; pre and post inversion is left to the caller
+ *
+ */
+static uint32_t _crc_sw(uint32_t crc, const uint8_t *p, size_t len);
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C using the SSE4.2 crc32 instruction eight bytes at a time
+ *
+ * @return updated CRC; pre and post inversion is left to the caller
+ *
+ */
+__attribute__((target("sse4.2"))) static uint32_t _crc_hw_x86(
+    uint32_t crc, const uint8_t *p, size_t len);
+#endif
+
+/**
+ * @brief direct mapped slot for a file
+ *
+ */
+static cksum_slot *_index_slot(cksum_index *idx, const struct stat *st);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+uint32_t
+cksum_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&_crc_once, _crc_setup);
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (_crc_hw)
+    {
+        return ~_crc_hw_x86(crc, buf, len);
+    }
+#endif
+    return ~_crc_sw(crc, buf, len);
+}
+
+int64_t
+cksum_copy(int infd, int outfd, uint64_t len, uint32_t *crc)
+{
+    int64_t  ret   = -1;
+    uint8_t *buf   = NULL;
+    uint64_t total = 0;
+    uint32_t sum   = 0;
+    ssize_t  rlen  = 0;
+    ssize_t  wlen  = 0;
+    size_t   off   = 0;
+
+    if (NULL == crc)
+    {
+        log_error("cksum_copy: NULL crc");
+        goto ERR;
+    }
+
+    buf = malloc(CKSUM_COPY_BUF);
+    if (NULL == buf)
+    {
+        log_error("cksum_copy: couldn't malloc buffer");
+        goto ERR;
+    }
+
+    while (total < len)
+    {
+        rlen = read(infd,
+                    buf,
+                    (len - total < CKSUM_COPY_BUF) ? len - total
+                                                   : CKSUM_COPY_BUF);
+        if (0 > rlen && EINTR == errno)
+        {
+            continue;
+        }
+        if (0 >= rlen)
+        {
+            // the file shrinking under us would leave the peer short
+            log_perror("cksum_copy: read error");
+            goto ERR;
+        }
+        flight_mark(FLIGHT_IO);
+
+        // the buffer is still hot in cache, so this is the only pass over
+        // the data the checksum needs
+        sum = cksum_crc32c(sum, buf, rlen);
+
+        for (off = 0; off < (size_t)rlen; off += wlen)
+        {
+            wlen = send(outfd, &buf[off], rlen - off, MSG_NOSIGNAL);
+            if (0 > wlen && ENOTSOCK == errno)
+            {
+                wlen = write(outfd, &buf[off], rlen - off);
+            }
+            if (0 <= wlen)
+            {
+                continue;
+            }
+            wlen = 0;
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno || EWOULDBLOCK == errno)
+                && 0 == tcp_wait_writable(outfd))
+            {
+                continue;
+            }
+            log_perror("cksum_copy: write error");
+            goto ERR;
+        }
+        total += rlen;
+    }
+
+    *crc = sum;
+    ret  = total;
+
+ERR:
+    free(buf);
+    buf = NULL;
+    return ret;
+}
+
+cksum_index *
+cksum_index_open(int rootfd)
+{
+    cksum_index *ret = NULL;
+    cksum_index *idx = NULL;
+    int          fd  = -1;
+    struct stat  st;
+
+    idx = calloc(1, sizeof(struct cksum_index_));
+    if (NULL == idx)
+    {
+        fprintf(stderr, "! cksum_index_open: couldn't calloc index\n");
+        goto ERR;
+    }
+    idx->slots = MAP_FAILED;
+
+    fd = openat(rootfd,
+                CKSUM_INDEX_FILE,
+                O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                0600);
+    if (0 > fd)
+    {
+        perror("! cksum_index_open: couldn't open index");
+        goto ERR;
+    }
+
+    // a sidecar from a build with a different slot count is just dropped;
+    // every entry is only a cache of something that can be recomputed
+    if (0 != fstat(fd, &st)
+        || ((off_t)CKSUM_INDEX_LEN != st.st_size
+            && 0 != ftruncate(fd, 0))
+        || 0 != ftruncate(fd, CKSUM_INDEX_LEN))
+    {
+        perror("! cksum_index_open: couldn't size index");
+        goto ERR;
+    }
+
+    idx->slots = mmap(
+        NULL, CKSUM_INDEX_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == idx->slots)
+    {
+        perror("! cksum_index_open: couldn't map index");
+        goto ERR;
+    }
+
+    if (0 != pthread_mutex_init(&idx->lock, NULL))
+    {
+        fprintf(stderr, "! cksum_index_open: couldn't init lock\n");
+        goto ERR;
+    }
+
+    ret = idx;
+    idx = NULL;
+
+ERR:
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    if (NULL != idx && MAP_FAILED != idx->slots)
+    {
+        munmap(idx->slots, CKSUM_INDEX_LEN);
+    }
+    free(idx);
+    idx = NULL;
+    return ret;
+}
+
+int
+cksum_index_get(cksum_index *idx, int fd, uint32_t *crc)
+{
+    int         ret  = -1;
+    cksum_slot *slot = NULL;
+    struct stat st;
+
+    if (NULL == idx || NULL == crc || 0 != fstat(fd, &st))
+    {
+        goto ERR;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    slot = _index_slot(idx, &st);
+    if (slot->valid && (uint64_t)st.st_dev == slot->dev
+        && (uint64_t)st.st_ino == slot->ino
+        && (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec
+               == slot->mtime
+        && (uint64_t)st.st_size == slot->size)
+    {
+        *crc = slot->crc;
+        ret  = 0;
+    }
+    pthread_mutex_unlock(&idx->lock);
+
+ERR:
+    return ret;
+}
+
+int
+cksum_index_put(cksum_index *      idx,
+                int                fd,
+                const struct stat *before,
+                uint32_t           crc)
+{
+    int         ret  = -1;
+    cksum_slot *slot = NULL;
+    struct stat st;
+
+    if (NULL == idx || NULL == before || 0 != fstat(fd, &st))
+    {
+        goto ERR;
+    }
+
+    // ctime as well as mtime, as a write can land within one mtime tick
+    if (before->st_dev != st.st_dev || before->st_ino != st.st_ino
+        || before->st_size != st.st_size
+        || before->st_mtim.tv_sec != st.st_mtim.tv_sec
+        || before->st_mtim.tv_nsec != st.st_mtim.tv_nsec
+        || before->st_ctim.tv_sec != st.st_ctim.tv_sec
+        || before->st_ctim.tv_nsec != st.st_ctim.tv_nsec)
+    {
+        goto ERR;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    slot        = _index_slot(idx, &st);
+    slot->dev   = st.st_dev;
+    slot->ino   = st.st_ino;
+    slot->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    slot->size  = st.st_size;
+    slot->crc   = crc;
+    slot->valid = 1;
+    pthread_mutex_unlock(&idx->lock);
+    ret = 0;
+
+ERR:
+    return ret;
+}
+
+int
+cksum_index_close(cksum_index *idx)
+{
+    int ret = 0;
+
+    if (NULL == idx)
+    {
+        fprintf(stderr, "! cksum_index_close: NULL index\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    ret = munmap(idx->slots, CKSUM_INDEX_LEN);
+    pthread_mutex_destroy(&idx->lock);
+    free(idx);
+    idx = NULL;
+
+ERR:
+    return ret;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_crc_setup(void)
+{
+    uint32_t crc = 0;
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1) ? CKSUM_POLY : 0);
+        }
+        _crc_table[i] = crc;
+    }
+
+#if defined(__x86_64__)
+    _crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t
+_crc_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+    {
+        crc = _crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+_crc_hw_x86(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    uint64_t v = 0;
+
+    while (len && ((uintptr_t)p & 7))
+    {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= sizeof(v))
+    {
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+        p += sizeof(v);
+        len -= sizeof(v);
+    }
+    while (len--)
+    {
+        c = _mm_crc32_u8(c, *p++);
+    }
+
+    return c;
+}
+#endif
+
+static cksum_slot *
+_index_slot(cksum_index *idx, const struct stat *st)
+{
+    uint64_t h = (uint64_t)st->st_ino ^ ((uint64_t)st->st_dev << 32);
+
+    // fibonacci hashing spreads sequential inode numbers across the table
+    h *= 0x9e3779b97f4a7c15ULL;
+    return &idx->slots[(h >> 32) % CKSUM_INDEX_SLOTS];
+}
+/* PRIVATE FUNCTION DEFINITIONS */
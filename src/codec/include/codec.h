@@ -0,0 +1,267 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <ll.h>
+#include <threadpool.h>
+
+/**
+ * uncompressed size of one chunk of a compressed stream
+ */
+#define CODEC_CHUNK (64 * 1024)
+
+/**
+ * number of chunks compressed ahead of the one being sent
+ */
+#define CODEC_INFLIGHT 8
+
+/**
+ * length of the header in front of every chunk of a compressed stream:
+ * uncompressed len (4) | compressed len (4); a chunk whose compressed
+ * length equals its uncompressed length is stored raw and a chunk with
+ * both lengths zero ends the stream
+ */
+#define CODEC_CHUNK_HDR 8
+
+/**
+ * compression algorithms; the value is sent on the wire
+ */
+typedef enum codec_type_
+{
+    CODEC_NONE = 0x0,
+    CODEC_ZLIB = 0x1,
+    CODEC_ZSTD = 0x2,
+} codec_type;
+
+/**
+ * @brief one cached compressed stream for a file; shared by every
+ *        connection sending the file and freed by the last user
+ *
+ * @param dev - device of the file
+ *
+ * @param ino - inode of the file
+ *
+ * @param mtime - modification time of the file in nanoseconds
+ *
+ * @param type - codec of @param data
+ *
+ * @param data - complete compressed stream including the end chunk
+ *
+ * @param len - length of @param data
+ *
+ * @param refs - the cache plus every connection sending @param data
+ *
+ */
+typedef struct codec_entry_
+{
+    dev_t       dev;
+    ino_t       ino;
+    int64_t     mtime;
+    codec_type  type;
+    uint8_t *   data;
+    uint64_t    len;
+    atomic_uint refs;
+} codec_entry;
+
+/**
+ * @brief cache of compressed streams for hot files, keyed by inode and
+ *        mtime so a rewritten file is never served stale; least recently
+ *        used entries are evicted once @param budget bytes are in use
+ *
+ * @param lock - protects @param entries and @param used
+ *
+ * @param entries - most recently used first
+ *
+ * @param used - bytes of compressed data held
+ *
+ * @param budget - maximum bytes of compressed data held
+ *
+ */
+typedef struct codec_cache_
+{
+    pthread_mutex_t lock;
+    ll *            entries;
+    uint64_t        used;
+    uint64_t        budget;
+} codec_cache;
+
+/**
+ * @brief picks the best codec this build supports
+ *
+ * @return codec to use when the client asks for compression
+ *
+ */
+codec_type codec_default(void);
+
+/**
+ * @brief compresses one buffer
+ *
+ * @param type - codec to use
+ *
+ * @param in - data to compress
+ *
+ * @param inlen - length of @param in
+ *
+ * @param out - destination; must hold codec_bound(@param inlen) bytes
+ *
+ * @param outcap - size of @param out
+ *
+ * @return compressed length on success; -1 on error
+ *
+ */
+int64_t codec_compress(codec_type     type,
+                       const uint8_t *in,
+                       uint32_t       inlen,
+                       uint8_t *      out,
+                       uint32_t       outcap);
+
+/**
+ * @brief decompresses one buffer produced by codec_compress
+ *
+ * @return decompressed length on success; -1 on error
+ *
+ */
+int64_t codec_decompress(codec_type     type,
+                         const uint8_t *in,
+                         uint32_t       inlen,
+                         uint8_t *      out,
+                         uint32_t       outcap);
+
+/**
+ * @brief worst case compressed size of @param inlen bytes for any codec
+ *
+ */
+uint32_t codec_bound(uint32_t inlen);
+
+/**
+ * @brief compresses @param infd into a chunked stream written to
+ *        @param outfd; chunks are compressed by pool workers up to
+ *        CODEC_INFLIGHT ahead of the one being written, so compression
+ *        overlaps with socket I/O; the calling thread compresses chunks
+ *        itself if no worker has picked them up yet, so this is safe to
+ *        call from a pool worker
+ *
+ * @param pool - pool the chunks are compressed on
+ *
+ * @param type - codec to use
+ *
+ * @param infd - file to read from its current offset to EOF
+ *
+ * @param outfd - socket or file to write the stream to
+ *
+ * @param keep - if not NULL, set to a malloc'd copy of the whole stream
+ *        for caching, or NULL if it grew past @param keepmax
+ *
+ * @param keepmax - largest stream that is copied to @param keep
+ *
+ * @param keeplen - set to the length of @param keep
+ *
+ * @return bytes written to @param outfd on success; -1 on error
+ *
+ */
+int64_t codec_stream(threadpool *pool,
+                     codec_type  type,
+                     int         infd,
+                     int         outfd,
+                     uint8_t **  keep,
+                     uint64_t    keepmax,
+                     uint64_t *  keeplen);
+
+/**
+ * @brief decodes a complete chunked stream held in memory, e.g. the body
+ *        of a compressed PUT, and writes the data to @param outfd
+ *
+ * @param type - codec of the stream
+ *
+ * @param in - the stream
+ *
+ * @param inlen - length of @param in
+ *
+ * @param outfd - file to write the data to
+ *
+ * @return bytes written to @param outfd on success; -1 on a corrupt
+ *         stream or write error
+ *
+ */
+int64_t codec_unstream(codec_type     type,
+                       const uint8_t *in,
+                       uint64_t       inlen,
+                       int            outfd);
+
+/**
+ * @brief initializes the compressed stream cache
+ *
+ * @param budget - maximum bytes of compressed data to hold; 0 disables
+ *        caching
+ *
+ * @return pointer to initialized cache; NULL on error
+ *
+ */
+codec_cache *codec_cache_init(uint64_t budget);
+
+/**
+ * @brief looks up the compressed stream for an open file
+ *
+ * @param cache - stream cache
+ *
+ * @param fd - open file to look up; its current inode and mtime are used
+ *
+ * @param type - codec wanted
+ *
+ * @return referenced entry that must be given back with
+ *         codec_cache_release; NULL on a miss
+ *
+ */
+codec_entry *codec_cache_get(codec_cache *cache, int fd, codec_type type);
+
+/**
+ * @brief adds a compressed stream for an open file, evicting least
+ *        recently used entries to stay within budget; takes ownership of
+ *        @param data, which is freed instead if a stream of the same
+ *        version of the file was cached meanwhile
+ *
+ * @param cache - stream cache
+ *
+ * @param fd - file the stream was made from
+ *
+ * @param type - codec of @param data
+ *
+ * @param data - malloc'd stream from codec_stream
+ *
+ * @param len - length of @param data
+ *
+ * @return 0 on success; nonzero if the stream was not cached, in which
+ *         case @param data has been freed
+ *
+ */
+int codec_cache_put(codec_cache *cache,
+                    int          fd,
+                    codec_type   type,
+                    uint8_t *    data,
+                    uint64_t     len);
+
+/**
+ * @brief gives back an entry from codec_cache_get
+ *
+ * @param e - entry to release
+ *
+ * @return nothing
+ *
+ */
+void codec_cache_release(codec_entry *e);
+
+/**
+ * @brief frees the cache; entries still held by a connection are freed
+ *        when that connection releases them
+ *
+ * @param cache - stream cache
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int codec_cache_destroy(codec_cache *cache);
+
+#endif /* _CODEC_H */
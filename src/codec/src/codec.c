@@ -0,0 +1,871 @@
+#include <codec.h>
+#include <netpoll.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif // HAVE_ZSTD
+
+// favour speed; the point is to beat the link, not to win on ratio
+#define CODEC_ZLIB_LEVEL 1
+#define CODEC_ZSTD_LEVEL 1
+
+/**
+ * life cycle of a slot in codec_stream
+ */
+typedef enum slot_state_
+{
+    SLOT_EMPTY   = 0,
+    SLOT_PENDING = 1,
+    SLOT_CLAIMED = 2,
+    SLOT_DONE    = 3,
+} slot_state;
+
+typedef struct stream_ stream;
+
+/**
+ * @brief one chunk of a stream being compressed
+ *
+ * @param state - slot_state; moved from SLOT_PENDING to SLOT_CLAIMED by
+ *        whichever thread compresses the chunk
+ *
+ * @param owner - stream the slot belongs to
+ *
+ * @param inlen - uncompressed bytes in @param in
+ *
+ * @param outlen - compressed bytes in @param out; equal to @param inlen
+ *        if the chunk is sent raw
+ *
+ * @param in - uncompressed chunk
+ *
+ * @param out - compressed chunk
+ *
+ */
+typedef struct slot_
+{
+    atomic_int state;
+    stream *   owner;
+    uint32_t   inlen;
+    uint32_t   outlen;
+    uint8_t *  in;
+    uint8_t *  out;
+} slot;
+
+/**
+ * @brief state shared between codec_stream and the compression jobs it
+ *        queues; jobs can outlive the call so it is reference counted
+ *
+ * @param type - codec to use
+ *
+ * @param lock - used with @param cond to wait for a slot to finish
+ *
+ * @param cond - signaled whenever a slot finishes
+ *
+ * @param refs - caller plus every queued job
+ *
+ * @param slots - ring of chunks in flight
+ *
+ */
+struct stream_
+{
+    codec_type      type;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    atomic_uint     refs;
+    slot            slots[CODEC_INFLIGHT];
+};
+
+/**
+ * @brief compresses a slot if nobody else has claimed it yet
+ *
+ * @param s - slot to compress
+ *
+ * @return nothing
+ *
+ */
+static void _slot_run(slot *s);
+
+/**
+ * @brief threadpool job wrapping _slot_run
+ *
+ * @param slot_in - pointer to the slot
+ *
+ * @return nothing
+ *
+ */
+static void _slot_job(void *slot_in);
+
+/**
+ * @brief drops one reference to a stream and frees it with the last one
+ *
+ * @param st - stream to release
+ *
+ * @return nothing
+ *
+ */
+static void _stream_release(stream *st);
+
+/**
+ * @brief writes all of @param buf to @param fd, waiting out EAGAIN on
+ *        non-blocking sockets
+ *
+ * @return 0 on success; -1 on error
+ *
+ */
+static int _stream_out(int fd, const uint8_t *buf, size_t len);
+
+/**
+ * @brief appends to the copy of the stream kept for the cache; drops the
+ *        copy once it passes @param keepmax and marks that with a NULL
+ *        @param keep and a @param keepcap of 1 so nothing more is kept
+ *
+ * @return nothing
+ *
+ */
+static void _stream_keep(uint8_t ** keep,
+                         uint64_t * keeplen,
+                         uint64_t * keepcap,
+                         uint64_t   keepmax,
+                         const void *buf,
+                         size_t     len);
+
+/**
+ * @brief custom free function to be supplied as a pointer to the linked
+ *        list; drops the cache's reference to an entry
+ *
+ * @param p - pointer to the node to be freed
+ *
+ * @return nothing
+ *
+ */
+static void _cache_free_node(void *p);
+
+/**
+ * @brief finds the entry for the version of a file @param st describes
+ *        and moves it to the front; the caller holds the cache lock
+ *
+ * @return entry, still referenced only by the list; NULL on a miss
+ *
+ */
+static codec_entry *_cache_find(codec_cache *      cache,
+                                const struct stat *st,
+                                codec_type         type);
+
+static void _put32(uint8_t *p, uint32_t v);
+static uint32_t _get32(const uint8_t *p);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+codec_type
+codec_default(void)
+{
+#ifdef HAVE_ZSTD
+    return CODEC_ZSTD;
+#else
+    return CODEC_ZLIB;
+#endif // HAVE_ZSTD
+}
+
+uint32_t
+codec_bound(uint32_t inlen)
+{
+    uint32_t ret = compressBound(inlen);
+
+#ifdef HAVE_ZSTD
+    if (ZSTD_compressBound(inlen) > ret)
+    {
+        ret = ZSTD_compressBound(inlen);
+    }
+#endif // HAVE_ZSTD
+
+    return ret;
+}
+
+int64_t
+codec_compress(codec_type     type,
+               const uint8_t *in,
+               uint32_t       inlen,
+               uint8_t *      out,
+               uint32_t       outcap)
+{
+    int64_t ret    = -1;
+    uLongf  outlen = outcap;
+
+    switch (type)
+    {
+        case CODEC_ZLIB:
+            if (Z_OK == compress2(out, &outlen, in, inlen, CODEC_ZLIB_LEVEL))
+            {
+                ret = outlen;
+            }
+            break;
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+        {
+            size_t zret
+                = ZSTD_compress(out, outcap, in, inlen, CODEC_ZSTD_LEVEL);
+            if (!ZSTD_isError(zret))
+            {
+                ret = zret;
+            }
+            break;
+        }
+#endif // HAVE_ZSTD
+        default:
+            log_error("codec_compress: unsupported codec %d", type);
+    }
+
+    return ret;
+}
+
+int64_t
+codec_decompress(codec_type     type,
+                 const uint8_t *in,
+                 uint32_t       inlen,
+                 uint8_t *      out,
+                 uint32_t       outcap)
+{
+    int64_t ret    = -1;
+    uLongf  outlen = outcap;
+
+    switch (type)
+    {
+        case CODEC_ZLIB:
+            if (Z_OK == uncompress(out, &outlen, in, inlen))
+            {
+                ret = outlen;
+            }
+            break;
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+        {
+            size_t zret = ZSTD_decompress(out, outcap, in, inlen);
+            if (!ZSTD_isError(zret))
+            {
+                ret = zret;
+            }
+            break;
+        }
+#endif // HAVE_ZSTD
+        default:
+            log_error("codec_decompress: unsupported codec %d", type);
+    }
+
+    return ret;
+}
+
+int64_t
+codec_stream(threadpool *pool,
+             codec_type  type,
+             int         infd,
+             int         outfd,
+             uint8_t **  keep,
+             uint64_t    keepmax,
+             uint64_t *  keeplen)
+{
+    int64_t  ret                  = -1;
+    stream * st                   = NULL;
+    slot *   s                    = NULL;
+    uint8_t  hdr[CODEC_CHUNK_HDR] = { 0 };
+    uint64_t seq                  = 0;
+    uint64_t sent                 = 0;
+    uint64_t total                = 0;
+    uint64_t keepcap              = 0;
+    ssize_t  rlen                 = 0;
+    int      eof                  = 0;
+
+    if (NULL == pool || (NULL != keep && NULL == keeplen))
+    {
+        log_error("codec_stream: NULL arguments");
+        goto ERR;
+    }
+    if (NULL != keep)
+    {
+        *keep    = NULL;
+        *keeplen = 0;
+    }
+
+    st = calloc(1, sizeof(struct stream_));
+    if (NULL == st)
+    {
+        log_error("codec_stream: couldn't calloc stream");
+        goto ERR;
+    }
+    st->type = type;
+    pthread_mutex_init(&(st->lock), NULL);
+    pthread_cond_init(&(st->cond), NULL);
+    atomic_init(&(st->refs), 1);
+    for (int i = 0; i < CODEC_INFLIGHT; i++)
+    {
+        st->slots[i].owner = st;
+        st->slots[i].in    = malloc(CODEC_CHUNK);
+        st->slots[i].out   = malloc(codec_bound(CODEC_CHUNK));
+        if (NULL == st->slots[i].in || NULL == st->slots[i].out)
+        {
+            log_error("codec_stream: couldn't malloc slots");
+            goto ERR;
+        }
+    }
+
+    while (!eof || sent < seq)
+    {
+        // keep the ring full so workers stay ahead of the socket
+        while (!eof && seq - sent < CODEC_INFLIGHT)
+        {
+            s        = &(st->slots[seq % CODEC_INFLIGHT]);
+            s->inlen = 0;
+            while (s->inlen < CODEC_CHUNK)
+            {
+                rlen = read(infd, &s->in[s->inlen], CODEC_CHUNK - s->inlen);
+                if (0 > rlen && EINTR == errno)
+                {
+                    continue;
+                }
+                if (0 > rlen)
+                {
+                    log_perror("codec_stream: read error");
+                    goto ERR;
+                }
+                if (0 == rlen)
+                {
+                    eof = 1;
+                    break;
+                }
+                s->inlen += rlen;
+            }
+            if (0 == s->inlen)
+            {
+                break;
+            }
+
+            atomic_store(&(s->state), SLOT_PENDING);
+            atomic_fetch_add(&(st->refs), 1);
+            if (0 != thpool_add_job(pool, _slot_job, s))
+            {
+                atomic_fetch_sub(&(st->refs), 1);
+            }
+            seq++;
+        }
+
+        if (sent == seq)
+        {
+            break;
+        }
+
+        // compress it here if no worker got to it, otherwise wait
+        s = &(st->slots[sent % CODEC_INFLIGHT]);
+        _slot_run(s);
+        pthread_mutex_lock(&(st->lock));
+        while (SLOT_DONE != atomic_load(&(s->state)))
+        {
+            pthread_cond_wait(&(st->cond), &(st->lock));
+        }
+        pthread_mutex_unlock(&(st->lock));
+
+        _put32(&hdr[0], s->inlen);
+        _put32(&hdr[4], s->outlen);
+        if (0 != _stream_out(outfd, hdr, sizeof(hdr))
+            || 0
+                   != _stream_out(outfd,
+                                  (s->outlen == s->inlen) ? s->in : s->out,
+                                  s->outlen))
+        {
+            goto ERR;
+        }
+        if (NULL != keep)
+        {
+            _stream_keep(keep, keeplen, &keepcap, keepmax, hdr, sizeof(hdr));
+            _stream_keep(keep,
+                         keeplen,
+                         &keepcap,
+                         keepmax,
+                         (s->outlen == s->inlen) ? s->in : s->out,
+                         s->outlen);
+        }
+        total += sizeof(hdr) + s->outlen;
+        atomic_store(&(s->state), SLOT_EMPTY);
+        sent++;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    if (0 != _stream_out(outfd, hdr, sizeof(hdr)))
+    {
+        goto ERR;
+    }
+    if (NULL != keep)
+    {
+        _stream_keep(keep, keeplen, &keepcap, keepmax, hdr, sizeof(hdr));
+    }
+
+    ret = total + sizeof(hdr);
+
+ERR:
+    if (0 > ret && NULL != keep)
+    {
+        free(*keep);
+        *keep    = NULL;
+        *keeplen = 0;
+    }
+    if (NULL != st)
+    {
+        // queued jobs hold their own references, so chunks still in
+        // flight on error are safe to abandon
+        _stream_release(st);
+    }
+    st = NULL;
+    return ret;
+}
+
+int64_t
+codec_unstream(codec_type     type,
+               const uint8_t *in,
+               uint64_t       inlen,
+               int            outfd)
+{
+    int64_t        ret    = -1;
+    uint64_t       off    = 0;
+    uint64_t       total  = 0;
+    uint32_t       ulen   = 0;
+    uint32_t       clen   = 0;
+    int64_t        dlen   = 0;
+    uint8_t *      tmp    = NULL;
+    const uint8_t *data   = NULL;
+    ssize_t        wlen   = 0;
+    uint32_t       wtotal = 0;
+
+    if (NULL == in)
+    {
+        log_error("codec_unstream: NULL stream");
+        goto ERR;
+    }
+
+    tmp = malloc(CODEC_CHUNK);
+    if (NULL == tmp)
+    {
+        log_error("codec_unstream: couldn't malloc chunk");
+        goto ERR;
+    }
+
+    for (;;)
+    {
+        if (CODEC_CHUNK_HDR > inlen - off)
+        {
+            log_warn("codec_unstream: truncated stream");
+            goto ERR;
+        }
+        ulen = _get32(&in[off]);
+        clen = _get32(&in[off + 4]);
+        off += CODEC_CHUNK_HDR;
+        if (0 == ulen && 0 == clen)
+        {
+            break;
+        }
+        if (CODEC_CHUNK < ulen || clen > ulen || clen > inlen - off)
+        {
+            log_warn("codec_unstream: corrupt chunk header");
+            goto ERR;
+        }
+
+        data = &in[off];
+        if (clen < ulen)
+        {
+            dlen = codec_decompress(type, data, clen, tmp, CODEC_CHUNK);
+            if (dlen != ulen)
+            {
+                log_warn("codec_unstream: corrupt chunk");
+                goto ERR;
+            }
+            data = tmp;
+        }
+
+        for (wtotal = 0; wtotal < ulen; wtotal += wlen)
+        {
+            wlen = write(outfd, &data[wtotal], ulen - wtotal);
+            if (0 > wlen)
+            {
+                if (EINTR == errno)
+                {
+                    wlen = 0;
+                    continue;
+                }
+                log_perror("codec_unstream: write error");
+                goto ERR;
+            }
+        }
+
+        off += clen;
+        total += ulen;
+    }
+
+    ret = total;
+ERR:
+    free(tmp);
+    tmp = NULL;
+    return ret;
+}
+
+codec_cache *
+codec_cache_init(uint64_t budget)
+{
+    codec_cache *ret   = NULL;
+    codec_cache *cache = NULL;
+    int          err   = 0;
+
+    cache = calloc(1, sizeof(struct codec_cache_));
+    if (NULL == cache)
+    {
+        fprintf(stderr, "! codec_cache_init: couldn't calloc cache\n");
+        goto ERR;
+    }
+
+    cache->entries = ll_init();
+    if (NULL == cache->entries)
+    {
+        fprintf(stderr, "! codec_cache_init: couldn't init entry list\n");
+        goto ERR;
+    }
+
+    err = pthread_mutex_init(&(cache->lock), NULL);
+    if (0 != err)
+    {
+        perror("! codec_cache_init: couldn't init mutex\n");
+        goto ERR;
+    }
+
+    cache->budget = budget;
+
+    ret   = cache;
+    cache = NULL;
+
+ERR:
+    if (NULL != cache && NULL != cache->entries)
+    {
+        ll_destroy(cache->entries);
+    }
+    free(cache);
+    cache = NULL;
+    return ret;
+}
+
+codec_entry *
+codec_cache_get(codec_cache *cache, int fd, codec_type type)
+{
+    codec_entry *ret = NULL;
+    struct stat  st  = { 0 };
+
+    if (NULL == cache || 0 != fstat(fd, &st))
+    {
+        goto RET;
+    }
+
+    pthread_mutex_lock(&(cache->lock));
+    ret = _cache_find(cache, &st, type);
+    if (NULL != ret)
+    {
+        atomic_fetch_add(&(ret->refs), 1);
+    }
+    pthread_mutex_unlock(&(cache->lock));
+
+RET:
+    return ret;
+}
+
+int
+codec_cache_put(codec_cache *cache,
+                int          fd,
+                codec_type   type,
+                uint8_t *    data,
+                uint64_t     len)
+{
+    int          ret = -1;
+    codec_entry *e   = NULL;
+    codec_entry *old = NULL;
+    struct stat  st  = { 0 };
+
+    if (NULL == cache || NULL == data || len > cache->budget
+        || 0 != fstat(fd, &st))
+    {
+        goto ERR;
+    }
+
+    e = calloc(1, sizeof(struct codec_entry_));
+    if (NULL == e)
+    {
+        log_error("codec_cache_put: couldn't calloc entry");
+        goto ERR;
+    }
+    e->dev   = st.st_dev;
+    e->ino   = st.st_ino;
+    e->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    e->type  = type;
+    e->data  = data;
+    e->len   = len;
+    atomic_init(&(e->refs), 1);
+
+    pthread_mutex_lock(&(cache->lock));
+    // readers that missed together all compress the file and race here;
+    // the first stream in is kept and the others are dropped
+    if (NULL != _cache_find(cache, &st, type))
+    {
+        ret = 0;
+    }
+    else
+    {
+        while (cache->used + len > cache->budget
+               && NULL != cache->entries->head)
+        {
+            // ll's pop_back can't take the last node
+            old = (NULL == cache->entries->head->next)
+                      ? pop_front(cache->entries)
+                      : pop_back(cache->entries);
+            cache->used -= old->len;
+            codec_cache_release(old);
+        }
+        ret = push_front(cache->entries, e, _cache_free_node);
+        if (0 == ret)
+        {
+            cache->used += len;
+            e    = NULL;
+            data = NULL;
+        }
+    }
+    pthread_mutex_unlock(&(cache->lock));
+
+ERR:
+    free(e);
+    free(data);
+    return ret;
+}
+
+void
+codec_cache_release(codec_entry *e)
+{
+    if (NULL == e || 1 != atomic_fetch_sub(&(e->refs), 1))
+    {
+        return;
+    }
+
+    free(e->data);
+    e->data = NULL;
+    free(e);
+    return;
+}
+
+int
+codec_cache_destroy(codec_cache *cache)
+{
+    int ret = 0;
+
+    if (NULL == cache)
+    {
+        fprintf(stderr, "! codec_cache_destroy: NULL cache\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    ret = ll_destroy(cache->entries);
+    cache->entries = NULL;
+    pthread_mutex_destroy(&(cache->lock));
+    free(cache);
+    cache = NULL;
+
+ERR:
+    return ret;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_slot_run(slot *s)
+{
+    int     expect = SLOT_PENDING;
+    int64_t clen   = 0;
+    stream *st     = s->owner;
+
+    if (!atomic_compare_exchange_strong(&(s->state), &expect, SLOT_CLAIMED))
+    {
+        return;
+    }
+
+    clen = codec_compress(
+        st->type, s->in, s->inlen, s->out, codec_bound(CODEC_CHUNK));
+
+    // incompressible chunks go out raw
+    s->outlen = (0 > clen || clen >= s->inlen) ? s->inlen : clen;
+
+    pthread_mutex_lock(&(st->lock));
+    atomic_store(&(s->state), SLOT_DONE);
+    pthread_cond_broadcast(&(st->cond));
+    pthread_mutex_unlock(&(st->lock));
+    return;
+}
+
+static void
+_slot_job(void *slot_in)
+{
+    slot *  s  = (slot *)slot_in;
+    stream *st = s->owner;
+
+    _slot_run(s);
+    _stream_release(st);
+    return;
+}
+
+static void
+_stream_release(stream *st)
+{
+    if (1 != atomic_fetch_sub(&(st->refs), 1))
+    {
+        return;
+    }
+
+    for (int i = 0; i < CODEC_INFLIGHT; i++)
+    {
+        free(st->slots[i].in);
+        free(st->slots[i].out);
+    }
+    pthread_cond_destroy(&(st->cond));
+    pthread_mutex_destroy(&(st->lock));
+    free(st);
+    return;
+}
+
+static int
+_stream_out(int fd, const uint8_t *buf, size_t len)
+{
+    size_t  total = 0;
+    ssize_t wlen  = 0;
+
+    while (total < len)
+    {
+        wlen = write(fd, &buf[total], len - total);
+        if (0 > wlen)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno || EWOULDBLOCK == errno)
+                && 0 == tcp_wait_writable(fd))
+            {
+                continue;
+            }
+            log_perror("_stream_out: write error");
+            return -1;
+        }
+        total += wlen;
+    }
+
+    return 0;
+}
+
+static void
+_stream_keep(uint8_t **  keep,
+             uint64_t *  keeplen,
+             uint64_t *  keepcap,
+             uint64_t    keepmax,
+             const void *buf,
+             size_t      len)
+{
+    uint8_t *grown = NULL;
+    uint64_t cap   = 0;
+
+    if (NULL == *keep && 0 < *keepcap)
+    {
+        return;
+    }
+
+    if (*keeplen + len > keepmax)
+    {
+        free(*keep);
+        *keep    = NULL;
+        *keeplen = 0;
+        *keepcap = 1;
+        return;
+    }
+
+    if (*keeplen + len > *keepcap || NULL == *keep)
+    {
+        cap = (0 == *keepcap) ? CODEC_CHUNK : *keepcap;
+        while (cap < *keeplen + len)
+        {
+            cap *= 2;
+        }
+        grown = realloc(*keep, cap);
+        if (NULL == grown)
+        {
+            free(*keep);
+            *keep    = NULL;
+            *keeplen = 0;
+            *keepcap = 1;
+            return;
+        }
+        *keep    = grown;
+        *keepcap = cap;
+    }
+
+    memcpy(&(*keep)[*keeplen], buf, len);
+    *keeplen += len;
+    return;
+}
+
+static void
+_cache_free_node(void *p)
+{
+    node *n = (node *)p;
+    codec_cache_release(n->data);
+    n->data = NULL;
+    n->next = NULL;
+    n->f    = NULL;
+    free(n);
+    return;
+}
+
+static codec_entry *
+_cache_find(codec_cache *cache, const struct stat *st, codec_type type)
+{
+    codec_entry *e  = NULL;
+    node *       n  = NULL;
+    int64_t      mt = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    uint         i  = 0;
+
+    for (n = cache->entries->head; NULL != n; n = n->next, i++)
+    {
+        e = n->data;
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->mtime == mt
+            && e->type == type)
+        {
+            // ll_rm drops the list's reference, so take one to carry the
+            // entry to the front
+            atomic_fetch_add(&(e->refs), 1);
+            ll_rm(cache->entries, i);
+            push_front(cache->entries, e, _cache_free_node);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+_put32(uint8_t *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t
+_get32(const uint8_t *p)
+{
+    uint32_t v = 0;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+/* PRIVATE FUNCTION DEFINITIONS */
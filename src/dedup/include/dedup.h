@@ -0,0 +1,162 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pathres.h>
+
+/**
+ * name of the content addressed object directory beneath the server root;
+ * user paths are reflinked from objects, which only works within one
+ * filesystem, and pathres refuses client paths that reach into it
+ */
+#define DEDUP_OBJ_DIR PATHRES_OBJ_DIR
+
+/**
+ * length of a SHA-256 object digest
+ */
+#define DEDUP_DIGEST_LEN 32
+
+/**
+ * @brief content addressed object store
+ *
+ * @param rootfd - server root from pathres_rootopen
+ *
+ * @param objfd - object directory beneath @param rootfd
+ *
+ */
+typedef struct dedup_store_
+{
+    int rootfd;
+    int objfd;
+} dedup_store;
+
+/**
+ * @brief a PUT body being hashed and written as it streams in; opaque to
+ *        callers. A PUT_OP arrives as one frame of at most PROTO_MAX_FRAME
+ *        and is given to dedup_put_update whole; a larger file arrives as
+ *        UPCHUNK_OP frames, each given to dedup_put_update in turn
+ */
+typedef struct dedup_put_ dedup_put;
+
+/**
+ * @brief opens the object store, creating the object directory if needed
+ *
+ * @param rootfd - server root from pathres_rootopen
+ *
+ * @return pointer to initialized store; NULL on error
+ *
+ */
+dedup_store *dedup_init(int rootfd);
+
+/**
+ * @brief starts receiving a PUT body into a temporary object
+ *
+ * @param store - object store
+ *
+ * @return pointer to the new put; NULL on error
+ *
+ */
+dedup_put *dedup_put_begin(dedup_store *store);
+
+/**
+ * @brief hashes and writes the next piece of the body
+ *
+ * @param put - put from dedup_put_begin
+ *
+ * @param buf - body data
+ *
+ * @param len - length of @param buf
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int dedup_put_update(dedup_put *put, const void *buf, size_t len);
+
+/**
+ * @brief finishes the hash, stores the object unless an identical one is
+ *        already stored, and places a copy of it at @param path; the copy
+ *        shares the object's blocks where the filesystem supports
+ *        reflinks (FICLONE) and is a plain copy otherwise, and either way
+ *        is its own inode, so writing to it, truncating it or changing
+ *        its mode never reaches the object or any other copy; always
+ *        frees @param put
+ *
+ * @param put - put from dedup_put_begin
+ *
+ * @param path - destination path beneath the server root
+ *
+ * @param overwrite - nonzero if an existing file at @param path may be
+ *        replaced
+ *
+ * @param digest - if not NULL, set to the object digest
+ *
+ * @return 0 on success; -1 on error with errno set, EEXIST if the
+ *         destination exists and @param overwrite is 0
+ *
+ */
+int dedup_put_commit(dedup_put * put,
+                     const char *path,
+                     int         overwrite,
+                     uint8_t     digest[DEDUP_DIGEST_LEN]);
+
+/**
+ * @brief discards a put and its temporary object
+ *
+ * @param put - put from dedup_put_begin
+ *
+ * @return nothing
+ *
+ */
+void dedup_put_abort(dedup_put *put);
+
+/**
+ * @brief places a copy of an already stored object at @param path, as
+ *        dedup_put_commit does; lets a PUT whose digest is known up front
+ *        finish without sending the body
+ *
+ * @param store - object store
+ *
+ * @param digest - SHA-256 of the content
+ *
+ * @param path - destination path beneath the server root
+ *
+ * @param overwrite - nonzero if an existing file at @param path may be
+ *        replaced
+ *
+ * @return 0 on success; -1 on error with errno set, ENOENT if no such
+ *         object is stored, EEXIST if the destination exists and
+ *         @param overwrite is 0
+ *
+ */
+int dedup_link(dedup_store * store,
+               const uint8_t digest[DEDUP_DIGEST_LEN],
+               const char *  path,
+               int           overwrite);
+
+/**
+ * @brief removes objects no PUT has used for @param idle_s seconds, and
+ *        temporary objects as old left behind by puts that never ended;
+ *        an object is only a source to clone from, so removing one just
+ *        means the next PUT of that content stores it again
+ *
+ * @param store - object store
+ *
+ * @param idle_s - seconds since an object was last stored or placed
+ *
+ * @return number of files removed; -1 on error
+ *
+ */
+int dedup_gc(dedup_store *store, uint64_t idle_s);
+
+/**
+ * @brief frees the object store; stored objects stay on disk
+ *
+ * @param store - object store
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int dedup_destroy(dedup_store *store);
+
+#endif /* _DEDUP_H */
@@ -0,0 +1,645 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for O_PATH and renameat2
+#endif
+#include <dedup.h>
+#include <pathres.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+
+#define DEDUP_TMP_LEN 24
+#define DEDUP_HEX_LEN (DEDUP_DIGEST_LEN * 2 + 1)
+
+/**
+ * @brief a PUT body being hashed and written as it streams in
+ *
+ * @param store - object store the body goes to
+ *
+ * @param md - running SHA-256 of the body
+ *
+ * @param fd - temporary object
+ *
+ * @param tmpname - name of the temporary object in the object directory
+ *
+ */
+struct dedup_put_
+{
+    dedup_store *store;
+    EVP_MD_CTX * md;
+    int          fd;
+    char         tmpname[DEDUP_TMP_LEN];
+};
+
+/**
+ * @brief fills @param name with a random temporary file name
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _dedup_tmpname(char name[DEDUP_TMP_LEN]);
+
+/**
+ * @brief opens the fan out directory for a digest and sets @param obj to
+ *        the object name inside it
+ *
+ * @param store - object store
+ *
+ * @param digest - object digest
+ *
+ * @param create - nonzero to create the fan out directory if missing
+ *
+ * @param obj - set to the object name
+ *
+ * @return O_PATH directory file descriptor on success; -1 on error
+ *
+ */
+static int _dedup_objdir(dedup_store * store,
+                         const uint8_t digest[DEDUP_DIGEST_LEN],
+                         int           create,
+                         char          obj[DEDUP_HEX_LEN]);
+
+/**
+ * @brief places a copy of an object at a user path beneath the server
+ *        root; the copy is its own inode, so writing to it, truncating it
+ *        or changing its mode never reaches the object or other copies
+ *
+ * @param store - object store
+ *
+ * @param srcfd - object opened for reading
+ *
+ * @param path - destination path beneath the server root
+ *
+ * @param overwrite - nonzero if an existing file may be replaced
+ *
+ * @return 0 on success; -1 on error with errno set
+ *
+ */
+static int _dedup_placepath(dedup_store *store,
+                            int          srcfd,
+                            const char * path,
+                            int          overwrite);
+
+/**
+ * @brief fills an empty file with the contents of another, sharing the
+ *        blocks with FICLONE where the filesystem supports reflinks and
+ *        copying them with copy_file_range otherwise
+ *
+ * @param srcfd - file to read
+ *
+ * @param dstfd - empty file open for writing
+ *
+ * @return 0 on success; -1 on error with errno set
+ *
+ */
+static int _dedup_clone(int srcfd, int dstfd);
+
+/**
+ * @brief removes the regular files in a directory whose names start with
+ *        @param prefix and that were last modified before @param cutoff
+ *
+ * @param fd - directory to sweep
+ *
+ * @param prefix - name prefix; "" for every file
+ *
+ * @param cutoff - CLOCK_REALTIME seconds
+ *
+ * @return number of files removed
+ *
+ */
+static int _dedup_sweep(int fd, const char *prefix, time_t cutoff);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+dedup_store *
+dedup_init(int rootfd)
+{
+    dedup_store *ret   = NULL;
+    dedup_store *store = NULL;
+
+    store = calloc(1, sizeof(struct dedup_store_));
+    if (NULL == store)
+    {
+        fprintf(stderr, "! dedup_init: couldn't calloc store\n");
+        goto ERR;
+    }
+
+    if (0 != mkdirat(rootfd, DEDUP_OBJ_DIR, 0700) && EEXIST != errno)
+    {
+        perror("! dedup_init: couldn't create object directory");
+        goto ERR;
+    }
+
+    store->objfd = openat(
+        rootfd, DEDUP_OBJ_DIR, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (0 > store->objfd)
+    {
+        perror("! dedup_init: couldn't open object directory");
+        goto ERR;
+    }
+    store->rootfd = rootfd;
+
+    ret   = store;
+    store = NULL;
+
+ERR:
+    free(store);
+    store = NULL;
+    return ret;
+}
+
+dedup_put *
+dedup_put_begin(dedup_store *store)
+{
+    dedup_put *ret = NULL;
+    dedup_put *put = NULL;
+
+    if (NULL == store)
+    {
+        log_error("dedup_put_begin: NULL store");
+        goto ERR;
+    }
+
+    put = calloc(1, sizeof(struct dedup_put_));
+    if (NULL == put)
+    {
+        log_error("dedup_put_begin: couldn't calloc put");
+        goto ERR;
+    }
+    put->fd    = -1;
+    put->store = store;
+
+    put->md = EVP_MD_CTX_new();
+    if (NULL == put->md || 1 != EVP_DigestInit_ex(put->md, EVP_sha256(), NULL))
+    {
+        log_error("dedup_put_begin: couldn't init digest");
+        goto ERR;
+    }
+
+    if (0 != _dedup_tmpname(put->tmpname))
+    {
+        goto ERR;
+    }
+
+    // readable as well, as the copy placed at the user path is taken from
+    // it if the stored object has been collected meanwhile
+    put->fd = openat(store->objfd,
+                     put->tmpname,
+                     O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                     0644);
+    if (0 > put->fd)
+    {
+        log_perror("dedup_put_begin: couldn't create temporary object");
+        goto ERR;
+    }
+
+    ret = put;
+    put = NULL;
+
+ERR:
+    if (NULL != put)
+    {
+        EVP_MD_CTX_free(put->md);
+    }
+    free(put);
+    put = NULL;
+    return ret;
+}
+
+int
+dedup_put_update(dedup_put *put, const void *buf, size_t len)
+{
+    int     ret   = -1;
+    size_t  total = 0;
+    ssize_t wlen  = 0;
+
+    if (NULL == put || (NULL == buf && 0 < len))
+    {
+        log_error("dedup_put_update: NULL arguments");
+        goto ERR;
+    }
+
+    if (1 != EVP_DigestUpdate(put->md, buf, len))
+    {
+        log_error("dedup_put_update: digest error");
+        goto ERR;
+    }
+
+    while (total < len)
+    {
+        wlen = write(put->fd, (const char *)buf + total, len - total);
+        if (0 > wlen)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            log_perror("dedup_put_update: write error");
+            goto ERR;
+        }
+        total += wlen;
+    }
+
+    ret = 0;
+ERR:
+    return ret;
+}
+
+int
+dedup_put_commit(dedup_put * put,
+                 const char *path,
+                 int         overwrite,
+                 uint8_t     digest[DEDUP_DIGEST_LEN])
+{
+    int     ret                 = -1;
+    int     err                 = 0;
+    int     dirfd               = -1;
+    int     srcfd               = -1;
+    uint8_t md[EVP_MAX_MD_SIZE] = { 0 };
+    uint    mdlen               = 0;
+    char    obj[DEDUP_HEX_LEN]  = { 0 };
+
+    if (NULL == put || NULL == path)
+    {
+        log_error("dedup_put_commit: NULL arguments");
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    if (1 != EVP_DigestFinal_ex(put->md, md, &mdlen)
+        || DEDUP_DIGEST_LEN != mdlen)
+    {
+        log_error("dedup_put_commit: digest error");
+        errno = EIO;
+        goto ERR;
+    }
+
+    dirfd = _dedup_objdir(put->store, md, 1, obj);
+    if (0 > dirfd)
+    {
+        goto ERR;
+    }
+
+    // the first copy of some content becomes the object; any later copy
+    // is a duplicate and its temporary file is simply dropped
+    ret = renameat2(
+        put->store->objfd, put->tmpname, dirfd, obj, RENAME_NOREPLACE);
+    if (0 != ret && EEXIST != errno)
+    {
+        log_perror("dedup_put_commit: couldn't store object");
+        goto ERR;
+    }
+
+    // cloned from the stored object so reflinked copies share its blocks;
+    // dedup_gc may have removed it since, and this put holds the same
+    // content
+    srcfd = openat(dirfd, obj, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    ret   = _dedup_placepath(
+        put->store, (0 <= srcfd) ? srcfd : put->fd, path, overwrite);
+    if (0 == ret && 0 <= srcfd)
+    {
+        // keeps a used object from being collected
+        futimens(srcfd, NULL);
+    }
+    if (0 == ret && NULL != digest)
+    {
+        memcpy(digest, md, DEDUP_DIGEST_LEN);
+    }
+
+ERR:
+    err = errno;
+    if (0 <= srcfd)
+    {
+        close(srcfd);
+    }
+    if (0 <= dirfd)
+    {
+        close(dirfd);
+    }
+    if (NULL != put)
+    {
+        // still there if the object already existed or on error
+        unlinkat(put->store->objfd, put->tmpname, 0);
+        close(put->fd);
+        EVP_MD_CTX_free(put->md);
+        free(put);
+    }
+    put   = NULL;
+    errno = err;
+    return ret;
+}
+
+void
+dedup_put_abort(dedup_put *put)
+{
+    if (NULL == put)
+    {
+        return;
+    }
+
+    unlinkat(put->store->objfd, put->tmpname, 0);
+    close(put->fd);
+    EVP_MD_CTX_free(put->md);
+    free(put);
+    return;
+}
+
+int
+dedup_link(dedup_store * store,
+           const uint8_t digest[DEDUP_DIGEST_LEN],
+           const char *  path,
+           int           overwrite)
+{
+    int  ret                = -1;
+    int  err                = 0;
+    int  dirfd              = -1;
+    int  srcfd              = -1;
+    char obj[DEDUP_HEX_LEN] = { 0 };
+
+    if (NULL == store || NULL == digest || NULL == path)
+    {
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    dirfd = _dedup_objdir(store, digest, 0, obj);
+    if (0 > dirfd)
+    {
+        goto ERR;
+    }
+
+    srcfd = openat(dirfd, obj, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (0 > srcfd)
+    {
+        goto ERR;
+    }
+
+    ret = _dedup_placepath(store, srcfd, path, overwrite);
+    if (0 == ret)
+    {
+        futimens(srcfd, NULL);
+    }
+
+ERR:
+    err = errno;
+    if (0 <= srcfd)
+    {
+        close(srcfd);
+    }
+    if (0 <= dirfd)
+    {
+        close(dirfd);
+    }
+    errno = err;
+    return ret;
+}
+
+int
+dedup_gc(dedup_store *store, uint64_t idle_s)
+{
+    int    ret    = 0;
+    int    fd     = -1;
+    char   fan[3] = { 0 };
+    time_t cutoff = time(NULL) - (time_t)idle_s;
+
+    if (NULL == store)
+    {
+        log_error("dedup_gc: NULL store");
+        return -1;
+    }
+
+    // temporary objects of puts that were never committed or aborted
+    ret += _dedup_sweep(store->objfd, "tmp.", cutoff);
+
+    for (int i = 0; i < 256; i++)
+    {
+        snprintf(fan, sizeof(fan), "%02x", i);
+        fd = openat(
+            store->objfd, fan, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (0 > fd)
+        {
+            continue;
+        }
+        ret += _dedup_sweep(fd, "", cutoff);
+        close(fd);
+    }
+
+    return ret;
+}
+
+int
+dedup_destroy(dedup_store *store)
+{
+    int ret = 0;
+
+    if (NULL == store)
+    {
+        fprintf(stderr, "! dedup_destroy: NULL store\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    ret = close(store->objfd);
+    free(store);
+    store = NULL;
+
+ERR:
+    return ret;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static int
+_dedup_tmpname(char name[DEDUP_TMP_LEN])
+{
+    uint64_t r = 0;
+
+    if (sizeof(r) != getrandom(&r, sizeof(r), 0))
+    {
+        log_perror("_dedup_tmpname: getrandom error");
+        return -1;
+    }
+    snprintf(name, DEDUP_TMP_LEN, "tmp.%016" PRIx64, r);
+
+    return 0;
+}
+
+static int
+_dedup_objdir(dedup_store * store,
+              const uint8_t digest[DEDUP_DIGEST_LEN],
+              int           create,
+              char          obj[DEDUP_HEX_LEN])
+{
+    char fan[3] = { 0 };
+    int  ret    = -1;
+
+    // 256 fan out directories keyed by the first digest byte keep any
+    // one directory small
+    snprintf(fan, sizeof(fan), "%02x", digest[0]);
+    for (int i = 1; i < DEDUP_DIGEST_LEN; i++)
+    {
+        snprintf(&obj[(i - 1) * 2], 3, "%02x", digest[i]);
+    }
+
+    if (create && 0 != mkdirat(store->objfd, fan, 0700) && EEXIST != errno)
+    {
+        log_perror("_dedup_objdir: couldn't create fan out directory");
+        goto ERR;
+    }
+
+    ret = openat(
+        store->objfd, fan, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+ERR:
+    return ret;
+}
+
+static int
+_dedup_placepath(dedup_store *store,
+                 int          srcfd,
+                 const char * path,
+                 int          overwrite)
+{
+    int         ret      = -1;
+    int         err      = 0;
+    int         parentfd = -1;
+    int         fd       = -1;
+    const char *base     = NULL;
+    char        tmp[DEDUP_TMP_LEN];
+
+    parentfd = pathres_parent(store->rootfd, path, &base);
+    if (0 > parentfd)
+    {
+        goto ERR;
+    }
+
+    // filled under a temporary name and renamed into place so readers
+    // never see the path missing or half written
+    if (0 != _dedup_tmpname(tmp))
+    {
+        goto ERR;
+    }
+    fd = openat(parentfd,
+                tmp,
+                O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                0644);
+    if (0 > fd)
+    {
+        goto ERR;
+    }
+
+    if (0 == _dedup_clone(srcfd, fd))
+    {
+        ret = renameat2(
+            parentfd, tmp, parentfd, base, overwrite ? 0 : RENAME_NOREPLACE);
+    }
+
+ERR:
+    err = errno;
+    if (0 <= fd)
+    {
+        close(fd);
+        if (0 != ret)
+        {
+            unlinkat(parentfd, tmp, 0);
+        }
+    }
+    if (0 <= parentfd)
+    {
+        close(parentfd);
+    }
+    errno = err;
+    return ret;
+}
+
+static int
+_dedup_clone(int srcfd, int dstfd)
+{
+    struct stat st  = { 0 };
+    loff_t      off = 0;
+    ssize_t     len = 0;
+
+    if (0 == ioctl(dstfd, FICLONE, srcfd))
+    {
+        return 0;
+    }
+
+    if (0 != fstat(srcfd, &st))
+    {
+        return -1;
+    }
+
+    // no reflinks on this filesystem; copy_file_range at least keeps the
+    // data out of userspace
+    while (off < st.st_size)
+    {
+        len = copy_file_range(srcfd, &off, dstfd, NULL, st.st_size - off, 0);
+        if (0 > len && EINTR == errno)
+        {
+            continue;
+        }
+        if (0 >= len)
+        {
+            if (0 == len)
+            {
+                errno = EIO;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+_dedup_sweep(int fd, const char *prefix, time_t cutoff)
+{
+    int            ret   = 0;
+    int            dirfd = -1;
+    size_t         plen  = strlen(prefix);
+    DIR *          dir   = NULL;
+    struct dirent *ent   = NULL;
+    struct stat    st    = { 0 };
+
+    dirfd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (0 > dirfd)
+    {
+        return 0;
+    }
+
+    dir = fdopendir(dirfd);
+    if (NULL == dir)
+    {
+        close(dirfd);
+        return 0;
+    }
+
+    while (NULL != (ent = readdir(dir)))
+    {
+        if ((DT_REG != ent->d_type && DT_UNKNOWN != ent->d_type)
+            || 0 != strncmp(ent->d_name, prefix, plen)
+            || 0 != fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW)
+            || !S_ISREG(st.st_mode) || st.st_mtime >= cutoff)
+        {
+            continue;
+        }
+        if (0 == unlinkat(fd, ent->d_name, 0))
+        {
+            ret++;
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+/* PRIVATE FUNCTION DEFINITIONS */
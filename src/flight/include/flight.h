@@ -0,0 +1,118 @@
+#ifndef _FLIGHT_H
+#define _FLIGHT_H
+
+#include <stdint.h>
+
+/**
+ * requests kept by default; must be a power of two
+ */
+#define FLIGHT_SLOTS 1024
+
+/**
+ * points a request passes through; each is stamped with the time since
+ * the request's bytes started being read, the last time it is reached
+ */
+typedef enum flight_stage_
+{
+    FLIGHT_PARSE,   // frame read off the socket and split out
+    FLIGHT_QUEUE,   // a worker picked the frame up
+    FLIGHT_SESSION, // session looked up, stamped by the request handler
+    FLIGHT_RESOLVE, // client path resolved beneath the server root
+    FLIGHT_IO,      // file data read or written
+    FLIGHT_SEND,    // response written to the socket
+    FLIGHT_NSTAGES,
+} flight_stage;
+
+/**
+ * @brief the trace one request carries from the poller to the worker
+ *        that runs it
+ *
+ * @param start - CLOCK_MONOTONIC nanoseconds when reading began
+ *
+ * @param at - nanoseconds after start each stage was reached; 0 if not
+ *
+ */
+typedef struct flight_rec_
+{
+    uint64_t start;
+    uint64_t at[FLIGHT_NSTAGES];
+} flight_rec;
+
+/**
+ * @brief sets up the ring of the last @param nslots requests and, if
+ *        @param signo is nonzero, a thread that dumps the ring to the log
+ *        whenever that signal arrives; must be called before any other
+ *        thread is started so they all inherit the blocked signal
+ *
+ * @param nslots - requests kept; a power of two, 0 for FLIGHT_SLOTS
+ *
+ * @param slow_ns - requests that take longer are logged as they finish;
+ *        0 logs none
+ *
+ * @param signo - signal that dumps the ring, e.g. SIGUSR2; 0 for none
+ *
+ * @return 0 on success; nonzero on error or if already set up
+ *
+ */
+int flight_init(uint32_t nslots, uint64_t slow_ns, int signo);
+
+/**
+ * @brief stops the dump thread and frees the ring; should be called once
+ *        requests have stopped
+ *
+ * @return nothing
+ *
+ */
+void flight_shutdown(void);
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds, for flight_rec.start
+ *
+ */
+uint64_t flight_now(void);
+
+/**
+ * @brief makes @param rec the calling thread's current request, so code
+ *        deeper in the call can stamp it with flight_mark, and stamps
+ *        FLIGHT_QUEUE
+ *
+ * @param rec - trace of the request about to run
+ *
+ * @return nothing
+ *
+ */
+void flight_begin(flight_rec *rec);
+
+/**
+ * @brief stamps a stage of the calling thread's current request; does
+ *        nothing outside flight_begin and flight_end
+ *
+ * @param stage - stage just reached
+ *
+ * @return nothing
+ *
+ */
+void flight_mark(flight_stage stage);
+
+/**
+ * @brief copies the current request into the ring, logs it if it was
+ *        slow, and clears the calling thread's current request
+ *
+ * @param fd - client socket
+ *
+ * @param op - opcode of the request
+ *
+ * @return nothing
+ *
+ */
+void flight_end(int fd, uint8_t op);
+
+/**
+ * @brief logs every request in the ring, oldest first
+ *
+ * @return nothing
+ *
+ */
+void flight_dump(void);
+
+#endif /* _FLIGHT_H */
@@ -0,0 +1,328 @@
+#include <flight.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FLIGHT_LINE_MAX 200
+
+/**
+ * @brief one finished request in the ring; written as a seqlock so the
+ *        dump can skip a slot that is being overwritten
+ *
+ * @param seq - odd while a writer holds the slot; 0 if never written
+ *
+ * @param fdop - client socket shifted left 8 bits, or'd with the opcode
+ *
+ */
+typedef struct _flight_slot_
+{
+    atomic_ulong seq;
+    atomic_ulong fdop;
+    atomic_ulong total;
+    atomic_ulong at[FLIGHT_NSTAGES];
+} _flight_slot;
+
+static _flight_slot *_flight_ring    = NULL;
+static uint32_t      _flight_mask    = 0;
+static uint64_t      _flight_slow    = 0;
+static atomic_ulong  _flight_head    = 0;
+static int           _flight_signo   = 0;
+static atomic_int    _flight_running = 0;
+static pthread_t     _flight_thread;
+
+static _Thread_local flight_rec *_flight_cur = NULL;
+
+static const char *const _flight_names[FLIGHT_NSTAGES] = {
+    "parse", "queue", "session", "resolve", "io", "send",
+};
+
+/**
+ * @brief formats one request as key=value pairs, stages in microseconds
+ *        after reading began and "-" for stages it never reached
+ *
+ * @return nothing
+ *
+ */
+static void _flight_format(char *          out,
+                           size_t          len,
+                           uint64_t        fdop,
+                           uint64_t        total,
+                           const uint64_t *at);
+
+/**
+ * @brief waits for the dump signal and dumps the ring each time
+ *
+ * @return NULL
+ *
+ */
+static void *_flight_waiter(void *arg);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+int
+flight_init(uint32_t nslots, uint64_t slow_ns, int signo)
+{
+    int           ret  = -1;
+    _flight_slot *ring = NULL;
+    sigset_t      set;
+
+    nslots = (0 == nslots) ? FLIGHT_SLOTS : nslots;
+    if (0 != (nslots & (nslots - 1)))
+    {
+        fprintf(stderr, "! flight_init: slots must be a power of two\n");
+        goto ERR;
+    }
+    if (NULL != _flight_ring)
+    {
+        fprintf(stderr, "! flight_init: already set up\n");
+        goto ERR;
+    }
+
+    ring = calloc(nslots, sizeof(_flight_slot));
+    if (NULL == ring)
+    {
+        fprintf(stderr, "! flight_init: couldn't calloc ring\n");
+        goto ERR;
+    }
+    _flight_ring = ring;
+    _flight_mask = nslots - 1;
+    _flight_slow = slow_ns;
+    atomic_store(&_flight_head, 0);
+
+    if (0 != signo)
+    {
+        // every thread started after this inherits the mask, so the signal
+        // is only ever taken by sigwait in the dump thread
+        sigemptyset(&set);
+        sigaddset(&set, signo);
+        if (0 != pthread_sigmask(SIG_BLOCK, &set, NULL))
+        {
+            fprintf(stderr, "! flight_init: couldn't block signal\n");
+            goto ERR;
+        }
+        _flight_signo = signo;
+        atomic_store(&_flight_running, 1);
+        if (0 != pthread_create(&_flight_thread, NULL, _flight_waiter, NULL))
+        {
+            fprintf(stderr, "! flight_init: couldn't start dump thread\n");
+            atomic_store(&_flight_running, 0);
+            _flight_signo = 0;
+            goto ERR;
+        }
+    }
+    ret = 0;
+
+ERR:
+    if (0 != ret && NULL != ring)
+    {
+        free(ring);
+        _flight_ring = NULL;
+    }
+    return ret;
+}
+
+void
+flight_shutdown(void)
+{
+    if (0 != atomic_exchange(&_flight_running, 0))
+    {
+        pthread_kill(_flight_thread, _flight_signo);
+        pthread_join(_flight_thread, NULL);
+        _flight_signo = 0;
+    }
+    free(_flight_ring);
+    _flight_ring = NULL;
+}
+
+uint64_t
+flight_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+flight_begin(flight_rec *rec)
+{
+    if (NULL == _flight_ring || NULL == rec)
+    {
+        return;
+    }
+    _flight_cur = rec;
+    flight_mark(FLIGHT_QUEUE);
+}
+
+void
+flight_mark(flight_stage stage)
+{
+    flight_rec *rec = _flight_cur;
+
+    if (NULL != rec)
+    {
+        rec->at[stage] = flight_now() - rec->start;
+    }
+}
+
+void
+flight_end(int fd, uint8_t op)
+{
+    flight_rec *  rec   = _flight_cur;
+    _flight_slot *s     = NULL;
+    uint64_t      total = 0;
+    uint64_t      seq   = 0;
+    uint64_t      fdop  = ((uint64_t)(uint32_t)fd << 8) | op;
+    char          line[FLIGHT_LINE_MAX];
+
+    if (NULL == rec)
+    {
+        return;
+    }
+    _flight_cur = NULL;
+    total       = flight_now() - rec->start;
+
+    // a writer lapped by another one a whole ring behind gives the slot up
+    // rather than wait for it
+    s   = &_flight_ring[atomic_fetch_add_explicit(&_flight_head,
+                                                  1,
+                                                  memory_order_relaxed)
+                      & _flight_mask];
+    seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    if (!(seq & 1)
+        && atomic_compare_exchange_strong_explicit(&s->seq,
+                                                   &seq,
+                                                   seq + 1,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed))
+    {
+        atomic_store_explicit(&s->fdop, fdop, memory_order_relaxed);
+        atomic_store_explicit(&s->total, total, memory_order_relaxed);
+        for (int i = 0; i < FLIGHT_NSTAGES; i++)
+        {
+            atomic_store_explicit(&s->at[i], rec->at[i], memory_order_relaxed);
+        }
+        atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+    }
+
+    if (0 < _flight_slow && _flight_slow <= total)
+    {
+        _flight_format(line, sizeof(line), fdop, total, rec->at);
+        log_warn("flight: slow request %s", line);
+    }
+}
+
+void
+flight_dump(void)
+{
+    _flight_slot *  s     = NULL;
+    uint64_t        head  = 0;
+    uint64_t        first = 0;
+    uint64_t        seq   = 0;
+    uint64_t        fdop  = 0;
+    uint64_t        total = 0;
+    uint64_t        n     = 0;
+    struct timespec req   = { 0, 2000000 };
+    uint64_t        at[FLIGHT_NSTAGES];
+    char            line[FLIGHT_LINE_MAX];
+
+    if (NULL == _flight_ring)
+    {
+        return;
+    }
+
+    head  = atomic_load(&_flight_head);
+    first = (head > _flight_mask) ? head - _flight_mask - 1 : 0;
+    log_info("flight: dumping %lu requests", (unsigned long)(head - first));
+    for (uint64_t i = first; i < head; i++)
+    {
+        s   = &_flight_ring[i & _flight_mask];
+        seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (0 == seq || (seq & 1))
+        {
+            continue;
+        }
+        fdop  = atomic_load_explicit(&s->fdop, memory_order_relaxed);
+        total = atomic_load_explicit(&s->total, memory_order_relaxed);
+        for (int j = 0; j < FLIGHT_NSTAGES; j++)
+        {
+            at[j] = atomic_load_explicit(&s->at[j], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != atomic_load_explicit(&s->seq, memory_order_relaxed))
+        {
+            continue;
+        }
+
+        _flight_format(line, sizeof(line), fdop, total, at);
+        log_info("flight: %s", line);
+
+        // the log ring is no bigger than this one; let the drain thread
+        // catch up instead of dropping most of the dump
+        if (0 == ++n % (LOG_RING_SLOTS / 2))
+        {
+            nanosleep(&req, NULL);
+        }
+    }
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_flight_format(char *          out,
+               size_t          len,
+               uint64_t        fdop,
+               uint64_t        total,
+               const uint64_t *at)
+{
+    int off = 0;
+
+    off = snprintf(out,
+                   len,
+                   "fd=%d op=0x%02x total_us=%.1f",
+                   (int)(fdop >> 8),
+                   (unsigned)(fdop & 0xff),
+                   total / 1e3);
+    for (int i = 0; i < FLIGHT_NSTAGES && 0 <= off && (size_t)off < len; i++)
+    {
+        if (0 == at[i])
+        {
+            off += snprintf(&out[off], len - off, " %s=-", _flight_names[i]);
+        }
+        else
+        {
+            off += snprintf(&out[off],
+                            len - off,
+                            " %s=%.1f",
+                            _flight_names[i],
+                            at[i] / 1e3);
+        }
+    }
+}
+
+static void *
+_flight_waiter(void *arg)
+{
+    sigset_t set;
+    int      sig = 0;
+
+    (void)arg;
+
+    sigemptyset(&set);
+    sigaddset(&set, _flight_signo);
+    while (0 == sigwait(&set, &sig))
+    {
+        if (!atomic_load(&_flight_running))
+        {
+            break;
+        }
+        flight_dump();
+    }
+
+    return NULL;
+}
+/* PRIVATE FUNCTION DEFINTIONS */
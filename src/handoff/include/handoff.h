@@ -0,0 +1,115 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <stdint.h>
+
+/**
+ * most bytes of session state carried with one client socket
+ */
+#define HANDOFF_STATE_MAX 1024
+
+/**
+ * seconds either side waits for the other before giving up on a handoff
+ */
+#define HANDOFF_TIMEOUT 10
+
+/**
+ * @brief run in the old process for each client socket being handed off
+ *
+ * @param fd - client socket
+ *
+ * @param state - buffer of HANDOFF_STATE_MAX bytes for the client's
+ *        session state
+ *
+ * @param len - set to the bytes of @param state used; starts at 0
+ *
+ * @param arg - argument given to handoff_serve
+ *
+ * @return 0 to hand the socket over; nonzero to keep it, e.g. while a
+ *         transfer on it is still running, in which case the callback
+ *         owns the socket and closes it once it is done
+ *
+ */
+typedef int (*handoff_exportfn)(int       fd,
+                                uint8_t * state,
+                                uint32_t *len,
+                                void *    arg);
+
+/**
+ * @brief run in the new process for each client socket received, before
+ *        it is added to the poller
+ *
+ * @param fd - client socket
+ *
+ * @param state - session state from handoff_exportfn
+ *
+ * @param len - bytes in @param state
+ *
+ * @param arg - argument given to handoff_takeover
+ *
+ * @return 0 to keep the socket; nonzero to close it
+ *
+ */
+typedef int (*handoff_importfn)(int            fd,
+                                const uint8_t *state,
+                                uint32_t       len,
+                                void *         arg);
+
+/**
+ * @brief takes the listening socket and idle clients over from a server
+ *        still running on the handoff socket at @param path; received
+ *        clients are queued with tcp_netpoll_adopt once the handoff has
+ *        completed, and closed if it fails
+ *
+ * @param path - Unix socket path the running server called handoff_serve
+ *        with
+ *
+ * @param fn - restores each client's session; NULL keeps every client
+ *
+ * @param arg - passed to @param fn
+ *
+ * @return listening socket on success; -1 if no server is running on
+ *         @param path; -2 on error
+ *
+ */
+int handoff_takeover(const char *path, handoff_importfn fn, void *arg);
+
+/**
+ * @brief starts a thread that waits on the Unix socket at @param path for
+ *        a new process; when one connects the running poller is stopped
+ *        and its listening socket and clients are passed to it with
+ *        SCM_RIGHTS; a socket at @param path left by the process being
+ *        replaced is swapped out atomically
+ *
+ * @param path - Unix socket path
+ *
+ * @param fn - exports each client's session; NULL hands every client over
+ *        with no state
+ *
+ * @param arg - passed to @param fn
+ *
+ * @return 0 on success; nonzero on error or if already serving
+ *
+ */
+int handoff_serve(const char *path, handoff_exportfn fn, void *arg);
+
+/**
+ * @brief stops the thread started by handoff_serve; the socket path is
+ *        removed unless a new process has taken it over
+ *
+ * @return nothing
+ *
+ */
+void handoff_stop(void);
+
+/**
+ * @brief whether this process has handed its sockets off; once it has,
+ *        tcp_netpoll has returned and the process should let running
+ *        transfers finish and exit
+ *
+ * @return nonzero once handed off
+ *
+ */
+int handoff_done(void);
+
+#endif /* _HANDOFF_H */
@@ -0,0 +1,584 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for accept4, pipe2 and MSG_CMSG_CLOEXEC
+#endif
+#include <handoff.h>
+#include <netpoll.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define HANDOFF_MAGIC 0x4f485043 // "CPHO"
+
+/**
+ * message kinds; every message but the end marker carries one socket
+ */
+#define HANDOFF_LISTENER 1
+#define HANDOFF_CLIENT   2
+#define HANDOFF_END      3
+
+/**
+ * @brief header of one message on the handoff socket; session state
+ *        follows it in the same message
+ *
+ * @param len - bytes of session state after the header
+ *
+ */
+typedef struct _handoff_hdr_
+{
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t len;
+} _handoff_hdr;
+
+static int              _handoff_fd        = -1;
+static int              _handoff_stopfd[2] = { -1, -1 };
+static pthread_t        _handoff_thread;
+static atomic_int       _handoff_serving = 0;
+static atomic_int       _handoff_handed  = 0;
+static handoff_exportfn _handoff_export  = NULL;
+static void *           _handoff_arg     = NULL;
+static char _handoff_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/**
+ * @brief fills @param un with @param path
+ *
+ * @return 0 on success; -1 if @param path is too long
+ *
+ */
+static int _handoff_addr(struct sockaddr_un *un, const char *path);
+
+/**
+ * @brief sends one message, with @param fd attached unless it is -1
+ *
+ * @return 0 on success; -1 on error
+ *
+ */
+static int _handoff_send(int            conn,
+                         uint32_t       kind,
+                         int            fd,
+                         const uint8_t *state,
+                         uint32_t       len);
+
+/**
+ * @brief receives one message
+ *
+ * @param state - buffer of HANDOFF_STATE_MAX bytes
+ *
+ * @param fd - set to the socket attached, or -1
+ *
+ * @return 0 on success; -1 on error or a malformed message
+ *
+ */
+static int _handoff_recv(int           conn,
+                         _handoff_hdr *hdr,
+                         uint8_t *     state,
+                         int *         fd);
+
+/**
+ * @brief handoffcb run on the poller thread; passes the listener and
+ *        every client the export callback lets go to the new process, and
+ *        puts everything back in the poller's adopt queue if it fails
+ *        before the new process has been sent the end marker
+ *
+ * @param arg - connection to the new process, cast to a pointer
+ *
+ * @return nothing
+ *
+ */
+static void _handoff_poller(int sockfd, const int *fds, int nfds, void *arg);
+
+/**
+ * @brief waits on the handoff socket for a new process
+ *
+ * @return NULL
+ *
+ */
+static void *_handoff_loop(void *arg);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+int
+handoff_takeover(const char *path, handoff_importfn fn, void *arg)
+{
+    int                ret      = -2;
+    int                conn     = -1;
+    int                fd       = -1;
+    int                nclients = 0;
+    int                nadopted = 0;
+    int                ended    = 0;
+    int                capfds   = 0;
+    int *              fds      = NULL;
+    int *              tmp      = NULL;
+    struct timeval     tv       = { HANDOFF_TIMEOUT, 0 };
+    struct sockaddr_un un       = { 0 };
+    _handoff_hdr       hdr      = { 0 };
+    uint8_t            state[HANDOFF_STATE_MAX];
+
+    if (NULL == path || 0 != _handoff_addr(&un, path))
+    {
+        fprintf(stderr, "! handoff_takeover: invalid socket path\n");
+        return ret;
+    }
+
+    conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (0 > conn)
+    {
+        perror("! handoff_takeover: socket");
+        goto ERR;
+    }
+    if (0 != connect(conn, (struct sockaddr *)&un, sizeof(un)))
+    {
+        // nothing is running to take over from
+        if (ENOENT == errno || ECONNREFUSED == errno)
+        {
+            ret = -1;
+            goto ERR;
+        }
+        perror("! handoff_takeover: connect");
+        goto ERR;
+    }
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    ret = -1;
+    for (;;)
+    {
+        if (0 != _handoff_recv(conn, &hdr, state, &fd))
+        {
+            break;
+        }
+        if (HANDOFF_END == hdr.kind)
+        {
+            ended = 1;
+            break;
+        }
+        if (HANDOFF_LISTENER == hdr.kind && 0 > ret)
+        {
+            ret = fd;
+            continue;
+        }
+        if (HANDOFF_CLIENT == hdr.kind && nclients == capfds)
+        {
+            tmp = realloc(fds, (capfds ? capfds * 2 : 64) * sizeof(int));
+            if (NULL == tmp)
+            {
+                fprintf(stderr, "! handoff_takeover: couldn't grow fds\n");
+                close(fd);
+                break;
+            }
+            fds    = tmp;
+            capfds = capfds ? capfds * 2 : 64;
+        }
+        if (HANDOFF_CLIENT == hdr.kind
+            && (NULL == fn || 0 == fn(fd, state, hdr.len, arg)))
+        {
+            fds[nclients++] = fd;
+            continue;
+        }
+        close(fd);
+    }
+
+    // clients are only adopted once the old process has sent its end
+    // marker and been acknowledged; before that it may still resume them
+    if (0 <= ret
+        && (!ended || 0 != _handoff_send(conn, HANDOFF_END, -1, NULL, 0)))
+    {
+        close(ret);
+        ret = -2;
+    }
+    else if (!ended)
+    {
+        ret = -2;
+    }
+    for (int i = 0; i < nclients; i++)
+    {
+        if (0 <= ret && 0 == tcp_netpoll_adopt(fds[i]))
+        {
+            nadopted++;
+            continue;
+        }
+        close(fds[i]);
+    }
+    if (0 <= ret)
+    {
+        log_info("handoff_takeover: took over listener and %d clients",
+                 nadopted);
+    }
+
+ERR:
+    free(fds);
+    fds = NULL;
+    if (0 <= conn)
+    {
+        close(conn);
+    }
+    return ret;
+}
+
+int
+handoff_serve(const char *path, handoff_exportfn fn, void *arg)
+{
+    int                ret = -1;
+    char               tmp[sizeof(_handoff_path)];
+    struct sockaddr_un un = { 0 };
+
+    if (NULL == path || 0 != _handoff_addr(&un, path)
+        || (int)sizeof(tmp) <= snprintf(tmp, sizeof(tmp), "%s.%d", path,
+                                        (int)getpid()))
+    {
+        fprintf(stderr, "! handoff_serve: invalid socket path\n");
+        return ret;
+    }
+
+    if (0 != atomic_exchange(&_handoff_serving, 1))
+    {
+        fprintf(stderr, "! handoff_serve: already serving\n");
+        return ret;
+    }
+    _handoff_export = fn;
+    _handoff_arg    = arg;
+
+    // bound under a private name and renamed over the path, so a process
+    // being replaced never sees the path missing or unlinks the new socket
+    strcpy(un.sun_path, tmp);
+    unlink(tmp);
+    _handoff_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (0 > _handoff_fd
+        || 0 != bind(_handoff_fd, (struct sockaddr *)&un, sizeof(un))
+        || 0 != listen(_handoff_fd, 1) || 0 != rename(tmp, path))
+    {
+        perror("! handoff_serve: couldn't listen");
+        unlink(tmp);
+        goto ERR;
+    }
+    strcpy(_handoff_path, path);
+
+    if (0 != pipe2(_handoff_stopfd, O_CLOEXEC))
+    {
+        perror("! handoff_serve: pipe2");
+        goto ERR;
+    }
+
+    if (0 != pthread_create(&_handoff_thread, NULL, _handoff_loop, NULL))
+    {
+        fprintf(stderr, "! handoff_serve: couldn't start thread\n");
+        goto ERR;
+    }
+    ret = 0;
+
+ERR:
+    if (0 != ret)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (0 <= _handoff_stopfd[i])
+            {
+                close(_handoff_stopfd[i]);
+                _handoff_stopfd[i] = -1;
+            }
+        }
+        if (0 <= _handoff_fd)
+        {
+            close(_handoff_fd);
+            _handoff_fd = -1;
+        }
+        if ('\0' != _handoff_path[0])
+        {
+            unlink(_handoff_path);
+            _handoff_path[0] = '\0';
+        }
+        atomic_store(&_handoff_serving, 0);
+    }
+    return ret;
+}
+
+void
+handoff_stop(void)
+{
+    if (0 == atomic_exchange(&_handoff_serving, 0))
+    {
+        return;
+    }
+
+    if (1 != write(_handoff_stopfd[1], "", 1))
+    {
+        perror("! handoff_stop: write");
+    }
+    pthread_join(_handoff_thread, NULL);
+
+    close(_handoff_stopfd[0]);
+    close(_handoff_stopfd[1]);
+    _handoff_stopfd[0] = -1;
+    _handoff_stopfd[1] = -1;
+    close(_handoff_fd);
+    _handoff_fd = -1;
+    // once handed off the path belongs to the new process
+    if (!atomic_load(&_handoff_handed))
+    {
+        unlink(_handoff_path);
+    }
+    _handoff_path[0] = '\0';
+}
+
+int
+handoff_done(void)
+{
+    return atomic_load(&_handoff_handed);
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static int
+_handoff_addr(struct sockaddr_un *un, const char *path)
+{
+    if (sizeof(un->sun_path) <= strlen(path))
+    {
+        return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, path);
+    return 0;
+}
+
+static int
+_handoff_send(int            conn,
+              uint32_t       kind,
+              int            fd,
+              const uint8_t *state,
+              uint32_t       len)
+{
+    _handoff_hdr    hdr    = { HANDOFF_MAGIC, kind, len };
+    struct msghdr   msg    = { 0 };
+    struct cmsghdr *cmsg   = NULL;
+    ssize_t         slen   = 0;
+    struct iovec    iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)state, .iov_len = len },
+    };
+    union
+    {
+        char           buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = (0 < len) ? 2 : 1;
+    if (0 <= fd)
+    {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        cmsg               = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level   = SOL_SOCKET;
+        cmsg->cmsg_type    = SCM_RIGHTS;
+        cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do
+    {
+        slen = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (0 > slen && EINTR == errno);
+
+    if ((ssize_t)(sizeof(hdr) + len) != slen)
+    {
+        log_perror("_handoff_send: sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+_handoff_recv(int conn, _handoff_hdr *hdr, uint8_t *state, int *fd)
+{
+    struct msghdr   msg    = { 0 };
+    struct cmsghdr *cmsg   = NULL;
+    ssize_t         rlen   = 0;
+    struct iovec    iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = state, .iov_len = HANDOFF_STATE_MAX },
+    };
+    union
+    {
+        char           buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    *fd                = -1;
+    msg.msg_iov        = iov;
+    msg.msg_iovlen     = 2;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    do
+    {
+        rlen = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (0 > rlen && EINTR == errno);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (0 < rlen && NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level
+        && SCM_RIGHTS == cmsg->cmsg_type
+        && CMSG_LEN(sizeof(int)) == cmsg->cmsg_len)
+    {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if ((ssize_t)sizeof(*hdr) > rlen || HANDOFF_MAGIC != hdr->magic
+        || (ssize_t)(sizeof(*hdr) + hdr->len) != rlen
+        || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        || (HANDOFF_END != hdr->kind && 0 > *fd))
+    {
+        fprintf(stderr, "! _handoff_recv: bad or missing message\n");
+        if (0 <= *fd)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void
+_handoff_poller(int sockfd, const int *fds, int nfds, void *arg)
+{
+    int          conn  = (int)(intptr_t)arg;
+    int          nsent = 0;
+    int          fd    = -1;
+    uint32_t     len   = 0;
+    char         kept[nfds + 1];
+    _handoff_hdr hdr = { 0 };
+    uint8_t      state[HANDOFF_STATE_MAX];
+
+    memset(kept, 0, sizeof(kept));
+    if (0 != _handoff_send(conn, HANDOFF_LISTENER, sockfd, NULL, 0))
+    {
+        goto ERR;
+    }
+    for (int i = 0; i < nfds; i++)
+    {
+        len = 0;
+        // a client the export callback keeps is its to close
+        if (NULL != _handoff_export
+            && 0 != _handoff_export(fds[i], state, &len, _handoff_arg))
+        {
+            kept[i] = 1;
+            continue;
+        }
+        len = (HANDOFF_STATE_MAX < len) ? HANDOFF_STATE_MAX : len;
+        if (0 != _handoff_send(conn, HANDOFF_CLIENT, fds[i], state, len))
+        {
+            goto ERR;
+        }
+        nsent++;
+    }
+    if (0 != _handoff_send(conn, HANDOFF_END, -1, NULL, 0))
+    {
+        goto ERR;
+    }
+
+    // once the end marker is out the new process may already be serving
+    // the sockets, so a missing acknowledgment still counts as handed off;
+    // resuming them here could leave both processes answering one client
+    if (0 != _handoff_recv(conn, &hdr, state, &fd) || HANDOFF_END != hdr.kind)
+    {
+        log_warn("_handoff_poller: no acknowledgment, handing off anyway");
+    }
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+
+    // the new process holds its own copies now
+    atomic_store(&_handoff_handed, 1);
+    close(sockfd);
+    for (int i = 0; i < nfds; i++)
+    {
+        if (!kept[i])
+        {
+            close(fds[i]);
+        }
+    }
+    log_info("_handoff_poller: handed off listener and %d clients", nsent);
+    close(conn);
+    return;
+
+ERR:
+    // the new process never saw the end marker, so it closes whatever it
+    // received; the caller sees handoff_done is still 0 and restarts
+    // tcp_netpoll with its listener, which picks these back up
+    log_error("_handoff_poller: handoff failed, resuming");
+    for (int i = 0; i < nfds; i++)
+    {
+        if (!kept[i])
+        {
+            tcp_netpoll_adopt(fds[i]);
+        }
+    }
+    close(conn);
+}
+
+static void *
+_handoff_loop(void *arg)
+{
+    int           conn   = -1;
+    struct pollfd pfds[] = {
+        { .fd = _handoff_fd, .events = POLLIN },
+        { .fd = _handoff_stopfd[0], .events = POLLIN },
+    };
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+
+    (void)arg;
+
+    for (;;)
+    {
+        if (0 > poll(pfds, 2, -1))
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("! _handoff_loop: poll");
+            break;
+        }
+        if (pfds[1].revents)
+        {
+            break;
+        }
+        if (!(pfds[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        conn = accept4(_handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (0 > conn)
+        {
+            continue;
+        }
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // the poller runs the handoff between two polls; with no poller
+        // running there is nothing to hand over
+        if (0 != tcp_netpoll_handoff(_handoff_poller, (void *)(intptr_t)conn))
+        {
+            log_warn("_handoff_loop: no poller running to hand off");
+            _handoff_send(conn, HANDOFF_END, -1, NULL, 0);
+            close(conn);
+            continue;
+        }
+        log_info("_handoff_loop: new process connected, handing off");
+    }
+
+    return NULL;
+}
+/* PRIVATE FUNCTION DEFINTIONS */
@@ -0,0 +1,194 @@
+#ifndef _HOTCACHE_H
+#define _HOTCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+/**
+ * largest file kept in the cache; bigger files are always read from disk
+ */
+#define HOTCACHE_MAX_FILE (64 * 1024)
+
+/**
+ * smallest chunk a file is stored in; chunks double in size up to
+ * HOTCACHE_MAX_FILE
+ */
+#define HOTCACHE_MIN_CHUNK 1024
+
+/**
+ * the arena is handed to size classes this many bytes at a time; once it
+ * is all handed out, a class that runs out takes a slab back from the
+ * class holding the least often read files, emptying it
+ */
+#define HOTCACHE_SLAB HOTCACHE_MAX_FILE
+
+/**
+ * @brief a file held by the cache; opaque to the caller, whose pointer
+ *        from hotcache_get pins it until hotcache_release
+ */
+typedef struct hotcache_entry_ hotcache_entry;
+
+/**
+ * @brief content cache for small, frequently read files; opaque to the
+ *        caller
+ */
+typedef struct hotcache_ hotcache;
+
+/**
+ * @brief counters kept by every cache for the metrics exporter
+ *
+ * @param nhits - lookups served from the cache
+ *
+ * @param nmisses - lookups that had to go to disk
+ *
+ * @param nadmitted - files stored after a miss
+ *
+ * @param nrejected - files turned away because they were read less often
+ *        than what they would have evicted
+ *
+ * @param nevicted - files dropped to make room for another
+ *
+ * @param ninvalidated - files dropped because they were written,
+ *        replaced or deleted, whether by hotcache_invalidate or found
+ *        stale by hotcache_get
+ *
+ */
+typedef struct hotcache_stats_
+{
+    atomic_ulong nhits;
+    atomic_ulong nmisses;
+    atomic_ulong nadmitted;
+    atomic_ulong nrejected;
+    atomic_ulong nevicted;
+    atomic_ulong ninvalidated;
+} hotcache_stats;
+
+extern hotcache_stats hotcache_stat;
+
+/**
+ * @brief sets up a cache whose file contents live in one arena of
+ *        @param budget bytes, rounded up to a whole huge page; the arena is
+ *        mapped with explicit huge pages if the system has them reserved
+ *        and with transparent huge pages requested otherwise
+ *
+ * @param budget - bytes of file content the cache may hold
+ *
+ * @return pointer to the cache; NULL on error or if @param budget is
+ *         smaller than one slab
+ *
+ */
+hotcache *hotcache_init(size_t budget);
+
+/**
+ * @brief frees the cache; no entry may still be pinned
+ *
+ * @param hc - cache to free; NULL is ignored
+ *
+ * @return nothing
+ *
+ */
+void hotcache_destroy(hotcache *hc);
+
+/**
+ * @brief looks a file up and counts the access towards its admission;
+ *        entries are keyed by path, so one is only a hit if the file the
+ *        path resolves to now is the one it was read from, and a stale
+ *        entry is dropped
+ *
+ * @param hc - cache
+ *
+ * @param path - path as the client sent it; NOT nul terminated
+ *
+ * @param pathlen - length of @param path
+ *
+ * @param st - fstat of the file @param path resolves to now
+ *
+ * @param ticket - set on a miss; handed to hotcache_offer so content read
+ *        while the file was being written is never stored
+ *
+ * @return pinned entry on a hit, to be given back with hotcache_release
+ *         once it is sent; NULL on a miss
+ *
+ */
+hotcache_entry *hotcache_get(hotcache *         hc,
+                             const char *       path,
+                             uint16_t           pathlen,
+                             const struct stat *st,
+                             uint64_t *         ticket);
+
+/**
+ * @brief content of a pinned entry, e.g. for proto_respond to send with
+ *        the response header in one writev
+ *
+ * @param e - entry from hotcache_get
+ *
+ * @param len - set to the length of the content
+ *
+ * @return pointer to the content; valid until hotcache_release
+ *
+ */
+const uint8_t *hotcache_data(const hotcache_entry *e, uint32_t *len);
+
+/**
+ * @brief unpins an entry from hotcache_get
+ *
+ * @param hc - cache
+ *
+ * @param e - entry to unpin
+ *
+ * @return nothing
+ *
+ */
+void hotcache_release(hotcache *hc, hotcache_entry *e);
+
+/**
+ * @brief offers a file just read from disk after a miss; it is stored if
+ *        there is room in its size class or if it has been read more often
+ *        than the least recently used file it would evict
+ *
+ * @param hc - cache
+ *
+ * @param path - path given to hotcache_get; NOT nul terminated
+ *
+ * @param pathlen - length of @param path
+ *
+ * @param st - fstat of the file taken before @param data was read from
+ *        it, so a write racing the read leaves the entry stale
+ *
+ * @param data - file content; copied
+ *
+ * @param len - length of @param data
+ *
+ * @param ticket - ticket from the hotcache_get that missed
+ *
+ * @return 0 if stored; 1 if turned away; -1 on error
+ *
+ */
+int hotcache_offer(hotcache *         hc,
+                   const char *       path,
+                   uint16_t           pathlen,
+                   const struct stat *st,
+                   const uint8_t *    data,
+                   uint32_t           len,
+                   uint64_t           ticket);
+
+/**
+ * @brief drops a file from the cache; hotcache_get already refuses an
+ *        entry whose file changed, so this only frees its chunk sooner,
+ *        and the handlers of PUT_OP, DEL_OP and UPCOMMIT_OP should call it
+ *        on @param path; entries still being sent are freed once released
+ *
+ * @param hc - cache
+ *
+ * @param path - path as the client sent it; NOT nul terminated
+ *
+ * @param pathlen - length of @param path
+ *
+ * @return nothing
+ *
+ */
+void hotcache_invalidate(hotcache *hc, const char *path, uint16_t pathlen);
+
+#endif /* _HOTCACHE_H */
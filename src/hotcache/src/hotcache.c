@@ -0,0 +1,924 @@
+#include <hotcache.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define HOTCACHE_NCLASS   7 // HOTCACHE_MIN_CHUNK << 6 == HOTCACHE_MAX_FILE
+#define HOTCACHE_HUGE     (2 * 1024 * 1024)
+#define HOTCACHE_AVG_FILE 4096 // sizes the hash table and the sketch
+#define HOTCACHE_ROWS     4
+#define HOTCACHE_FREQ_MAX 15
+#define HOTCACHE_VICTIMS  4 // unpinned entries tried before giving up
+
+hotcache_stats hotcache_stat;
+
+/**
+ * @brief a cached file; the key follows the struct
+ *
+ * @param hnext - next entry in the same hash bucket
+ *
+ * @param prev - neighbour in its class's LRU list, towards the most
+ *        recently used end
+ *
+ * @param next - neighbour towards the least recently used end
+ *
+ * @param data - chunk in the arena holding the content
+ *
+ * @param dev, ino, size, mtim, ctim - identity of the file the content
+ *        was read from; a write, truncate or rename over it changes one
+ *
+ * @param refs - callers currently sending @param data
+ *
+ * @param dead - invalidated while pinned; freed by the last release
+ *
+ */
+struct hotcache_entry_
+{
+    hotcache_entry *hnext;
+    hotcache_entry *prev;
+    hotcache_entry *next;
+    uint8_t *       data;
+    uint64_t        hash;
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtim;
+    struct timespec ctim;
+    uint32_t        len;
+    uint32_t        refs;
+    uint8_t         cls;
+    uint8_t         dead;
+    uint16_t        keylen;
+    char            key[];
+};
+
+/**
+ * @brief chunks of one size
+ *
+ * @param free - free chunks, each holding a pointer to the next in its
+ *        first bytes
+ *
+ * @param mru - most recently used entry
+ *
+ * @param lru - least recently used entry, the first eviction candidate
+ *
+ */
+typedef struct _hotcache_class_
+{
+    uint8_t *       free;
+    hotcache_entry *mru;
+    hotcache_entry *lru;
+} _hotcache_class;
+
+/**
+ * @brief the cache; everything is under @param lock, which is only held
+ *        for lookups and bookkeeping, never while content is sent
+ *
+ * @param carved - bytes at the start of the arena already split into
+ *        chunks
+ *
+ * @param owners - entry holding each HOTCACHE_MIN_CHUNK of the arena,
+ *        indexed by offset; NULL where nothing is stored, so a slab can
+ *        be emptied for another class
+ *
+ * @param sketch - count-min sketch of HOTCACHE_ROWS rows of saturating
+ *        counters estimating how often each path was read lately
+ *
+ * @param nsamples - reads counted since the sketch was last halved
+ *
+ * @param gen - bumped by every invalidation
+ *
+ */
+struct hotcache_
+{
+    pthread_mutex_t  lock;
+    uint8_t *        arena;
+    size_t           arenalen;
+    size_t           carved;
+    hotcache_entry **owners;
+    hotcache_entry **buckets;
+    uint32_t         bmask;
+    uint8_t *        sketch;
+    uint32_t         smask;
+    uint32_t         nsamples;
+    uint32_t         resetat;
+    uint64_t         gen;
+    _hotcache_class  cls[HOTCACHE_NCLASS];
+};
+
+static const uint64_t _hotcache_seeds[HOTCACHE_ROWS] = {
+    0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9, 0x94d049bb133111eb,
+    0xd6e8feb86659fd93,
+};
+
+/**
+ * @brief rewrites a client path the way it resolves beneath the root, so
+ *        "a//b", "./a/b" and "/a/c/../b" share one entry and are all
+ *        dropped by an invalidation of any of them
+ *
+ * @param out - buffer of at least @param pathlen bytes
+ *
+ * @return length of the key in @param out; -1 if the path leaves the
+ *         root or holds a nul byte
+ *
+ */
+static int _hotcache_norm(const char *path, uint16_t pathlen, char *out);
+
+/**
+ * @brief FNV-1a of the key with a final mix so every bit of the result
+ *        is usable for the sketch rows
+ *
+ */
+static uint64_t _hotcache_hash(const char *key, uint16_t keylen);
+
+/**
+ * @brief whether @param e was read from the file @param st describes, as
+ *        it is now
+ *
+ */
+static int _hotcache_fresh(const hotcache_entry *e, const struct stat *st);
+
+/**
+ * @brief size class a file of @param len bytes is stored in
+ *
+ */
+static int _hotcache_class_of(uint32_t len);
+
+/**
+ * @brief looks an entry up in the hash table
+ *
+ * @return entry; NULL if not cached
+ *
+ */
+static hotcache_entry *_hotcache_find(hotcache *  hc,
+                                      uint64_t    hash,
+                                      const char *key,
+                                      uint16_t    keylen);
+
+/**
+ * @brief counts a read of @param hash in the sketch; every counter is
+ *        halved once enough reads were counted so old popularity fades
+ *
+ * @return nothing
+ *
+ */
+static void _hotcache_touch(hotcache *hc, uint64_t hash);
+
+/**
+ * @brief estimated recent reads of @param hash
+ *
+ */
+static uint8_t _hotcache_freq(hotcache *hc, uint64_t hash);
+
+/**
+ * @brief takes a free chunk of class @param cls, splitting a new slab of
+ *        the arena into chunks if the class has none left
+ *
+ * @return chunk; NULL if the class and the arena are both used up
+ *
+ */
+static uint8_t *_hotcache_chunk(hotcache *hc, int cls);
+
+/**
+ * @brief splits the slab at @param slab into free chunks of class
+ *        @param cls
+ *
+ * @return nothing
+ *
+ */
+static void _hotcache_carve(hotcache *hc, int cls, uint8_t *slab);
+
+/**
+ * @brief moves a slab to class @param cls, which has no free chunk left:
+ *        the class whose least recently used unpinned entry is read least
+ *        often, and less often than @param freq, gives up the slab that
+ *        entry sits in, along with everything else stored in it
+ *
+ * @return 0 if a slab was moved; -1 if every other class is hotter, or
+ *         the slab holds an entry being sent
+ *
+ */
+static int _hotcache_reclaim(hotcache *hc, int cls, uint8_t freq);
+
+/**
+ * @brief takes an entry out of the hash table and its LRU list
+ *
+ * @return nothing
+ *
+ */
+static void _hotcache_unlink(hotcache *hc, hotcache_entry *e);
+
+/**
+ * @brief returns an unlinked entry's chunk to its class and frees it
+ *
+ * @return nothing
+ *
+ */
+static void _hotcache_free(hotcache *hc, hotcache_entry *e);
+
+/**
+ * @brief makes @param e the most recently used entry of its class
+ *
+ * @return nothing
+ *
+ */
+static void _hotcache_lru_push(hotcache *hc, hotcache_entry *e);
+
+/**
+ * @brief takes @param e out of its class's LRU list
+ *
+ * @return nothing
+ *
+ */
+static void _hotcache_lru_remove(hotcache *hc, hotcache_entry *e);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+hotcache *
+hotcache_init(size_t budget)
+{
+    hotcache *  hc    = NULL;
+    hotcache *  ret   = NULL;
+    uint32_t    n     = 1024;
+    const char *pages = "explicit";
+
+    if (HOTCACHE_SLAB > budget)
+    {
+        fprintf(stderr,
+                "! hotcache_init: budget must be at least %d bytes\n",
+                HOTCACHE_SLAB);
+        goto ERR;
+    }
+
+    hc = calloc(1, sizeof(hotcache));
+    if (NULL == hc)
+    {
+        fprintf(stderr, "! hotcache_init: couldn't calloc cache\n");
+        goto ERR;
+    }
+    hc->arena = MAP_FAILED;
+
+    // a whole number of huge pages, so the last one isn't split into base
+    // pages; pages are only touched as slabs are carved out
+    hc->arenalen = (budget + HOTCACHE_HUGE - 1) & ~(size_t)(HOTCACHE_HUGE - 1);
+    hc->arena    = mmap(NULL,
+                        hc->arenalen,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                        -1,
+                        0);
+    if (MAP_FAILED == hc->arena)
+    {
+        // no pages reserved in the hugetlb pool; let khugepaged back the
+        // arena instead where transparent huge pages are enabled
+        pages     = "transparent";
+        hc->arena = mmap(NULL,
+                         hc->arenalen,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0);
+        if (MAP_FAILED == hc->arena)
+        {
+            perror("! hotcache_init: couldn't map arena");
+            goto ERR;
+        }
+        if (0 != madvise(hc->arena, hc->arenalen, MADV_HUGEPAGE))
+        {
+            pages = "base";
+        }
+    }
+
+    while (n < hc->arenalen / HOTCACHE_AVG_FILE)
+    {
+        n <<= 1;
+    }
+    hc->bmask   = n - 1;
+    hc->smask   = n - 1;
+    hc->resetat = 10 * n;
+    hc->buckets = calloc(n, sizeof(hotcache_entry *));
+    hc->sketch  = calloc(HOTCACHE_ROWS, n);
+    hc->owners
+        = calloc(hc->arenalen / HOTCACHE_MIN_CHUNK, sizeof(hotcache_entry *));
+    if (NULL == hc->buckets || NULL == hc->sketch || NULL == hc->owners)
+    {
+        fprintf(stderr, "! hotcache_init: couldn't calloc tables\n");
+        goto ERR;
+    }
+
+    if (0 != pthread_mutex_init(&hc->lock, NULL))
+    {
+        fprintf(stderr, "! hotcache_init: couldn't init lock\n");
+        goto ERR;
+    }
+
+    log_info("hotcache_init: %zu byte arena on %s pages",
+             hc->arenalen,
+             pages);
+    ret = hc;
+    hc  = NULL;
+
+ERR:
+    if (NULL != hc)
+    {
+        if (MAP_FAILED != hc->arena)
+        {
+            munmap(hc->arena, hc->arenalen);
+        }
+        free(hc->buckets);
+        free(hc->sketch);
+        free(hc->owners);
+    }
+    free(hc);
+    hc = NULL;
+    return ret;
+}
+
+void
+hotcache_destroy(hotcache *hc)
+{
+    hotcache_entry *e = NULL;
+
+    if (NULL == hc)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i <= hc->bmask; i++)
+    {
+        while (NULL != (e = hc->buckets[i]))
+        {
+            hc->buckets[i] = e->hnext;
+            free(e);
+        }
+    }
+    munmap(hc->arena, hc->arenalen);
+    free(hc->buckets);
+    free(hc->sketch);
+    free(hc->owners);
+    pthread_mutex_destroy(&hc->lock);
+    free(hc);
+}
+
+hotcache_entry *
+hotcache_get(hotcache *         hc,
+             const char *       path,
+             uint16_t           pathlen,
+             const struct stat *st,
+             uint64_t *         ticket)
+{
+    hotcache_entry *e      = NULL;
+    uint64_t        hash   = 0;
+    int             keylen = 0;
+    char            key[pathlen + 1];
+
+    keylen = _hotcache_norm(path, pathlen, key);
+    if (NULL == hc || NULL == st || 0 > keylen)
+    {
+        return NULL;
+    }
+    hash = _hotcache_hash(key, keylen);
+
+    pthread_mutex_lock(&hc->lock);
+    _hotcache_touch(hc, hash);
+    e = _hotcache_find(hc, hash, key, keylen);
+    if (NULL != e && !_hotcache_fresh(e, st))
+    {
+        // written or replaced behind the cache's back; the caller reads
+        // it from disk and may offer the new content
+        _hotcache_unlink(hc, e);
+        if (0 == e->refs)
+        {
+            _hotcache_free(hc, e);
+        }
+        else
+        {
+            e->dead = 1;
+        }
+        e = NULL;
+        atomic_fetch_add_explicit(
+            &hotcache_stat.ninvalidated, 1, memory_order_relaxed);
+    }
+    if (NULL != e)
+    {
+        e->refs++;
+        _hotcache_lru_remove(hc, e);
+        _hotcache_lru_push(hc, e);
+    }
+    else if (NULL != ticket)
+    {
+        *ticket = hc->gen;
+    }
+    pthread_mutex_unlock(&hc->lock);
+
+    atomic_fetch_add_explicit((NULL != e) ? &hotcache_stat.nhits
+                                          : &hotcache_stat.nmisses,
+                              1,
+                              memory_order_relaxed);
+    return e;
+}
+
+const uint8_t *
+hotcache_data(const hotcache_entry *e, uint32_t *len)
+{
+    *len = e->len;
+    return e->data;
+}
+
+void
+hotcache_release(hotcache *hc, hotcache_entry *e)
+{
+    if (NULL == hc || NULL == e)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&hc->lock);
+    if (0 == --e->refs && e->dead)
+    {
+        _hotcache_free(hc, e);
+    }
+    pthread_mutex_unlock(&hc->lock);
+}
+
+int
+hotcache_offer(hotcache *         hc,
+               const char *       path,
+               uint16_t           pathlen,
+               const struct stat *st,
+               const uint8_t *    data,
+               uint32_t           len,
+               uint64_t           ticket)
+{
+    int             ret    = 1;
+    hotcache_entry *e      = NULL;
+    hotcache_entry *victim = NULL;
+    uint8_t *       chunk  = NULL;
+    uint64_t        hash   = 0;
+    int             keylen = 0;
+    int             cls    = 0;
+    uint8_t         freq   = 0;
+    uint8_t         vfreq  = 0;
+    char            key[pathlen + 1];
+
+    if (NULL == hc || NULL == st || (NULL == data && 0 < len))
+    {
+        log_error("hotcache_offer: NULL cache, stat or data");
+        return -1;
+    }
+    keylen = _hotcache_norm(path, pathlen, key);
+    if (HOTCACHE_MAX_FILE < len || 0 > keylen)
+    {
+        return 1;
+    }
+    hash = _hotcache_hash(key, keylen);
+    cls  = _hotcache_class_of(len);
+
+    e = malloc(sizeof(hotcache_entry) + keylen + 1);
+    if (NULL == e)
+    {
+        log_error("hotcache_offer: couldn't malloc entry");
+        return -1;
+    }
+
+    pthread_mutex_lock(&hc->lock);
+    // written or deleted since the miss, so @param data may be stale; or
+    // another reader that missed at the same time got here first
+    if (ticket != hc->gen || NULL != _hotcache_find(hc, hash, key, keylen))
+    {
+        goto RET;
+    }
+
+    chunk = _hotcache_chunk(hc, cls);
+    if (NULL == chunk)
+    {
+        // TinyLFU: a newcomer only displaces a file read more often if it
+        // has been read more often still; one-off reads never get in
+        freq   = _hotcache_freq(hc, hash);
+        victim = hc->cls[cls].lru;
+        for (int i = 1; NULL != victim && 0 < victim->refs; i++)
+        {
+            victim = (HOTCACHE_VICTIMS > i) ? victim->prev : NULL;
+        }
+        vfreq = (NULL != victim) ? _hotcache_freq(hc, victim->hash) : freq;
+        if (vfreq >= freq)
+        {
+            victim = NULL;
+        }
+
+        // a class that filled up first would otherwise keep its slabs
+        // while files of another size are turned away however often they
+        // are read; a colder class elsewhere gives up a whole slab
+        if (0 == _hotcache_reclaim(hc, cls, (NULL != victim) ? vfreq : freq))
+        {
+            chunk  = _hotcache_chunk(hc, cls);
+            victim = NULL;
+        }
+        if (NULL == chunk && NULL == victim)
+        {
+            atomic_fetch_add_explicit(
+                &hotcache_stat.nrejected, 1, memory_order_relaxed);
+            goto RET;
+        }
+    }
+    if (NULL != victim)
+    {
+        _hotcache_unlink(hc, victim);
+        chunk = victim->data;
+        free(victim);
+        victim = NULL;
+        atomic_fetch_add_explicit(
+            &hotcache_stat.nevicted, 1, memory_order_relaxed);
+    }
+
+    memcpy(chunk, data, len);
+    e->data   = chunk;
+    e->hash   = hash;
+    e->dev    = st->st_dev;
+    e->ino    = st->st_ino;
+    e->size   = st->st_size;
+    e->mtim   = st->st_mtim;
+    e->ctim   = st->st_ctim;
+    e->len    = len;
+    e->refs   = 0;
+    e->cls    = cls;
+    e->dead   = 0;
+    e->keylen = keylen;
+    memcpy(e->key, key, keylen);
+    e->key[keylen] = '\0';
+
+    hc->owners[(size_t)(chunk - hc->arena) / HOTCACHE_MIN_CHUNK] = e;
+    e->hnext                      = hc->buckets[hash & hc->bmask];
+    hc->buckets[hash & hc->bmask] = e;
+    _hotcache_lru_push(hc, e);
+    e   = NULL;
+    ret = 0;
+    atomic_fetch_add_explicit(
+        &hotcache_stat.nadmitted, 1, memory_order_relaxed);
+
+RET:
+    pthread_mutex_unlock(&hc->lock);
+    free(e);
+    return ret;
+}
+
+void
+hotcache_invalidate(hotcache *hc, const char *path, uint16_t pathlen)
+{
+    hotcache_entry *e      = NULL;
+    uint64_t        hash   = 0;
+    int             keylen = 0;
+    char            key[pathlen + 1];
+
+    keylen = _hotcache_norm(path, pathlen, key);
+    if (NULL == hc || 0 > keylen)
+    {
+        return;
+    }
+    hash = _hotcache_hash(key, keylen);
+
+    pthread_mutex_lock(&hc->lock);
+    hc->gen++;
+    e = _hotcache_find(hc, hash, key, keylen);
+    if (NULL != e)
+    {
+        _hotcache_unlink(hc, e);
+        if (0 == e->refs)
+        {
+            _hotcache_free(hc, e);
+        }
+        else
+        {
+            e->dead = 1;
+        }
+        atomic_fetch_add_explicit(
+            &hotcache_stat.ninvalidated, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&hc->lock);
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static int
+_hotcache_norm(const char *path, uint16_t pathlen, char *out)
+{
+    int      len = 0;
+    uint16_t i   = 0;
+    uint16_t n   = 0;
+
+    if (NULL == path || NULL != memchr(path, '\0', pathlen))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < pathlen; i = n + 1)
+    {
+        for (n = i; n < pathlen && '/' != path[n]; n++)
+        {
+        }
+
+        if (n == i || (1 == n - i && '.' == path[i]))
+        {
+            continue;
+        }
+        if (2 == n - i && '.' == path[i] && '.' == path[i + 1])
+        {
+            if (0 == len)
+            {
+                return -1;
+            }
+            while (0 < len && '/' != out[--len])
+            {
+            }
+            continue;
+        }
+
+        if (0 < len)
+        {
+            out[len++] = '/';
+        }
+        memcpy(&out[len], &path[i], n - i);
+        len += n - i;
+    }
+
+    return len;
+}
+
+static uint64_t
+_hotcache_hash(const char *key, uint16_t keylen)
+{
+    uint64_t h = 0xcbf29ce484222325;
+
+    for (uint16_t i = 0; i < keylen; i++)
+    {
+        h = (h ^ (uint8_t)key[i]) * 0x100000001b3;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    return h;
+}
+
+static int
+_hotcache_fresh(const hotcache_entry *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino
+           && e->size == st->st_size
+           && e->mtim.tv_sec == st->st_mtim.tv_sec
+           && e->mtim.tv_nsec == st->st_mtim.tv_nsec
+           && e->ctim.tv_sec == st->st_ctim.tv_sec
+           && e->ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static int
+_hotcache_class_of(uint32_t len)
+{
+    int cls = 0;
+
+    while ((uint32_t)(HOTCACHE_MIN_CHUNK << cls) < len)
+    {
+        cls++;
+    }
+    return cls;
+}
+
+static hotcache_entry *
+_hotcache_find(hotcache *hc, uint64_t hash, const char *key, uint16_t keylen)
+{
+    hotcache_entry *e = hc->buckets[hash & hc->bmask];
+
+    while (NULL != e
+           && (hash != e->hash || keylen != e->keylen
+               || 0 != memcmp(key, e->key, keylen)))
+    {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void
+_hotcache_touch(hotcache *hc, uint64_t hash)
+{
+    uint8_t *c = NULL;
+
+    for (int i = 0; i < HOTCACHE_ROWS; i++)
+    {
+        c = &hc->sketch[i * (hc->smask + 1)
+                        + ((uint32_t)((hash * _hotcache_seeds[i]) >> 32)
+                           & hc->smask)];
+        if (HOTCACHE_FREQ_MAX > *c)
+        {
+            (*c)++;
+        }
+    }
+
+    if (++hc->nsamples >= hc->resetat)
+    {
+        for (size_t i = 0; i < HOTCACHE_ROWS * (size_t)(hc->smask + 1); i++)
+        {
+            hc->sketch[i] >>= 1;
+        }
+        hc->nsamples /= 2;
+    }
+}
+
+static uint8_t
+_hotcache_freq(hotcache *hc, uint64_t hash)
+{
+    uint8_t f = HOTCACHE_FREQ_MAX;
+    uint8_t c = 0;
+
+    for (int i = 0; i < HOTCACHE_ROWS; i++)
+    {
+        c = hc->sketch[i * (hc->smask + 1)
+                       + ((uint32_t)((hash * _hotcache_seeds[i]) >> 32)
+                          & hc->smask)];
+        f = (c < f) ? c : f;
+    }
+    return f;
+}
+
+static uint8_t *
+_hotcache_chunk(hotcache *hc, int cls)
+{
+    _hotcache_class *c     = &hc->cls[cls];
+    uint8_t *        chunk = NULL;
+
+    if (NULL == c->free && hc->carved + HOTCACHE_SLAB <= hc->arenalen)
+    {
+        _hotcache_carve(hc, cls, &hc->arena[hc->carved]);
+        hc->carved += HOTCACHE_SLAB;
+    }
+
+    chunk = c->free;
+    if (NULL != chunk)
+    {
+        memcpy(&c->free, chunk, sizeof(uint8_t *));
+    }
+    return chunk;
+}
+
+static void
+_hotcache_carve(hotcache *hc, int cls, uint8_t *slab)
+{
+    _hotcache_class *c     = &hc->cls[cls];
+    size_t           size  = (size_t)HOTCACHE_MIN_CHUNK << cls;
+    uint8_t *        chunk = NULL;
+
+    for (size_t off = HOTCACHE_SLAB; 0 < off; off -= size)
+    {
+        chunk = &slab[off - size];
+        memcpy(chunk, &c->free, sizeof(uint8_t *));
+        c->free = chunk;
+    }
+}
+
+static int
+_hotcache_reclaim(hotcache *hc, int cls, uint8_t freq)
+{
+    hotcache_entry *e     = NULL;
+    hotcache_entry *cold  = NULL;
+    uint8_t *       slab  = NULL;
+    uint8_t *       prev  = NULL;
+    uint8_t *       cur   = NULL;
+    uint8_t *       next  = NULL;
+    size_t          first = 0;
+    size_t          size  = 0;
+    uint8_t         f     = 0;
+    int             donor = -1;
+
+    for (int c = 0; c < HOTCACHE_NCLASS; c++)
+    {
+        e = (c == cls) ? NULL : hc->cls[c].lru;
+        for (int i = 1; NULL != e && 0 < e->refs; i++)
+        {
+            e = (HOTCACHE_VICTIMS > i) ? e->prev : NULL;
+        }
+        if (NULL != e && (f = _hotcache_freq(hc, e->hash)) < freq)
+        {
+            freq  = f;
+            cold  = e;
+            donor = c;
+        }
+    }
+    if (0 > donor)
+    {
+        return -1;
+    }
+
+    // the slab changes class, so nothing in it may still be being sent
+    size  = (size_t)HOTCACHE_MIN_CHUNK << donor;
+    first = (size_t)(cold->data - hc->arena) / HOTCACHE_SLAB * HOTCACHE_SLAB;
+    slab  = &hc->arena[first];
+    for (size_t off = 0; off < HOTCACHE_SLAB; off += size)
+    {
+        e = hc->owners[(first + off) / HOTCACHE_MIN_CHUNK];
+        if (NULL != e && 0 < e->refs)
+        {
+            return -1;
+        }
+    }
+    for (size_t off = 0; off < HOTCACHE_SLAB; off += size)
+    {
+        e = hc->owners[(first + off) / HOTCACHE_MIN_CHUNK];
+        if (NULL != e)
+        {
+            _hotcache_unlink(hc, e);
+            _hotcache_free(hc, e);
+            atomic_fetch_add_explicit(
+                &hotcache_stat.nevicted, 1, memory_order_relaxed);
+        }
+    }
+
+    // every chunk of the slab is on the donor's free list now
+    for (cur = hc->cls[donor].free; NULL != cur; cur = next)
+    {
+        memcpy(&next, cur, sizeof(uint8_t *));
+        if (slab > cur || cur >= slab + HOTCACHE_SLAB)
+        {
+            prev = cur;
+        }
+        else if (NULL == prev)
+        {
+            hc->cls[donor].free = next;
+        }
+        else
+        {
+            memcpy(prev, &next, sizeof(uint8_t *));
+        }
+    }
+
+    _hotcache_carve(hc, cls, slab);
+    return 0;
+}
+
+static void
+_hotcache_unlink(hotcache *hc, hotcache_entry *e)
+{
+    hotcache_entry **p = &hc->buckets[e->hash & hc->bmask];
+
+    while (*p != e)
+    {
+        p = &(*p)->hnext;
+    }
+    *p       = e->hnext;
+    e->hnext = NULL;
+    _hotcache_lru_remove(hc, e);
+}
+
+static void
+_hotcache_free(hotcache *hc, hotcache_entry *e)
+{
+    _hotcache_class *c = &hc->cls[e->cls];
+
+    hc->owners[(size_t)(e->data - hc->arena) / HOTCACHE_MIN_CHUNK] = NULL;
+    memcpy(e->data, &c->free, sizeof(uint8_t *));
+    c->free = e->data;
+    free(e);
+}
+
+static void
+_hotcache_lru_push(hotcache *hc, hotcache_entry *e)
+{
+    _hotcache_class *c = &hc->cls[e->cls];
+
+    e->prev = NULL;
+    e->next = c->mru;
+    if (NULL != c->mru)
+    {
+        c->mru->prev = e;
+    }
+    c->mru = e;
+    if (NULL == c->lru)
+    {
+        c->lru = e;
+    }
+}
+
+static void
+_hotcache_lru_remove(hotcache *hc, hotcache_entry *e)
+{
+    _hotcache_class *c = &hc->cls[e->cls];
+
+    if (NULL != e->prev)
+    {
+        e->prev->next = e->next;
+    }
+    else
+    {
+        c->mru = e->next;
+    }
+    if (NULL != e->next)
+    {
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        c->lru = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+/* PRIVATE FUNCTION DEFINTIONS */
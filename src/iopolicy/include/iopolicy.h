@@ -0,0 +1,209 @@
+#ifndef _IOPOLICY_H
+#define _IOPOLICY_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * default bytes read ahead of a sending transfer
+ */
+#define IOPOLICY_WINDOW (2 * 1024 * 1024)
+
+/**
+ * default file size from which a sent file's pages are dropped from the
+ * page cache behind the transfer
+ */
+#define IOPOLICY_DROP_MIN (256ULL * 1024 * 1024)
+
+/**
+ * default bytes a writer may leave dirty before their writeback is
+ * started
+ */
+#define IOPOLICY_DIRTY_MAX (8 * 1024 * 1024)
+
+/**
+ * @brief page cache hints given for file transfers; 0 turns a hint off
+ *
+ * @param window - bytes read ahead of a sending transfer; the next
+ *        window's readahead is issued while the current one is on its way
+ *
+ * @param dropmin - files at least this large are streamed once and
+ *        dropped from the page cache behind the transfer, so they don't
+ *        evict the files that are read over and over
+ *
+ * @param dirtymax - bytes a writer may dirty before their writeback is
+ *        started; it then waits for the previous batch, so a writer never
+ *        has more than twice this much dirty
+ *
+ */
+typedef struct iopolicy_
+{
+    uint64_t window;
+    uint64_t dropmin;
+    uint64_t dirtymax;
+} iopolicy;
+
+/**
+ * policy used by every transfer; set at startup, e.g. by iopolicy_parse
+ */
+extern iopolicy iopolicy_cfg;
+
+/**
+ * @brief state of one file being sent
+ *
+ * @param fd - file being sent
+ *
+ * @param end - offset the transfer stops at
+ *
+ * @param ahead - readahead has been issued up to here
+ *
+ * @param dropped - pages before here were dropped from the page cache
+ *
+ * @param drop - nonzero if pages are dropped behind the transfer
+ *
+ */
+typedef struct iopolicy_read_
+{
+    int      fd;
+    uint64_t end;
+    uint64_t ahead;
+    uint64_t dropped;
+    int      drop;
+} iopolicy_read;
+
+/**
+ * @brief state of one file being written
+ *
+ * @param fd - file being written
+ *
+ * @param lock - protects the rest; chunks may be written from several
+ *        threads at once
+ *
+ * @param lo - lowest offset written since writeback was last started
+ *
+ * @param hi - end of the highest range written since then
+ *
+ * @param dirty - bytes written since then
+ *
+ * @param prevlo - start of the range whose writeback was started last
+ *
+ * @param prevhi - end of that range; equal to @param prevlo if none
+ *
+ */
+typedef struct iopolicy_write_
+{
+    int             fd;
+    pthread_mutex_t lock;
+    uint64_t        lo;
+    uint64_t        hi;
+    uint64_t        dirty;
+    uint64_t        prevlo;
+    uint64_t        prevhi;
+} iopolicy_write;
+
+/**
+ * @brief sets iopolicy_cfg from a startup option of comma separated
+ *        key=bytes entries, keys being ra, drop and dirty and sizes taking
+ *        an optional K, M or G suffix in powers of 1024, e.g.
+ *        "ra=4M,drop=1G,dirty=16M"; "off" turns every hint off
+ *
+ * @param spec - policy specification
+ *
+ * @return 0 on success; nonzero on a malformed @param spec
+ *
+ */
+int iopolicy_parse(const char *spec);
+
+/**
+ * @brief starts sending [@param off, @param off + @param len) of a file;
+ *        marks the range sequential and asks for its first window
+ *
+ * @param r - state to initialize
+ *
+ * @param fd - file being sent
+ *
+ * @param off - first byte to send
+ *
+ * @param len - bytes to send
+ *
+ * @param fsize - size of the whole file, for iopolicy.dropmin
+ *
+ * @return nothing
+ *
+ */
+void iopolicy_read_begin(iopolicy_read *r,
+                         int            fd,
+                         uint64_t       off,
+                         uint64_t       len,
+                         uint64_t       fsize);
+
+/**
+ * @brief to be called before sending from @param pos; reads the next
+ *        windows ahead and drops what was sent before @param pos if the
+ *        file is dropped behind
+ *
+ * @param r - state from iopolicy_read_begin
+ *
+ * @param pos - offset the next send starts at
+ *
+ * @param want - bytes the caller would send
+ *
+ * @return bytes to send now; @param want as it stands, so callers can
+ *         wrap their send length in the call
+ *
+ */
+uint64_t iopolicy_read_next(iopolicy_read *r, uint64_t pos, uint64_t want);
+
+/**
+ * @brief finishes a transfer, dropping the rest of what was sent if the
+ *        file is dropped behind
+ *
+ * @param r - state from iopolicy_read_begin
+ *
+ * @param pos - offset the transfer stopped at
+ *
+ * @return nothing
+ *
+ */
+void iopolicy_read_end(iopolicy_read *r, uint64_t pos);
+
+/**
+ * @brief starts tracking writes to a file
+ *
+ * @param w - state to initialize
+ *
+ * @param fd - file being written
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int iopolicy_write_init(iopolicy_write *w, int fd);
+
+/**
+ * @brief to be called after each chunk is written; once
+ *        iopolicy.dirtymax bytes have been written, starts their
+ *        writeback with sync_file_range and waits for the batch before
+ *        to reach the disk; safe to call from several threads
+ *
+ * @param w - state from iopolicy_write_init
+ *
+ * @param off - offset of the chunk
+ *
+ * @param len - length of the chunk
+ *
+ * @return nothing
+ *
+ */
+void iopolicy_written(iopolicy_write *w, uint64_t off, uint64_t len);
+
+/**
+ * @brief frees the state; does not close the file
+ *
+ * @param w - state from iopolicy_write_init
+ *
+ * @return nothing
+ *
+ */
+void iopolicy_write_destroy(iopolicy_write *w);
+
+#endif /* _IOPOLICY_H */
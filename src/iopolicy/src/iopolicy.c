@@ -0,0 +1,217 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for readahead and sync_file_range
+#endif
+#include <iopolicy.h>
+#include <units.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+iopolicy iopolicy_cfg = {
+    .window   = IOPOLICY_WINDOW,
+    .dropmin  = IOPOLICY_DROP_MIN,
+    .dirtymax = IOPOLICY_DIRTY_MAX,
+};
+
+/* PUBLIC FUNCTION DEFINTIONS */
+int
+iopolicy_parse(const char *spec)
+{
+    const char *p   = spec;
+    iopolicy    cfg = iopolicy_cfg;
+    uint64_t *  dst = NULL;
+
+    if (NULL == spec)
+    {
+        return -1;
+    }
+    if (0 == strcmp(spec, "off"))
+    {
+        memset(&iopolicy_cfg, 0, sizeof(iopolicy_cfg));
+        return 0;
+    }
+
+    while ('\0' != *p)
+    {
+        if (0 == strncmp(p, "ra=", 3))
+        {
+            dst = &cfg.window;
+            p += 3;
+        }
+        else if (0 == strncmp(p, "drop=", 5))
+        {
+            dst = &cfg.dropmin;
+            p += 5;
+        }
+        else if (0 == strncmp(p, "dirty=", 6))
+        {
+            dst = &cfg.dirtymax;
+            p += 6;
+        }
+        else
+        {
+            fprintf(stderr, "! iopolicy_parse: unknown key in '%s'\n", p);
+            return -1;
+        }
+
+        if (0 != units_bytes(p, &p, dst))
+        {
+            return -1;
+        }
+        if (',' == *p)
+        {
+            p++;
+        }
+        else if ('\0' != *p)
+        {
+            fprintf(stderr, "! iopolicy_parse: trailing '%s'\n", p);
+            return -1;
+        }
+    }
+
+    iopolicy_cfg = cfg;
+    return 0;
+}
+
+void
+iopolicy_read_begin(iopolicy_read *r,
+                    int            fd,
+                    uint64_t       off,
+                    uint64_t       len,
+                    uint64_t       fsize)
+{
+    uint64_t window = iopolicy_cfg.window;
+
+    r->fd      = fd;
+    r->end     = off + len;
+    r->ahead   = off;
+    r->dropped = off;
+    r->drop    = 0 < iopolicy_cfg.dropmin && iopolicy_cfg.dropmin <= fsize;
+
+    if (0 == window || 0 == len)
+    {
+        return;
+    }
+
+    // doubles the kernel's own readahead for the range; the first window
+    // is asked for now so the disk is busy before the first send
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+    r->ahead = (len < window) ? r->end : off + window;
+    posix_fadvise(fd, off, r->ahead - off, POSIX_FADV_WILLNEED);
+}
+
+uint64_t
+iopolicy_read_next(iopolicy_read *r, uint64_t pos, uint64_t want)
+{
+    uint64_t window = iopolicy_cfg.window;
+    uint64_t target = 0;
+
+    if (0 == window)
+    {
+        return want;
+    }
+
+    // once less than a window is requested past @param pos, the next two
+    // are asked for; with small sends this is one call per window rather
+    // than one per send
+    if (r->ahead < r->end && r->ahead < pos + window)
+    {
+        target = (r->end - pos > 2 * window) ? pos + 2 * window : r->end;
+        readahead(r->fd, r->ahead, target - r->ahead);
+        r->ahead = target;
+    }
+
+    // pages still held by the socket are not freed by this, only taken
+    // out of the page cache so nothing finds them again
+    if (r->drop && pos >= r->dropped + window)
+    {
+        posix_fadvise(r->fd, r->dropped, pos - r->dropped, POSIX_FADV_DONTNEED);
+        r->dropped = pos;
+    }
+
+    return want;
+}
+
+void
+iopolicy_read_end(iopolicy_read *r, uint64_t pos)
+{
+    if (r->drop && pos > r->dropped)
+    {
+        posix_fadvise(r->fd, r->dropped, pos - r->dropped, POSIX_FADV_DONTNEED);
+        r->dropped = pos;
+    }
+}
+
+int
+iopolicy_write_init(iopolicy_write *w, int fd)
+{
+    memset(w, 0, sizeof(iopolicy_write));
+    w->fd = fd;
+    w->lo = UINT64_MAX;
+    if (0 != pthread_mutex_init(&w->lock, NULL))
+    {
+        log_error("iopolicy_write_init: couldn't init lock");
+        return -1;
+    }
+    return 0;
+}
+
+void
+iopolicy_written(iopolicy_write *w, uint64_t off, uint64_t len)
+{
+    uint64_t lo     = 0;
+    uint64_t hi     = 0;
+    uint64_t prevlo = 0;
+    uint64_t prevhi = 0;
+
+    if (0 == iopolicy_cfg.dirtymax || 0 == len)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->lo = (off < w->lo) ? off : w->lo;
+    w->hi = (off + len > w->hi) ? off + len : w->hi;
+    w->dirty += len;
+    if (w->dirty < iopolicy_cfg.dirtymax)
+    {
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+    lo        = w->lo;
+    hi        = w->hi;
+    prevlo    = w->prevlo;
+    prevhi    = w->prevhi;
+    w->prevlo = lo;
+    w->prevhi = hi;
+    w->lo     = UINT64_MAX;
+    w->hi     = 0;
+    w->dirty  = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    // start this batch and wait for the one before, so the disk always
+    // has a batch to write while the writer is held to at most two; the
+    // chunks of an upload may arrive out of order, so a batch is the span
+    // they cover
+    if (0 != sync_file_range(w->fd, lo, hi - lo, SYNC_FILE_RANGE_WRITE))
+    {
+        return;
+    }
+    if (prevhi > prevlo)
+    {
+        sync_file_range(w->fd,
+                        prevlo,
+                        prevhi - prevlo,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+}
+
+void
+iopolicy_write_destroy(iopolicy_write *w)
+{
+    pthread_mutex_destroy(&w->lock);
+}
+/* PUBLIC FUNCTION DEFINTIONS */
@@ -0,0 +1,120 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+/**
+ * severity levels, lowest first
+ */
+#define LOG_LVL_DEBUG 0
+#define LOG_LVL_INFO  1
+#define LOG_LVL_WARN  2
+#define LOG_LVL_ERROR 3
+
+/**
+ * calls below this level are compiled out entirely, arguments included;
+ * override with -DLOG_LEVEL=LOG_LVL_WARN and the like
+ */
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LVL_INFO
+#else
+#define LOG_LEVEL LOG_LVL_DEBUG
+#endif // NDEBUG
+#endif // LOG_LEVEL
+
+/**
+ * bytes a record holds for the arguments of a call, strings included,
+ * and the longest message written; a call whose arguments don't fit is
+ * formatted by the caller instead, and longer messages are truncated
+ */
+#define LOG_MSG_LEN 240
+
+/**
+ * records each thread's ring holds; a thread that outruns the drain thread
+ * drops records rather than wait for it; must be a power of two
+ */
+#define LOG_RING_SLOTS 1024
+
+/**
+ * runtime threshold; calls compiled in but below it return after one load
+ */
+extern atomic_int log_level;
+
+/**
+ * @brief starts the drain thread; until this is called, and after
+ *        log_shutdown, records are written straight to stderr by the
+ *        calling thread instead
+ *
+ * @param fd - file descriptor records are written to, e.g. STDERR_FILENO
+ *
+ * @param level - initial runtime threshold
+ *
+ * @return 0 on success; nonzero on error or if already started
+ *
+ */
+int log_init(int fd, int level);
+
+/**
+ * @brief writes out every queued record and stops the drain thread; a
+ *        record logged once this has started is written straight out by
+ *        its caller, and one already being queued is waited for, so none
+ *        is lost
+ *
+ * @return nothing
+ *
+ */
+void log_shutdown(void);
+
+/**
+ * @brief queues a record in the calling thread's ring without taking a
+ *        lock or formatting anything, making a system call only to wake
+ *        the drain thread when it has gone idle; the arguments are copied
+ *        in as they are and the drain thread formats the line; use the
+ *        level macros below rather than calling this directly
+ *
+ * @param level - severity
+ *
+ * @param err - errno value whose description is appended; 0 for none
+ *
+ * @param fmt - printf format; it is read again by the drain thread, so it
+ *        must be a string literal, while the arguments, strings included,
+ *        are copied and need not outlive the call; %n, %m, wide
+ *        conversions and long doubles are formatted by the caller instead
+ *
+ * @return nothing
+ *
+ */
+void log_write(int level, int err, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * @brief records dropped so far because a thread's ring was full, as
+ *        counted by the drain thread
+ *
+ * @return number of records dropped
+ *
+ */
+uint64_t log_dropped(void);
+
+/**
+ * the dead branch keeps the format checked when a level is compiled out
+ */
+#define LOG_AT(lvl, err, ...)                     \
+    do                                            \
+    {                                             \
+        if (LOG_LEVEL <= (lvl))                   \
+        {                                         \
+            log_write((lvl), (err), __VA_ARGS__); \
+        }                                         \
+    } while (0)
+
+#define log_debug(...)  LOG_AT(LOG_LVL_DEBUG, 0, __VA_ARGS__)
+#define log_info(...)   LOG_AT(LOG_LVL_INFO, 0, __VA_ARGS__)
+#define log_warn(...)   LOG_AT(LOG_LVL_WARN, 0, __VA_ARGS__)
+#define log_error(...)  LOG_AT(LOG_LVL_ERROR, 0, __VA_ARGS__)
+#define log_perror(...) LOG_AT(LOG_LVL_ERROR, errno, __VA_ARGS__)
+
+#endif /* _LOG_H */
@@ -0,0 +1,985 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for the GNU strerror_r
+#endif
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LOG_OUT_BUF    65536
+#define LOG_LINE_MAX   (LOG_MSG_LEN + 512)
+#define LOG_CACHE_LINE 64
+#define LOG_SPEC_MAX   32 // longest conversion the drain thread rebuilds
+
+/**
+ * @brief one queued message
+ *
+ * @param ts - CLOCK_REALTIME nanoseconds of the call
+ *
+ * @param fmt - format the drain thread renders @param msg with; NULL when
+ *        @param msg already holds the formatted text
+ *
+ * @param level - severity
+ *
+ * @param len - bytes used in @param msg
+ *
+ * @param err - errno value whose description is appended; 0 for none
+ *
+ * @param msg - arguments of @param fmt packed in call order, integers
+ *        widened to 64 bits and strings copied with their nul; or the
+ *        formatted text, NOT nul terminated
+ *
+ */
+typedef struct _log_rec_
+{
+    uint64_t    ts;
+    const char *fmt;
+    uint16_t    level;
+    uint16_t    len;
+    int32_t     err;
+    char        msg[LOG_MSG_LEN];
+} _log_rec;
+
+/**
+ * length modifiers of a conversion
+ */
+typedef enum _log_len_
+{
+    LOG_LEN_NONE,
+    LOG_LEN_HH,
+    LOG_LEN_H,
+    LOG_LEN_L,
+    LOG_LEN_LL,
+    LOG_LEN_Z,
+    LOG_LEN_J,
+    LOG_LEN_T,
+    LOG_LEN_BIG_L,
+} _log_len;
+
+/**
+ * @brief one conversion of a format string
+ *
+ * @param start - its '%'
+ *
+ * @param mod - its length modifier, or its conversion if it has none
+ *
+ * @param end - one past its conversion character
+ *
+ * @param conv - conversion character
+ *
+ * @param len - length modifier
+ *
+ * @param nstar - '*' width and precision arguments it takes, 0 to 2
+ *
+ * @param prec - fixed precision; -1 for none, -2 for one given by '*'
+ *
+ */
+typedef struct _log_spec_
+{
+    const char *start;
+    const char *mod;
+    const char *end;
+    char        conv;
+    _log_len    len;
+    int         nstar;
+    int         prec;
+} _log_spec;
+
+/**
+ * @brief single producer single consumer ring owned by one thread; the
+ *        producer and consumer indices sit on separate cache lines so the
+ *        owner and the drain thread never write the same line
+ *
+ * @param head - next record the owner writes; only the owner stores it
+ *
+ * @param pushing - set by the owner while it fills a record, so the drain
+ *        thread can wait out a push that began before log_shutdown
+ *
+ * @param tail - next record the drain thread reads; only it stores it
+ *
+ * @param dropped - records dropped since the drain thread last looked
+ *
+ * @param dead - set once the owning thread has exited
+ *
+ * @param tid - kernel thread id of the owner
+ *
+ * @param next - next ring in the registry
+ *
+ */
+typedef struct _log_ring_
+{
+    _Alignas(LOG_CACHE_LINE) atomic_ulong head;
+    atomic_int pushing;
+    _Alignas(LOG_CACHE_LINE) atomic_ulong tail;
+    _Alignas(LOG_CACHE_LINE) atomic_ulong dropped;
+    atomic_int          dead;
+    int                 tid;
+    struct _log_ring_ * next;
+    _log_rec            recs[LOG_RING_SLOTS];
+} _log_ring;
+
+atomic_int log_level = LOG_LVL_INFO;
+
+/**
+ * every ring ever registered; threads only push at the head, and only the
+ * drain thread unlinks, so the list needs no lock
+ */
+static _Atomic(_log_ring *) _log_rings = NULL;
+
+static atomic_int     _log_running  = 0;
+static atomic_int     _log_sleeping = 0; // futex the idle drain thread waits on
+static atomic_ulong   _log_ndropped = 0;
+static int            _log_fd       = 2;
+static pthread_t      _log_thread;
+static pthread_key_t  _log_key;
+static pthread_once_t _log_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local _log_ring *_log_tring = NULL;
+
+static const char *const _log_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/**
+ * @brief creates the key whose destructor retires a thread's ring
+ *
+ * @return nothing
+ *
+ */
+static void _log_keyinit(void);
+
+/**
+ * @brief marks the exiting thread's ring so the drain thread frees it once
+ *        it is empty
+ *
+ * @return nothing
+ *
+ */
+static void _log_retire(void *arg);
+
+/**
+ * @brief allocates and registers the calling thread's ring
+ *
+ * @return the ring; NULL on error
+ *
+ */
+static _log_ring *_log_ring_new(void);
+
+/**
+ * @brief finds the next conversion of a format string
+ *
+ * @param p - where to start looking
+ *
+ * @param sp - set to the conversion found
+ *
+ * @return 0 if one was found; 1 at the end of the format; -1 for a
+ *         conversion _log_pack can't carry, such as %n, %m or a wide one
+ *
+ */
+static int _log_spec_next(const char *p, _log_spec *sp);
+
+/**
+ * @brief copies the arguments of a call into @param rec so the drain thread
+ *        can format them later; much cheaper than formatting, as nothing
+ *        is converted to text
+ *
+ * @return 0 on success; -1 if @param fmt has a conversion that can't be
+ *         carried or the arguments don't fit, in which case the caller
+ *         formats the message itself
+ *
+ */
+static int _log_pack(_log_rec *rec, const char *fmt, va_list ap);
+
+/**
+ * @brief renders the message of a record packed by _log_pack
+ *
+ * @param cap - size of @param out; at least 1
+ *
+ * @return length written, nul excluded
+ *
+ */
+static size_t _log_render(char *out, size_t cap, const _log_rec *rec);
+
+/**
+ * @brief formats a record as one line of output
+ *
+ * @return length of the line
+ *
+ */
+static size_t _log_format(char *out, const _log_rec *rec, int tid);
+
+/**
+ * @brief wakes the drain thread if it is asleep; called after a record is
+ *        published or _log_running is cleared, and costs a fence and a
+ *        load unless the drain thread actually has to be woken
+ *
+ * @return nothing
+ *
+ */
+static void _log_wake(void);
+
+/**
+ * @brief writes all of @param buf to the log descriptor
+ *
+ * @return nothing
+ *
+ */
+static void _log_flush(const char *buf, size_t len);
+
+/**
+ * @brief writes out every record queued in every ring and frees the rings
+ *        of exited threads
+ *
+ * @return number of records written
+ *
+ */
+static size_t _log_drain_once(void);
+
+/**
+ * @brief drain thread; sleeps on _log_sleeping once a pass finds nothing,
+ *        until a push or log_shutdown wakes it, and once log_shutdown
+ *        starts waits out the pushes already under way before its last
+ *        pass
+ *
+ * @return NULL
+ *
+ */
+static void *_log_drain(void *arg);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+int
+log_init(int fd, int level)
+{
+    int ret = -1;
+
+    if (0 > fd)
+    {
+        fprintf(stderr, "! log_init: invalid file descriptor\n");
+        goto ERR;
+    }
+
+    if (0 != atomic_exchange(&_log_running, 1))
+    {
+        fprintf(stderr, "! log_init: already started\n");
+        goto ERR;
+    }
+
+    _log_fd = fd;
+    atomic_store(&log_level, level);
+    if (0 != pthread_create(&_log_thread, NULL, _log_drain, NULL))
+    {
+        fprintf(stderr, "! log_init: couldn't start drain thread\n");
+        atomic_store(&_log_running, 0);
+        goto ERR;
+    }
+    ret = 0;
+
+ERR:
+    return ret;
+}
+
+void
+log_shutdown(void)
+{
+    if (0 == atomic_exchange(&_log_running, 0))
+    {
+        return;
+    }
+
+    // the drain thread makes one last pass before it exits
+    _log_wake();
+    pthread_join(_log_thread, NULL);
+}
+
+void
+log_write(int level, int err, const char *fmt, ...)
+{
+    _log_ring *     ring = _log_tring;
+    _log_rec        tmp;
+    _log_rec *      rec  = &tmp;
+    uint64_t        head = 0;
+    int             len  = 0;
+    int             ret  = -1;
+    char            line[LOG_LINE_MAX];
+    struct timespec now;
+    va_list         ap;
+
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (atomic_load_explicit(&_log_running, memory_order_relaxed))
+    {
+        if (NULL == ring)
+        {
+            ring = _log_ring_new();
+        }
+        if (NULL != ring)
+        {
+            // announced before running is checked again, so either the
+            // drain thread waits for this push or it is never queued
+            atomic_store(&ring->pushing, 1);
+            if (!atomic_load(&_log_running))
+            {
+                atomic_store_explicit(&ring->pushing, 0, memory_order_release);
+            }
+            else
+            {
+                head
+                    = atomic_load_explicit(&ring->head, memory_order_relaxed);
+                if (LOG_RING_SLOTS
+                    <= head
+                           - atomic_load_explicit(&ring->tail,
+                                                  memory_order_acquire))
+                {
+                    atomic_fetch_add_explicit(
+                        &ring->dropped, 1, memory_order_relaxed);
+                    atomic_store_explicit(
+                        &ring->pushing, 0, memory_order_release);
+                    return;
+                }
+                rec = &ring->recs[head & (LOG_RING_SLOTS - 1)];
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec->ts    = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    rec->level = level;
+    rec->err   = err;
+    rec->fmt   = fmt;
+
+    // a queued record is formatted by the drain thread; one written here
+    // is formatted now either way
+    if (rec != &tmp)
+    {
+        va_start(ap, fmt);
+        ret = _log_pack(rec, fmt, ap);
+        va_end(ap);
+    }
+    if (0 != ret)
+    {
+        rec->fmt = NULL;
+        va_start(ap, fmt);
+        len = vsnprintf(rec->msg, LOG_MSG_LEN, fmt, ap);
+        va_end(ap);
+        rec->len = (0 > len) ? 0
+                             : ((LOG_MSG_LEN <= len) ? LOG_MSG_LEN - 1 : len);
+    }
+
+    if (rec != &tmp)
+    {
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        atomic_store_explicit(&ring->pushing, 0, memory_order_release);
+        _log_wake();
+        return;
+    }
+
+    // no drain thread; still one write(2) so lines never interleave
+    _log_flush(line, _log_format(line, rec, (int)syscall(SYS_gettid)));
+}
+
+uint64_t
+log_dropped(void)
+{
+    return atomic_load(&_log_ndropped);
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_log_keyinit(void)
+{
+    pthread_key_create(&_log_key, _log_retire);
+}
+
+static void
+_log_retire(void *arg)
+{
+    _log_ring *ring = arg;
+
+    atomic_store_explicit(&ring->dead, 1, memory_order_release);
+}
+
+static _log_ring *
+_log_ring_new(void)
+{
+    _log_ring *ring = NULL;
+
+    pthread_once(&_log_once, _log_keyinit);
+
+    ring = aligned_alloc(LOG_CACHE_LINE, sizeof(_log_ring));
+    if (NULL == ring)
+    {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(_log_ring));
+    ring->tid = (int)syscall(SYS_gettid);
+
+    ring->next = atomic_load(&_log_rings);
+    while (!atomic_compare_exchange_weak(&_log_rings, &ring->next, ring))
+    {
+    }
+
+    pthread_setspecific(_log_key, ring);
+    _log_tring = ring;
+    return ring;
+}
+
+static int
+_log_spec_next(const char *p, _log_spec *sp)
+{
+    p = strchr(p, '%');
+    if (NULL == p)
+    {
+        return 1;
+    }
+
+    sp->start = p++;
+    sp->nstar = 0;
+    sp->prec  = -1;
+    sp->len   = LOG_LEN_NONE;
+    while ('\0' != *p && NULL != strchr("-+ #0'", *p))
+    {
+        p++;
+    }
+    if ('*' == *p)
+    {
+        sp->nstar++;
+        p++;
+    }
+    while ('0' <= *p && '9' >= *p)
+    {
+        p++;
+    }
+    if ('.' == *p)
+    {
+        p++;
+        sp->prec = 0;
+        if ('*' == *p)
+        {
+            sp->nstar++;
+            sp->prec = -2;
+            p++;
+        }
+        while ('0' <= *p && '9' >= *p)
+        {
+            sp->prec = (LOG_MSG_LEN < sp->prec) ? sp->prec
+                                                : sp->prec * 10 + *p - '0';
+            p++;
+        }
+    }
+
+    sp->mod = p;
+    switch (*p)
+    {
+        case 'h':
+            sp->len = ('h' == p[1]) ? LOG_LEN_HH : LOG_LEN_H;
+            break;
+        case 'l':
+            sp->len = ('l' == p[1]) ? LOG_LEN_LL : LOG_LEN_L;
+            break;
+        case 'z':
+            sp->len = LOG_LEN_Z;
+            break;
+        case 'j':
+            sp->len = LOG_LEN_J;
+            break;
+        case 't':
+            sp->len = LOG_LEN_T;
+            break;
+        case 'L':
+            sp->len = LOG_LEN_BIG_L;
+            break;
+        default:
+            break;
+    }
+    p += (LOG_LEN_HH == sp->len || LOG_LEN_LL == sp->len) ? 2
+         : (LOG_LEN_NONE == sp->len)                      ? 0
+                                                          : 1;
+    sp->conv = *p;
+    sp->end  = ('\0' == *p) ? p : p + 1;
+
+    if (LOG_SPEC_MAX <= sp->end - sp->start)
+    {
+        return -1;
+    }
+    switch (sp->conv)
+    {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            return (LOG_LEN_BIG_L == sp->len) ? -1 : 0;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            return (LOG_LEN_BIG_L == sp->len) ? -1 : 0;
+        case 'c':
+        case 's':
+        case 'p':
+            return (LOG_LEN_NONE == sp->len) ? 0 : -1;
+        case '%':
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static int
+_log_pack(_log_rec *rec, const char *fmt, va_list ap)
+{
+    _log_spec   sp    = { 0 };
+    size_t      used  = 0;
+    size_t      slen  = 0;
+    int64_t     iv    = 0;
+    uint64_t    uv    = 0;
+    double      dv    = 0;
+    int         star  = 0;
+    int         ret   = 0;
+    const char *str   = NULL;
+    const char *p     = fmt;
+
+// appends one value; a record too small for the arguments is formatted by
+// the caller instead
+#define _LOG_PUT(v)                                   \
+    do                                                \
+    {                                                 \
+        if (LOG_MSG_LEN - used < sizeof(v))           \
+        {                                             \
+            return -1;                                \
+        }                                             \
+        memcpy(&rec->msg[used], &(v), sizeof(v));     \
+        used += sizeof(v);                            \
+    } while (0)
+
+    for (; 0 == (ret = _log_spec_next(p, &sp)); p = sp.end)
+    {
+        for (int i = 0; i < sp.nstar; i++)
+        {
+            star = va_arg(ap, int);
+            _LOG_PUT(star);
+        }
+
+        switch (sp.conv)
+        {
+            case 'd':
+            case 'i':
+                switch (sp.len)
+                {
+                    case LOG_LEN_HH:
+                        iv = (signed char)va_arg(ap, int);
+                        break;
+                    case LOG_LEN_H:
+                        iv = (short)va_arg(ap, int);
+                        break;
+                    case LOG_LEN_L:
+                        iv = va_arg(ap, long);
+                        break;
+                    case LOG_LEN_LL:
+                        iv = va_arg(ap, long long);
+                        break;
+                    case LOG_LEN_Z:
+                        iv = va_arg(ap, ssize_t);
+                        break;
+                    case LOG_LEN_J:
+                        iv = va_arg(ap, intmax_t);
+                        break;
+                    case LOG_LEN_T:
+                        iv = va_arg(ap, ptrdiff_t);
+                        break;
+                    default:
+                        iv = va_arg(ap, int);
+                        break;
+                }
+                _LOG_PUT(iv);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                switch (sp.len)
+                {
+                    case LOG_LEN_HH:
+                        uv = (unsigned char)va_arg(ap, unsigned int);
+                        break;
+                    case LOG_LEN_H:
+                        uv = (unsigned short)va_arg(ap, unsigned int);
+                        break;
+                    case LOG_LEN_L:
+                        uv = va_arg(ap, unsigned long);
+                        break;
+                    case LOG_LEN_LL:
+                        uv = va_arg(ap, unsigned long long);
+                        break;
+                    case LOG_LEN_Z:
+                        uv = va_arg(ap, size_t);
+                        break;
+                    case LOG_LEN_J:
+                        uv = va_arg(ap, uintmax_t);
+                        break;
+                    case LOG_LEN_T:
+                        uv = va_arg(ap, ptrdiff_t);
+                        break;
+                    default:
+                        uv = va_arg(ap, unsigned int);
+                        break;
+                }
+                _LOG_PUT(uv);
+                break;
+            case 'c':
+                iv = va_arg(ap, int);
+                _LOG_PUT(iv);
+                break;
+            case 'p':
+                uv = (uintptr_t)va_arg(ap, void *);
+                _LOG_PUT(uv);
+                break;
+            case 's':
+                // a precision bounds the read, so the string need not be
+                // nul terminated
+                str  = va_arg(ap, const char *);
+                str  = (NULL == str) ? "(null)" : str;
+                slen = (-2 == sp.prec && 0 <= star) ? (size_t)star
+                       : (0 <= sp.prec)            ? (size_t)sp.prec
+                                                   : LOG_MSG_LEN;
+                slen = strnlen(str, slen);
+                if (LOG_MSG_LEN - used <= slen)
+                {
+                    return -1;
+                }
+                memcpy(&rec->msg[used], str, slen);
+                rec->msg[used + slen] = '\0';
+                used += slen + 1;
+                break;
+            case '%':
+                break;
+            default:
+                dv = va_arg(ap, double);
+                _LOG_PUT(dv);
+                break;
+        }
+    }
+#undef _LOG_PUT
+
+    rec->len = used;
+    return (1 == ret) ? 0 : -1;
+}
+
+static size_t
+_log_render(char *out, size_t cap, const _log_rec *rec)
+{
+    _log_spec   sp    = { 0 };
+    size_t      olen  = 0;
+    size_t      used  = 0;
+    size_t      n     = 0;
+    int         len   = 0;
+    int         st[2] = { 0 };
+    int64_t     iv    = 0;
+    uint64_t    uv    = 0;
+    double      dv    = 0;
+    const char *p     = rec->fmt;
+    const char *str   = NULL;
+    char        spec[LOG_SPEC_MAX + 2];
+
+    if (NULL == rec->fmt)
+    {
+        olen = (rec->len < cap) ? rec->len : cap - 1;
+        memcpy(out, rec->msg, olen);
+        out[olen] = '\0';
+        return olen;
+    }
+
+// reads back a value _log_pack appended
+#define _LOG_GET(v)                               \
+    do                                            \
+    {                                             \
+        memcpy(&(v), &rec->msg[used], sizeof(v)); \
+        used += sizeof(v);                        \
+    } while (0)
+
+// formats one value with the '*' arguments its conversion takes
+#define _LOG_EMIT(v)                                                        \
+    (0 == sp.nstar   ? snprintf(&out[olen], cap - olen, spec, v)            \
+     : 1 == sp.nstar ? snprintf(&out[olen], cap - olen, spec, st[0], v)     \
+                     : snprintf(&out[olen], cap - olen, spec, st[0], st[1], \
+                                v))
+
+    for (; 0 == _log_spec_next(p, &sp) && olen + 1 < cap; p = sp.end)
+    {
+        n = (size_t)(sp.start - p);
+        n = (cap - 1 - olen < n) ? cap - 1 - olen : n;
+        memcpy(&out[olen], p, n);
+        olen += n;
+
+        for (int i = 0; i < sp.nstar; i++)
+        {
+            _LOG_GET(st[i]);
+        }
+
+        // integers were widened, so their length modifier is replaced
+        n = (size_t)(sp.mod - sp.start);
+        memcpy(spec, sp.start, n);
+        switch (sp.conv)
+        {
+            case 'd':
+            case 'i':
+                memcpy(&spec[n], "ll", 2);
+                spec[n + 2] = sp.conv;
+                spec[n + 3] = '\0';
+                _LOG_GET(iv);
+                len = _LOG_EMIT((long long)iv);
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                memcpy(&spec[n], "ll", 2);
+                spec[n + 2] = sp.conv;
+                spec[n + 3] = '\0';
+                _LOG_GET(uv);
+                len = _LOG_EMIT((unsigned long long)uv);
+                break;
+            case 'c':
+                spec[n]     = sp.conv;
+                spec[n + 1] = '\0';
+                _LOG_GET(iv);
+                len = _LOG_EMIT((int)iv);
+                break;
+            case 'p':
+                spec[n]     = sp.conv;
+                spec[n + 1] = '\0';
+                _LOG_GET(uv);
+                len = _LOG_EMIT((void *)(uintptr_t)uv);
+                break;
+            case 's':
+                spec[n]     = sp.conv;
+                spec[n + 1] = '\0';
+                str         = &rec->msg[used];
+                used += strlen(str) + 1;
+                len = _LOG_EMIT(str);
+                break;
+            case '%':
+                out[olen] = '%';
+                len       = 1;
+                break;
+            default:
+                spec[n]     = sp.conv;
+                spec[n + 1] = '\0';
+                _LOG_GET(dv);
+                len = _LOG_EMIT(dv);
+                break;
+        }
+        olen += (0 > len) ? 0
+                          : ((cap - olen <= (size_t)len) ? cap - 1 - olen
+                                                         : (size_t)len);
+    }
+#undef _LOG_EMIT
+#undef _LOG_GET
+
+    // the text after the last conversion
+    n = strlen(p);
+    n = (cap - 1 - olen < n) ? cap - 1 - olen : n;
+    memcpy(&out[olen], p, n);
+    olen += n;
+    out[olen] = '\0';
+    return olen;
+}
+
+static size_t
+_log_format(char *out, const _log_rec *rec, int tid)
+{
+    int    len  = 0;
+    size_t olen = 0;
+    char   ebuf[128];
+
+    len  = snprintf(out,
+                   LOG_LINE_MAX,
+                   "%llu.%06llu %-5s %d ",
+                   (unsigned long long)(rec->ts / 1000000000),
+                   (unsigned long long)(rec->ts % 1000000000 / 1000),
+                   _log_names[rec->level & 3],
+                   tid);
+    olen = (0 > len) ? 0 : len;
+    olen += _log_render(&out[olen], LOG_MSG_LEN, rec);
+    if (0 != rec->err)
+    {
+        len = snprintf(&out[olen],
+                       LOG_LINE_MAX - olen,
+                       ": %s",
+                       strerror_r(rec->err, ebuf, sizeof(ebuf)));
+        olen += (0 > len) ? 0
+                          : ((LOG_LINE_MAX - 1 - olen < (size_t)len)
+                                 ? LOG_LINE_MAX - 1 - olen
+                                 : (size_t)len);
+    }
+    out[olen++] = '\n';
+
+    return olen;
+}
+
+static void
+_log_wake(void)
+{
+    // pairs with the fence in _log_drain: either it sees what was just
+    // stored, or this sees it asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&_log_sleeping, memory_order_relaxed)
+        && atomic_exchange(&_log_sleeping, 0))
+    {
+        syscall(
+            SYS_futex, &_log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static void
+_log_flush(const char *buf, size_t len)
+{
+    ssize_t wlen = 0;
+
+    for (size_t off = 0; off < len; off += wlen)
+    {
+        wlen = write(_log_fd, &buf[off], len - off);
+        if (0 > wlen && EINTR == errno)
+        {
+            wlen = 0;
+            continue;
+        }
+        if (0 > wlen)
+        {
+            // nowhere left to report it
+            return;
+        }
+    }
+}
+
+static size_t
+_log_drain_once(void)
+{
+    static char out[LOG_OUT_BUF];
+    size_t      olen  = 0;
+    size_t      count = 0;
+    uint64_t    head  = 0;
+    uint64_t    tail  = 0;
+    uint64_t    lost  = 0;
+    int         len   = 0;
+    int         dead  = 0;
+    _log_ring * prev  = NULL;
+    _log_ring * r     = atomic_load(&_log_rings);
+    _log_ring * next  = NULL;
+
+    for (; NULL != r; r = next)
+    {
+        next = r->next;
+        // read dead before head so a retired ring is seen empty only after
+        // its last record is
+        dead = atomic_load_explicit(&r->dead, memory_order_acquire);
+
+        tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail != head; tail++)
+        {
+            if (LOG_OUT_BUF - olen < LOG_LINE_MAX)
+            {
+                _log_flush(out, olen);
+                olen = 0;
+            }
+            olen += _log_format(
+                &out[olen], &r->recs[tail & (LOG_RING_SLOTS - 1)], r->tid);
+            count++;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+        lost = atomic_exchange(&r->dropped, 0);
+        if (0 != lost)
+        {
+            atomic_fetch_add(&_log_ndropped, lost);
+            if (LOG_OUT_BUF - olen < LOG_LINE_MAX)
+            {
+                _log_flush(out, olen);
+                olen = 0;
+            }
+            len = snprintf(&out[olen],
+                           LOG_OUT_BUF - olen,
+                           "! log: thread %d dropped %llu records\n",
+                           r->tid,
+                           (unsigned long long)lost);
+            olen += (0 > len) ? 0 : len;
+        }
+
+        // the head of the list may be racing a push, so it is left in
+        // place until another ring is registered in front of it
+        if (dead && NULL != prev)
+        {
+            prev->next = next;
+            free(r);
+            continue;
+        }
+        prev = r;
+    }
+
+    _log_flush(out, olen);
+    return count;
+}
+
+static void *
+_log_drain(void *arg)
+{
+    (void)arg;
+
+    while (atomic_load(&_log_running))
+    {
+        if (0 != _log_drain_once())
+        {
+            continue;
+        }
+
+        // announce the sleep, then look once more: a record published
+        // before the fence is found by this pass, and one published after
+        // it finds _log_sleeping set and wakes us
+        atomic_store(&_log_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (0 == _log_drain_once() && atomic_load(&_log_running))
+        {
+            // returns at once if a waker already cleared the flag
+            syscall(SYS_futex,
+                    &_log_sleeping,
+                    FUTEX_WAIT_PRIVATE,
+                    1,
+                    NULL,
+                    NULL,
+                    0);
+        }
+        atomic_store(&_log_sleeping, 0);
+    }
+
+    // new pushes now write straight out; one that saw running set before
+    // log_shutdown cleared it is still filling its record, and is on the
+    // list already since it registered its ring first
+    for (_log_ring *r = atomic_load(&_log_rings); NULL != r; r = r->next)
+    {
+        while (atomic_load_explicit(&r->pushing, memory_order_acquire))
+        {
+            sched_yield();
+        }
+    }
+    _log_drain_once();
+
+    return NULL;
+}
+/* PRIVATE FUNCTION DEFINTIONS */
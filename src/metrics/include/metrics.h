@@ -0,0 +1,144 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * opcodes tracked per opcode; covers every opcode in proto.h
+ */
+#define METRICS_OPS 16
+
+/**
+ * request latency buckets; bucket i counts requests that took under 2^i
+ * microseconds, so the last one ends a little past 4 seconds and anything
+ * slower only shows in +Inf
+ */
+#define METRICS_BUCKETS 23
+
+/**
+ * most values metrics_register can add
+ */
+#define METRICS_MAX_EXTRA 32
+
+/**
+ * monotonic counters; gauges such as open connections or queue depth are
+ * the difference of a pair of them, taken when metrics are read
+ */
+typedef enum metrics_counter_
+{
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_CONNS_ACCEPTED,
+    METRIC_CONNS_CLOSED,
+    METRIC_JOBS_ADDED,
+    METRIC_JOBS_DONE,
+    METRIC_FRAMES_QUEUED,
+    METRIC_FRAMES_DONE,
+    METRIC_NCOUNTERS,
+} metrics_counter;
+
+/**
+ * @brief reads one value registered with metrics_register
+ *
+ * @param arg - argument given to metrics_register
+ *
+ * @return current value
+ *
+ */
+typedef double (*metrics_fn)(void *arg);
+
+/**
+ * @brief adds to a counter in the calling thread's shard; no lock, no
+ *        atomic read-modify-write and no system call
+ *
+ * @param c - counter
+ *
+ * @param n - amount to add
+ *
+ * @return nothing
+ *
+ */
+void metrics_add(metrics_counter c, uint64_t n);
+
+/**
+ * @brief counts one request and records how long it took
+ *
+ * @param op - opcode of the request
+ *
+ * @param ns - nanoseconds the request took to run
+ *
+ * @return nothing
+ *
+ */
+void metrics_request(uint8_t op, uint64_t ns);
+
+/**
+ * @brief counts one response by its return code; called by whatever builds
+ *        the response, since only it knows the code
+ *
+ * @param op - opcode of the request
+ *
+ * @param ret - RETCODE sent back
+ *
+ * @return nothing
+ *
+ */
+void metrics_retcode(uint8_t op, uint8_t ret);
+
+/**
+ * @brief adds a value read through a callback whenever metrics are
+ *        rendered, e.g. a counter another module already keeps
+ *
+ * @param name - metric name, without the capstone_ prefix
+ *
+ * @param help - one line description
+ *
+ * @param type - "counter" or "gauge"
+ *
+ * @param fn - reads the value; may be called from any thread
+ *
+ * @param arg - passed to @param fn
+ *
+ * @return 0 on success; nonzero if METRICS_MAX_EXTRA are registered
+ *
+ */
+int metrics_register(const char *name,
+                     const char *help,
+                     const char *type,
+                     metrics_fn  fn,
+                     void *      arg);
+
+/**
+ * @brief sums every thread's shard and formats the result in the
+ *        Prometheus text exposition format
+ *
+ * @param len - set to the length of the returned text
+ *
+ * @return malloc'd text; NULL on error
+ *
+ */
+char *metrics_render(size_t *len);
+
+/**
+ * @brief starts a thread answering every HTTP request on @param where with
+ *        metrics_render
+ *
+ * @param where - a port number, bound to 127.0.0.1 only, or a path
+ *        containing a '/' for a Unix socket, e.g. "9100" or
+ *        "/run/capstone.metrics"
+ *
+ * @return 0 on success; nonzero on error or if already serving
+ *
+ */
+int metrics_serve(const char *where);
+
+/**
+ * @brief stops the thread started by metrics_serve and closes its socket
+ *
+ * @return nothing
+ *
+ */
+void metrics_stop(void);
+
+#endif /* _METRICS_H */
@@ -0,0 +1,796 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for accept4 and open_memstream
+#endif
+#include <metrics.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define METRICS_RETS      7 // OTHER, the five RETCODEs below FAIL, FAIL
+#define METRICS_REQ_MAX   1024
+#define METRICS_BACKLOG   8
+#define METRICS_CACHELINE 64
+
+/**
+ * @brief one thread's counters; only the owning thread writes them, so an
+ *        update is a plain load and store rather than a locked add, and
+ *        readers sum every shard
+ *
+ * @param live - set while a thread owns the shard; a shard whose thread
+ *        has exited is handed to the next new thread, keeping its counts
+ *
+ * @param next - next shard in the registry
+ *
+ */
+typedef struct _metrics_shard_
+{
+    atomic_ulong              counters[METRIC_NCOUNTERS];
+    atomic_ulong              reqs[METRICS_OPS];
+    atomic_ulong              nsum[METRICS_OPS];
+    atomic_ulong              lat[METRICS_OPS][METRICS_BUCKETS + 1];
+    atomic_ulong              rets[METRICS_OPS][METRICS_RETS];
+    atomic_int                live;
+    struct _metrics_shard_ *  next;
+} _metrics_shard;
+
+/**
+ * @brief value added with metrics_register
+ *
+ */
+typedef struct _metrics_extra_
+{
+    const char *name;
+    const char *help;
+    const char *type;
+    metrics_fn  fn;
+    void *      arg;
+} _metrics_extra;
+
+/**
+ * every shard ever created; only ever pushed at the head, never unlinked
+ */
+static _Atomic(_metrics_shard *) _metrics_shards = NULL;
+
+static _Thread_local _metrics_shard *_metrics_tshard = NULL;
+
+static pthread_key_t  _metrics_key;
+static pthread_once_t _metrics_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t _metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static _metrics_extra  _metrics_extras[METRICS_MAX_EXTRA];
+static int             _metrics_nextra = 0;
+
+static atomic_int _metrics_serving   = 0;
+static int        _metrics_fd        = -1;
+static int        _metrics_stopfd[2] = { -1, -1 };
+static pthread_t  _metrics_thread;
+static char       _metrics_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/**
+ * names by opcode; must match opcode in proto.h
+ */
+static const char *const _metrics_ops[METRICS_OPS] = {
+    [0x1] = "USER",   [0x2] = "DEL",     [0x3] = "LS",
+    [0x4] = "GET",    [0x5] = "MK",      [0x6] = "PUT",
+    [0x7] = "BATCH",  [0x8] = "GETR",    [0x9] = "UPOPEN",
+    [0xa] = "UPCHUNK", [0xb] = "UPCOMMIT",
+};
+
+/**
+ * names by return code slot; must match retcode in proto.h
+ */
+static const char *const _metrics_rets[METRICS_RETS] = {
+    "OTHER",    "SUCCESS",   "SES_ERR", "PERM_ERR",
+    "USR_EXIST", "FILE_EXIST", "FAIL",
+};
+
+static const char *const _metrics_counters[METRIC_NCOUNTERS][2] = {
+    { "bytes_received_total", "Bytes read from client sockets." },
+    { "bytes_sent_total", "Bytes written to client sockets." },
+    { "connections_accepted_total", "Client connections accepted." },
+    { "connections_closed_total", "Client connections closed." },
+    { "threadpool_jobs_added_total", "Jobs added to thread pools." },
+    { "threadpool_jobs_done_total", "Jobs thread pools have run." },
+    { "frames_queued_total", "Request frames queued to run." },
+    { "frames_done_total", "Request frames run or dropped." },
+};
+
+/**
+ * @brief creates the key whose destructor releases a thread's shard
+ *
+ * @return nothing
+ *
+ */
+static void _metrics_keyinit(void);
+
+/**
+ * @brief marks the exiting thread's shard free for the next new thread
+ *
+ * @return nothing
+ *
+ */
+static void _metrics_release(void *arg);
+
+/**
+ * @brief the calling thread's shard; on first use claims a released shard
+ *        or allocates and registers a new one
+ *
+ * @return the shard; NULL on allocation failure
+ *
+ */
+static _metrics_shard *_metrics_shard_get(void);
+
+/**
+ * @brief adds to a counter only the calling thread writes
+ *
+ * @return nothing
+ *
+ */
+static inline void _metrics_bump(atomic_ulong *c, uint64_t n);
+
+/**
+ * @brief opens and binds the listening socket for metrics_serve
+ *
+ * @return socket on success; -1 on error
+ *
+ */
+static int _metrics_listen(const char *where);
+
+/**
+ * @brief reads one HTTP request and answers it with the current metrics
+ *
+ * @return nothing
+ *
+ */
+static void _metrics_answer(int fd);
+
+/**
+ * @brief accepts and answers scrapes until metrics_stop is called
+ *
+ * @return NULL
+ *
+ */
+static void *_metrics_loop(void *arg);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+void
+metrics_add(metrics_counter c, uint64_t n)
+{
+    _metrics_shard *s = _metrics_tshard;
+
+    if (NULL == s && NULL == (s = _metrics_shard_get()))
+    {
+        return;
+    }
+    _metrics_bump(&s->counters[c], n);
+}
+
+void
+metrics_request(uint8_t op, uint64_t ns)
+{
+    _metrics_shard *s   = _metrics_tshard;
+    uint64_t        us  = ns / 1000;
+    int             idx = 0;
+
+    if (NULL == s && NULL == (s = _metrics_shard_get()))
+    {
+        return;
+    }
+
+    op  = (METRICS_OPS <= op) ? 0 : op;
+    idx = (0 == us) ? 0 : 64 - __builtin_clzll(us);
+    idx = (METRICS_BUCKETS < idx) ? METRICS_BUCKETS : idx;
+    _metrics_bump(&s->reqs[op], 1);
+    _metrics_bump(&s->nsum[op], ns);
+    _metrics_bump(&s->lat[op][idx], 1);
+}
+
+void
+metrics_retcode(uint8_t op, uint8_t ret)
+{
+    _metrics_shard *s = _metrics_tshard;
+
+    if (NULL == s && NULL == (s = _metrics_shard_get()))
+    {
+        return;
+    }
+
+    op  = (METRICS_OPS <= op) ? 0 : op;
+    if (0xff == ret)
+    {
+        ret = METRICS_RETS - 1;
+    }
+    else if (METRICS_RETS - 1 <= ret)
+    {
+        ret = 0;
+    }
+    _metrics_bump(&s->rets[op][ret], 1);
+}
+
+int
+metrics_register(const char *name,
+                 const char *help,
+                 const char *type,
+                 metrics_fn  fn,
+                 void *      arg)
+{
+    int ret = -1;
+
+    if (NULL == name || NULL == help || NULL == type || NULL == fn)
+    {
+        fprintf(stderr, "! metrics_register: NULL argument\n");
+        return ret;
+    }
+
+    pthread_mutex_lock(&_metrics_lock);
+    if (METRICS_MAX_EXTRA > _metrics_nextra)
+    {
+        _metrics_extras[_metrics_nextra++]
+            = (_metrics_extra) { name, help, type, fn, arg };
+        ret = 0;
+    }
+    pthread_mutex_unlock(&_metrics_lock);
+
+    if (0 != ret)
+    {
+        fprintf(stderr, "! metrics_register: too many metrics\n");
+    }
+    return ret;
+}
+
+char *
+metrics_render(size_t *len)
+{
+    static _metrics_shard sum;
+    _metrics_shard *      s    = NULL;
+    char *                out  = NULL;
+    FILE *                f    = NULL;
+    uint64_t              cum  = 0;
+    int64_t               diff = 0;
+    char                  opbuf[8];
+    const char *          name = NULL;
+
+    f = open_memstream(&out, len);
+    if (NULL == f)
+    {
+        perror("! metrics_render: open_memstream");
+        return NULL;
+    }
+
+    // the lock also keeps concurrent scrapes off the static sum
+    pthread_mutex_lock(&_metrics_lock);
+    memset(&sum, 0, sizeof(sum));
+    for (s = atomic_load(&_metrics_shards); NULL != s; s = s->next)
+    {
+        for (int c = 0; c < METRIC_NCOUNTERS; c++)
+        {
+            sum.counters[c] += atomic_load_explicit(&s->counters[c],
+                                                    memory_order_relaxed);
+        }
+        for (int op = 0; op < METRICS_OPS; op++)
+        {
+            sum.reqs[op] += atomic_load_explicit(&s->reqs[op],
+                                                 memory_order_relaxed);
+            sum.nsum[op] += atomic_load_explicit(&s->nsum[op],
+                                                 memory_order_relaxed);
+            for (int b = 0; b <= METRICS_BUCKETS; b++)
+            {
+                sum.lat[op][b] += atomic_load_explicit(&s->lat[op][b],
+                                                       memory_order_relaxed);
+            }
+            for (int r = 0; r < METRICS_RETS; r++)
+            {
+                sum.rets[op][r] += atomic_load_explicit(&s->rets[op][r],
+                                                        memory_order_relaxed);
+            }
+        }
+    }
+
+    for (int c = 0; c < METRIC_NCOUNTERS; c++)
+    {
+        fprintf(f,
+                "# HELP capstone_%s %s\n# TYPE capstone_%s counter\n"
+                "capstone_%s %lu\n",
+                _metrics_counters[c][0],
+                _metrics_counters[c][1],
+                _metrics_counters[c][0],
+                _metrics_counters[c][0],
+                (unsigned long)sum.counters[c]);
+    }
+
+    // each gauge is the difference of a pair of counters; the pair is not
+    // read atomically so a scrape racing an update may see it dip below 0
+    static const struct
+    {
+        const char *    name;
+        const char *    help;
+        metrics_counter up;
+        metrics_counter down;
+    } gauges[] = {
+        { "connections_open", "Client connections open.",
+          METRIC_CONNS_ACCEPTED, METRIC_CONNS_CLOSED },
+        { "threadpool_queue_depth", "Jobs queued or running.",
+          METRIC_JOBS_ADDED, METRIC_JOBS_DONE },
+        { "frames_inflight", "Request frames queued or running.",
+          METRIC_FRAMES_QUEUED, METRIC_FRAMES_DONE },
+    };
+    for (size_t g = 0; g < sizeof(gauges) / sizeof(gauges[0]); g++)
+    {
+        diff = sum.counters[gauges[g].up] - sum.counters[gauges[g].down];
+        fprintf(f,
+                "# HELP capstone_%s %s\n# TYPE capstone_%s gauge\n"
+                "capstone_%s %ld\n",
+                gauges[g].name,
+                gauges[g].help,
+                gauges[g].name,
+                gauges[g].name,
+                (long)((0 > diff) ? 0 : diff));
+    }
+
+    fprintf(f,
+            "# HELP capstone_requests_total Requests run, by opcode.\n"
+            "# TYPE capstone_requests_total counter\n");
+    for (int op = 0; op < METRICS_OPS; op++)
+    {
+        if (0 == sum.reqs[op])
+        {
+            continue;
+        }
+        name = _metrics_ops[op];
+        if (NULL == name)
+        {
+            snprintf(opbuf, sizeof(opbuf), "0x%x", op);
+            name = opbuf;
+        }
+        fprintf(f,
+                "capstone_requests_total{op=\"%s\"} %lu\n",
+                name,
+                (unsigned long)sum.reqs[op]);
+    }
+
+    fprintf(f,
+            "# HELP capstone_request_duration_seconds Time to run a "
+            "request, by opcode.\n"
+            "# TYPE capstone_request_duration_seconds histogram\n");
+    for (int op = 0; op < METRICS_OPS; op++)
+    {
+        if (0 == sum.reqs[op])
+        {
+            continue;
+        }
+        name = _metrics_ops[op];
+        if (NULL == name)
+        {
+            snprintf(opbuf, sizeof(opbuf), "0x%x", op);
+            name = opbuf;
+        }
+        cum = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            cum += sum.lat[op][b];
+            fprintf(f,
+                    "capstone_request_duration_seconds_bucket"
+                    "{op=\"%s\",le=\"%g\"} %lu\n",
+                    name,
+                    (double)(1ULL << b) / 1e6,
+                    (unsigned long)cum);
+        }
+        fprintf(f,
+                "capstone_request_duration_seconds_bucket"
+                "{op=\"%s\",le=\"+Inf\"} %lu\n"
+                "capstone_request_duration_seconds_sum{op=\"%s\"} %.9f\n"
+                "capstone_request_duration_seconds_count{op=\"%s\"} %lu\n",
+                name,
+                (unsigned long)(cum + sum.lat[op][METRICS_BUCKETS]),
+                name,
+                sum.nsum[op] / 1e9,
+                name,
+                (unsigned long)sum.reqs[op]);
+    }
+
+    fprintf(f,
+            "# HELP capstone_responses_total Responses sent, by opcode and "
+            "return code.\n"
+            "# TYPE capstone_responses_total counter\n");
+    for (int op = 0; op < METRICS_OPS; op++)
+    {
+        name = _metrics_ops[op];
+        if (NULL == name)
+        {
+            snprintf(opbuf, sizeof(opbuf), "0x%x", op);
+            name = opbuf;
+        }
+        for (int r = 0; r < METRICS_RETS; r++)
+        {
+            if (0 == sum.rets[op][r])
+            {
+                continue;
+            }
+            fprintf(f,
+                    "capstone_responses_total{op=\"%s\",code=\"%s\"} %lu\n",
+                    name,
+                    _metrics_rets[r],
+                    (unsigned long)sum.rets[op][r]);
+        }
+    }
+
+    for (int e = 0; e < _metrics_nextra; e++)
+    {
+        fprintf(f,
+                "# HELP capstone_%s %s\n# TYPE capstone_%s %s\n"
+                "capstone_%s %.17g\n",
+                _metrics_extras[e].name,
+                _metrics_extras[e].help,
+                _metrics_extras[e].name,
+                _metrics_extras[e].type,
+                _metrics_extras[e].name,
+                (_metrics_extras[e].fn)(_metrics_extras[e].arg));
+    }
+    pthread_mutex_unlock(&_metrics_lock);
+
+    if (0 != fclose(f))
+    {
+        perror("! metrics_render: fclose");
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+int
+metrics_serve(const char *where)
+{
+    int ret = -1;
+
+    if (NULL == where)
+    {
+        fprintf(stderr, "! metrics_serve: NULL address\n");
+        return ret;
+    }
+
+    if (0 != atomic_exchange(&_metrics_serving, 1))
+    {
+        fprintf(stderr, "! metrics_serve: already serving\n");
+        return ret;
+    }
+
+    _metrics_fd = _metrics_listen(where);
+    if (0 > _metrics_fd)
+    {
+        goto ERR;
+    }
+
+    if (0 != pipe2(_metrics_stopfd, O_CLOEXEC))
+    {
+        perror("! metrics_serve: pipe2");
+        goto ERR;
+    }
+
+    if (0 != pthread_create(&_metrics_thread, NULL, _metrics_loop, NULL))
+    {
+        fprintf(stderr, "! metrics_serve: couldn't start thread\n");
+        goto ERR;
+    }
+    ret = 0;
+
+ERR:
+    if (0 != ret)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (0 <= _metrics_stopfd[i])
+            {
+                close(_metrics_stopfd[i]);
+                _metrics_stopfd[i] = -1;
+            }
+        }
+        if (0 <= _metrics_fd)
+        {
+            close(_metrics_fd);
+            _metrics_fd = -1;
+        }
+        atomic_store(&_metrics_serving, 0);
+    }
+    return ret;
+}
+
+void
+metrics_stop(void)
+{
+    if (0 == atomic_exchange(&_metrics_serving, 0))
+    {
+        return;
+    }
+
+    if (1 != write(_metrics_stopfd[1], "", 1))
+    {
+        perror("! metrics_stop: write");
+    }
+    pthread_join(_metrics_thread, NULL);
+
+    close(_metrics_stopfd[0]);
+    close(_metrics_stopfd[1]);
+    _metrics_stopfd[0] = -1;
+    _metrics_stopfd[1] = -1;
+    close(_metrics_fd);
+    _metrics_fd = -1;
+    if ('\0' != _metrics_path[0])
+    {
+        unlink(_metrics_path);
+        _metrics_path[0] = '\0';
+    }
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_metrics_keyinit(void)
+{
+    pthread_key_create(&_metrics_key, _metrics_release);
+}
+
+static void
+_metrics_release(void *arg)
+{
+    _metrics_shard *s = arg;
+
+    atomic_store_explicit(&s->live, 0, memory_order_release);
+}
+
+static _metrics_shard *
+_metrics_shard_get(void)
+{
+    _metrics_shard *s    = NULL;
+    int             dead = 0;
+
+    pthread_once(&_metrics_once, _metrics_keyinit);
+
+    for (s = atomic_load(&_metrics_shards); NULL != s; s = s->next)
+    {
+        dead = 0;
+        if (atomic_compare_exchange_strong(&s->live, &dead, 1))
+        {
+            break;
+        }
+    }
+
+    if (NULL == s)
+    {
+        s = aligned_alloc(METRICS_CACHELINE,
+                          (sizeof(_metrics_shard) + METRICS_CACHELINE - 1)
+                              / METRICS_CACHELINE * METRICS_CACHELINE);
+        if (NULL == s)
+        {
+            return NULL;
+        }
+        memset(s, 0, sizeof(_metrics_shard));
+        s->live = 1;
+        s->next = atomic_load(&_metrics_shards);
+        while (!atomic_compare_exchange_weak(&_metrics_shards, &s->next, s))
+        {
+        }
+    }
+
+    pthread_setspecific(_metrics_key, s);
+    _metrics_tshard = s;
+    return s;
+}
+
+static inline void
+_metrics_bump(atomic_ulong *c, uint64_t n)
+{
+    atomic_store_explicit(
+        c, atomic_load_explicit(c, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+static int
+_metrics_listen(const char *where)
+{
+    int                fd   = -1;
+    int                one  = 1;
+    char *             end  = NULL;
+    unsigned long      port = 0;
+    struct sockaddr_in in   = { 0 };
+    struct sockaddr_un un   = { 0 };
+    struct stat        st   = { 0 };
+
+    if (NULL != strchr(where, '/'))
+    {
+        if (sizeof(un.sun_path) <= strlen(where))
+        {
+            fprintf(stderr, "! metrics_serve: socket path too long\n");
+            return -1;
+        }
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, where);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // a socket left behind by an earlier run would fail the bind;
+        // anything else at the path is left for the bind to refuse
+        if (0 == lstat(where, &st) && S_ISSOCK(st.st_mode))
+        {
+            unlink(where);
+        }
+        if (0 > fd || 0 != bind(fd, (struct sockaddr *)&un, sizeof(un)))
+        {
+            perror("! metrics_serve: bind");
+            goto ERR;
+        }
+        strcpy(_metrics_path, where);
+    }
+    else
+    {
+        port = strtoul(where, &end, 10);
+        if ('\0' == where[0] || '\0' != *end || 0 == port || 65535 < port)
+        {
+            fprintf(stderr, "! metrics_serve: invalid port %s\n", where);
+            return -1;
+        }
+        in.sin_family      = AF_INET;
+        in.sin_port        = htons(port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (0 > fd
+            || 0 != setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+            || 0 != bind(fd, (struct sockaddr *)&in, sizeof(in)))
+        {
+            perror("! metrics_serve: bind");
+            goto ERR;
+        }
+    }
+
+    if (0 != listen(fd, METRICS_BACKLOG))
+    {
+        perror("! metrics_serve: listen");
+        goto ERR;
+    }
+    return fd;
+
+ERR:
+    if (0 <= fd)
+    {
+        close(fd);
+    }
+    if ('\0' != _metrics_path[0])
+    {
+        unlink(_metrics_path);
+        _metrics_path[0] = '\0';
+    }
+    return -1;
+}
+
+static void
+_metrics_answer(int fd)
+{
+    size_t         rlen = 0;
+    size_t         blen = 0;
+    ssize_t        len  = 0;
+    int            hlen = 0;
+    char *         body = NULL;
+    struct timeval tv   = { 1, 0 };
+    char           req[METRICS_REQ_MAX];
+    char           hdr[160];
+
+    // a scraper that never finishes its request is not waited on for long
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    while (rlen < sizeof(req) - 1)
+    {
+        len = read(fd, &req[rlen], sizeof(req) - 1 - rlen);
+        if (0 > len && EINTR == errno)
+        {
+            continue;
+        }
+        if (0 >= len)
+        {
+            break;
+        }
+        rlen += len;
+        req[rlen] = '\0';
+        if (NULL != strstr(req, "\r\n\r\n") || NULL != strstr(req, "\n\n"))
+        {
+            break;
+        }
+    }
+
+    body = metrics_render(&blen);
+    if (NULL == body)
+    {
+        hlen = snprintf(hdr,
+                        sizeof(hdr),
+                        "HTTP/1.0 500 Internal Server Error\r\n"
+                        "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    else
+    {
+        hlen = snprintf(hdr,
+                        sizeof(hdr),
+                        "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                        blen);
+    }
+
+    for (size_t off = 0; off < (size_t)hlen + blen; off += len)
+    {
+        if (off < (size_t)hlen)
+        {
+            len = send(fd, &hdr[off], hlen - off, MSG_NOSIGNAL);
+        }
+        else
+        {
+            // a scraper hanging up early must not raise SIGPIPE in the
+            // server
+            len = send(
+                fd, &body[off - hlen], blen - (off - hlen), MSG_NOSIGNAL);
+        }
+        if (0 > len && EINTR == errno)
+        {
+            len = 0;
+            continue;
+        }
+        if (0 > len)
+        {
+            break;
+        }
+    }
+    free(body);
+}
+
+static void *
+_metrics_loop(void *arg)
+{
+    int           fd     = -1;
+    struct pollfd pfds[] = {
+        { .fd = _metrics_fd, .events = POLLIN },
+        { .fd = _metrics_stopfd[0], .events = POLLIN },
+    };
+
+    (void)arg;
+
+    for (;;)
+    {
+        if (0 > poll(pfds, 2, -1))
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("! _metrics_loop: poll");
+            break;
+        }
+        if (pfds[1].revents)
+        {
+            break;
+        }
+        if (!(pfds[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        fd = accept4(_metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (0 > fd)
+        {
+            continue;
+        }
+        _metrics_answer(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+/* PRIVATE FUNCTION DEFINTIONS */
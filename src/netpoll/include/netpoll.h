@@ -1,5 +1,8 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
 #include <poll.h>
 
 /**
@@ -8,7 +11,7 @@
  * reinitialize this variable as it is set to 1 everytime tcp_netpoll is
  * called
  */
-volatile int netpoll_keepalive;
+extern volatile int netpoll_keepalive;
 
 /**
  * @brief function poitner to be defined in the caller and provided to
@@ -23,6 +26,85 @@ volatile int netpoll_keepalive;
  */
 typedef void (*reventhandler)(int sfd);
 
+/**
+ * @brief function pointer to be defined in the caller; consulted before
+ *        every poll to decide whether a client socket is polled for input,
+ *        so a connection whose earlier requests are still queued or whose
+ *        responses are unsent is left to back up in its TCP window instead
+ *        of being read into memory
+ *
+ * @param sfd - client socket file descriptor
+ *
+ * @return nonzero if @param sfd may be read; 0 to pause it
+ *
+ */
+typedef int (*readgate)(int sfd);
+
+/**
+ * @brief function pointer to be defined in the caller; consulted before
+ *        every poll to decide whether new connections are accepted, so an
+ *        overloaded server leaves them in the listen backlog
+ *
+ * @return nonzero if connections may be accepted; 0 to pause accepting
+ *
+ */
+typedef int (*acceptgate)(void);
+
+/**
+ * @brief admission gates used by tcp_netpoll; NULL gates never pause
+ */
+extern readgate   netpoll_readgate;
+extern acceptgate netpoll_acceptgate;
+
+/**
+ * @brief function pointer to be defined in the caller; run on the poller
+ *        thread when a client socket leaves the poller because the client
+ *        finished sending, hung up or failed, or because the poller is
+ *        stopping; the socket is NOT closed but now belongs to the handler,
+ *        which closes it once no request still queued for the client can
+ *        write to it, so its number is never reused under a response
+ *
+ * @param sfd - client socket file descriptor
+ *
+ * @param abort - 0 if the client only finished sending; everything it
+ *        sent before that was handed to the revent handler or is still
+ *        unread in the socket, and it may still be answered; nonzero if
+ *        the socket failed or the poller is stopping, so queued work for
+ *        it can be dropped
+ *
+ * @return nothing
+ *
+ */
+typedef void (*closehandler)(int sfd, int abort);
+
+/**
+ * @brief close handler used by tcp_netpoll; NULL has the poller close
+ *        client sockets itself, which only suits callers that answer
+ *        every request from within the revent handler
+ */
+extern closehandler netpoll_closehandler;
+
+/**
+ * @brief admission counters kept by tcp_netpoll for the metrics exporter
+ *        instead of logging every event
+ *
+ * @param nrejected - connections closed because maxcon was reached
+ *
+ * @param nreadpaused - times a client socket stopped being polled for
+ *        input by netpoll_readgate
+ *
+ * @param nacceptpaused - times accepting was paused by netpoll_acceptgate
+ *
+ */
+typedef struct netpoll_stats_
+{
+    atomic_ulong nrejected;
+    atomic_ulong nreadpaused;
+    atomic_ulong nacceptpaused;
+} netpoll_stats;
+
+extern netpoll_stats netpoll_stat;
+
 /**
  * @brief helper function to open a listening socket on @param port and
  *        @param ip domain (AF_INET or AF_INET6)
@@ -50,17 +132,62 @@ int tcp_socketsetup(uint16_t port, int ipDomain, int maxpend);
  */
 void tcp_printsockaddr(struct sockaddr_storage *in);
 
+/**
+ * @brief formats the peer address of a connected socket as addr:port; the
+ *        poller no longer copies out or prints the address of every
+ *        accepted connection, so this is for callers that actually log it
+ *
+ * @param fd - connected socket
+ *
+ * @param buf - buffer for the address; INET6_ADDRSTRLEN + 8 is enough
+ *
+ * @param len - length of @param buf
+ *
+ * @return 0 on success; -1 on error or if @param buf is too small
+ *
+ */
+int tcp_peername(int fd, char *buf, size_t len);
+
+/**
+ * @brief tunes a listening socket for reconnect storms; both options are
+ *        off when given 0
+ *
+ * @param sockfd - listening socket from tcp_socketsetup
+ *
+ * @param defer - seconds TCP_DEFER_ACCEPT lets a connection wait for its
+ *        first request before the poller is woken for it, so clients that
+ *        connect and stay silent never take a slot
+ *
+ * @param fastopen - TCP_FASTOPEN queue length, letting returning clients
+ *        send their first request in the SYN
+ *
+ * @return 0 on success; -1 if either option could not be set
+ *
+ */
+int tcp_listenopts(int sockfd, int defer, int fastopen);
+
+/**
+ * most connections tcp_netpoll accepts per wakeup before it serves the
+ * clients it already has again
+ */
+#define NETPOLL_ACCEPT_BATCH 64
+
 /**
  * @brief helper function that polls for incoming connections and data
  *        from clients
  *
- * @param sockfd - server socket file descriptor
+ * @param sockfd - server socket file descriptor; owned by the poller from
+ *        the call on: it is closed when tcp_netpoll returns, or as soon as
+ *        a drain starts, unless a handoff passes it to its callback, so the
+ *        caller must not close it afterwards
  *
  * @param eventhandler - a function pointer that accepts a void ponter for
  *        arguments; points a to a caller defined function that will handle
- *        events for poll notably
+ *        events for poll notably; it is also run for a client that has
+ *        hung up with input left, before netpoll_closehandler
  *
- * @param maxcon - maximum number of connections
+ * @param maxcon - maximum number of connections; accepted client sockets
+ *        are non-blocking and close-on-exec
  *
  * @param timeout - time (in seconds) that poll will wait for an event
  *
@@ -70,6 +197,166 @@ void tcp_printsockaddr(struct sockaddr_storage *in);
  */
 int tcp_netpoll(int sockfd, reventhandler rh, int maxcon, int timeout);
 
+/**
+ * @brief wakes tcp_netpoll so it consults its gates again; to be called by
+ *        whoever makes a paused socket or the listener eligible again, e.g.
+ *        a worker finishing a request, rather than waiting for the poll
+ *        timeout; safe to call from any thread
+ *
+ * @return nothing
+ *
+ */
+void tcp_netpoll_wake(void);
+
+/**
+ * @brief callback run on the poller thread when a timer expires; should
+ *        only hand work off, e.g. resubmit a job to a pool
+ *
+ * @param arg - argument given to tcp_netpoll_timer
+ *
+ * @return nothing
+ *
+ */
+typedef void (*timercb)(void *arg);
+
+/**
+ * @brief parks work in the poller until @param delay_ns has passed, so a
+ *        throttled transfer gives its worker back instead of sleeping in
+ *        it; timers still pending when tcp_netpoll returns are run then so
+ *        their owners can clean up; safe to call from any thread
+ *
+ * @param delay_ns - nanoseconds from now
+ *
+ * @param cb - callback to run
+ *
+ * @param arg - passed to @param cb
+ *
+ * @return 0 on success; nonzero on error, including when no poller is
+ *         running, in which case the caller still owns @param arg
+ *
+ */
+int tcp_netpoll_timer(uint64_t delay_ns, timercb cb, void *arg);
+
+/**
+ * @brief callback run on the poller thread for work parked with
+ *        tcp_netpoll_writable; should only hand work off, e.g. resubmit a
+ *        job to a pool
+ *
+ * @param arg - argument given to tcp_netpoll_writable
+ *
+ * @param ready - nonzero if the socket can take more data, hung up or has
+ *        an error, so the next write returns rather than blocks; 0 if it
+ *        stayed full for netpoll_iotimeout or the poller stopped
+ *
+ * @return nothing
+ *
+ */
+typedef void (*writecb)(void *arg, int ready);
+
+/**
+ * @brief parks work in the poller until a socket that returned EAGAIN can
+ *        take more data, so a transfer to a client that stopped reading
+ *        gives its worker back instead of waiting in tcp_wait_writable;
+ *        work still parked when tcp_netpoll returns is run then with
+ *        ready 0; safe to call from any thread
+ *
+ * @param fd - socket to wait on
+ *
+ * @param cb - callback to run
+ *
+ * @param arg - passed to @param cb
+ *
+ * @return 0 on success; nonzero on error, including when no poller is
+ *         running, in which case the caller still owns @param arg
+ *
+ */
+int tcp_netpoll_writable(int fd, writecb cb, void *arg);
+
+/**
+ * @brief callback run on the poller thread once a handoff is requested;
+ *        the poller has stopped, and the listening socket and every client
+ *        socket it held are still open and now belong to the callback;
+ *        tcp_netpoll returns 0 after it
+ *
+ * @param sockfd - listening socket given to tcp_netpoll
+ *
+ * @param fds - client sockets; only valid during the call
+ *
+ * @param nfds - number of @param fds
+ *
+ * @param arg - argument given to tcp_netpoll_handoff
+ *
+ * @return nothing
+ *
+ */
+typedef void (*handoffcb)(int sockfd, const int *fds, int nfds, void *arg);
+
+/**
+ * @brief asks the running poller to stop and give its sockets to @param cb
+ *        instead of closing them, e.g. to pass them to a new process; safe
+ *        to call from any thread
+ *
+ * @param cb - callback to run
+ *
+ * @param arg - passed to @param cb
+ *
+ * @return 0 on success; -1 if no poller is running or a handoff is
+ *         already pending
+ *
+ */
+int tcp_netpoll_handoff(handoffcb cb, void *arg);
+
+/**
+ * @brief adds an already connected client socket, e.g. one received from
+ *        the process being replaced, to the poller; sockets adopted before
+ *        tcp_netpoll starts are added when it does; safe to call from any
+ *        thread
+ *
+ * @param fd - connected socket; made non-blocking here
+ *
+ * @return 0 on success; -1 on error
+ *
+ */
+int tcp_netpoll_adopt(int fd);
+
+/**
+ * longest tcp_netpoll sleeps while draining before it asks the idle gate
+ * about the clients it is waiting for again
+ */
+#define NETPOLL_DRAIN_POLL_MS 10
+
+/**
+ * @brief function pointer to be defined in the caller and provided to
+ *        tcp_netpoll_drain; tells whether a client has no request queued
+ *        or running and no response left to send
+ *
+ * @param sfd - client socket file descriptor
+ *
+ * @return nonzero if @param sfd can be closed without cutting a response
+ *         short
+ *
+ */
+typedef int (*idlegate)(int sfd);
+
+/**
+ * @brief asks the running poller to drain; the listening socket, which
+ *        the poller owns, is closed so new connections are refused,
+ *        clients are no longer read, and each client @param idle reports
+ *        idle gets a FIN once its responses are sent; tcp_netpoll returns 0
+ *        once every client has hung up or @param timeout_ns has passed,
+ *        and closes whatever is left; safe to call from any thread
+ *
+ * @param timeout_ns - nanoseconds from now before the remaining clients
+ *        are closed regardless
+ *
+ * @param idle - idle gate; NULL treats every client as idle
+ *
+ * @return 0 on success; -1 if no poller is running or it is already
+ *         draining
+ *
+ */
+int tcp_netpoll_drain(uint64_t timeout_ns, idlegate idle);
+
 /**
  * @brief handles partial reads from a file descriptor provided the amount
  *        of expected data is known
@@ -88,7 +375,52 @@ int tcp_netpoll(int sockfd, reventhandler rh, int maxcon, int timeout);
 int tcp_read_handler(int fd, void *buf, uint readlen);
 
 /**
- * @brief handles partial writes to a file descriptor
+ * suggested value for netpoll_zcmin; below this the page pinning and
+ * completion round trip of MSG_ZEROCOPY cost more than copying
+ */
+#define NETPOLL_ZEROCOPY_MIN (64 * 1024)
+
+/**
+ * writes of at least this many bytes to a socket are sent with
+ * MSG_ZEROCOPY when the kernel and socket allow it; 0, the default,
+ * disables zerocopy. Each such write waits for the peer to acknowledge
+ * the data before returning, so only opt in where copying costs more than
+ * that round trip. SO_ZEROCOPY is turned on when the poller takes a
+ * socket in, so set this before tcp_netpoll starts; sockets taken in
+ * while it was 0 are always copied
+ */
+extern size_t netpoll_zcmin;
+
+/**
+ * default for netpoll_iotimeout
+ */
+#define NETPOLL_IO_TIMEOUT_MS 30000
+
+/**
+ * milliseconds a read or write waits on a non-blocking socket that
+ * returned EAGAIN before giving up with ETIMEDOUT, so a client that stops
+ * reading only holds a worker this long; negative waits forever
+ */
+extern int netpoll_iotimeout;
+
+/**
+ * @brief waits for a non-blocking socket that returned EAGAIN part way
+ *        through a write to take more data, for at most netpoll_iotimeout
+ *
+ * @param fd - socket to wait on
+ *
+ * @return 0 once @param fd is writable; -1 on error, hangup or timeout,
+ *         with errno set to ETIMEDOUT for the last
+ *
+ */
+int tcp_wait_writable(int fd);
+
+/**
+ * @brief handles partial writes to a file descriptor; a short write
+ *        resumes where it stopped and EAGAIN on a non-blocking socket is
+ *        waited out with tcp_wait_writable; writes of at least
+ *        netpoll_zcmin bytes use MSG_ZEROCOPY and return only once the
+ *        kernel has released @param buf
  *
  * @param fd - file descriptor tow write to
  *
@@ -100,3 +432,107 @@ int tcp_read_handler(int fd, void *buf, uint readlen);
  *
  */
 int tcp_write_handler(int fd, char *buf, uint writelen);
+
+/**
+ * @brief handles partial writes of a scattered buffer so a fixed header,
+ *        a path and a payload can go out in one system call without being
+ *        copied together first; a short write resumes at the exact byte it
+ *        stopped at, whether that is an iovec boundary or not
+ *
+ * @param fd - file descriptor to write to
+ *
+ * @param iov - buffers to be sent in order; CONSUMED, the entries are
+ *        advanced past whatever was written
+ *
+ * @param iovcnt - number of entries in @param iov; may exceed IOV_MAX
+ *
+ * @return total bytes written on success; -1 on error
+ *
+ */
+int64_t tcp_writev_handler(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * buffer size classes handed out by netbuf_acquire; they match the
+ * protocol's fixed request headers, its bounded messages and the chunk
+ * size used for file transfers
+ */
+#define NETBUF_HDR_LEN   12
+#define NETBUF_MSG_LEN   2048
+#define NETBUF_CHUNK_LEN 65536
+
+/**
+ * number of free buffers of each class a thread keeps for itself before
+ * handing half of them back to the shared depot
+ */
+#define NETBUF_CACHE 32
+
+/**
+ * @brief takes a buffer of at least @param len bytes from the calling
+ *        thread's cache, refilling the cache from the shared depot or the
+ *        heap when it runs dry
+ *
+ * @param len - bytes needed; at most NETBUF_CHUNK_LEN
+ *
+ * @return pointer to the buffer; NULL on error or if @param len is too big
+ *
+ */
+void *netbuf_acquire(size_t len);
+
+/**
+ * @brief returns a buffer from netbuf_acquire; any thread may release a
+ *        buffer acquired by another
+ *
+ * @param buf - buffer to release; NULL is ignored
+ *
+ * @return nothing
+ *
+ */
+void netbuf_release(void *buf);
+
+/**
+ * @brief usable size of a buffer from netbuf_acquire
+ *
+ * @param buf - buffer from netbuf_acquire
+ *
+ * @return size of the buffer's class
+ *
+ */
+size_t netbuf_size(const void *buf);
+
+/**
+ * @brief allocates @param count transfer chunk buffers in one mapping and
+ *        registers them with an io_uring instance as fixed buffers so
+ *        READ_FIXED/WRITE_FIXED can skip pinning pages on every request;
+ *        the buffers join the depot and are handed out like any other
+ *        chunk buffer
+ *
+ * @param ringfd - io_uring file descriptor
+ *
+ * @param count - number of chunk buffers to register
+ *
+ * @return 0 on success; -1 on error with errno set, ENOSYS if io_uring is
+ *         not available
+ *
+ */
+int netbuf_register(int ringfd, uint count);
+
+/**
+ * @brief fixed buffer index of a buffer for io_uring requests
+ *
+ * @param buf - buffer from netbuf_acquire
+ *
+ * @return index passed to netbuf_register's ring; -1 if @param buf is not
+ *         registered
+ *
+ */
+int netbuf_index(const void *buf);
+
+/**
+ * @brief frees the unregistered buffers held by the depot, e.g. after a
+ *        burst of traffic or at shutdown; buffers in thread caches or in
+ *        use are left alone
+ *
+ * @return nothing
+ *
+ */
+void netbuf_reclaim(void);
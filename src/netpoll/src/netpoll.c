@@ -1,32 +1,306 @@
 #ifndef _GNU_SOURCE
-#define _GNU_SOURCE // for POLLRDHUP
+#define _GNU_SOURCE // for POLLRDHUP and accept4
 #endif
 #include <netpoll.h>
+#include <log.h>
+#include <metrics.h>
+#include <trace.h>
+#include <flight.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#ifdef SYS_io_uring_register
+#include <linux/io_uring.h>
+#endif
+
+#define NETBUF_NCLASS 3
+
+/**
+ * sockets numbered at or above this are always copied; see _tcp_zcfd
+ */
+#define NETPOLL_ZEROCOPY_FDS 65536
 
 /**
- * @brief accepts all waiting connections and stores the socket
- *        file descriptor in @param pfds; if there are no available
- *        pfds left then the connection is closed
+ * @brief bookkeeping stored in front of every pooled buffer; 16 bytes so
+ *        the data that follows keeps malloc's alignment
  *
- * @param sockfd - server socket file descriptor
+ * @param next - next free buffer while in a depot free list
  *
- * @param pfd - pointer to poll file descriptor array
+ * @param cls - size class
  *
- * @param plen - length of pfd array
+ * @param index - io_uring fixed buffer index; -1 if unregistered
+ *
+ */
+typedef struct _netbuf_
+{
+    struct _netbuf_ *next;
+    uint32_t         cls;
+    int32_t          index;
+} _netbuf;
+
+/**
+ * @brief per-thread free buffers of each class
+ *
+ */
+typedef struct _netbuf_cache_
+{
+    _netbuf *bufs[NETBUF_NCLASS][NETBUF_CACHE];
+    uint     nbufs[NETBUF_NCLASS];
+    int      keyed;
+} _netbuf_cache;
+
+static const size_t _netbuf_len[NETBUF_NCLASS]
+    = { NETBUF_HDR_LEN, NETBUF_MSG_LEN, NETBUF_CHUNK_LEN };
+
+/**
+ * shared free lists the thread caches refill from and spill to
+ */
+static pthread_mutex_t _netbuf_lock[NETBUF_NCLASS]
+    = { PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_MUTEX_INITIALIZER };
+static _netbuf *_netbuf_depot[NETBUF_NCLASS];
+
+volatile int  netpoll_keepalive    = 0;
+readgate      netpoll_readgate     = NULL;
+acceptgate    netpoll_acceptgate   = NULL;
+closehandler  netpoll_closehandler = NULL;
+int           netpoll_iotimeout    = NETPOLL_IO_TIMEOUT_MS;
+size_t        netpoll_zcmin        = 0;
+netpoll_stats netpoll_stat;
+
+/**
+ * @brief client slots of a poller; closed slots are kept on a stack so
+ *        an accept finds a free one without scanning the poll array
+ *
+ * @param pfds - poll array; the server socket and wakeup eventfd first
+ *
+ * @param plen - length of @param pfds
+ *
+ * @param nfds - entries handed to poll; every slot from here on is unused
+ *
+ * @param holes - stack of closed slots below @param nfds
+ *
+ * @param nholes - number of entries in @param holes
+ *
+ * @param shut - per slot, nonzero once the client was sent a FIN while
+ *        draining
+ *
+ * @param drainby - CLOCK_MONOTONIC nanoseconds by which draining ends;
+ *        0 while not draining
+ *
+ * @param idle - idle gate given to tcp_netpoll_drain
+ *
+ */
+typedef struct _tcp_slots_
+{
+    struct pollfd *pfds;
+    int            plen;
+    int            nfds;
+    int *          holes;
+    int            nholes;
+    uint8_t *      shut;
+    uint64_t       drainby;
+    idlegate       idle;
+} _tcp_slots;
+
+/**
+ * @brief a parked callback in the poller's timer heap
+ *
+ * @param deadline - CLOCK_MONOTONIC nanoseconds at which to run @param cb
+ *
+ * @param cb - callback
+ *
+ * @param arg - passed to @param cb
+ *
+ */
+typedef struct _tcp_timer_
+{
+    uint64_t deadline;
+    timercb  cb;
+    void *   arg;
+} _tcp_timer;
+
+/**
+ * @brief work parked in the poller until a socket is writable
+ *
+ * @param fd - socket to poll for POLLOUT
+ *
+ * @param deadline - CLOCK_MONOTONIC nanoseconds at which @param cb is run
+ *        with ready 0; UINT64_MAX for none
+ *
+ * @param cb - callback
+ *
+ * @param arg - passed to @param cb
+ *
+ * @param revents - what the last poll reported for @param fd
+ *
+ */
+typedef struct _tcp_watch_
+{
+    int      fd;
+    uint64_t deadline;
+    writecb  cb;
+    void *   arg;
+    short    revents;
+} _tcp_watch;
+
+/**
+ * binary min-heap of timers ordered by deadline
+ */
+static pthread_mutex_t _timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static _tcp_timer *    _timers     = NULL;
+static size_t          _ntimers    = 0;
+static size_t          _captimers  = 0;
+
+/**
+ * work parked with tcp_netpoll_writable, oldest first, guarded by
+ * _timer_lock; only the poller removes entries, so the ones it put in its
+ * poll array keep their place until it has read the results
+ */
+static _tcp_watch *_watches    = NULL;
+static size_t      _nwatches   = 0;
+static size_t      _capwatches = 0;
+
+/**
+ * per file descriptor, nonzero while SO_ZEROCOPY is on for the client
+ * socket using it; set once when the poller takes the socket in so a
+ * write never pays for the setsockopt, and cleared when it is closed
+ */
+static atomic_uchar _tcp_zcfd[NETPOLL_ZEROCOPY_FDS];
+
+/**
+ * eventfd polled next to the server socket so tcp_netpoll_wake can cut a
+ * poll short; -1 while no poller is running
+ */
+static atomic_int _tcp_wakefd = -1;
+
+/**
+ * tcp_netpoll_wake calls between loading _tcp_wakefd and writing to it;
+ * the poller clears the descriptor and waits for this to reach 0 before
+ * closing it, so a late wakeup never writes to a reused number
+ */
+static atomic_int _tcp_wakers = 0;
+
+/**
+ * client sockets given to tcp_netpoll_adopt, a handoff requested with
+ * tcp_netpoll_handoff and a drain requested with tcp_netpoll_drain; the
+ * poller takes them after it is woken; a drain stays set until the poller
+ * returns
+ */
+static pthread_mutex_t _adopt_lock  = PTHREAD_MUTEX_INITIALIZER;
+static int *           _adopted     = NULL;
+static int             _nadopted    = 0;
+static int             _capadopted  = 0;
+static handoffcb       _handoff_cb  = NULL;
+static void *          _handoff_arg = NULL;
+static uint64_t        _drain_by    = 0;
+static idlegate        _drain_idle  = NULL;
+static atomic_int      _tcp_pending = 0;
+
+static _Thread_local _netbuf_cache _netbuf_tcache;
+static pthread_key_t               _netbuf_key;
+static pthread_once_t              _netbuf_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief accepts up to NETPOLL_ACCEPT_BATCH waiting connections and
+ *        stores each socket file descriptor in a free slot; if there are
+ *        no free slots left then the connection is closed
+ *
+ * @param sockfd - server socket file descriptor
+ *
+ * @param slots - client slots of the poller
  *
  * @return number of newly connected clients
  *
  */
-static int _tcp_acceptconn(int sockfd, struct pollfd *pfds, int plen);
+static int _tcp_acceptconn(int sockfd, _tcp_slots *slots);
+
+/**
+ * @brief stores a connected client socket in a free slot
+ *
+ * @param slots - client slots of the poller
+ *
+ * @param fd - client socket
+ *
+ * @return slot used; -1 if every slot is taken
+ *
+ */
+static int _tcp_addslot(_tcp_slots *slots, int fd);
+
+/**
+ * @brief adds the sockets waiting in tcp_netpoll_adopt and runs a pending
+ *        handoff
+ *
+ * @param sockfd - server socket file descriptor
+ *
+ * @param slots - client slots of the poller
+ *
+ * @return 1 if the sockets were handed off and the poller should stop;
+ *         0 otherwise
+ *
+ */
+static int _tcp_pending_run(int sockfd, _tcp_slots *slots);
+
+/**
+ * @brief one step of draining: sends a FIN to every client the idle gate
+ *        reports idle and stops reading the others
+ *
+ * @param slots - client slots of the poller
+ *
+ * @return 1 if every client has hung up or the deadline has passed and
+ *         the poller should stop; 0 otherwise
+ *
+ */
+static int _tcp_drain_run(_tcp_slots *slots);
+
+/**
+ * @brief handles the events of one client slot; input is read before a
+ *        hangup releases the slot, so requests sent just ahead of the FIN
+ *        are not lost
+ *
+ * @param slots - client slots of the poller
+ *
+ * @param i - slot with events
+ *
+ * @param rh - revent handler given to tcp_netpoll
+ *
+ * @return nothing
+ *
+ */
+static void _tcp_clientevent(_tcp_slots *slots, int i, reventhandler rh);
+
+/**
+ * @brief gives a client socket to netpoll_closehandler, or closes it if
+ *        there is none, and puts its slot back on the free stack
+ *
+ * @param slots - client slots of the poller
+ *
+ * @param i - slot to release
+ *
+ * @param abort - passed to netpoll_closehandler
+ *
+ * @return nothing
+ *
+ */
+static void _tcp_releaseslot(_tcp_slots *slots, int i, int abort);
 
 /**
  * @brief closes the socket file descriptor and cleans the pfd struct of
@@ -51,404 +325,1887 @@ static int _tcp_closepfd(struct pollfd *pfd);
  */
 static int _tcp_shutdown(struct pollfd *pfds, int plen);
 
+/**
+ * @brief sets the poll events of the server socket and every client
+ *        socket from the admission gates before a poll
+ *
+ * @param pfds - pointer to poll file descriptor array
+ *
+ * @param nfds - number of entries in use
+ *
+ * @return nothing
+ *
+ */
+static void _tcp_applygates(struct pollfd *pfds, int nfds);
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds
+ *
+ */
+static uint64_t _tcp_now(void);
+
+/**
+ * @brief shortens a poll timeout so the poll returns by the earliest
+ *        timer or parked writer deadline
+ *
+ * @param timeout - poll(2) timeout in milliseconds; negative for none
+ *
+ * @return timeout to poll with
+ *
+ */
+static int _tcp_timer_timeout(int timeout);
+
+/**
+ * @brief runs every timer whose deadline has passed
+ *
+ * @param all - nonzero to run every timer queued at the time of the call
+ *        regardless of deadline; timers those callbacks add are left
+ *
+ * @return nothing
+ *
+ */
+static void _tcp_timer_run(int all);
+
+/**
+ * @brief adds the oldest parked writers to the poll array
+ *
+ * @param pfds - poll array entries after every client slot
+ *
+ * @param max - number of entries available at @param pfds
+ *
+ * @return number of entries filled in
+ *
+ */
+static int _tcp_watch_fill(struct pollfd *pfds, int max);
+
+/**
+ * @brief runs every parked writer whose socket was reported by the last
+ *        poll or whose deadline has passed
+ *
+ * @param pfds - entries filled in by _tcp_watch_fill
+ *
+ * @param nw - number of entries in @param pfds
+ *
+ * @param all - nonzero to run every parked writer with ready 0
+ *
+ * @return nothing
+ *
+ */
+static void _tcp_watch_run(struct pollfd *pfds, int nw, int all);
+
+/**
+ * @brief blocks until @param fd reports one of @param events, for at most
+ *        netpoll_iotimeout; used when a non-blocking socket returns EAGAIN
+ *        part way through a read or write
+ *
+ * @param fd - socket to wait on
+ *
+ * @param events - poll(2) events to wait for
+ *
+ * @return 0 on success; -1 on error, hangup or timeout, with errno set to
+ *         ETIMEDOUT for the last
+ *
+ */
+static int _tcp_wait(int fd, short events);
+
+/**
+ * @brief reads and clears the pending error of a socket
+ *
+ * @param fd - socket to check
+ *
+ * @return pending error; 0 if there is none
+ *
+ */
+static int _tcp_sockerr(int fd);
+
+/**
+ * @brief turns on SO_ZEROCOPY for a newly polled client socket if
+ *        netpoll_zcmin asks for zerocopy sends, and records the result in
+ *        _tcp_zcfd
+ *
+ * @param fd - socket to enable zerocopy sends on
+ *
+ * @return nothing
+ *
+ */
+static void _tcp_zc_enable(int fd);
+
+/**
+ * @brief tells whether MSG_ZEROCOPY may be used on a socket; the kernel
+ *        silently copies a MSG_ZEROCOPY send on a socket without
+ *        SO_ZEROCOPY and never queues a completion for it
+ *
+ * @param fd - socket to check
+ *
+ * @return nonzero if SO_ZEROCOPY is on for @param fd; 0 otherwise
+ *
+ */
+static int _tcp_zc_ready(int fd);
+
+/**
+ * @brief reads zerocopy completions from the socket error queue
+ *
+ * @param fd - socket the zerocopy sends were made on
+ *
+ * @param count - number of completions to wait for; 0 to only read the
+ *        ones already queued
+ *
+ * @return number of sends completed; -1 on error, with errno set to the
+ *         socket error if one was queued alongside the completions
+ *
+ */
+static int _tcp_zc_reap(int fd, uint count);
+
+/**
+ * @brief creates the key whose destructor hands a thread's cached
+ *        buffers back to the depot when the thread exits
+ *
+ * @return nothing
+ *
+ */
+static void _netbuf_keyinit(void);
+
+/**
+ * @brief sets the key to the calling thread's cache the first time the
+ *        thread acquires or releases a buffer, so its destructor runs
+ *
+ * @return nothing
+ *
+ */
+static void _netbuf_bind(_netbuf_cache *cache);
+
+/**
+ * @brief key destructor; moves every buffer in @param arg to the depot
+ *
+ * @param arg - exiting thread's cache
+ *
+ * @return nothing
+ *
+ */
+static void _netbuf_flush(void *arg);
+
+/**
+ * @brief pushes @param n buffers from a cache onto the depot of
+ *        @param cls under a single lock acquisition
+ *
+ * @return nothing
+ *
+ */
+static void _netbuf_spill(_netbuf **bufs, uint n, uint cls);
+
+/**
+ * @brief refills the calling thread's cache of @param cls with up to half
+ *        a cache of buffers, allocating from the heap when the depot is
+ *        empty
+ *
+ * @return 0 on success; -1 on error
+ *
+ */
+static int _netbuf_refill(_netbuf_cache *cache, uint cls);
+
+int
+tcp_wait_writable(int fd)
+{
+    return _tcp_wait(fd, POLLOUT);
+}
+
 int
 tcp_write_handler(int fd, char *buf, uint writelen)
 {
-    uint total_write = 0;
-    int  ret         = 0;
+    uint    total_write = 0;
+    uint    zcsent      = 0;
+    int     zcdone      = 0;
+    int     flags       = MSG_NOSIGNAL;
+    int     ret         = 0;
+    ssize_t wlen        = 0;
 
     if (NULL == buf)
     {
         fprintf(stderr, "! tcp_write_handler: NULL read buffer\n");
+        ret = -1;
         goto ERR;
     }
 
+    if (0 < netpoll_zcmin && netpoll_zcmin <= writelen && _tcp_zc_ready(fd))
+    {
+        flags |= MSG_ZEROCOPY;
+    }
+
     while (total_write < writelen)
     {
-        ret = write(fd, buf, writelen);
-        if (0 > ret)
+        wlen = send(fd, &buf[total_write], writelen - total_write, flags);
+        if (0 > wlen)
+        {
+            if (ENOTSOCK == errno)
+            {
+                wlen = write(fd, &buf[total_write], writelen - total_write);
+            }
+            else if (ENOBUFS == errno && (flags & MSG_ZEROCOPY))
+            {
+                // out of optmem for pinned pages; copy the rest instead
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+        }
+        if (0 > wlen)
         {
-            perror("error in _write_handler");
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+            {
+                // queued completions keep POLLERR raised, so they are
+                // read first or the wait below would return straight away
+                if (0 < zcsent)
+                {
+                    wlen = _tcp_zc_reap(fd, 0);
+                    if (0 > wlen)
+                    {
+                        ret = -1;
+                        goto ERR;
+                    }
+                    zcdone += wlen;
+                }
+                if (0 == _tcp_wait(fd, POLLOUT))
+                {
+                    continue;
+                }
+            }
+            log_perror("tcp_write_handler: write error");
             ret = -1;
             goto ERR;
         }
-        total_write += ret;
+        if (flags & MSG_ZEROCOPY)
+        {
+            zcsent++;
+        }
+        total_write += wlen;
     }
 
     ret = total_write;
 ERR:
+    metrics_add(METRIC_BYTES_OUT, total_write);
+    flight_mark(FLIGHT_SEND);
+    // the kernel still references buf until every zerocopy send has been
+    // completed, and the caller is free to reuse it once this returns
+    if ((int)zcsent > zcdone && 0 > _tcp_zc_reap(fd, zcsent - zcdone))
+    {
+        ret = -1;
+    }
     return ret;
 }
 
-int
-tcp_read_handler(int fd, void *buf, uint readlen)
+int64_t
+tcp_writev_handler(int fd, struct iovec *iov, int iovcnt)
 {
-    int  ret        = 0;
-    uint total_read = 0;
+    int64_t       total = 0;
+    ssize_t       wlen  = 0;
+    struct msghdr msg   = { 0 };
 
-    if (NULL == buf)
+    if (NULL == iov && 0 < iovcnt)
     {
-        fprintf(stderr, "! tcp_read_handler: NULL read buffer\n");
-        goto ERR;
+        fprintf(stderr, "! tcp_writev_handler: NULL iovec array\n");
+        return -1;
     }
 
-    while (total_read < readlen)
+    while (0 < iovcnt)
     {
-        ret = read(fd, &((char *)buf)[total_read], readlen - total_read);
-        if (0 > ret)
+        if (0 == iov->iov_len)
         {
-            perror("error in _read_handler");
-            ret = -1;
-            goto ERR;
+            iov++;
+            iovcnt--;
+            continue;
         }
 
-        total_read += ret;
-    }
-
-    ret = total_read;
-ERR:
-    return ret;
+        // sendmsg rather than writev so a closed peer is an EPIPE instead
+        // of a SIGPIPE
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = (IOV_MAX < iovcnt) ? IOV_MAX : iovcnt;
+        wlen           = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (0 > wlen && ENOTSOCK == errno)
+        {
+            wlen = writev(fd, iov, msg.msg_iovlen);
+        }
+        if (0 > wlen)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno || EWOULDBLOCK == errno)
+                && 0 == _tcp_wait(fd, POLLOUT))
+            {
+                continue;
+            }
+            log_perror("tcp_writev_handler: write error");
+            return -1;
+        }
+        total += wlen;
+        metrics_add(METRIC_BYTES_OUT, wlen);
+
+        while (0 < wlen)
+        {
+            if ((size_t)wlen < iov->iov_len)
+            {
+                iov->iov_base = (char *)iov->iov_base + wlen;
+                iov->iov_len -= wlen;
+                break;
+            }
+            wlen -= iov->iov_len;
+            iov->iov_len = 0;
+            iov++;
+            iovcnt--;
+        }
+    }
+    flight_mark(FLIGHT_SEND);
+
+    return total;
+}
+
+int
+tcp_read_handler(int fd, void *buf, uint readlen)
+{
+    int  ret        = 0;
+    uint total_read = 0;
+
+    if (NULL == buf)
+    {
+        fprintf(stderr, "! tcp_read_handler: NULL read buffer\n");
+        goto ERR;
+    }
+
+    while (total_read < readlen)
+    {
+        ret = read(fd, &((char *)buf)[total_read], readlen - total_read);
+        if (0 > ret && EINTR == errno)
+        {
+            continue;
+        }
+        // accepted sockets are non-blocking, so a message split across
+        // segments is waited for rather than failed
+        if (0 > ret && (EAGAIN == errno || EWOULDBLOCK == errno)
+            && 0 == _tcp_wait(fd, POLLIN))
+        {
+            continue;
+        }
+        if (0 == ret)
+        {
+            log_error("tcp_read_handler: peer closed connection");
+            ret = -1;
+            goto ERR;
+        }
+        if (0 > ret)
+        {
+            log_perror("tcp_read_handler: read error");
+            ret = -1;
+            goto ERR;
+        }
+
+        total_read += ret;
+    }
+
+    ret = total_read;
+ERR:
+    metrics_add(METRIC_BYTES_IN, total_read);
+    return ret;
 }
 
 int
 tcp_netpoll(int sockfd, reventhandler rh, int maxcon, int timeout)
 {
-    struct pollfd pfds[++maxcon]; // acounts for server socket in pfds
+    // server socket and wakeup eventfd, the client slots, then a parked
+    // writer for at most every client
+    struct pollfd pfds[2 * maxcon + 2];
+    int           holes[maxcon + 2];
+    uint8_t       shut[maxcon + 2];
+    int           plen    = maxcon + 2;
     int           pret    = 0;
-    int           nfds    = 1;
     int           ret     = 0;
     int           currfds = 0;
+    int           nw      = 0;
+    _tcp_slots    slots   = {
+        .pfds = pfds, .plen = plen, .nfds = 2, .holes = holes, .shut = shut
+    };
 
     if (NULL == rh)
     {
         fprintf(stderr, "! tcp_netpoll: NULL revent handler\n");
-        goto ERR;
+        close(sockfd);
+        return -1;
     }
 
     memset(pfds, 0, sizeof(pfds));
+    memset(shut, 0, sizeof(shut));
+    for (int i = 0; i < plen; i++)
+    {
+        // poll skips negative descriptors, so unused slots are never
+        // mistaken for fd 0
+        pfds[i].fd = -1;
+    }
     pfds[0].fd     = sockfd;
     pfds[0].events = POLLIN;
+    pfds[1].fd     = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pfds[1].events = POLLIN;
+    if (0 > pfds[1].fd)
+    {
+        perror("! tcp_netpoll: couldn't create wakeup eventfd");
+        pfds[1].fd = -1;
+        ret        = -1;
+        goto ERR;
+    }
+    atomic_store(&_tcp_wakefd, pfds[1].fd);
 
+    // sockets adopted before the poller started were never woken for
+    atomic_store(&_tcp_pending, 1);
+    pthread_mutex_lock(&_timer_lock);
     netpoll_keepalive = 1;
+    pthread_mutex_unlock(&_timer_lock);
     while (netpoll_keepalive)
     {
-#ifndef NDEBUG
-        fprintf(stderr, "[*] polling...\n");
-#endif // NDEBUG
+        log_debug("tcp_netpoll: polling %d slots", slots.nfds);
 
-        pret = poll(pfds, nfds, timeout);
+        // a draining poller reads no client and has no listener left, so
+        // the gates have nothing to decide; it wakes often enough to see
+        // clients finish without every finished request waking it
+        if (0 == slots.drainby)
+        {
+            _tcp_applygates(pfds, slots.nfds);
+        }
+        // parked writers go after every slot so a slot taken or closed
+        // below never sees their descriptors; unused slots are -1 and
+        // skipped by poll
+        nw   = _tcp_watch_fill(&pfds[plen], maxcon);
+        pret = poll(pfds,
+                    (0 < nw) ? plen + nw : slots.nfds,
+                    _tcp_timer_timeout(slots.drainby ? NETPOLL_DRAIN_POLL_MS
+                                                     : timeout));
 
         if (EINTR == errno)
         {
-            perror("! tcp_netpoll: poll interrupted, closing poller...\n");
+            log_info("tcp_netpoll: poll interrupted, closing poller");
             ret = 0;
             goto ERR;
         }
 
         if (0 > pret)
         {
-            perror("! tcp_netpoll: poll error\n");
+            log_perror("tcp_netpoll: poll error");
             ret = -1;
             goto ERR;
         }
 
-#ifndef NDEBUG
-        if (0 == pret)
-        {
-            fprintf(stderr, "[*] poll timed out\n");
-        }
-#endif // NDEBUG
+        if (0 == pret)
+        {
+            log_debug("tcp_netpoll: poll timed out");
+        }
+
+        _tcp_timer_run(0);
+        _tcp_watch_run(&pfds[plen], nw, 0);
+        if (atomic_load(&_tcp_pending) && _tcp_pending_run(sockfd, &slots))
+        {
+            ret = 0;
+            goto ERR;
+        }
+        if (0 != slots.drainby && _tcp_drain_run(&slots))
+        {
+            ret = 0;
+            goto ERR;
+        }
+        currfds = slots.nfds;
+
+        for (int i = 0; i < currfds; i++)
+        {
+            if (0 == pfds[i].revents)
+            {
+                continue;
+            }
+            // by slot rather than descriptor; once draining has closed the
+            // listener its number can be reused
+            if (0 == i)
+            {
+                if (pfds[i].revents & (POLLERR | POLLNVAL))
+                {
+                    log_error("tcp_netpoll: error with server socket, "
+                              "shutting down");
+                    goto ERR;
+                }
+                _tcp_acceptconn(pfds[i].fd, &slots);
+            }
+            else if (1 == i)
+            {
+                eventfd_t v = 0;
+
+                eventfd_read(pfds[i].fd, &v);
+            }
+            else
+            {
+                _tcp_clientevent(&slots, i, rh);
+            }
+        }
+    }
+
+ERR:
+    // under the timer lock so no timer can be parked after the last run
+    // below; tcp_netpoll_timer refuses work once this is clear
+    pthread_mutex_lock(&_timer_lock);
+    netpoll_keepalive = 0;
+    pthread_mutex_unlock(&_timer_lock);
+    atomic_store(&_tcp_wakefd, -1);
+    while (0 < atomic_load(&_tcp_wakers))
+    {
+        sched_yield();
+    }
+    pthread_mutex_lock(&_adopt_lock);
+    _drain_by   = 0;
+    _drain_idle = NULL;
+    pthread_mutex_unlock(&_adopt_lock);
+    _tcp_timer_run(1);
+    _tcp_watch_run(NULL, 0, 1);
+    for (int i = 2; i < slots.nfds; i++)
+    {
+        if (0 <= pfds[i].fd)
+        {
+            _tcp_releaseslot(&slots, i, 1);
+        }
+    }
+    _tcp_shutdown(pfds, plen);
+    return ret;
+}
+
+void
+tcp_netpoll_wake(void)
+{
+    int fd = -1;
+
+    // counted before the load so the poller either sees this call or this
+    // call sees the descriptor cleared
+    atomic_fetch_add(&_tcp_wakers, 1);
+    fd = atomic_load(&_tcp_wakefd);
+    if (0 <= fd)
+    {
+        eventfd_write(fd, 1);
+    }
+    atomic_fetch_sub(&_tcp_wakers, 1);
+}
+
+int
+tcp_netpoll_handoff(handoffcb cb, void *arg)
+{
+    int ret = -1;
+
+    if (NULL == cb)
+    {
+        fprintf(stderr, "! tcp_netpoll_handoff: NULL callback\n");
+        return -1;
+    }
+
+    // a draining poller has closed its listener and has nothing to hand
+    pthread_mutex_lock(&_adopt_lock);
+    if (0 <= atomic_load(&_tcp_wakefd) && NULL == _handoff_cb
+        && 0 == _drain_by)
+    {
+        _handoff_cb  = cb;
+        _handoff_arg = arg;
+        ret          = 0;
+    }
+    pthread_mutex_unlock(&_adopt_lock);
+
+    if (0 == ret)
+    {
+        atomic_store(&_tcp_pending, 1);
+        tcp_netpoll_wake();
+    }
+    return ret;
+}
+
+int
+tcp_netpoll_drain(uint64_t timeout_ns, idlegate idle)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&_adopt_lock);
+    if (0 <= atomic_load(&_tcp_wakefd) && NULL == _handoff_cb
+        && 0 == _drain_by)
+    {
+        _drain_by   = _tcp_now() + timeout_ns;
+        _drain_idle = idle;
+        ret         = 0;
+    }
+    pthread_mutex_unlock(&_adopt_lock);
+
+    if (0 == ret)
+    {
+        atomic_store(&_tcp_pending, 1);
+        tcp_netpoll_wake();
+    }
+    return ret;
+}
+
+int
+tcp_netpoll_adopt(int fd)
+{
+    int  ret = -1;
+    int *tmp = NULL;
+
+    if (0 > fd || 0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK))
+    {
+        fprintf(stderr, "! tcp_netpoll_adopt: invalid socket\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&_adopt_lock);
+    if (_nadopted == _capadopted)
+    {
+        tmp = realloc(_adopted,
+                      (_capadopted ? _capadopted * 2 : 64) * sizeof(int));
+        if (NULL == tmp)
+        {
+            fprintf(stderr, "! tcp_netpoll_adopt: couldn't grow queue\n");
+            goto ERR;
+        }
+        _adopted    = tmp;
+        _capadopted = _capadopted ? _capadopted * 2 : 64;
+    }
+    _adopted[_nadopted++] = fd;
+    ret                   = 0;
+
+ERR:
+    pthread_mutex_unlock(&_adopt_lock);
+    if (0 == ret)
+    {
+        atomic_store(&_tcp_pending, 1);
+        tcp_netpoll_wake();
+    }
+    return ret;
+}
+
+int
+tcp_netpoll_timer(uint64_t delay_ns, timercb cb, void *arg)
+{
+    int         ret = -1;
+    size_t      i   = 0;
+    _tcp_timer  t   = { 0 };
+    _tcp_timer *tmp = NULL;
+
+    if (NULL == cb)
+    {
+        fprintf(stderr, "! tcp_netpoll_timer: NULL callback\n");
+        return -1;
+    }
+    t.deadline = _tcp_now() + delay_ns;
+    t.cb       = cb;
+    t.arg      = arg;
+
+    pthread_mutex_lock(&_timer_lock);
+    if (!netpoll_keepalive)
+    {
+        // the poller has stopped, or never started, and would never run it
+        goto ERR;
+    }
+    if (_ntimers == _captimers)
+    {
+        tmp = realloc(_timers,
+                      (_captimers ? _captimers * 2 : 64) * sizeof(_tcp_timer));
+        if (NULL == tmp)
+        {
+            fprintf(stderr, "! tcp_netpoll_timer: couldn't grow heap\n");
+            goto ERR;
+        }
+        _timers    = tmp;
+        _captimers = _captimers ? _captimers * 2 : 64;
+    }
+
+    // sift up
+    for (i = _ntimers++; 0 < i && _timers[(i - 1) / 2].deadline > t.deadline;
+         i = (i - 1) / 2)
+    {
+        _timers[i] = _timers[(i - 1) / 2];
+    }
+    _timers[i] = t;
+    ret        = 0;
+
+ERR:
+    pthread_mutex_unlock(&_timer_lock);
+    // a new earliest deadline has to shorten the poll already in progress
+    if (0 == ret && 0 == i)
+    {
+        tcp_netpoll_wake();
+    }
+    return ret;
+}
+
+int
+tcp_netpoll_writable(int fd, writecb cb, void *arg)
+{
+    int         ret      = -1;
+    uint64_t    deadline = UINT64_MAX;
+    _tcp_watch *tmp      = NULL;
+
+    if (NULL == cb)
+    {
+        fprintf(stderr, "! tcp_netpoll_writable: NULL callback\n");
+        return -1;
+    }
+    if (0 <= netpoll_iotimeout)
+    {
+        deadline = _tcp_now() + (uint64_t)netpoll_iotimeout * 1000000;
+    }
+
+    pthread_mutex_lock(&_timer_lock);
+    if (!netpoll_keepalive)
+    {
+        goto ERR;
+    }
+    if (_nwatches == _capwatches)
+    {
+        tmp = realloc(_watches,
+                      (_capwatches ? _capwatches * 2 : 64)
+                          * sizeof(_tcp_watch));
+        if (NULL == tmp)
+        {
+            fprintf(stderr, "! tcp_netpoll_writable: couldn't grow list\n");
+            goto ERR;
+        }
+        _watches    = tmp;
+        _capwatches = _capwatches ? _capwatches * 2 : 64;
+    }
+
+    _watches[_nwatches].fd       = fd;
+    _watches[_nwatches].deadline = deadline;
+    _watches[_nwatches].cb       = cb;
+    _watches[_nwatches].arg      = arg;
+    _watches[_nwatches].revents  = 0;
+    _nwatches++;
+    ret = 0;
+
+ERR:
+    pthread_mutex_unlock(&_timer_lock);
+    // the socket has to be added to the poll already in progress
+    if (0 == ret)
+    {
+        tcp_netpoll_wake();
+    }
+    return ret;
+}
+
+void
+tcp_printsockaddr(struct sockaddr_storage *in)
+{
+    char     addr[INET6_ADDRSTRLEN];
+    uint16_t port;
+
+    if (NULL == in)
+    {
+        fprintf(stderr, "! tcp_printsockaddr: NULL sockaddr struct\n");
+        goto ERR;
+    }
+
+    switch (in->ss_family)
+    {
+
+        case AF_INET:
+            inet_ntop(in->ss_family,
+                      &((struct sockaddr_in *)in)->sin_addr,
+                      addr,
+                      sizeof(addr));
+            port = ntohs(((struct sockaddr_in *)in)->sin_port);
+            break;
+
+        case AF_INET6:
+            inet_ntop(in->ss_family,
+                      &((struct sockaddr_in6 *)in)->sin6_addr,
+                      addr,
+                      sizeof(addr));
+            port = ntohs(((struct sockaddr_in6 *)in)->sin6_port);
+            break;
+    }
+    fprintf(stderr,
+            "[*] saddr = family:%d (2=AF_INET, 10=AF_INET6)\n\t%s:%d\n",
+            in->ss_family,
+            addr,
+            port);
+
+ERR:
+    return;
+}
+
+int
+tcp_peername(int fd, char *buf, size_t len)
+{
+    int                     ret      = -1;
+    struct sockaddr_storage peer     = { 0 };
+    socklen_t               peer_len = sizeof(peer);
+    char                    addr[INET6_ADDRSTRLEN];
+
+    if (NULL == buf)
+    {
+        fprintf(stderr, "! tcp_peername: NULL buffer\n");
+        goto ERR;
+    }
+
+    if (0 != getpeername(fd, (struct sockaddr *)&peer, &peer_len))
+    {
+        goto ERR;
+    }
+
+    switch (peer.ss_family)
+    {
+        case AF_INET:
+            inet_ntop(AF_INET,
+                      &((struct sockaddr_in *)&peer)->sin_addr,
+                      addr,
+                      sizeof(addr));
+            ret = snprintf(buf,
+                           len,
+                           "%s:%hu",
+                           addr,
+                           ntohs(((struct sockaddr_in *)&peer)->sin_port));
+            break;
+        case AF_INET6:
+            inet_ntop(AF_INET6,
+                      &((struct sockaddr_in6 *)&peer)->sin6_addr,
+                      addr,
+                      sizeof(addr));
+            ret = snprintf(buf,
+                           len,
+                           "[%s]:%hu",
+                           addr,
+                           ntohs(((struct sockaddr_in6 *)&peer)->sin6_port));
+            break;
+        default:
+            goto ERR;
+    }
+    ret = (0 < ret && (size_t)ret < len) ? 0 : -1;
+
+ERR:
+    return ret;
+}
+
+int
+tcp_listenopts(int sockfd, int defer, int fastopen)
+{
+    int ret = 0;
+    int err = 0;
+
+    if (0 < defer)
+    {
+        err = setsockopt(
+            sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+        if (0 != err)
+        {
+            perror("! tcp_listenopts: couldn't set TCP_DEFER_ACCEPT");
+            ret = -1;
+        }
+    }
+
+    if (0 < fastopen)
+    {
+        err = setsockopt(
+            sockfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen));
+        if (0 != err)
+        {
+            perror("! tcp_listenopts: couldn't set TCP_FASTOPEN");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int
+tcp_socketsetup(uint16_t port, int ipDomain, int maxpend)
+{
+
+#ifndef NDEBUG
+    fprintf(stderr, "[*] converse_tcp listening on %i:%hu\n", ipDomain, port);
+#endif // NDEBUG
+
+    char             p[6] = { 0 };
+    int              err  = 0;
+    struct addrinfo  hints;
+    struct addrinfo *res    = NULL;
+    int              sockfd = 0;
+    int              ret    = 0;
+
+    snprintf(p, sizeof(p), "%i", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = ipDomain;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    err               = getaddrinfo(NULL, p, &hints, &res);
+    if (0 != err)
+    {
+        perror("! tcp_socketsetup: getaddrinfo error");
+        sockfd = -1;
+        goto ERR;
+    }
+
+    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (0 > sockfd)
+    {
+        perror("! tcp_socketsetup: socket error");
+        sockfd = -1;
+        goto ERR;
+    }
+
+    // set sockopt - this is so we can restart the server immediately
+    // after killing it
+
+    int optval = 1;
+    err = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (0 != err)
+    {
+        perror("! tcp_socketsetup: setsockopt error");
+        sockfd = -1;
+        goto ERR;
+    }
+
+    int flags = 0;
+
+    flags = fcntl(sockfd, F_GETFL, 0);
+    err   = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    if (0 > err)
+    {
+        perror("! tcp_socketsetup: fcntl error");
+        sockfd = -1;
+        goto ERR;
+    }
+
+    err = bind(sockfd, res->ai_addr, res->ai_addrlen);
+    if (0 != err)
+    {
+        perror("! tcp_socketsetup: bind error");
+        sockfd = -1;
+        goto ERR;
+    }
+
+    err = listen(sockfd, maxpend);
+    if (0 != err)
+    {
+        perror("! tcp_socketsetup: listen error");
+        sockfd = -1;
+        goto ERR;
+    }
+
+    ret    = sockfd;
+    sockfd = -1;
+ERR:
+    freeaddrinfo(res);
+    res = NULL;
+    err = close(sockfd);
+    if (0 > err && EBADF != errno)
+    {
+        perror("! tcp_socketsetup: couldn't close server socket after error");
+    }
+    return ret;
+}
+
+void *
+netbuf_acquire(size_t len)
+{
+    _netbuf_cache *cache = &_netbuf_tcache;
+    _netbuf *      nb    = NULL;
+    uint           cls   = 0;
+
+    while (NETBUF_NCLASS > cls && _netbuf_len[cls] < len)
+    {
+        cls++;
+    }
+    if (NETBUF_NCLASS == cls)
+    {
+        fprintf(stderr, "! netbuf_acquire: %zu bytes is too big\n", len);
+        return NULL;
+    }
+
+    if (0 == cache->nbufs[cls] && 0 != _netbuf_refill(cache, cls))
+    {
+        return NULL;
+    }
+    nb = cache->bufs[cls][--cache->nbufs[cls]];
+
+    return &nb[1];
+}
+
+void
+netbuf_release(void *buf)
+{
+    _netbuf_cache *cache = &_netbuf_tcache;
+    _netbuf *      nb    = NULL;
+    uint           cls   = 0;
+
+    if (NULL == buf)
+    {
+        return;
+    }
+    nb  = &((_netbuf *)buf)[-1];
+    cls = nb->cls;
+    if (!cache->keyed)
+    {
+        _netbuf_bind(cache);
+    }
+
+    // a full cache gives half back so a thread that only releases, like
+    // the one finishing sends for workers, doesn't hoard buffers
+    if (NETBUF_CACHE == cache->nbufs[cls])
+    {
+        cache->nbufs[cls] -= NETBUF_CACHE / 2;
+        _netbuf_spill(
+            &cache->bufs[cls][cache->nbufs[cls]], NETBUF_CACHE / 2, cls);
+    }
+    cache->bufs[cls][cache->nbufs[cls]++] = nb;
+
+    return;
+}
+
+size_t
+netbuf_size(const void *buf)
+{
+    return _netbuf_len[((const _netbuf *)buf)[-1].cls];
+}
+
+int
+netbuf_index(const void *buf)
+{
+    return ((const _netbuf *)buf)[-1].index;
+}
+
+int
+netbuf_register(int ringfd, uint count)
+{
+    int ret = -1;
+#ifdef SYS_io_uring_register
+    const size_t  stride = sizeof(_netbuf) + NETBUF_CHUNK_LEN;
+    struct iovec *iov    = NULL;
+    uint8_t *     slab   = MAP_FAILED;
+    _netbuf *     nb     = NULL;
+    int           err    = 0;
+
+    if (0 == count)
+    {
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    iov = calloc(count, sizeof(*iov));
+    if (NULL == iov)
+    {
+        fprintf(stderr, "! netbuf_register: couldn't calloc iovecs\n");
+        goto ERR;
+    }
+
+    slab = mmap(NULL,
+                stride * count,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0);
+    if (MAP_FAILED == slab)
+    {
+        perror("! netbuf_register: couldn't map buffers");
+        goto ERR;
+    }
+
+    for (uint i = 0; i < count; i++)
+    {
+        nb              = (_netbuf *)&slab[i * stride];
+        nb->cls         = NETBUF_NCLASS - 1;
+        nb->index       = i;
+        iov[i].iov_base = &nb[1];
+        iov[i].iov_len  = NETBUF_CHUNK_LEN;
+    }
+
+    if (0
+        != syscall(SYS_io_uring_register,
+                   ringfd,
+                   IORING_REGISTER_BUFFERS,
+                   iov,
+                   count))
+    {
+        perror("! netbuf_register: couldn't register buffers");
+        goto ERR;
+    }
+
+    // the mapping lives as long as the ring may use it, i.e. until exit
+    pthread_mutex_lock(&_netbuf_lock[NETBUF_NCLASS - 1]);
+    for (uint i = 0; i < count; i++)
+    {
+        nb                               = (_netbuf *)&slab[i * stride];
+        nb->next                         = _netbuf_depot[NETBUF_NCLASS - 1];
+        _netbuf_depot[NETBUF_NCLASS - 1] = nb;
+    }
+    pthread_mutex_unlock(&_netbuf_lock[NETBUF_NCLASS - 1]);
+    slab = MAP_FAILED;
+    ret  = 0;
+
+ERR:
+    err = errno;
+    if (MAP_FAILED != slab)
+    {
+        munmap(slab, stride * count);
+    }
+    free(iov);
+    iov   = NULL;
+    errno = err;
+#else
+    (void)ringfd;
+    (void)count;
+    errno = ENOSYS;
+#endif // SYS_io_uring_register
+    return ret;
+}
+
+void
+netbuf_reclaim(void)
+{
+    _netbuf *keep = NULL;
+    _netbuf *nb   = NULL;
+    _netbuf *next = NULL;
+
+    for (uint cls = 0; cls < NETBUF_NCLASS; cls++)
+    {
+        pthread_mutex_lock(&_netbuf_lock[cls]);
+        keep = NULL;
+        for (nb = _netbuf_depot[cls]; NULL != nb; nb = next)
+        {
+            next = nb->next;
+            if (0 <= nb->index)
+            {
+                nb->next = keep;
+                keep     = nb;
+                continue;
+            }
+            free(nb);
+        }
+        _netbuf_depot[cls] = keep;
+        pthread_mutex_unlock(&_netbuf_lock[cls]);
+    }
+
+    return;
+}
+
+static int
+_tcp_closepfd(struct pollfd *pfd)
+{
+    int ret = 0;
+
+    if (NULL == pfd)
+    {
+        fprintf(stderr, "! _tcp_closepfd: NULL pfd pointer\n");
+        goto ERR;
+    }
+
+    if (0 <= pfd->fd && NETPOLL_ZEROCOPY_FDS > pfd->fd)
+    {
+        atomic_store_explicit(&_tcp_zcfd[pfd->fd], 0, memory_order_relaxed);
+    }
+    ret = close(pfd->fd);
+    if (0 != ret)
+    {
+        log_perror("_tcp_closepfd: error closing file descriptor");
+        goto ERR;
+    }
+    memset(pfd, 0, sizeof(struct pollfd));
+    pfd->fd = -1;
+
+ERR:
+    return ret;
+}
+
+static int
+_tcp_acceptconn(int sockfd, _tcp_slots *slots)
+{
+    int  ret   = 0;
+    int  confd = -1;
+    int  i     = 0;
+    char peer[INET6_ADDRSTRLEN + 8];
+
+    if (NULL == slots)
+    {
+        fprintf(stderr, "! _tcp_acceptconn: NULL slots\n");
+        goto RET;
+    }
+
+    // bounded so a reconnect storm cannot starve the clients already
+    // connected; the listener is still readable on the next poll
+    while (NETPOLL_ACCEPT_BATCH > ret)
+    {
+        // the peer address is not copied out here; whoever logs it looks
+        // it up with tcp_peername
+        confd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (0 > confd)
+        {
+            if (EINTR == errno || ECONNABORTED == errno)
+            {
+                continue;
+            }
+            if (EWOULDBLOCK != errno && EAGAIN != errno)
+            {
+                log_perror("_tcp_acceptconn: accept error");
+            }
+            // if EWOULDBLOCK or EAGAIN there are no more connections to
+            // accept
+            goto RET;
+        }
+
+        i = _tcp_addslot(slots, confd);
+        if (0 > i)
+        {
+            atomic_fetch_add(&netpoll_stat.nrejected, 1);
+            close(confd);
+            goto RET;
+        }
+        ret++;
+        metrics_add(METRIC_CONNS_ACCEPTED, 1);
+        trace_accept(confd);
+
+        // the address lookup is a system call, so it is skipped unless
+        // the record would actually be kept
+        if (LOG_LEVEL <= LOG_LVL_DEBUG
+            && LOG_LVL_DEBUG >= atomic_load(&log_level)
+            && 0 == tcp_peername(confd, peer, sizeof(peer)))
+        {
+            log_debug("_tcp_acceptconn: connection from %s", peer);
+        }
+    }
+
+RET:
+    return ret;
+}
+
+static int
+_tcp_addslot(_tcp_slots *slots, int fd)
+{
+    int i = -1;
+
+    if (0 < slots->nholes)
+    {
+        i = slots->holes[--slots->nholes];
+    }
+    else if (slots->plen > slots->nfds)
+    {
+        i = slots->nfds++;
+    }
+    else
+    {
+        return -1;
+    }
+
+    slots->pfds[i].fd      = fd;
+    slots->pfds[i].events  = POLLIN | POLLRDHUP;
+    slots->pfds[i].revents = 0;
+    slots->shut[i]         = 0;
+    _tcp_zc_enable(fd);
+    return i;
+}
+
+static int
+_tcp_pending_run(int sockfd, _tcp_slots *slots)
+{
+    int *     adopted  = NULL;
+    int       nadopted = 0;
+    int       nfds     = 0;
+    handoffcb cb       = NULL;
+    void *    arg      = NULL;
+    uint64_t  drainby  = 0;
+    idlegate  idle     = NULL;
+    int       fds[slots->plen];
+
+    atomic_store(&_tcp_pending, 0);
+    pthread_mutex_lock(&_adopt_lock);
+    adopted      = _adopted;
+    nadopted     = _nadopted;
+    cb           = _handoff_cb;
+    arg          = _handoff_arg;
+    _adopted     = NULL;
+    _nadopted    = 0;
+    _capadopted  = 0;
+    _handoff_cb  = NULL;
+    _handoff_arg = NULL;
+    drainby      = _drain_by;
+    idle         = _drain_idle;
+    pthread_mutex_unlock(&_adopt_lock);
+
+    for (int i = 0; i < nadopted; i++)
+    {
+        if (0 > _tcp_addslot(slots, adopted[i]))
+        {
+            atomic_fetch_add(&netpoll_stat.nrejected, 1);
+            close(adopted[i]);
+            continue;
+        }
+        metrics_add(METRIC_CONNS_ACCEPTED, 1);
+        trace_accept(adopted[i]);
+    }
+    free(adopted);
+
+    if (0 != drainby && 0 == slots->drainby)
+    {
+        // closed rather than left unpolled, so a load balancer sees new
+        // connections refused instead of waiting in the backlog; the slot
+        // is emptied so the shutdown at the end never closes the number
+        // again
+        slots->drainby = drainby;
+        slots->idle    = idle;
+        if (0 <= slots->pfds[0].fd)
+        {
+            _tcp_closepfd(&slots->pfds[0]);
+        }
+        log_info("tcp_netpoll: draining %d slots", slots->nfds - 2);
+    }
+
+    if (NULL == cb)
+    {
+        return 0;
+    }
+
+    // the slots are emptied without closing, so the shutdown that follows
+    // leaves the sockets to the callback
+    for (int i = 2; i < slots->nfds; i++)
+    {
+        if (0 <= slots->pfds[i].fd)
+        {
+            fds[nfds++]       = slots->pfds[i].fd;
+            slots->pfds[i].fd = -1;
+            metrics_add(METRIC_CONNS_CLOSED, 1);
+        }
+    }
+    slots->pfds[0].fd = -1;
+    log_info("tcp_netpoll: handing off listener and %d clients", nfds);
+    cb(sockfd, fds, nfds, arg);
+
+    return 1;
+}
+
+static int
+_tcp_drain_run(_tcp_slots *slots)
+{
+    int nopen = 0;
+    int nbusy = 0;
+    int fd    = -1;
+
+    for (int i = 2; i < slots->nfds; i++)
+    {
+        fd = slots->pfds[i].fd;
+        if (0 > fd)
+        {
+            continue;
+        }
+        // only hangups are polled for, so nothing more is read
+        slots->pfds[i].events = POLLRDHUP;
+        nopen++;
+        if (slots->shut[i])
+        {
+            continue;
+        }
+        if (NULL != slots->idle && !slots->idle(fd))
+        {
+            nbusy++;
+            continue;
+        }
+
+        // a FIN instead of a close, which resets the connection if the
+        // client sent requests that were never read and can take the tail
+        // of the last response down with it; the slot is released once the
+        // client hangs up in turn
+        shutdown(fd, SHUT_WR);
+        slots->shut[i] = 1;
+    }
+
+    if (0 == nopen)
+    {
+        log_info("tcp_netpoll: drained");
+        return 1;
+    }
+    if (_tcp_now() >= slots->drainby)
+    {
+        log_warn("tcp_netpoll: drain deadline passed, closing %d clients "
+                 "(%d busy)",
+                 nopen,
+                 nbusy);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+_tcp_clientevent(_tcp_slots *slots, int i, reventhandler rh)
+{
+    struct pollfd *pfd = &slots->pfds[i];
+    short          rev = pfd->revents;
+
+    // a POLLERR without a pending error only means MSG_ZEROCOPY
+    // completions the writing thread has yet to read from the error queue
+    if ((rev & POLLNVAL) || ((rev & POLLERR) && 0 != _tcp_sockerr(pfd->fd)))
+    {
+        log_warn("tcp_netpoll: error with socket %i", pfd->fd);
+        _tcp_releaseslot(slots, i, 1);
+        return;
+    }
+
+    if (rev & POLLIN)
+    {
+        log_debug("tcp_netpoll: data from client %d", pfd->fd);
+        rh(pfd->fd);
+    }
+
+    // hung up, while paused by the read gate, or after a drain's FIN; input
+    // a paused client left unread is the close handler's to read
+    if (rev & (POLLRDHUP | POLLHUP))
+    {
+        log_debug("tcp_netpoll: client %i ended connection", pfd->fd);
+        _tcp_releaseslot(slots, i, 0);
+    }
+}
+
+static void
+_tcp_releaseslot(_tcp_slots *slots, int i, int abort)
+{
+    int fd = slots->pfds[i].fd;
+
+    trace_conn_close(fd);
+    metrics_add(METRIC_CONNS_CLOSED, 1);
+    if (NULL != netpoll_closehandler)
+    {
+        memset(&slots->pfds[i], 0, sizeof(struct pollfd));
+        slots->pfds[i].fd = -1;
+        netpoll_closehandler(fd, abort);
+    }
+    else
+    {
+        _tcp_closepfd(&slots->pfds[i]);
+    }
+    slots->holes[slots->nholes++] = i;
+}
+
+static int
+_tcp_shutdown(struct pollfd *pfds, int plen)
+{
+    int ret = 0;
+
+    log_info("_tcp_shutdown: shutting down poller");
 
-        currfds = nfds;
+    if (NULL == pfds)
+    {
+        fprintf(stderr, "! _tcp_shutdown: NULL pfds array\n");
+        goto ERR;
+    }
 
-        for (int i = 0; i < currfds; i++)
+    for (int i = 0; i < plen; i++)
+    {
+        if (0 <= pfds[i].fd)
         {
-            switch (pfds[i].revents)
-            {
-                case POLLIN:
-                    if (sockfd == pfds[i].fd)
-                    {
-                        printf("[*] received connection\n");
-                        nfds += _tcp_acceptconn(pfds[i].fd, pfds, maxcon);
-                    }
-                    else
-                    {
-#ifndef NDEBUG
-                        printf("[*] data received from client\n");
-#endif // NDEBUG
-                        rh(pfds[i].fd);
-                    }
-                    break;
-                case POLLERR:
-                    if (sockfd == pfds[i].fd)
-                    {
-                        fprintf(stderr,
-                                "! tcp_netpoll: error with server socket, "
-                                "shutting down\n");
-                        goto ERR;
-                    }
-                    else
-                    {
-                        fprintf(stderr,
-                                "! tcp_netpoll: error with socket %i\n",
-                                pfds[i].fd);
-                        _tcp_closepfd(&pfds[i]);
-                        nfds--;
-                    }
-                    break;
-                case POLLRDHUP | POLLIN:
-                    printf("[*] Client %i ended connection\n", pfds[i].fd);
-                    _tcp_closepfd(&pfds[i]);
-                    nfds--;
-                    break;
-                case 0: // caused by poll timeout
-                    break;
-                default:
-                    fprintf(stderr,
-                            "! tcp_netpoll: unexecpected event = %i\n",
-                            pfds[i].revents);
-            } // switch
-        }     // while
+            _tcp_closepfd(&pfds[i]);
+        }
     }
 
 ERR:
-    _tcp_shutdown(pfds, maxcon);
     return ret;
 }
 
-void
-tcp_printsockaddr(struct sockaddr_storage *in)
+static void
+_tcp_applygates(struct pollfd *pfds, int nfds)
 {
-    char     addr[INET6_ADDRSTRLEN];
-    uint16_t port;
+    short events = 0;
 
-    if (NULL == in)
+    if (NULL != netpoll_acceptgate)
     {
-        fprintf(stderr, "! tcp_printsockaddr: NULL sockaddr struct\n");
-        goto ERR;
+        events = netpoll_acceptgate() ? POLLIN : 0;
+        if (0 == events && 0 != pfds[0].events)
+        {
+            atomic_fetch_add(&netpoll_stat.nacceptpaused, 1);
+        }
+        pfds[0].events = events;
     }
 
-    switch (in->ss_family)
+    for (int i = 2; NULL != netpoll_readgate && i < nfds; i++)
     {
-
-        case AF_INET:
-            inet_ntop(in->ss_family,
-                      &((struct sockaddr_in *)in)->sin_addr,
-                      addr,
-                      sizeof(addr));
-            port = ntohs(((struct sockaddr_in *)in)->sin_port);
-            break;
-
-        case AF_INET6:
-            inet_ntop(in->ss_family,
-                      &((struct sockaddr_in6 *)in)->sin6_addr,
-                      addr,
-                      sizeof(addr));
-            port = ntohs(((struct sockaddr_in6 *)in)->sin6_port);
-            break;
+        if (0 > pfds[i].fd)
+        {
+            continue;
+        }
+        // POLLRDHUP stays on so a paused client hanging up is still seen
+        events = POLLRDHUP | (netpoll_readgate(pfds[i].fd) ? POLLIN : 0);
+        if (!(events & POLLIN) && (pfds[i].events & POLLIN))
+        {
+            atomic_fetch_add(&netpoll_stat.nreadpaused, 1);
+        }
+        pfds[i].events = events;
     }
-    fprintf(stderr,
-            "[*] saddr = family:%d (2=AF_INET, 10=AF_INET6)\n\t%s:%d\n",
-            in->ss_family,
-            addr,
-            port);
-
-ERR:
-    return;
 }
 
-int
-tcp_socketsetup(uint16_t port, int ipDomain, int maxpend)
+static uint64_t
+_tcp_now(void)
 {
+    struct timespec ts = { 0 };
 
-#ifndef NDEBUG
-    fprintf(stderr, "[*] converse_tcp listening on %i:%hu\n", ipDomain, port);
-#endif // NDEBUG
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    char             p[6] = { 0 };
-    int              err  = 0;
-    struct addrinfo  hints;
-    struct addrinfo *res    = NULL;
-    int              sockfd = 0;
-    int              ret    = 0;
+static int
+_tcp_timer_timeout(int timeout)
+{
+    uint64_t now = 0;
+    uint64_t ms  = 0;
 
-    snprintf(p, sizeof(p), "%i", port);
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = ipDomain;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags    = AI_PASSIVE;
-    err               = getaddrinfo(NULL, p, &hints, &res);
-    if (0 != err)
+    pthread_mutex_lock(&_timer_lock);
+    if (0 < _ntimers)
     {
-        perror("! tcp_socketsetup: getaddrinfo error");
-        sockfd = -1;
-        goto ERR;
+        now = _tcp_now();
+        ms  = (_timers[0].deadline > now)
+                  ? (_timers[0].deadline - now + 999999) / 1000000
+                  : 0;
+        if (0 > timeout || ms < (uint64_t)timeout)
+        {
+            timeout = ms;
+        }
     }
-
-    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (0 > sockfd)
+    for (size_t i = 0; i < _nwatches; i++)
     {
-        perror("! tcp_socketsetup: socket error");
-        sockfd = -1;
-        goto ERR;
+        if (UINT64_MAX == _watches[i].deadline)
+        {
+            continue;
+        }
+        now = _tcp_now();
+        ms  = (_watches[i].deadline > now)
+                  ? (_watches[i].deadline - now + 999999) / 1000000
+                  : 0;
+        if (0 > timeout || ms < (uint64_t)timeout)
+        {
+            timeout = ms;
+        }
     }
+    pthread_mutex_unlock(&_timer_lock);
 
-    // set sockopt - this is so we can restart the server immediately
-    // after killing it
+    return timeout;
+}
 
-    int optval = 1;
-    err = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    if (0 != err)
-    {
-        perror("! tcp_socketsetup: setsockopt error");
-        sockfd = -1;
-        goto ERR;
-    }
+static void
+_tcp_timer_run(int all)
+{
+    _tcp_timer t    = { 0 };
+    _tcp_timer last = { 0 };
+    uint64_t   now  = _tcp_now();
+    size_t     i    = 0;
+    size_t     c    = 0;
+    size_t     left = 0;
 
-    int flags = 0;
+    pthread_mutex_lock(&_timer_lock);
+    left = _ntimers;
+    pthread_mutex_unlock(&_timer_lock);
 
-    flags = fcntl(sockfd, F_GETFL, 0);
-    err   = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-    if (0 > err)
+    for (; 0 < left; left--)
     {
-        perror("! tcp_socketsetup: fcntl error");
-        sockfd = -1;
-        goto ERR;
+        pthread_mutex_lock(&_timer_lock);
+        if (0 == _ntimers || (!all && _timers[0].deadline > now))
+        {
+            pthread_mutex_unlock(&_timer_lock);
+            break;
+        }
+
+        // pop the root and sift the last element down into its place
+        t    = _timers[0];
+        last = _timers[--_ntimers];
+        for (i = 0; (c = 2 * i + 1) < _ntimers; i = c)
+        {
+            if (c + 1 < _ntimers
+                && _timers[c + 1].deadline < _timers[c].deadline)
+            {
+                c++;
+            }
+            if (last.deadline <= _timers[c].deadline)
+            {
+                break;
+            }
+            _timers[i] = _timers[c];
+        }
+        _timers[i] = last;
+        pthread_mutex_unlock(&_timer_lock);
+
+        // outside the lock so the callback may park itself again
+        t.cb(t.arg);
     }
+}
 
-    err = bind(sockfd, res->ai_addr, res->ai_addrlen);
-    if (0 != err)
+static int
+_tcp_watch_fill(struct pollfd *pfds, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&_timer_lock);
+    for (; n < max && (size_t)n < _nwatches; n++)
     {
-        perror("! tcp_socketsetup: bind error");
-        sockfd = -1;
-        goto ERR;
+        pfds[n].fd      = _watches[n].fd;
+        pfds[n].events  = POLLOUT;
+        pfds[n].revents = 0;
     }
+    pthread_mutex_unlock(&_timer_lock);
 
-    err = listen(sockfd, maxpend);
-    if (0 != err)
+    return n;
+}
+
+static void
+_tcp_watch_run(struct pollfd *pfds, int nw, int all)
+{
+    _tcp_watch w   = { 0 };
+    uint64_t   now = _tcp_now();
+    size_t     i   = 0;
+
+    pthread_mutex_lock(&_timer_lock);
+    for (i = 0; i < (size_t)nw; i++)
     {
-        perror("! tcp_socketsetup: listen error");
-        sockfd = -1;
-        goto ERR;
+        _watches[i].revents = pfds[i].revents;
     }
+    pthread_mutex_unlock(&_timer_lock);
 
-    ret    = sockfd;
-    sockfd = -1;
-ERR:
-    freeaddrinfo(res);
-    res = NULL;
-    err = close(sockfd);
-    if (0 > err && EBADF != errno)
+    for (;;)
     {
-        perror("! tcp_socketsetup: couldn't close server socket after error");
+        pthread_mutex_lock(&_timer_lock);
+        for (i = 0; i < _nwatches; i++)
+        {
+            if (all || 0 != _watches[i].revents
+                || now >= _watches[i].deadline)
+            {
+                break;
+            }
+        }
+        if (i == _nwatches)
+        {
+            pthread_mutex_unlock(&_timer_lock);
+            break;
+        }
+        w = _watches[i];
+        _nwatches--;
+        memmove(&_watches[i],
+                &_watches[i + 1],
+                (_nwatches - i) * sizeof(_tcp_watch));
+        pthread_mutex_unlock(&_timer_lock);
+
+        // outside the lock so the callback may park itself again
+        w.cb(w.arg, !all && 0 != w.revents);
     }
-    return ret;
 }
 
 static int
-_tcp_closepfd(struct pollfd *pfd)
+_tcp_wait(int fd, short events)
 {
-    int ret = 0;
+    struct pollfd pfd     = { .fd = fd, .events = events };
+    int           ret     = 0;
+    int           ms      = netpoll_iotimeout;
+    uint64_t      waitend = 0;
 
-    if (NULL == pfd)
+    if (0 <= ms)
     {
-        fprintf(stderr, "! _tcp_closepfd: NULL pfd pointer\n");
-        goto ERR;
+        waitend = _tcp_now() + (uint64_t)ms * 1000000;
+    }
+    for (;;)
+    {
+        ret = poll(&pfd, 1, ms);
+        if (0 <= ret || EINTR != errno)
+        {
+            break;
+        }
+        // a signal does not restart the full wait
+        if (0 <= ms)
+        {
+            ms = (_tcp_now() < waitend)
+                     ? (int)((waitend - _tcp_now() + 999999) / 1000000)
+                     : 0;
+        }
     }
 
-    ret = close(pfd->fd);
-    if (0 != ret)
+    if (0 == ret)
     {
-        perror("! tcp_closepfd: error closing file descriptor\n");
-        goto ERR;
+        errno = ETIMEDOUT;
+        return -1;
     }
-    memset(pfd, 0, sizeof(struct pollfd));
 
-ERR:
-    return ret;
+    // POLLERR is reported whatever was asked for; the caller's next
+    // system call tells a real socket error from a zerocopy completion
+    return (0 < ret && !(pfd.revents & (POLLHUP | POLLNVAL))) ? 0 : -1;
 }
 
 static int
-_tcp_acceptconn(int sockfd, struct pollfd *pfds, int plen)
+_tcp_sockerr(int fd)
 {
+    int       err = 0;
+    socklen_t len = sizeof(err);
 
-    int ret = 0;
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+    {
+        return errno;
+    }
 
-    if (NULL == pfds)
+    return err;
+}
+
+static void
+_tcp_zc_enable(int fd)
+{
+    int one = 1;
+
+    if (0 == netpoll_zcmin || 0 > fd || NETPOLL_ZEROCOPY_FDS <= fd)
     {
-        fprintf(stderr, "! _tcp_acceptconn: NULL pfds array\n");
-        goto RET;
+        return;
+    }
+
+    if (0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+    {
+        atomic_store_explicit(&_tcp_zcfd[fd], 1, memory_order_relaxed);
     }
+}
+
+static int
+_tcp_zc_ready(int fd)
+{
+    return 0 <= fd && NETPOLL_ZEROCOPY_FDS > fd
+           && atomic_load_explicit(&_tcp_zcfd[fd], memory_order_relaxed);
+}
 
-    int                     confd      = 0;
-    struct sockaddr_storage client     = { 0 };
-    socklen_t               client_len = sizeof(client);
+static int
+_tcp_zc_reap(int fd, uint count)
+{
+    char                      control[128];
+    struct msghdr             msg  = { 0 };
+    struct cmsghdr *          cm   = NULL;
+    struct sock_extended_err *serr = NULL;
+    uint                      done = 0;
 
-    while (0 <= confd)
+    for (;;)
     {
-        confd = accept(sockfd, (struct sockaddr *)&client, &client_len);
-        if (0 > confd)
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (0 > recvmsg(fd, &msg, MSG_ERRQUEUE))
         {
-            if (EWOULDBLOCK != errno && EAGAIN != errno)
+            if (EINTR == errno)
             {
-                perror("! server: accept error");
+                continue;
             }
-            else
+            if (EAGAIN != errno && EWOULDBLOCK != errno)
+            {
+                log_perror("_tcp_zc_reap: recvmsg error");
+                return -1;
+            }
+            if (done >= count)
+            {
+                break;
+            }
+            // completions are signaled with POLLERR; a peer that stops
+            // acknowledging fails the write, and with it the connection,
+            // after netpoll_iotimeout rather than holding the worker
+            if (0 != _tcp_wait(fd, POLLERR))
             {
-                // if EWOULDBLOCK or EAGAIN there are no more connections to
-                // accept
-                goto RET;
+                return -1;
             }
-        } // if
-        else
+            continue;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); NULL != cm; cm = CMSG_NXTHDR(&msg, cm))
         {
-            fprintf(stderr, "[*] connection from:\n");
-            tcp_printsockaddr(&client);
-            int i = 0;
-            for (i = 0; i < plen; i++)
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin)
             {
-                if (0 == pfds[i].fd)
+                // anything else on the error queue is the socket's own
+                // error, and reading it here is the only time it is seen
+                if (0 != serr->ee_errno)
                 {
-                    pfds[i].fd     = confd;
-                    pfds[i].events = POLLIN | POLLRDHUP;
-                    ret++;
-                    break;
+                    errno = serr->ee_errno;
+                    log_perror("_tcp_zc_reap: socket error");
+                    return -1;
                 }
-            } // for
-            if (plen == i)
-            {
-                fprintf(stderr, "! server: max connections reached.\n");
-                close(confd);
-                goto RET;
+                continue;
             }
-        } // else
-    }     // while
+            // each notification covers the inclusive range of send
+            // counters [ee_info, ee_data]
+            done += serr->ee_data - serr->ee_info + 1;
+        }
+    }
 
-RET:
-    return ret;
+    return done;
+}
+
+static void
+_netbuf_keyinit(void)
+{
+    if (0 != pthread_key_create(&_netbuf_key, _netbuf_flush))
+    {
+        fprintf(stderr, "! _netbuf_keyinit: couldn't create key\n");
+    }
+}
+
+static void
+_netbuf_bind(_netbuf_cache *cache)
+{
+    // the key only exists for its destructor, so it is set once per
+    // thread the first time the thread touches the pool, whichever way
+    pthread_once(&_netbuf_once, _netbuf_keyinit);
+    pthread_setspecific(_netbuf_key, cache);
+    cache->keyed = 1;
+}
+
+static void
+_netbuf_flush(void *arg)
+{
+    _netbuf_cache *cache = arg;
+
+    for (uint cls = 0; cls < NETBUF_NCLASS; cls++)
+    {
+        _netbuf_spill(cache->bufs[cls], cache->nbufs[cls], cls);
+        cache->nbufs[cls] = 0;
+    }
+}
+
+static void
+_netbuf_spill(_netbuf **bufs, uint n, uint cls)
+{
+    if (0 == n)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_netbuf_lock[cls]);
+    for (uint i = 0; i < n; i++)
+    {
+        bufs[i]->next      = _netbuf_depot[cls];
+        _netbuf_depot[cls] = bufs[i];
+    }
+    pthread_mutex_unlock(&_netbuf_lock[cls]);
 }
 
 static int
-_tcp_shutdown(struct pollfd *pfds, int plen)
+_netbuf_refill(_netbuf_cache *cache, uint cls)
 {
-    int ret = 0;
+    _netbuf *nb = NULL;
 
-    printf("[*] shutting down poller...\n");
+    if (!cache->keyed)
+    {
+        _netbuf_bind(cache);
+    }
 
-    if (NULL == pfds)
+    pthread_mutex_lock(&_netbuf_lock[cls]);
+    while (NETBUF_CACHE / 2 > cache->nbufs[cls] && NULL != _netbuf_depot[cls])
     {
-        fprintf(stderr, "! _tcp_shutdown: NULL pfds array\n");
-        goto ERR;
+        nb                                    = _netbuf_depot[cls];
+        _netbuf_depot[cls]                    = nb->next;
+        cache->bufs[cls][cache->nbufs[cls]++] = nb;
     }
+    pthread_mutex_unlock(&_netbuf_lock[cls]);
 
-    for (int i = 0; i < plen; i++)
+    if (0 < cache->nbufs[cls])
     {
-        if (0 != pfds[i].fd)
-        {
-            _tcp_closepfd(&pfds[i]);
-        }
+        return 0;
     }
 
-ERR:
-    return ret;
+    nb = malloc(sizeof(_netbuf) + _netbuf_len[cls]);
+    if (NULL == nb)
+    {
+        fprintf(stderr, "! _netbuf_refill: couldn't malloc buffer\n");
+        return -1;
+    }
+    nb->cls                               = cls;
+    nb->index                             = -1;
+    cache->bufs[cls][cache->nbufs[cls]++] = nb;
+
+    return 0;
 }
@@ -0,0 +1,102 @@
+#ifndef _PATHRES_H
+#define _PATHRES_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * server-owned stores that have to live on the same filesystem as the root
+ * (they are reflinked or renamed into it) and so sit inside it; a client
+ * path with any component equal to one of these names is refused with
+ * EACCES by every pathres call
+ */
+#define PATHRES_OBJ_DIR ".objects"
+#define PATHRES_STAGE_DIR ".uploads"
+#define PATHRES_CKSUM_FILE ".cksum"
+
+/**
+ * @brief opens the server root directory and returns a file descriptor
+ *        that is held for the lifetime of the server; every client path
+ *        is resolved relative to this descriptor so the root never has to
+ *        be canonicalized again
+ *
+ * @param dir - path to the server directory given with -d
+ *
+ * @return O_PATH directory file descriptor on success; -1 on error
+ *
+ */
+int pathres_rootopen(const char *dir);
+
+/**
+ * @brief opens a client supplied path confined beneath @param rootfd;
+ *        uses openat2(RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS) when the
+ *        kernel supports it and falls back to pathres_walk otherwise
+ *
+ * @param rootfd - directory file descriptor from pathres_rootopen
+ *
+ * @param path - client supplied path; leading '/' are treated as relative
+ *        to @param rootfd
+ *
+ * @param flags - open(2) flags for the final component
+ *
+ * @param mode - open(2) mode used when @param flags contains O_CREAT
+ *
+ * @return file descriptor on success; -1 on error with errno set, EXDEV
+ *         if the path would escape the root, EACCES if it names a
+ *         reserved store
+ *
+ */
+int pathres_open(int rootfd, const char *path, int flags, mode_t mode);
+
+/**
+ * @brief userspace fallback for pathres_open; walks @param path one
+ *        component at a time with openat(2), resolving ".." lexically and
+ *        refusing to follow any symlink
+ *
+ * @param rootfd - directory file descriptor from pathres_rootopen
+ *
+ * @param path - client supplied path
+ *
+ * @param flags - open(2) flags for the final component
+ *
+ * @param mode - open(2) mode used when @param flags contains O_CREAT
+ *
+ * @return file descriptor on success; -1 on error with errno set, EXDEV
+ *         if the path would escape the root, EACCES if it names a
+ *         reserved store
+ *
+ */
+int pathres_walk(int rootfd, const char *path, int flags, mode_t mode);
+
+/**
+ * @brief opens the parent directory of a client supplied path beneath
+ *        @param rootfd, for operations such as rename, link or unlink that
+ *        take a directory and a name
+ *
+ * @param rootfd - directory file descriptor from pathres_rootopen
+ *
+ * @param path - client supplied path
+ *
+ * @param base - set to point at the final component inside @param path
+ *
+ * @return O_PATH directory file descriptor on success; -1 on error with
+ *         errno set, EINVAL if the final component is empty, "." or "..",
+ *         EACCES if any component names a reserved store
+ *
+ */
+int pathres_parent(int rootfd, const char *path, const char **base);
+
+/**
+ * @brief tells whether a single path component is one of the reserved
+ *        store names, e.g. so a directory listing can leave it out
+ *
+ * @param name - path component, not necessarily NUL terminated
+ *
+ * @param len - length of @param name
+ *
+ * @return 1 if reserved; 0 otherwise
+ *
+ */
+int pathres_reserved(const char *name, size_t len);
+
+#endif /* _PATHRES_H */
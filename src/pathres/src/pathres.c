@@ -0,0 +1,297 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for O_PATH
+#endif
+#include <pathres.h>
+#include <trace.h>
+#include <flight.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#define PATHRES_DIRFLAGS (O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
+/**
+ * cleared the first time openat2 returns ENOSYS so later calls go straight
+ * to the userspace walker
+ */
+static atomic_int _openat2_ok = 1;
+
+/**
+ * names a client path may not contain; see PATHRES_OBJ_DIR
+ */
+static const char *const _pathres_names[] = {
+    PATHRES_OBJ_DIR,
+    PATHRES_STAGE_DIR,
+    PATHRES_CKSUM_FILE,
+};
+
+/**
+ * @brief skips leading '/' so absolute client paths are treated as
+ *        relative to the server root
+ *
+ * @param path - client supplied path
+ *
+ * @return pointer into @param path; "." if nothing is left
+ *
+ */
+static const char *_pathres_strip(const char *path);
+
+/**
+ * @brief refuses a client path with any component that names a reserved
+ *        store; every component is checked, not only the first, so that
+ *        "a/../.objects" is caught before ".." is resolved
+ *
+ * @param path - client supplied path
+ *
+ * @return 0 if the path may be opened; -1 with errno EACCES otherwise
+ *
+ */
+static int _pathres_screen(const char *path);
+
+int
+pathres_rootopen(const char *dir)
+{
+    int ret = -1;
+
+    if (NULL == dir)
+    {
+        fprintf(stderr, "! pathres_rootopen: NULL directory\n");
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    ret = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (0 > ret)
+    {
+        perror("! pathres_rootopen: couldn't open server directory");
+    }
+
+ERR:
+    return ret;
+}
+
+int
+pathres_open(int rootfd, const char *path, int flags, mode_t mode)
+{
+    int ret = -1;
+
+    if (NULL == path)
+    {
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    if (0 != _pathres_screen(path))
+    {
+        goto ERR;
+    }
+
+#ifdef SYS_openat2
+    if (atomic_load_explicit(&_openat2_ok, memory_order_relaxed))
+    {
+        struct open_how how = { 0 };
+
+        how.flags   = flags | O_CLOEXEC;
+        how.mode    = (flags & O_CREAT) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+        ret = syscall(
+            SYS_openat2, rootfd, _pathres_strip(path), &how, sizeof(how));
+        if (0 <= ret || ENOSYS != errno)
+        {
+            goto ERR;
+        }
+        atomic_store_explicit(&_openat2_ok, 0, memory_order_relaxed);
+    }
+#endif // SYS_openat2
+
+    ret = pathres_walk(rootfd, path, flags, mode);
+
+ERR:
+    trace_file_open(rootfd, path, ret);
+    flight_mark(FLIGHT_RESOLVE);
+    return ret;
+}
+
+int
+pathres_walk(int rootfd, const char *path, int flags, mode_t mode)
+{
+    char        buf[PATH_MAX];
+    char *      comps[PATH_MAX / 2];
+    char *      save  = NULL;
+    char *      tok   = NULL;
+    int         depth = 0;
+    int         dirfd = rootfd;
+    int         fd    = -1;
+    int         ret   = -1;
+    int         err   = 0;
+    const char *last  = ".";
+
+    if (NULL == path)
+    {
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    if (0 != _pathres_screen(path))
+    {
+        goto ERR;
+    }
+
+    if (sizeof(buf) <= strlen(path))
+    {
+        errno = ENAMETOOLONG;
+        goto ERR;
+    }
+    strcpy(buf, path);
+
+    // resolve "." and ".." lexically; this is only sound because no
+    // component is allowed to be a symlink below
+    for (tok = strtok_r(buf, "/", &save); NULL != tok;
+         tok = strtok_r(NULL, "/", &save))
+    {
+        if (0 == strcmp(tok, "."))
+        {
+            continue;
+        }
+        if (0 == strcmp(tok, ".."))
+        {
+            if (0 == depth)
+            {
+                errno = EXDEV;
+                goto ERR;
+            }
+            depth--;
+            continue;
+        }
+        comps[depth++] = tok;
+    }
+
+    if (0 < depth)
+    {
+        last = comps[--depth];
+    }
+
+    for (int i = 0; i < depth; i++)
+    {
+        fd  = openat(dirfd, comps[i], PATHRES_DIRFLAGS);
+        err = errno;
+        if (rootfd != dirfd)
+        {
+            close(dirfd);
+        }
+        dirfd = fd;
+        if (0 > dirfd)
+        {
+            errno = err;
+            goto ERR;
+        }
+    }
+
+    ret = openat(dirfd, last, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+
+ERR:
+    if (rootfd != dirfd && 0 <= dirfd)
+    {
+        err = errno;
+        close(dirfd);
+        errno = err;
+    }
+    return ret;
+}
+
+int
+pathres_parent(int rootfd, const char *path, const char **base)
+{
+    char        buf[PATH_MAX];
+    const char *slash = NULL;
+    int         ret   = -1;
+
+    if (NULL == path || NULL == base)
+    {
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    if (0 != _pathres_screen(path))
+    {
+        goto ERR;
+    }
+
+    slash = strrchr(path, '/');
+    *base = (NULL == slash) ? path : slash + 1;
+    if ('\0' == **base || 0 == strcmp(*base, ".") || 0 == strcmp(*base, ".."))
+    {
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    if ((size_t)(*base - path) >= sizeof(buf))
+    {
+        errno = ENAMETOOLONG;
+        goto ERR;
+    }
+    memcpy(buf, path, *base - path);
+    buf[*base - path] = '\0';
+
+    ret = pathres_open(rootfd, buf, O_PATH | O_DIRECTORY, 0);
+
+ERR:
+    return ret;
+}
+
+int
+pathres_reserved(const char *name, size_t len)
+{
+    for (size_t i = 0; i < sizeof(_pathres_names) / sizeof(*_pathres_names);
+         i++)
+    {
+        if (strlen(_pathres_names[i]) == len
+            && 0 == memcmp(_pathres_names[i], name, len))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static const char *
+_pathres_strip(const char *path)
+{
+    while ('/' == *path)
+    {
+        path++;
+    }
+
+    return ('\0' == *path) ? "." : path;
+}
+
+static int
+_pathres_screen(const char *path)
+{
+    size_t len = 0;
+
+    while ('\0' != *path)
+    {
+        len = strcspn(path, "/");
+        if (pathres_reserved(path, len))
+        {
+            errno = EACCES;
+            return -1;
+        }
+        path += len;
+        path += strspn(path, "/");
+    }
+
+    return 0;
+}
@@ -0,0 +1,499 @@
+#ifndef _PROTO_H
+#define _PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <ll.h>
+#include <threadpool.h>
+
+/**
+ * largest request frame that will be buffered for a single connection;
+ * anything bigger is treated as a protocol error. A PUT_OP is one frame,
+ * so its header, path and body together are capped at this; larger files
+ * are sent with UPOPEN_OP, UPCHUNK_OP and UPCOMMIT_OP, each chunk being a
+ * frame of its own
+ */
+#define PROTO_MAX_FRAME (64 * 1024 * 1024)
+
+/**
+ * request opcodes; must match OPCODE in client.py
+ */
+typedef enum opcode_
+{
+    USER_OP     = 0x1,
+    DEL_OP      = 0x2,
+    LS_OP       = 0x3,
+    GET_OP      = 0x4,
+    MK_OP       = 0x5,
+    PUT_OP      = 0x6,
+    BATCH_OP    = 0x7,
+    GETR_OP     = 0x8,
+    UPOPEN_OP   = 0x9,
+    UPCHUNK_OP  = 0xa,
+    UPCOMMIT_OP = 0xb,
+} opcode;
+
+/**
+ * reserved bit in the reserved byte of GET_OP and the flag byte of PUT_OP
+ * for asking for a compressed body; nothing in proto reads or sets it yet,
+ * as the codec library is not wired into the request path. Once it is, a
+ * GET_OP response the server compressed carries the same bit, a content
+ * length of 0xffffffff and a codec stream ended by its end chunk
+ */
+#define PROTO_FLAG_COMPRESS 0x80
+
+/**
+ * reserved bit in the same bytes for asking for a CRC32C of the body;
+ * like PROTO_FLAG_COMPRESS it is not read or set yet, as the cksum library
+ * is not wired into the request path. Once it is, a response carries the
+ * bit when a 4 byte big-endian CRC32C of the uncompressed body follows the
+ * body
+ */
+#define PROTO_FLAG_CKSUM 0x40
+
+/**
+ * length of the GETR_OP response header that precedes the range data
+ */
+#define PROTO_GETR_HDR 28
+
+/**
+ * response return codes; must match RETCODE in client.py
+ */
+typedef enum retcode_
+{
+    SUCCESS    = 0x1,
+    SES_ERR    = 0x2,
+    PERM_ERR   = 0x3,
+    USR_EXIST  = 0x4,
+    FILE_EXIST = 0x5,
+    FAIL       = 0xff,
+} retcode;
+
+/**
+ * @brief function pointer to be defined in the caller; runs one complete
+ *        request frame and writes its response to @param fd
+ *
+ * @param fd - client socket the request was read from
+ *
+ * @param req - complete request frame starting at the opcode
+ *
+ * @param reqlen - length of @param req
+ *
+ * @return nothing
+ *
+ */
+typedef void (*reqhandler)(int fd, uint8_t *req, uint32_t reqlen);
+
+/**
+ * @brief function pointer to be defined in the caller; runs one item of a
+ *        BATCH_OP request; called concurrently from several threads
+ *
+ * @param ctx - caller context given to proto_batch_run, e.g. the session
+ *        that was checked once for the whole batch
+ *
+ * @param op - GET_OP, DEL_OP or MK_OP
+ *
+ * @param path - path of this item; NOT nul terminated
+ *
+ * @param pathlen - length of @param path
+ *
+ * @param out - for GET_OP set to a malloc'd buffer with the file content;
+ *        freed by proto_batch_run
+ *
+ * @param outlen - length of @param out
+ *
+ * @return retcode for this item
+ *
+ */
+typedef uint8_t (*batchhandler)(void *      ctx,
+                                uint8_t     op,
+                                const char *path,
+                                uint16_t    pathlen,
+                                uint8_t **  out,
+                                uint32_t *  outlen);
+
+/**
+ * default cap on the frames one connection may have queued or running
+ */
+#define PROTO_CONN_MAX_PENDING 32
+
+/**
+ * @brief admission limits shared by every connection of a server
+ *
+ * @param inflight - frames queued or running across all connections
+ *
+ * @param maxinflight - connections stop being read once @param inflight
+ *        reaches this; 0 for no limit
+ *
+ * @param maxpending - connections stop being read once this many of their
+ *        own frames are queued or running
+ *
+ * @param highwater - new connections stop being accepted once
+ *        @param inflight reaches this; 0 for no limit
+ *
+ * @param nthrottled - times a read was refused by these limits
+ *
+ */
+typedef struct proto_admit_
+{
+    atomic_uint  inflight;
+    uint32_t     maxinflight;
+    uint32_t     maxpending;
+    uint32_t     highwater;
+    atomic_ulong nthrottled;
+} proto_admit;
+
+/**
+ * @brief per connection request pipeline; bytes read from the socket are
+ *        split into request frames which are queued and run one at a time
+ *        in arrival order so responses leave in the same order, without
+ *        the client having to wait for each response before sending the
+ *        next request
+ *
+ * @param fd - client socket
+ *
+ * @param lock - protects pending, running, closing, dropping and the
+ *        buffer
+ *
+ * @param idle - signaled when @param running turns false
+ *
+ * @param pending - queue of complete frames waiting to be run
+ *
+ * @param running - true while a drain job for this connection is queued
+ *        or running on the pool
+ *
+ * @param closing - true once proto_conn_close has taken the socket from
+ *        the poller; the last drain job frees the pipeline
+ *
+ * @param dropping - true once proto_conn_destroy or an aborting
+ *        proto_conn_close has started; no more frames are queued
+ *
+ * @param buf - bytes read from @param fd that are not queued yet; a
+ *        frame stays here while the connection is over its admission
+ *        limits
+ *
+ * @param len - number of bytes in @param buf
+ *
+ * @param cap - allocated size of @param buf
+ *
+ * @param rh - handler run for each frame
+ *
+ * @param pool - pool the drain job is submitted to
+ *
+ * @param admit - shared admission limits; NULL for none
+ *
+ * @param npending - frames of this connection queued or running; its
+ *        responses are not sent yet
+ *
+ */
+typedef struct proto_conn_
+{
+    int             fd;
+    pthread_mutex_t lock;
+    pthread_cond_t  idle;
+    ll *            pending;
+    bool            running;
+    bool            closing;
+    bool            dropping;
+    uint8_t *       buf;
+    uint32_t        len;
+    uint32_t        cap;
+    reqhandler      rh;
+    threadpool *    pool;
+    proto_admit *   admit;
+    atomic_uint     npending;
+} proto_conn;
+
+/**
+ * @brief computes the length of the request frame at the start of
+ *        @param buf from its fixed header
+ *
+ * @param buf - bytes received from the client
+ *
+ * @param len - number of bytes in @param buf
+ *
+ * @return frame length if the header is complete; 0 if more bytes are
+ *         needed to know; -1 on an unknown opcode or oversized frame
+ *
+ */
+int64_t proto_reqlen(const uint8_t *buf, uint32_t len);
+
+/**
+ * @brief initializes the request pipeline for a connection
+ *
+ * @param fd - client socket
+ *
+ * @param rh - handler run for each frame
+ *
+ * @param pool - pool the frames are run on
+ *
+ * @param admit - admission limits shared with the server's other
+ *        connections; NULL for none
+ *
+ * @return pointer to initialized pipeline; NULL on error
+ *
+ */
+proto_conn *proto_conn_init(int          fd,
+                            reqhandler   rh,
+                            threadpool * pool,
+                            proto_admit *admit);
+
+/**
+ * @brief initializes admission limits
+ *
+ * @param admit - limits to initialize
+ *
+ * @param maxinflight - cap on frames queued or running across all
+ *        connections; 0 for no limit
+ *
+ * @param maxpending - cap per connection; 0 for PROTO_CONN_MAX_PENDING
+ *
+ * @param highwater - in flight frames above which accepting pauses; 0 for
+ *        no limit
+ *
+ * @return nothing
+ *
+ */
+void proto_admit_init(proto_admit *admit,
+                      uint32_t     maxinflight,
+                      uint32_t     maxpending,
+                      uint32_t     highwater);
+
+/**
+ * @brief whether new connections should be accepted; meant to back the
+ *        netpoll accept gate
+ *
+ * @param admit - admission limits
+ *
+ * @return true if in flight frames are below the high-water mark
+ *
+ */
+bool proto_admit_accepting(proto_admit *admit);
+
+/**
+ * @brief whether the connection may be read; meant to back the netpoll
+ *        read gate so the client is held back by TCP flow control rather
+ *        than buffered without bound
+ *
+ * @param conn - connection pipeline
+ *
+ * @return true if neither the connection's nor the global cap is reached
+ *
+ */
+bool proto_conn_readable(proto_conn *conn);
+
+/**
+ * @brief whether the connection has no frame queued or running, so every
+ *        response it was due has been sent; meant to back the idle gate of
+ *        tcp_netpoll_drain
+ *
+ * @param conn - connection pipeline
+ *
+ * @return true if nothing is outstanding; a frame only partly read does
+ *         not count, as draining reads no more of it
+ *
+ */
+bool proto_conn_idle(proto_conn *conn);
+
+/**
+ * @brief reads everything currently available on the connection without
+ *        blocking, queues complete frames until the admission limits are
+ *        reached and schedules them on the pool; frames held back are
+ *        queued as earlier ones finish; meant to be called from the
+ *        netpoll event handler
+ *
+ * @param conn - connection pipeline
+ *
+ * @return number of frames queued; 0 if none are complete yet or the
+ *         connection is over its admission limits; -1 on error or if the
+ *         client closed the connection, which the poller then reports to
+ *         netpoll_closehandler
+ *
+ */
+int proto_conn_read(proto_conn *conn);
+
+/**
+ * @brief takes over the connection's socket once the poller has let go of
+ *        it; meant to back netpoll_closehandler. The pipeline is freed and
+ *        the socket closed once no frame is left: right away if none is
+ *        queued or running, otherwise by the drain job, so no response is
+ *        ever written to a closed or reused descriptor. The caller forgets
+ *        @param conn after this
+ *
+ * @param conn - connection pipeline
+ *
+ * @param abort - false to read what the client sent before it hung up
+ *        and answer it first; true to drop every frame not yet started
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int proto_conn_close(proto_conn *conn, bool abort);
+
+/**
+ * @brief frees the pipeline once no drain job is running; queued frames
+ *        that have not started are dropped; does not close the socket;
+ *        not for a pipeline given to proto_conn_close
+ *
+ * @param conn - connection pipeline
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int proto_conn_destroy(proto_conn *conn);
+
+/**
+ * @brief runs every item of a BATCH_OP request, spread across the pool,
+ *        and builds the response; the calling thread works on items too
+ *        so this is safe to call from a pool worker
+ *
+ *        request:  op | sub op | count (2) | session (4) | paths len (4) |
+ *                  { path len (2) | path } * count
+ *
+ *        response for DEL_OP/MK_OP:
+ *                  retcode | sub op | count (2) | status (1) * count
+ *
+ *        response for GET_OP:
+ *                  retcode | sub op | count (2) |
+ *                  { status (1) | content len (4) | content } * count
+ *
+ *        a response longer than PROTO_MAX_FRAME is replaced by
+ *                  FAIL | sub op | 0 (2)
+ *
+ * @param pool - pool the items are fanned out to
+ *
+ * @param req - complete BATCH_OP frame
+ *
+ * @param reqlen - length of @param req
+ *
+ * @param bh - handler run for each item
+ *
+ * @param ctx - passed through to @param bh
+ *
+ * @param resplen - set to the length of the returned response
+ *
+ * @return malloc'd response on success; NULL on a malformed request or
+ *         allocation failure
+ *
+ */
+uint8_t *proto_batch_run(threadpool *   pool,
+                         const uint8_t *req,
+                         uint32_t       reqlen,
+                         batchhandler   bh,
+                         void *         ctx,
+                         uint32_t *     resplen);
+
+/**
+ * @brief same as proto_batch_run but writes the response straight to
+ *        @param fd with a single vectored write, pointing at each item's
+ *        output instead of copying it into one response buffer
+ *
+ * @param fd - client socket
+ *
+ * @param pool - pool the items are fanned out to
+ *
+ * @param req - complete BATCH_OP frame
+ *
+ * @param reqlen - length of @param req
+ *
+ * @param bh - handler run for each item
+ *
+ * @param ctx - passed through to @param bh
+ *
+ * @return 0 on success; nonzero on a malformed request or write error
+ *
+ */
+int proto_batch_send(int            fd,
+                     threadpool *   pool,
+                     const uint8_t *req,
+                     uint32_t       reqlen,
+                     batchhandler   bh,
+                     void *         ctx);
+
+/**
+ * @brief writes a response made of a fixed header, an optional path and
+ *        an optional payload in one vectored write so the parts never
+ *        have to be copied into a single buffer
+ *
+ * @param fd - client socket
+ *
+ * @param hdr - response header
+ *
+ * @param hdrlen - length of @param hdr
+ *
+ * @param path - path echoed back to the client; may be NULL
+ *
+ * @param pathlen - length of @param path
+ *
+ * @param data - payload; may be NULL
+ *
+ * @param datalen - length of @param data
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int proto_respond(int         fd,
+                  const void *hdr,
+                  size_t      hdrlen,
+                  const void *path,
+                  size_t      pathlen,
+                  const void *data,
+                  size_t      datalen);
+
+/**
+ * @brief decodes a GETR_OP request
+ *
+ *        request:  op | reserved | path len (2) | session (4) |
+ *                  offset (8) | length (8) | path
+ *
+ * @param req - complete GETR_OP frame
+ *
+ * @param reqlen - length of @param req
+ *
+ * @param off - set to the requested offset
+ *
+ * @param len - set to the requested length; 0 means to the end of file
+ *
+ * @param path - set to point at the path inside @param req; NOT nul
+ *        terminated
+ *
+ * @param pathlen - set to the length of @param path
+ *
+ * @return 0 on success; -1 on a malformed request
+ *
+ */
+int proto_getr_parse(const uint8_t *req,
+                     uint32_t       reqlen,
+                     uint64_t *     off,
+                     uint64_t *     len,
+                     const char **  path,
+                     uint16_t *     pathlen);
+
+/**
+ * @brief sends the GETR_OP response for a byte range of an open file;
+ *        the data is sent with sendfile(2) so it never passes through a
+ *        userspace buffer; the range is clamped to the end of the file
+ *
+ *        response: retcode | reserved (3) | file size (8) | offset (8) |
+ *                  length (8) | data
+ *
+ *        if @param filefd can't be stat'ed or isn't a regular file the
+ *        header is sent with FAIL and every other field 0, and no data
+ *
+ * @param sockfd - client socket, blocking or non-blocking
+ *
+ * @param filefd - file to send from
+ *
+ * @param off - first byte to send
+ *
+ * @param len - number of bytes to send; 0 means to the end of file
+ *
+ * @return number of data bytes sent on success; -1 on error
+ *
+ */
+int64_t proto_send_range(int sockfd, int filefd, uint64_t off, uint64_t len);
+
+#endif /* _PROTO_H */
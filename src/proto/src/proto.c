@@ -0,0 +1,1473 @@
+#include <proto.h>
+#include <netpoll.h>
+#include <metrics.h>
+#include <trace.h>
+#include <flight.h>
+#include <iopolicy.h>
+#include <log.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define CONN_BUF_INIT 2048
+
+/**
+ * @brief one complete request frame waiting in proto_conn->pending
+ *
+ * @param len - length of @param data
+ *
+ * @param pooled - taken from the netbuf pool rather than the heap
+ *
+ * @param rec - stage timestamps, from the read that completed the frame
+ *
+ * @param data - the frame starting at the opcode
+ *
+ */
+typedef struct frame_
+{
+    uint32_t   len;
+    bool       pooled;
+    flight_rec rec;
+    uint8_t    data[];
+} frame;
+
+/**
+ * @brief state shared by the threads working on one BATCH_OP request;
+ *        items are claimed one at a time through next so the caller and
+ *        any number of pool workers can share the work
+ *
+ * @param next - index of the next unclaimed item
+ *
+ * @param done - number of finished items
+ *
+ * @param refs - caller plus every queued job; the last one frees the batch
+ *
+ * @param lock - used with @param cond to wait for done == count
+ *
+ * @param cond - signaled when the last item finishes
+ *
+ * @param op - sub opcode run for every item
+ *
+ * @param count - number of items
+ *
+ * @param paths - item paths; point into the request frame
+ *
+ * @param pathlens - item path lengths
+ *
+ * @param status - item retcodes
+ *
+ * @param out - item output buffers for GET_OP
+ *
+ * @param outlen - item output lengths
+ *
+ * @param bh - caller handler
+ *
+ * @param ctx - caller context for @param bh
+ *
+ */
+typedef struct batch_
+{
+    atomic_uint     next;
+    atomic_uint     done;
+    atomic_uint     refs;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint8_t         op;
+    uint16_t        count;
+    const char **   paths;
+    uint16_t *      pathlens;
+    uint8_t *       status;
+    uint8_t **      out;
+    uint32_t *      outlen;
+    batchhandler    bh;
+    void *          ctx;
+} batch;
+
+/**
+ * @brief custom free function to be supplied as a pointer to the linked
+ *        list to free queued frames
+ *
+ * @param p - pointer to the node to be freed
+ *
+ * @return nothing
+ *
+ */
+static void _conn_free_frame(void *p);
+
+/**
+ * @brief allocates a frame of @param flen bytes; one that fits a transfer
+ *        chunk comes from the netbuf pool, as frames are made by whichever
+ *        thread parses them and freed by the worker that runs them
+ *
+ * @return frame; NULL on error
+ *
+ */
+static frame *_frame_new(int64_t flen);
+
+/**
+ * @brief frees a frame from _frame_new; NULL is ignored
+ *
+ * @return nothing
+ *
+ */
+static void _frame_free(frame *f);
+
+/**
+ * @brief queues the complete frames at the front of the connection buffer
+ *        for as long as the connection is within its admission limits;
+ *        the caller holds conn->lock
+ *
+ * @param conn - connection pipeline
+ *
+ * @param start - time the frames were read, for the flight recorder
+ *
+ * @param parsed - time spent reading them
+ *
+ * @return number of frames queued
+ *
+ */
+static int _conn_parse(proto_conn *conn, uint64_t start, uint64_t parsed);
+
+/**
+ * @brief reads from the socket until it would block, growing the
+ *        connection buffer as needed
+ *
+ * @param conn - connection pipeline
+ *
+ * @return 0 on success; -1 on error or if the client hung up
+ *
+ */
+static int _conn_fill(proto_conn *conn);
+
+/**
+ * @brief threadpool job that runs queued frames for one connection in
+ *        order until the queue is empty
+ *
+ * @param conn_in - pointer to the connection pipeline
+ *
+ * @return nothing
+ *
+ */
+static void _conn_drain(void *conn_in);
+
+/**
+ * @brief frees a pipeline no drain job is running for; does not close the
+ *        socket
+ *
+ * @param conn - connection pipeline
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _conn_free(proto_conn *conn);
+
+/**
+ * @brief releases the admission counts of one finished or dropped frame
+ *        and wakes the poller if that brings the connection or the server
+ *        back under a limit
+ *
+ * @param conn - connection the frame belonged to
+ *
+ * @return nothing
+ *
+ */
+static void _conn_done(proto_conn *conn);
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds, for timing frames
+ *
+ */
+static uint64_t _conn_now(void);
+
+/**
+ * @brief claims and runs batch items until none are left
+ *
+ * @param b - batch being run
+ *
+ * @return nothing
+ *
+ */
+static void _batch_work(batch *b);
+
+/**
+ * @brief threadpool job wrapping _batch_work
+ *
+ * @param batch_in - pointer to the batch
+ *
+ * @return nothing
+ *
+ */
+static void _batch_job(void *batch_in);
+
+/**
+ * @brief drops one reference to the batch and frees it with the last one
+ *
+ * @param b - batch to release
+ *
+ * @return nothing
+ *
+ */
+static void _batch_release(batch *b);
+
+/**
+ * @brief parses a BATCH_OP request and runs all of its items across the
+ *        pool, returning once every item is done
+ *
+ * @return the finished batch, to be freed with _batch_free; NULL on a
+ *         malformed request or allocation failure
+ *
+ */
+static batch *_batch_exec(threadpool *   pool,
+                          const uint8_t *req,
+                          uint32_t       reqlen,
+                          batchhandler   bh,
+                          void *         ctx);
+
+/**
+ * @brief frees the item outputs of a finished batch and drops the
+ *        caller's reference
+ *
+ * @param b - batch from _batch_exec
+ *
+ * @return nothing
+ *
+ */
+static void _batch_free(batch *b);
+
+/**
+ * @brief length of the response to a finished batch, summed wide enough
+ *        that 65535 items of up to 4 GiB each can't wrap it
+ *
+ * @param b - batch from _batch_exec
+ *
+ * @return response length in bytes
+ *
+ */
+static uint64_t _batch_resplen(const batch *b);
+
+/**
+ * @brief sends all of @param buf, waiting out EAGAIN
+ *
+ * @param fd - socket to send on
+ *
+ * @param buf - data to send
+ *
+ * @param len - length of @param buf
+ *
+ * @param flags - send(2) flags
+ *
+ * @return 0 on success; -1 on error
+ *
+ */
+static int _send_all(int fd, const uint8_t *buf, size_t len, int flags);
+
+/**
+ * @brief reads a big endian 16, 32 or 64 bit field from an unaligned buffer
+ *
+ */
+static uint32_t _get16(const uint8_t *p);
+static uint32_t _get32(const uint8_t *p);
+static uint64_t _get64(const uint8_t *p);
+
+/**
+ * @brief writes a big endian 32 or 64 bit field to an unaligned buffer
+ *
+ */
+static void _put32(uint8_t *p, uint32_t v);
+static void _put64(uint8_t *p, uint64_t v);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+int64_t
+proto_reqlen(const uint8_t *buf, uint32_t len)
+{
+    int64_t ret = 0;
+
+    if (NULL == buf || 0 == len)
+    {
+        goto RET;
+    }
+
+    switch (buf[0])
+    {
+        case DEL_OP:
+        case GET_OP:
+            // op | reserved | path len (2) | session (4) | path
+            if (8 <= len)
+            {
+                ret = 8 + (int64_t)_get16(&buf[2]);
+            }
+            break;
+        case LS_OP:
+        case MK_OP:
+            // op | reserved | path len (2) | session (4) | pos (4) | path
+            if (12 <= len)
+            {
+                ret = 12 + (int64_t)_get16(&buf[2]);
+            }
+            break;
+        case USER_OP:
+            // op | flag | reserved (2) | user len (2) | pass len (2) |
+            // session (4) | user | pass
+            if (12 <= len)
+            {
+                ret = 12 + (int64_t)_get16(&buf[4]) + _get16(&buf[6]);
+            }
+            break;
+        case PUT_OP:
+            // op | overwrite | path len (2) | session (4) | file len (4) |
+            // path | file
+            if (12 <= len)
+            {
+                ret = 12 + (int64_t)_get16(&buf[2]) + _get32(&buf[8]);
+            }
+            break;
+        case BATCH_OP:
+            // op | sub op | count (2) | session (4) | paths len (4) | paths
+            if (12 <= len)
+            {
+                ret = 12 + (int64_t)_get32(&buf[8]);
+            }
+            break;
+        case GETR_OP:
+            // op | reserved | path len (2) | session (4) | offset (8) |
+            // length (8) | path
+            if (24 <= len)
+            {
+                ret = 24 + (int64_t)_get16(&buf[2]);
+            }
+            break;
+        case UPOPEN_OP:
+            // op | overwrite | path len (2) | session (4) | size (8) | path
+            if (16 <= len)
+            {
+                ret = 16 + (int64_t)_get16(&buf[2]);
+            }
+            break;
+        case UPCHUNK_OP:
+            // op | reserved (3) | session (4) | upload id (8) |
+            // offset (8) | chunk len (4) | chunk
+            if (28 <= len)
+            {
+                ret = 28 + (int64_t)_get32(&buf[24]);
+            }
+            break;
+        case UPCOMMIT_OP:
+            // op | reserved (3) | session (4) | upload id (8)
+            ret = 16;
+            break;
+        default:
+            ret = -1;
+    }
+
+    if (PROTO_MAX_FRAME < ret)
+    {
+        ret = -1;
+    }
+
+RET:
+    return ret;
+}
+
+proto_conn *
+proto_conn_init(int fd, reqhandler rh, threadpool *pool, proto_admit *admit)
+{
+    proto_conn *ret  = NULL;
+    proto_conn *conn = NULL;
+    int         err  = 0;
+
+    if (NULL == rh || NULL == pool)
+    {
+        log_error("proto_conn_init: NULL handler or pool");
+        goto ERR;
+    }
+
+    conn = calloc(1, sizeof(struct proto_conn_));
+    if (NULL == conn)
+    {
+        log_error("proto_conn_init: couldn't calloc conn");
+        goto ERR;
+    }
+
+    conn->buf = malloc(CONN_BUF_INIT);
+    if (NULL == conn->buf)
+    {
+        log_error("proto_conn_init: couldn't malloc buffer");
+        goto ERR;
+    }
+    conn->cap = CONN_BUF_INIT;
+
+    conn->pending = ll_init();
+    if (NULL == conn->pending)
+    {
+        log_error("proto_conn_init: couldn't init queue");
+        goto ERR;
+    }
+
+    err = pthread_mutex_init(&(conn->lock), NULL);
+    if (0 != err)
+    {
+        log_error("proto_conn_init: couldn't init mutex");
+        goto ERR;
+    }
+
+    err = pthread_cond_init(&(conn->idle), NULL);
+    if (0 != err)
+    {
+        log_error("proto_conn_init: couldn't init condvar");
+        pthread_mutex_destroy(&(conn->lock));
+        goto ERR;
+    }
+
+    conn->fd    = fd;
+    conn->rh    = rh;
+    conn->pool  = pool;
+    conn->admit = admit;
+    atomic_init(&(conn->npending), 0);
+
+    ret  = conn;
+    conn = NULL;
+
+ERR:
+    if (NULL != conn)
+    {
+        if (NULL != conn->pending)
+        {
+            ll_destroy(conn->pending);
+        }
+        free(conn->buf);
+    }
+    free(conn);
+    conn = NULL;
+    return ret;
+}
+
+int
+proto_conn_read(proto_conn *conn)
+{
+    int      ret      = 0;
+    int      err      = 0;
+    bool     schedule = false;
+    uint64_t start    = flight_now();
+    uint64_t parsed   = 0;
+
+    if (NULL == conn)
+    {
+        log_error("proto_conn_read: NULL conn");
+        ret = -1;
+        goto ERR;
+    }
+
+    if (!proto_conn_readable(conn))
+    {
+        atomic_fetch_add(&(conn->admit->nthrottled), 1);
+        goto ERR;
+    }
+
+    // the buffer is shared with _conn_drain, which queues what is left in
+    // it as running frames finish
+    pthread_mutex_lock(&(conn->lock));
+    err    = _conn_fill(conn);
+    parsed = flight_now() - start;
+    ret    = _conn_parse(conn, start, parsed);
+    if (0 < ret && !conn->running)
+    {
+        conn->running = true;
+        schedule      = true;
+    }
+    if (0 > proto_reqlen(conn->buf, conn->len))
+    {
+        err = -1;
+    }
+    pthread_mutex_unlock(&(conn->lock));
+
+    // a full queue is pushed back onto the poller, which stops reading
+    // other clients while it drains this one
+    if (schedule && 0 != thpool_add_job(conn->pool, _conn_drain, conn))
+    {
+        _conn_drain(conn);
+    }
+
+    if (0 != err)
+    {
+        ret = -1;
+    }
+
+ERR:
+    return ret;
+}
+
+void
+proto_admit_init(proto_admit *admit,
+                 uint32_t     maxinflight,
+                 uint32_t     maxpending,
+                 uint32_t     highwater)
+{
+    if (NULL == admit)
+    {
+        return;
+    }
+
+    atomic_init(&(admit->inflight), 0);
+    atomic_init(&(admit->nthrottled), 0);
+    admit->maxinflight = maxinflight;
+    admit->maxpending
+        = (0 == maxpending) ? PROTO_CONN_MAX_PENDING : maxpending;
+    admit->highwater   = highwater;
+}
+
+bool
+proto_admit_accepting(proto_admit *admit)
+{
+    return NULL == admit || 0 == admit->highwater
+           || atomic_load(&(admit->inflight)) < admit->highwater;
+}
+
+bool
+proto_conn_readable(proto_conn *conn)
+{
+    proto_admit *admit = NULL;
+
+    if (NULL == conn || NULL == conn->admit)
+    {
+        return true;
+    }
+    admit = conn->admit;
+
+    return atomic_load(&(conn->npending)) < admit->maxpending
+           && (0 == admit->maxinflight
+               || atomic_load(&(admit->inflight)) < admit->maxinflight);
+}
+
+bool
+proto_conn_idle(proto_conn *conn)
+{
+    return NULL == conn || 0 == atomic_load(&(conn->npending));
+}
+
+int
+proto_conn_destroy(proto_conn *conn)
+{
+    int ret = 0;
+
+    if (NULL == conn)
+    {
+        log_error("proto_conn_destroy: NULL conn");
+        ret = -1;
+        goto ERR;
+    }
+
+    // drop what has not started and wait for the current frame to finish
+    pthread_mutex_lock(&(conn->lock));
+    conn->dropping = true;
+    while (NULL != conn->pending->head)
+    {
+        _frame_free(pop_front(conn->pending));
+        _conn_done(conn);
+    }
+    while (conn->running)
+    {
+        pthread_cond_wait(&(conn->idle), &(conn->lock));
+    }
+    pthread_mutex_unlock(&(conn->lock));
+
+    ret  = _conn_free(conn);
+    conn = NULL;
+
+ERR:
+    return ret;
+}
+
+int
+proto_conn_close(proto_conn *conn, bool abort)
+{
+    int  fd       = -1;
+    bool schedule = false;
+
+    if (NULL == conn)
+    {
+        log_error("proto_conn_close: NULL conn");
+        return -1;
+    }
+
+    pthread_mutex_lock(&(conn->lock));
+    conn->closing = true;
+    if (abort)
+    {
+        conn->dropping = true;
+        while (NULL != conn->pending->head)
+        {
+            _frame_free(pop_front(conn->pending));
+            _conn_done(conn);
+        }
+    }
+    // a drain job is started even with nothing queued, as the client may
+    // have left requests unread in the socket while it was paused
+    if (!conn->running && !conn->dropping)
+    {
+        conn->running = true;
+        schedule      = true;
+    }
+    fd = (conn->running) ? -1 : conn->fd;
+    pthread_mutex_unlock(&(conn->lock));
+
+    if (schedule && 0 != thpool_add_job(conn->pool, _conn_drain, conn))
+    {
+        _conn_drain(conn);
+    }
+    // otherwise the drain job that is running frees it
+    if (0 <= fd)
+    {
+        _conn_free(conn);
+        close(fd);
+    }
+    return 0;
+}
+
+uint8_t *
+proto_batch_run(threadpool *   pool,
+                const uint8_t *req,
+                uint32_t       reqlen,
+                batchhandler   bh,
+                void *         ctx,
+                uint32_t *     resplen)
+{
+    uint8_t *ret  = NULL;
+    batch *  b    = NULL;
+    uint64_t off  = 0;
+    uint64_t rlen = 0;
+    bool     fail = false;
+
+    if (NULL == resplen)
+    {
+        log_error("proto_batch_run: NULL resplen");
+        goto ERR;
+    }
+
+    b = _batch_exec(pool, req, reqlen, bh, ctx);
+    if (NULL == b)
+    {
+        goto ERR;
+    }
+
+    // a response the client could never take as one frame is refused
+    // before anything is allocated for it
+    rlen = _batch_resplen(b);
+    if (PROTO_MAX_FRAME < rlen)
+    {
+        log_warn("proto_batch_run: %llu byte response refused",
+                 (unsigned long long)rlen);
+        rlen = 4;
+        fail = true;
+    }
+
+    ret = malloc(rlen);
+    if (NULL == ret)
+    {
+        log_error("proto_batch_run: couldn't malloc response");
+        goto ERR;
+    }
+    if (fail)
+    {
+        ret[0]   = FAIL;
+        ret[1]   = b->op;
+        ret[2]   = 0;
+        ret[3]   = 0;
+        *resplen = rlen;
+        goto ERR;
+    }
+    ret[0] = SUCCESS;
+    ret[1] = b->op;
+    ret[2] = b->count >> 8;
+    ret[3] = b->count & 0xff;
+    off    = 4;
+    for (uint16_t i = 0; i < b->count; i++)
+    {
+        ret[off++] = b->status[i];
+        if (GET_OP == b->op)
+        {
+            _put32(&ret[off], b->outlen[i]);
+            off += 4;
+            if (0 < b->outlen[i])
+            {
+                memcpy(&ret[off], b->out[i], b->outlen[i]);
+                off += b->outlen[i];
+            }
+        }
+    }
+    *resplen = rlen;
+
+ERR:
+    if (NULL != b)
+    {
+        _batch_free(b);
+    }
+    b = NULL;
+    return ret;
+}
+
+int
+proto_batch_send(int            fd,
+                 threadpool *   pool,
+                 const uint8_t *req,
+                 uint32_t       reqlen,
+                 batchhandler   bh,
+                 void *         ctx)
+{
+    int           ret    = -1;
+    batch *       b      = NULL;
+    struct iovec *iov    = NULL;
+    uint8_t *     ihdr   = NULL;
+    int           iovcnt = 0;
+    uint8_t       hdr[4];
+
+    b = _batch_exec(pool, req, reqlen, bh, ctx);
+    if (NULL == b)
+    {
+        goto ERR;
+    }
+
+    // held to the same limit as proto_batch_run so both answer alike
+    if (PROTO_MAX_FRAME < _batch_resplen(b))
+    {
+        log_warn("proto_batch_send: %llu byte response refused",
+                 (unsigned long long)_batch_resplen(b));
+        hdr[0] = FAIL;
+        hdr[1] = b->op;
+        hdr[2] = 0;
+        hdr[3] = 0;
+        ret    = (0 > tcp_write_handler(fd, (char *)hdr, sizeof(hdr))) ? -1
+                                                                       : 0;
+        goto ERR;
+    }
+
+    // header, then either the status array as is or a 5 byte item header
+    // plus the handler's own buffer per item; nothing is copied
+    iov  = calloc(1 + 2 * (size_t)b->count, sizeof(struct iovec));
+    ihdr = calloc(b->count + 1, 5);
+    if (NULL == iov || NULL == ihdr)
+    {
+        log_error("proto_batch_send: couldn't calloc iovecs");
+        goto ERR;
+    }
+
+    hdr[0]                = SUCCESS;
+    hdr[1]                = b->op;
+    hdr[2]                = b->count >> 8;
+    hdr[3]                = b->count & 0xff;
+    iov[iovcnt].iov_base  = hdr;
+    iov[iovcnt++].iov_len = sizeof(hdr);
+    if (GET_OP != b->op)
+    {
+        iov[iovcnt].iov_base  = b->status;
+        iov[iovcnt++].iov_len = b->count;
+    }
+    for (uint16_t i = 0; GET_OP == b->op && i < b->count; i++)
+    {
+        ihdr[i * 5] = b->status[i];
+        _put32(&ihdr[i * 5 + 1], b->outlen[i]);
+        iov[iovcnt].iov_base  = &ihdr[i * 5];
+        iov[iovcnt++].iov_len = 5;
+        iov[iovcnt].iov_base  = b->out[i];
+        iov[iovcnt++].iov_len = (NULL == b->out[i]) ? 0 : b->outlen[i];
+    }
+
+    if (0 > tcp_writev_handler(fd, iov, iovcnt))
+    {
+        goto ERR;
+    }
+    ret = 0;
+
+ERR:
+    free(iov);
+    iov = NULL;
+    free(ihdr);
+    ihdr = NULL;
+    if (NULL != b)
+    {
+        _batch_free(b);
+    }
+    b = NULL;
+    return ret;
+}
+
+int
+proto_respond(int         fd,
+              const void *hdr,
+              size_t      hdrlen,
+              const void *path,
+              size_t      pathlen,
+              const void *data,
+              size_t      datalen)
+{
+    struct iovec iov[3] = {
+        { .iov_base = (void *)hdr, .iov_len = (NULL == hdr) ? 0 : hdrlen },
+        { .iov_base = (void *)path, .iov_len = (NULL == path) ? 0 : pathlen },
+        { .iov_base = (void *)data, .iov_len = (NULL == data) ? 0 : datalen },
+    };
+
+    return (0 > tcp_writev_handler(fd, iov, 3)) ? -1 : 0;
+}
+
+int
+proto_getr_parse(const uint8_t *req,
+                 uint32_t       reqlen,
+                 uint64_t *     off,
+                 uint64_t *     len,
+                 const char **  path,
+                 uint16_t *     pathlen)
+{
+    int ret = -1;
+
+    if (NULL == req || NULL == off || NULL == len || NULL == path
+        || NULL == pathlen || 24 > reqlen || GETR_OP != req[0]
+        || 24 + _get16(&req[2]) != reqlen)
+    {
+        log_warn("proto_getr_parse: malformed request");
+        goto ERR;
+    }
+
+    *off     = _get64(&req[8]);
+    *len     = _get64(&req[16]);
+    *pathlen = _get16(&req[2]);
+    *path    = (const char *)&req[24];
+    ret      = 0;
+
+ERR:
+    return ret;
+}
+
+int64_t
+proto_send_range(int sockfd, int filefd, uint64_t off, uint64_t len)
+{
+    int64_t       ret                 = -1;
+    uint8_t       hdr[PROTO_GETR_HDR] = { 0 };
+    struct stat   st                  = { 0 };
+    off_t         pos                 = 0;
+    uint64_t      sent                = 0;
+    ssize_t       slen                = 0;
+    iopolicy_read io                  = { 0 };
+
+    // refused before the header goes out, so a client is never promised
+    // a size that sendfile can't deliver
+    if (0 != fstat(filefd, &st))
+    {
+        log_perror("proto_send_range: fstat error");
+        goto REFUSE;
+    }
+    if (!S_ISREG(st.st_mode) || 0 > st.st_size)
+    {
+        log_error("proto_send_range: not a regular file");
+        goto REFUSE;
+    }
+
+    if (off > (uint64_t)st.st_size)
+    {
+        off = st.st_size;
+    }
+    if (0 == len || len > st.st_size - off)
+    {
+        len = st.st_size - off;
+    }
+
+    hdr[0] = SUCCESS;
+    _put64(&hdr[4], st.st_size);
+    _put64(&hdr[12], off);
+    _put64(&hdr[20], len);
+    // corked only when data follows; an empty range would otherwise sit
+    // in the socket until the cork times out
+    if (0 != _send_all(sockfd, hdr, sizeof(hdr), (0 < len) ? MSG_MORE : 0))
+    {
+        goto ERR;
+    }
+
+    pos = off;
+    iopolicy_read_begin(&io, filefd, off, len, st.st_size);
+    while (sent < len)
+    {
+        slen = sendfile(
+            sockfd, filefd, &pos, iopolicy_read_next(&io, pos, len - sent));
+        if (0 > slen)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno || EWOULDBLOCK == errno)
+                && 0 == tcp_wait_writable(sockfd))
+            {
+                continue;
+            }
+            log_perror("proto_send_range: sendfile error");
+            goto ERR;
+        }
+        if (0 == slen)
+        {
+            // file shrank underneath us; the client sees a short range
+            log_error("proto_send_range: unexpected end of file");
+            goto ERR;
+        }
+        sent += slen;
+        metrics_add(METRIC_BYTES_OUT, slen);
+    }
+    flight_mark(FLIGHT_SEND);
+    metrics_retcode(GETR_OP, SUCCESS);
+
+    ret = sent;
+    goto RET;
+
+REFUSE:
+    hdr[0] = FAIL;
+    _send_all(sockfd, hdr, sizeof(hdr), 0);
+ERR:
+    metrics_retcode(GETR_OP, FAIL);
+RET:
+    iopolicy_read_end(&io, pos);
+    return ret;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_conn_free_frame(void *p)
+{
+    node *n = (node *)p;
+    _frame_free(n->data);
+    n->data = NULL;
+    n->next = NULL;
+    n->f    = NULL;
+    free(n);
+    return;
+}
+
+static frame *
+_frame_new(int64_t flen)
+{
+    frame *f      = NULL;
+    bool   pooled = (NETBUF_CHUNK_LEN >= sizeof(frame) + flen);
+
+    f = pooled ? netbuf_acquire(sizeof(frame) + flen)
+               : malloc(sizeof(frame) + flen);
+    if (NULL != f)
+    {
+        f->pooled = pooled;
+    }
+    return f;
+}
+
+static void
+_frame_free(frame *f)
+{
+    if (NULL != f && f->pooled)
+    {
+        netbuf_release(f);
+        return;
+    }
+    free(f);
+}
+
+static int
+_conn_parse(proto_conn *conn, uint64_t start, uint64_t parsed)
+{
+    int      ret  = 0;
+    int64_t  flen = 0;
+    uint32_t off  = 0;
+    frame *  f    = NULL;
+
+    // admission is checked per frame, so a read that brought in a burst of
+    // small frames cannot take the connection past its limits; a closing
+    // connection is no longer polled, so it is let through one frame at a
+    // time whatever the server wide limit
+    while ((proto_conn_readable(conn)
+            || (conn->closing && 0 == atomic_load(&(conn->npending))))
+           && 0 < (flen = proto_reqlen(&conn->buf[off], conn->len - off))
+           && flen <= conn->len - off)
+    {
+        f = _frame_new(flen);
+        if (NULL == f)
+        {
+            log_error("_conn_parse: couldn't allocate frame");
+            break;
+        }
+        f->len = flen;
+        memset(&f->rec, 0, sizeof(f->rec));
+        f->rec.start            = start;
+        f->rec.at[FLIGHT_PARSE] = parsed;
+        memcpy(f->data, &conn->buf[off], flen);
+        push_back(conn->pending, f, _conn_free_frame);
+        trace_request_parsed(conn->fd, f->data[0], flen);
+        atomic_fetch_add(&(conn->npending), 1);
+        if (NULL != conn->admit)
+        {
+            atomic_fetch_add(&(conn->admit->inflight), 1);
+        }
+        off += flen;
+        ret++;
+    }
+    metrics_add(METRIC_FRAMES_QUEUED, ret);
+
+    memmove(conn->buf, &conn->buf[off], conn->len - off);
+    conn->len -= off;
+
+    return ret;
+}
+
+static int
+_conn_fill(proto_conn *conn)
+{
+    int      ret    = 0;
+    ssize_t  rlen   = 0;
+    int64_t  flen   = 0;
+    uint32_t newcap = 0;
+    uint8_t *newbuf = NULL;
+
+    for (;;)
+    {
+        if (conn->len == conn->cap)
+        {
+            // a whole frame is already buffered; leave the rest in the
+            // socket until it has been queued, poll will report it again
+            flen = proto_reqlen(conn->buf, conn->len);
+            if (0 < flen && flen <= conn->len)
+            {
+                goto ERR;
+            }
+            if (0 > flen)
+            {
+                log_warn("_conn_fill: invalid or oversized frame");
+                ret = -1;
+                goto ERR;
+            }
+
+            // grow to fit the frame being received if its length is known
+            newcap = (flen > conn->cap) ? flen : conn->cap * 2;
+            newbuf = realloc(conn->buf, newcap);
+            if (NULL == newbuf)
+            {
+                log_error("_conn_fill: couldn't grow buffer");
+                ret = -1;
+                goto ERR;
+            }
+            conn->buf = newbuf;
+            conn->cap = newcap;
+        }
+
+        rlen = recv(conn->fd,
+                    &conn->buf[conn->len],
+                    conn->cap - conn->len,
+                    MSG_DONTWAIT);
+        if (0 > rlen)
+        {
+            if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+            {
+                log_perror("_conn_fill: recv error");
+                ret = -1;
+            }
+            if (EINTR != errno)
+            {
+                goto ERR;
+            }
+            continue;
+        }
+        if (0 == rlen)
+        {
+            ret = -1;
+            goto ERR;
+        }
+
+        conn->len += rlen;
+        metrics_add(METRIC_BYTES_IN, rlen);
+    }
+
+ERR:
+    return ret;
+}
+
+static void
+_conn_drain(void *conn_in)
+{
+    proto_conn *conn    = (proto_conn *)conn_in;
+    frame *     f       = NULL;
+    uint64_t    start   = 0;
+    bool        closing = false;
+    int         fd      = -1;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&(conn->lock));
+        // frames held back in the buffer by the admission limits are queued
+        // here as earlier ones finish; the socket may have nothing new to
+        // make the poller read it again, and once it is closing the poller
+        // no longer reads it at all
+        if (!conn->dropping)
+        {
+            if (conn->closing && NULL == conn->pending->head)
+            {
+                _conn_fill(conn);
+            }
+            _conn_parse(conn, flight_now(), 0);
+            if (0 > proto_reqlen(conn->buf, conn->len))
+            {
+                // seen by the poller as a hangup, which ends the connection
+                shutdown(conn->fd, SHUT_RD);
+                conn->len = 0;
+            }
+        }
+        f = (NULL != conn->pending->head) ? pop_front(conn->pending) : NULL;
+        if (NULL == f)
+        {
+            conn->running = false;
+            closing       = conn->closing;
+            pthread_cond_broadcast(&(conn->idle));
+        }
+        pthread_mutex_unlock(&(conn->lock));
+
+        if (NULL == f)
+        {
+            // nothing else holds the pipeline once it is closing
+            if (closing)
+            {
+                fd = conn->fd;
+                _conn_free(conn);
+                close(fd);
+            }
+            break;
+        }
+
+        trace_request_start(conn->fd, f->data[0]);
+        flight_begin(&f->rec);
+        start = _conn_now();
+        (conn->rh)(conn->fd, f->data, f->len);
+        metrics_request(f->data[0], _conn_now() - start);
+        flight_end(conn->fd, f->data[0]);
+        trace_response_sent(conn->fd, f->data[0]);
+        _frame_free(f);
+        f = NULL;
+        _conn_done(conn);
+    }
+
+    return;
+}
+
+static int
+_conn_free(proto_conn *conn)
+{
+    int ret = 0;
+
+    ret           = ll_destroy(conn->pending);
+    conn->pending = NULL;
+    pthread_cond_destroy(&(conn->idle));
+    pthread_mutex_destroy(&(conn->lock));
+    free(conn->buf);
+    conn->buf = NULL;
+    free(conn);
+
+    return ret;
+}
+
+static void
+_conn_done(proto_conn *conn)
+{
+    proto_admit *admit    = conn->admit;
+    uint32_t     pending  = 0;
+    uint32_t     inflight = 0;
+
+    pending = atomic_fetch_sub(&(conn->npending), 1);
+    metrics_add(METRIC_FRAMES_DONE, 1);
+    if (NULL == admit)
+    {
+        return;
+    }
+    inflight = atomic_fetch_sub(&(admit->inflight), 1);
+
+    // only a step down from exactly a limit can unpause anything
+    if (pending == admit->maxpending || inflight == admit->maxinflight
+        || inflight == admit->highwater)
+    {
+        tcp_netpoll_wake();
+    }
+}
+
+static uint64_t
+_conn_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+_batch_work(batch *b)
+{
+    uint32_t i = 0;
+
+    while ((i = atomic_fetch_add(&(b->next), 1)) < b->count)
+    {
+        b->status[i] = (b->bh)(b->ctx,
+                               b->op,
+                               b->paths[i],
+                               b->pathlens[i],
+                               &(b->out[i]),
+                               &(b->outlen[i]));
+        if (GET_OP != b->op || NULL == b->out[i])
+        {
+            b->outlen[i] = 0;
+        }
+
+        if (atomic_fetch_add(&(b->done), 1) + 1 == b->count)
+        {
+            pthread_mutex_lock(&(b->lock));
+            pthread_cond_broadcast(&(b->cond));
+            pthread_mutex_unlock(&(b->lock));
+        }
+    }
+
+    return;
+}
+
+static void
+_batch_job(void *batch_in)
+{
+    batch *b = (batch *)batch_in;
+
+    _batch_work(b);
+    _batch_release(b);
+    return;
+}
+
+static void
+_batch_release(batch *b)
+{
+    if (1 != atomic_fetch_sub(&(b->refs), 1))
+    {
+        return;
+    }
+
+    pthread_cond_destroy(&(b->cond));
+    pthread_mutex_destroy(&(b->lock));
+    free(b->paths);
+    free(b->pathlens);
+    free(b->status);
+    free(b->out);
+    free(b->outlen);
+    free(b);
+    return;
+}
+
+static batch *
+_batch_exec(threadpool *   pool,
+            const uint8_t *req,
+            uint32_t       reqlen,
+            batchhandler   bh,
+            void *         ctx)
+{
+    batch *  ret   = NULL;
+    batch *  b     = NULL;
+    uint32_t off   = 12;
+    uint32_t njobs = 0;
+
+    if (NULL == pool || NULL == req || NULL == bh
+        || 12 > reqlen || BATCH_OP != req[0] || 12 + _get32(&req[8]) != reqlen)
+    {
+        log_warn("_batch_exec: malformed request");
+        goto ERR;
+    }
+
+    if (GET_OP != req[1] && DEL_OP != req[1] && MK_OP != req[1])
+    {
+        log_warn("_batch_exec: bad sub opcode %u", req[1]);
+        goto ERR;
+    }
+
+    b = calloc(1, sizeof(struct batch_));
+    if (NULL == b)
+    {
+        log_error("_batch_exec: couldn't calloc batch");
+        goto ERR;
+    }
+    b->op       = req[1];
+    b->count    = _get16(&req[2]);
+    b->bh       = bh;
+    b->ctx      = ctx;
+    b->paths    = calloc(b->count + 1, sizeof(char *));
+    b->pathlens = calloc(b->count + 1, sizeof(uint16_t));
+    b->status   = calloc(b->count + 1, sizeof(uint8_t));
+    b->out      = calloc(b->count + 1, sizeof(uint8_t *));
+    b->outlen   = calloc(b->count + 1, sizeof(uint32_t));
+    pthread_mutex_init(&(b->lock), NULL);
+    pthread_cond_init(&(b->cond), NULL);
+    atomic_init(&(b->refs), 1);
+    if (NULL == b->paths || NULL == b->pathlens || NULL == b->status
+        || NULL == b->out || NULL == b->outlen)
+    {
+        log_error("_batch_exec: couldn't calloc items");
+        goto ERR;
+    }
+
+    for (uint16_t i = 0; i < b->count; i++)
+    {
+        if (off + 2 > reqlen || off + 2 + _get16(&req[off]) > reqlen)
+        {
+            log_warn("_batch_exec: item %u out of bounds", i);
+            goto ERR;
+        }
+        b->pathlens[i] = _get16(&req[off]);
+        b->paths[i]    = (const char *)&req[off + 2];
+        off += 2 + b->pathlens[i];
+    }
+    if (off != reqlen)
+    {
+        log_warn("_batch_exec: trailing bytes in request");
+        goto ERR;
+    }
+
+    // one job per worker at most; the caller works through items as well
+    // so the batch finishes even if every worker is busy
+    njobs = (0 < b->count) ? b->count - 1u : 0;
+    if (njobs > pool->nthreads)
+    {
+        njobs = pool->nthreads;
+    }
+    for (uint32_t i = 0; i < njobs; i++)
+    {
+        atomic_fetch_add(&(b->refs), 1);
+        if (0 != thpool_add_job(pool, _batch_job, b))
+        {
+            atomic_fetch_sub(&(b->refs), 1);
+            break;
+        }
+    }
+
+    _batch_work(b);
+
+    pthread_mutex_lock(&(b->lock));
+    while (atomic_load(&(b->done)) < b->count)
+    {
+        pthread_cond_wait(&(b->cond), &(b->lock));
+    }
+    pthread_mutex_unlock(&(b->lock));
+
+    // each item is answered with its own status inside the response
+    for (uint16_t i = 0; i < b->count; i++)
+    {
+        metrics_retcode(b->op, b->status[i]);
+    }
+
+    ret = b;
+    b   = NULL;
+
+ERR:
+    if (NULL != b)
+    {
+        _batch_release(b);
+    }
+    b = NULL;
+    return ret;
+}
+
+static uint64_t
+_batch_resplen(const batch *b)
+{
+    uint64_t len = 4;
+
+    if (GET_OP != b->op)
+    {
+        return len + b->count;
+    }
+    for (uint16_t i = 0; i < b->count; i++)
+    {
+        len += 5 + (uint64_t)b->outlen[i];
+    }
+
+    return len;
+}
+
+static void
+_batch_free(batch *b)
+{
+    for (uint16_t i = 0; NULL != b->out && i < b->count; i++)
+    {
+        free(b->out[i]);
+        b->out[i] = NULL;
+    }
+    _batch_release(b);
+}
+
+static int
+_send_all(int fd, const uint8_t *buf, size_t len, int flags)
+{
+    size_t  total = 0;
+    ssize_t slen  = 0;
+
+    while (total < len)
+    {
+        slen = send(fd, &buf[total], len - total, flags | MSG_NOSIGNAL);
+        if (0 > slen)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN == errno || EWOULDBLOCK == errno)
+                && 0 == tcp_wait_writable(fd))
+            {
+                continue;
+            }
+            log_perror("_send_all: send error");
+            return -1;
+        }
+        total += slen;
+        metrics_add(METRIC_BYTES_OUT, slen);
+    }
+    flight_mark(FLIGHT_SEND);
+
+    return 0;
+}
+
+static uint32_t
+_get16(const uint8_t *p)
+{
+    uint16_t v = 0;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+static uint32_t
+_get32(const uint8_t *p)
+{
+    uint32_t v = 0;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static uint64_t
+_get64(const uint8_t *p)
+{
+    return ((uint64_t)_get32(p) << 32) | _get32(&p[4]);
+}
+
+static void
+_put32(uint8_t *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void
+_put64(uint8_t *p, uint64_t v)
+{
+    _put32(p, v >> 32);
+    _put32(&p[4], v & 0xffffffff);
+}
+/* PRIVATE FUNCTION DEFINITIONS */
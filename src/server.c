@@ -4,6 +4,17 @@
 #include <ctype.h>
 #include <limits.h>
 #include <netpoll.h>
+#include <pathres.h>
+#include <shaper.h>
+#include <log.h>
+#include <metrics.h>
+#include <flight.h>
+#include <hotcache.h>
+#include <iopolicy.h>
+#include <units.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
 
 /**
  * @brief prints command line usage information, separated from main to reduce
@@ -11,24 +22,49 @@
  */
 static void usage(void);
 
+/**
+ * @brief reads an atomic_ulong counter for metrics_register
+ */
+static double _read_counter(void *arg);
+
+/**
+ * @brief reads log_dropped for metrics_register
+ */
+static double _read_logdropped(void *arg);
+
+/**
+ * @brief exposes counters other modules already keep on the metrics
+ *        endpoint
+ *
+ * @return 0 on success; nonzero on error
+ */
+static int _register_metrics(void);
+
 int
 main(int argc, char **argv)
 {
-    int   ret     = 0;
-    uint  timeout = 0;
-    char *serv_dir;
-    uint  port = 0;
-    char  c    = 0;
-    char *err  = NULL;
-
-    if (7 != argc)
+    int       ret      = 0;
+    uint      timeout  = 0;
+    char *    serv_dir = NULL;
+    int       rootfd   = -1;
+    uint      port     = 0;
+    char      c        = 0;
+    char *    err      = NULL;
+    char *    limits   = NULL;
+    char *    mwhere   = NULL;
+    ulong     slow_ms  = 0;
+    uint64_t  cachesz  = 0;
+    shaper *  sh       = NULL;
+    hotcache *hc       = NULL;
+
+    if (7 > argc || 17 < argc || 0 == argc % 2)
     {
         usage();
         ret = -1;
         goto ERR;
     }
 
-    while ((c = getopt(argc, argv, "t:d:p:")) != -1)
+    while ((c = getopt(argc, argv, "t:d:p:b:m:r:c:i:")) != -1)
     {
         switch (c)
         {
@@ -43,20 +79,52 @@ main(int argc, char **argv)
                 }
                 break;
             case 'd':
-                // check if valid directory?
                 serv_dir = optarg;
                 break;
             case 'p':
                 port = strtoul(optarg, &err, 10);
-                if (0 != *err || port > 0 || port > USHRT_MAX)
+                if (0 != *err || 0 == port || port > USHRT_MAX)
                 {
                     fprintf(stderr, "Invalid value for -p <port_number>\n");
                     ret = -1;
                     goto ERR;
                 }
                 break;
+            case 'b':
+                limits = optarg;
+                break;
+            case 'm':
+                mwhere = optarg;
+                break;
+            case 'i':
+                if (0 != iopolicy_parse(optarg))
+                {
+                    fprintf(stderr, "Invalid value for -i <io_policy>\n");
+                    ret = -1;
+                    goto ERR;
+                }
+                break;
+            case 'c':
+                if (0 != units_bytes(optarg, NULL, &cachesz))
+                {
+                    fprintf(stderr, "Invalid value for -c <cache_bytes>\n");
+                    ret = -1;
+                    goto ERR;
+                }
+                break;
+            case 'r':
+                slow_ms = strtoul(optarg, &err, 10);
+                if (0 != *err)
+                {
+                    fprintf(stderr, "Invalid value for -r <slow_request_ms>\n");
+                    ret = -1;
+                    goto ERR;
+                }
+                break;
             case '?':
-                if (optopt == 't' || optopt == 'd' || optopt == 'p')
+                if (optopt == 't' || optopt == 'd' || optopt == 'p'
+                    || optopt == 'b' || optopt == 'm' || optopt == 'r'
+                    || optopt == 'c' || optopt == 'i')
                 {
                     fprintf(
                         stderr, "Option -%c requires an argument.\n", optopt);
@@ -75,9 +143,84 @@ main(int argc, char **argv)
         }
     }
 
+    // a client that stops reading fails its write after the connection
+    // timeout rather than holding a worker until it resumes
+    if (0 < timeout)
+    {
+        netpoll_iotimeout
+            = ((uint)INT_MAX / 1000 < timeout) ? -1 : (int)timeout * 1000;
+    }
+
+    // before any other thread starts, so SIGUSR2 is left to the thread
+    // that dumps the last requests to the log
+    if (0 != flight_init(FLIGHT_SLOTS, slow_ms * 1000000, SIGUSR2))
+    {
+        ret = -1;
+        goto ERR;
+    }
+
+    // from here on the request path hands its messages to the drain thread
+    // instead of writing to the terminal itself
+    if (0 != log_init(STDERR_FILENO, LOG_LVL_INFO))
+    {
+        ret = -1;
+        goto ERR;
+    }
+
+    // held for the lifetime of the server; all client paths are resolved
+    // beneath it with pathres_open
+    rootfd = pathres_rootopen(serv_dir);
+    if (0 > rootfd)
+    {
+        fprintf(stderr, "Invalid value for -d <path_to_server_folder>\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    // limits can be changed later through shaper_set_role and
+    // shaper_set_session while transfers are running
+    sh = shaper_init();
+    if (NULL == sh || (NULL != limits && 0 != shaper_parse(sh, limits)))
+    {
+        fprintf(stderr, "Invalid value for -b <bandwidth_limits>\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    // small files read often are served from memory; a hit is checked
+    // against an fstat of the file, and whatever handles PUT_OP, DEL_OP and
+    // UPCOMMIT_OP should also call hotcache_invalidate to free it at once
+    if (0 < cachesz && NULL == (hc = hotcache_init(cachesz)))
+    {
+        fprintf(stderr, "Invalid value for -c <cache_bytes>\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    // scraped over its own socket so a busy client port never delays it
+    if (NULL != mwhere
+        && (0 != _register_metrics() || 0 != metrics_serve(mwhere)))
+    {
+        fprintf(stderr, "Invalid value for -m <metrics_port_or_socket>\n");
+        ret = -1;
+        goto ERR;
+    }
+
     printf("t = %u / d = %s / p = %hu\n", timeout, serv_dir, port);
 
 ERR:
+    metrics_stop();
+    hotcache_destroy(hc);
+    if (NULL != sh)
+    {
+        shaper_destroy(sh);
+    }
+    if (0 <= rootfd)
+    {
+        close(rootfd);
+    }
+    flight_shutdown();
+    log_shutdown();
     return ret;
 }
 
@@ -86,5 +229,105 @@ usage(void)
 {
     fprintf(stderr,
             "Usage: ./capstone -t <timeout_seconds> -d <path_to_server_folder> "
-            "-p <listening_port>\n");
+            "-p <listening_port> [-b <bandwidth_limits>]\n"
+            "    [-m <metrics_port_or_socket>] [-r <slow_request_ms>] "
+            "[-c <cache_bytes>]\n"
+            "    [-i <io_policy>]\n"
+            "    bandwidth_limits: role=rate[/session_rate],... with role one "
+            "of ro, rw, ad\n"
+            "    and rates in bytes/s with an optional K, M or G suffix, "
+            "e.g. ro=100M/10M,rw=400M\n"
+            "    metrics_port_or_socket: port on 127.0.0.1, or a path with a "
+            "'/' for a Unix\n"
+            "    socket, serving Prometheus text, e.g. 9100 or "
+            "./capstone.metrics\n"
+            "    slow_request_ms: requests slower than this are logged with "
+            "the time each\n"
+            "    stage took; SIGUSR2 logs the last %d requests the same way\n"
+            "    cache_bytes: memory for caching files of up to %d bytes, "
+            "with an optional\n"
+            "    K, M or G suffix, e.g. 256M; rounded up to whole 2M huge "
+            "pages\n"
+            "    io_policy: page cache hints as key=bytes with an optional K, "
+            "M or G suffix,\n"
+            "    0 turning one off: ra (readahead window), drop (file size "
+            "from which sent\n"
+            "    pages are dropped), dirty (writeback batch), e.g. "
+            "ra=2M,drop=256M,dirty=8M;\n"
+            "    or off\n"
+            "    K, M and G are powers of 1024 in every size and rate\n",
+            FLIGHT_SLOTS,
+            HOTCACHE_MAX_FILE);
+}
+
+static double
+_read_counter(void *arg)
+{
+    return atomic_load((atomic_ulong *)arg);
+}
+
+static double
+_read_logdropped(void *arg)
+{
+    (void)arg;
+    return log_dropped();
+}
+
+static int
+_register_metrics(void)
+{
+    int ret = 0;
+
+    ret |= metrics_register("netpoll_rejected_total",
+                            "Connections closed because maxcon was reached.",
+                            "counter",
+                            _read_counter,
+                            &netpoll_stat.nrejected);
+    ret |= metrics_register("netpoll_read_paused_total",
+                            "Times a client socket stopped being polled.",
+                            "counter",
+                            _read_counter,
+                            &netpoll_stat.nreadpaused);
+    ret |= metrics_register("netpoll_accept_paused_total",
+                            "Times accepting was paused.",
+                            "counter",
+                            _read_counter,
+                            &netpoll_stat.nacceptpaused);
+    ret |= metrics_register("log_dropped_total",
+                            "Log records dropped because a ring was full.",
+                            "counter",
+                            _read_logdropped,
+                            NULL);
+    ret |= metrics_register("hotcache_hits_total",
+                            "Files served from the cache.",
+                            "counter",
+                            _read_counter,
+                            &hotcache_stat.nhits);
+    ret |= metrics_register("hotcache_misses_total",
+                            "Cache lookups that went to disk.",
+                            "counter",
+                            _read_counter,
+                            &hotcache_stat.nmisses);
+    ret |= metrics_register("hotcache_admitted_total",
+                            "Files stored in the cache after a miss.",
+                            "counter",
+                            _read_counter,
+                            &hotcache_stat.nadmitted);
+    ret |= metrics_register("hotcache_rejected_total",
+                            "Files kept out by the frequency sketch.",
+                            "counter",
+                            _read_counter,
+                            &hotcache_stat.nrejected);
+    ret |= metrics_register("hotcache_evicted_total",
+                            "Files dropped to make room for another.",
+                            "counter",
+                            _read_counter,
+                            &hotcache_stat.nevicted);
+    ret |= metrics_register("hotcache_invalidated_total",
+                            "Files dropped because they were written.",
+                            "counter",
+                            _read_counter,
+                            &hotcache_stat.ninvalidated);
+
+    return ret;
 }
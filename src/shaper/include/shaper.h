@@ -0,0 +1,296 @@
+#ifndef _SHAPER_H
+#define _SHAPER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <threadpool.h>
+
+/**
+ * most bytes a transfer moves per token grant, and the smallest burst a
+ * bucket is given so a grant is never smaller than a useful send
+ */
+#define SHAPER_QUANTUM (64 * 1024)
+
+/**
+ * user roles; must match the create-ro, create-rw and create-ad flags of
+ * USER_OP in client.py
+ */
+typedef enum shaper_role_
+{
+    ROLE_RO    = 0x1,
+    ROLE_RW    = 0x2,
+    ROLE_ADMIN = 0x3,
+    ROLE_MAX,
+} shaper_role;
+
+/**
+ * @brief token bucket measured in bytes
+ *
+ * @param lock - protects every other member
+ *
+ * @param rate - refill rate in bytes per second; 0 for unlimited
+ *
+ * @param burst - most tokens the bucket holds
+ *
+ * @param tokens - tokens currently available
+ *
+ * @param last - CLOCK_MONOTONIC nanoseconds of the last refill
+ *
+ * @param sh - shaper a session bucket is registered with; NULL for a role
+ *        bucket
+ *
+ * @param role - role a session bucket follows the per session limit of
+ *
+ * @param prev - previous session of the same role; protected by the
+ *        shaper's lock rather than @param lock
+ *
+ * @param next - next session of the same role; protected likewise
+ *
+ */
+typedef struct shaper_bucket_
+{
+    pthread_mutex_t        lock;
+    uint64_t               rate;
+    uint64_t               burst;
+    double                 tokens;
+    uint64_t               last;
+    struct shaper_ *       sh;
+    int                    role;
+    struct shaper_bucket_ *prev;
+    struct shaper_bucket_ *next;
+} shaper_bucket;
+
+/**
+ * @brief bandwidth limits of a server
+ *
+ * @param roles - aggregate bucket shared by every session of a role
+ *
+ * @param lock - protects @param srate, @param sburst and @param sessions
+ *
+ * @param srate - per session rate of a role
+ *
+ * @param sburst - per session burst of a role
+ *
+ * @param sessions - live session buckets of a role, so a change to the
+ *        per session limit reaches them too
+ *
+ */
+typedef struct shaper_
+{
+    shaper_bucket   roles[ROLE_MAX];
+    pthread_mutex_t lock;
+    uint64_t        srate[ROLE_MAX];
+    uint64_t        sburst[ROLE_MAX];
+    shaper_bucket * sessions[ROLE_MAX];
+} shaper;
+
+/**
+ * @brief throttled file transfer; opaque to callers
+ */
+typedef struct shaper_xfer_ shaper_xfer;
+
+/**
+ * @brief called once a throttled transfer has finished
+ *
+ * @param arg - argument given to shaper_sendfile
+ *
+ * @param sent - bytes sent; -1 on error
+ *
+ * @return nothing
+ *
+ */
+typedef void (*shaper_done)(void *arg, int64_t sent);
+
+/**
+ * @brief initializes a shaper with every limit off
+ *
+ * @return pointer to initialized shaper; NULL on error
+ *
+ */
+shaper *shaper_init(void);
+
+/**
+ * @brief sets limits from a startup option of comma separated
+ *        role=rate[/session rate] entries, role being ro, rw or ad and
+ *        rates in bytes per second with an optional K, M or G suffix in
+ *        powers of 1024, e.g. "ro=100M/10M,rw=400M"
+ *
+ * @param sh - shaper
+ *
+ * @param spec - limit specification
+ *
+ * @return 0 on success; nonzero on a malformed @param spec
+ *
+ */
+int shaper_parse(shaper *sh, const char *spec);
+
+/**
+ * @brief changes the aggregate limit of a role; takes effect on the next
+ *        grant so it may be called while transfers are running
+ *
+ * @param sh - shaper
+ *
+ * @param role - role to change
+ *
+ * @param rate - bytes per second; 0 for unlimited
+ *
+ * @param burst - bucket size; 0 for a quarter second worth of @param rate
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int shaper_set_role(shaper *    sh,
+                    shaper_role role,
+                    uint64_t    rate,
+                    uint64_t    burst);
+
+/**
+ * @brief changes the per session limit of a role, both for new sessions
+ *        and every live one; takes effect on their next grant
+ *
+ * @param sh - shaper
+ *
+ * @param role - role to change
+ *
+ * @param rate - bytes per second; 0 for unlimited
+ *
+ * @param burst - bucket size; 0 for a quarter second worth of @param rate
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int shaper_set_session(shaper *    sh,
+                       shaper_role role,
+                       uint64_t    rate,
+                       uint64_t    burst);
+
+/**
+ * @brief initializes the bucket of a new session from its role's per
+ *        session limit and registers it so later changes to that limit
+ *        apply to it
+ *
+ * @param sh - shaper
+ *
+ * @param role - role of the session's user
+ *
+ * @param b - session bucket to initialize
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int shaper_session_init(shaper *sh, shaper_role role, shaper_bucket *b);
+
+/**
+ * @brief changes the limit of one bucket at runtime; a later
+ *        shaper_set_session overrides it for a session bucket
+ *
+ * @param b - bucket
+ *
+ * @param rate - bytes per second; 0 for unlimited
+ *
+ * @param burst - bucket size; 0 for a quarter second worth of @param rate
+ *
+ * @return nothing
+ *
+ */
+void shaper_bucket_set(shaper_bucket *b, uint64_t rate, uint64_t burst);
+
+/**
+ * @brief unregisters a session bucket and destroys its lock; the bucket
+ *        itself belongs to the session and is not freed
+ *
+ * @param b - bucket from shaper_session_init
+ *
+ * @return nothing
+ *
+ */
+void shaper_bucket_destroy(shaper_bucket *b);
+
+/**
+ * @brief takes up to @param want tokens from a session bucket and its
+ *        role's bucket at once
+ *
+ * @param sess - session bucket; may be NULL
+ *
+ * @param role - role bucket; may be NULL
+ *
+ * @param want - bytes the caller would like to send
+ *
+ * @param wait - when nothing is granted, set to the nanoseconds until a
+ *        quantum will be available
+ *
+ * @return bytes granted
+ *
+ */
+uint64_t shaper_take(shaper_bucket *sess,
+                     shaper_bucket *role,
+                     uint64_t       want,
+                     uint64_t *     wait);
+
+/**
+ * @brief returns tokens that were granted but not used
+ *
+ * @param sess - session bucket; may be NULL
+ *
+ * @param role - role bucket; may be NULL
+ *
+ * @param unused - bytes to give back
+ *
+ * @return nothing
+ *
+ */
+void shaper_refund(shaper_bucket *sess, shaper_bucket *role, uint64_t unused);
+
+/**
+ * @brief sends @param len bytes of @param filefd from @param off with
+ *        sendfile(2) at the pace the buckets allow; when they run dry the
+ *        transfer is parked in the tcp_netpoll timer heap and resubmitted
+ *        to @param pool once tokens are back, and when the socket is full
+ *        it is parked with tcp_netpoll_writable until the client reads,
+ *        so no worker sleeps or blocks on it
+ *
+ * @param pool - pool the transfer runs on
+ *
+ * @param sess - session bucket; may be NULL
+ *
+ * @param role - role bucket; may be NULL
+ *
+ * @param sockfd - client socket
+ *
+ * @param filefd - file to send; stays owned by the caller until
+ *        @param done runs
+ *
+ * @param off - file offset to start at
+ *
+ * @param len - bytes to send
+ *
+ * @param done - run once the transfer finishes or fails
+ *
+ * @param arg - passed to @param done
+ *
+ * @return 0 if the transfer was started; nonzero on error, in which case
+ *         @param done is not run
+ *
+ */
+int shaper_sendfile(threadpool *   pool,
+                    shaper_bucket *sess,
+                    shaper_bucket *role,
+                    int            sockfd,
+                    int            filefd,
+                    uint64_t       off,
+                    uint64_t       len,
+                    shaper_done    done,
+                    void *         arg);
+
+/**
+ * @brief frees a shaper; transfers using its buckets must have finished
+ *        and its session buckets must have been destroyed
+ *
+ * @param sh - shaper
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int shaper_destroy(shaper *sh);
+
+#endif /* _SHAPER_H */
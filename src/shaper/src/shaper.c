@@ -0,0 +1,673 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <shaper.h>
+#include <netpoll.h>
+#include <metrics.h>
+#include <iopolicy.h>
+#include <units.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define NSEC 1000000000ULL
+
+/**
+ * delay before a transfer refused by a full job queue is offered again
+ */
+#define SHAPER_REQUEUE_NS 1000000ULL
+
+/**
+ * @brief state of a throttled sendfile between grants
+ *
+ * @param pool - pool the transfer runs on
+ *
+ * @param sess - session bucket
+ *
+ * @param role - role bucket
+ *
+ * @param sockfd - client socket
+ *
+ * @param filefd - file being sent
+ *
+ * @param pos - next file offset to send
+ *
+ * @param left - bytes still to send
+ *
+ * @param sent - bytes sent so far
+ *
+ * @param done - completion callback
+ *
+ * @param arg - passed to @param done
+ *
+ * @param io - readahead and drop-behind state of @param filefd
+ *
+ */
+struct shaper_xfer_
+{
+    threadpool *   pool;
+    shaper_bucket *sess;
+    shaper_bucket *role;
+    int            sockfd;
+    int            filefd;
+    off_t          pos;
+    uint64_t       left;
+    uint64_t       sent;
+    shaper_done    done;
+    void *         arg;
+    iopolicy_read  io;
+};
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds
+ *
+ */
+static uint64_t _shaper_now(void);
+
+/**
+ * @brief sets up a bucket that starts full
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _bucket_init(shaper_bucket *b, uint64_t rate, uint64_t burst);
+
+/**
+ * @brief burst to use for @param rate when none is given, never below one
+ *        quantum
+ *
+ */
+static uint64_t _bucket_burst(uint64_t rate, uint64_t burst);
+
+/**
+ * @brief adds the tokens earned since the last refill; caller holds the
+ *        bucket lock
+ *
+ * @return nothing
+ *
+ */
+static void _bucket_refill(shaper_bucket *b, uint64_t now);
+
+/**
+ * @brief threadpool job sending as much of a transfer as the buckets
+ *        allow, then either finishing it or parking it
+ *
+ * @param xfer_in - pointer to the transfer
+ *
+ * @return nothing
+ *
+ */
+static void _xfer_job(void *xfer_in);
+
+/**
+ * @brief timer callback that puts a parked transfer back on its pool
+ *
+ * @param xfer_in - pointer to the transfer
+ *
+ * @return nothing
+ *
+ */
+static void _xfer_wake(void *xfer_in);
+
+/**
+ * @brief poller callback that puts a transfer parked on a full socket back
+ *        on its pool, or fails it if the client stopped reading
+ *
+ * @param xfer_in - pointer to the transfer
+ *
+ * @param ready - nonzero if the socket can take more data
+ *
+ * @return nothing
+ *
+ */
+static void _xfer_writable(void *xfer_in, int ready);
+
+/**
+ * @brief runs the completion callback and frees the transfer
+ *
+ * @return nothing
+ *
+ */
+static void _xfer_finish(shaper_xfer *x, int64_t sent);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+shaper *
+shaper_init(void)
+{
+    shaper *ret = NULL;
+    shaper *sh  = NULL;
+    int     i   = 0;
+
+    sh = calloc(1, sizeof(struct shaper_));
+    if (NULL == sh)
+    {
+        fprintf(stderr, "! shaper_init: couldn't calloc shaper\n");
+        goto ERR;
+    }
+
+    for (i = 0; i < ROLE_MAX; i++)
+    {
+        if (0 != _bucket_init(&(sh->roles[i]), 0, 0))
+        {
+            goto ERR;
+        }
+    }
+
+    if (0 != pthread_mutex_init(&(sh->lock), NULL))
+    {
+        fprintf(stderr, "! shaper_init: couldn't init mutex\n");
+        goto ERR;
+    }
+
+    ret = sh;
+    sh  = NULL;
+
+ERR:
+    while (NULL != sh && 0 < i--)
+    {
+        pthread_mutex_destroy(&(sh->roles[i].lock));
+    }
+    free(sh);
+    sh = NULL;
+    return ret;
+}
+
+int
+shaper_parse(shaper *sh, const char *spec)
+{
+    const char *p     = spec;
+    shaper_role role  = 0;
+    uint64_t    rate  = 0;
+    uint64_t    srate = 0;
+
+    if (NULL == sh || NULL == spec)
+    {
+        return -1;
+    }
+
+    while ('\0' != *p)
+    {
+        if (0 == strncmp(p, "ro=", 3))
+        {
+            role = ROLE_RO;
+        }
+        else if (0 == strncmp(p, "rw=", 3))
+        {
+            role = ROLE_RW;
+        }
+        else if (0 == strncmp(p, "ad=", 3))
+        {
+            role = ROLE_ADMIN;
+        }
+        else
+        {
+            fprintf(stderr, "! shaper_parse: unknown role in '%s'\n", p);
+            return -1;
+        }
+
+        if (0 != units_bytes(p + 3, &p, &rate))
+        {
+            return -1;
+        }
+        srate = 0;
+        if ('/' == *p && 0 != units_bytes(p + 1, &p, &srate))
+        {
+            return -1;
+        }
+        if (',' == *p)
+        {
+            p++;
+        }
+        else if ('\0' != *p)
+        {
+            fprintf(stderr, "! shaper_parse: trailing '%s'\n", p);
+            return -1;
+        }
+
+        shaper_set_role(sh, role, rate, 0);
+        shaper_set_session(sh, role, srate, 0);
+    }
+
+    return 0;
+}
+
+int
+shaper_set_role(shaper *sh, shaper_role role, uint64_t rate, uint64_t burst)
+{
+    if (NULL == sh || ROLE_RO > role || ROLE_MAX <= role)
+    {
+        fprintf(stderr, "! shaper_set_role: bad arguments\n");
+        return -1;
+    }
+
+    shaper_bucket_set(&(sh->roles[role]), rate, burst);
+    return 0;
+}
+
+int
+shaper_set_session(shaper *    sh,
+                   shaper_role role,
+                   uint64_t    rate,
+                   uint64_t    burst)
+{
+    if (NULL == sh || ROLE_RO > role || ROLE_MAX <= role)
+    {
+        fprintf(stderr, "! shaper_set_session: bad arguments\n");
+        return -1;
+    }
+
+    // bucket locks nest inside the shaper's, never the other way round
+    pthread_mutex_lock(&(sh->lock));
+    sh->srate[role]  = rate;
+    sh->sburst[role] = _bucket_burst(rate, burst);
+    for (shaper_bucket *b = sh->sessions[role]; NULL != b; b = b->next)
+    {
+        shaper_bucket_set(b, rate, burst);
+    }
+    pthread_mutex_unlock(&(sh->lock));
+    return 0;
+}
+
+int
+shaper_session_init(shaper *sh, shaper_role role, shaper_bucket *b)
+{
+    int ret = 0;
+
+    if (NULL == sh || NULL == b || ROLE_RO > role || ROLE_MAX <= role)
+    {
+        log_error("shaper_session_init: bad arguments");
+        return -1;
+    }
+
+    // registered under the same lock the limit is read with, so a change
+    // lands either before the read or on the registered bucket
+    pthread_mutex_lock(&(sh->lock));
+    ret = _bucket_init(b, sh->srate[role], sh->sburst[role]);
+    if (0 == ret)
+    {
+        b->sh   = sh;
+        b->role = role;
+        b->next = sh->sessions[role];
+        if (NULL != b->next)
+        {
+            b->next->prev = b;
+        }
+        sh->sessions[role] = b;
+    }
+    pthread_mutex_unlock(&(sh->lock));
+
+    return ret;
+}
+
+void
+shaper_bucket_set(shaper_bucket *b, uint64_t rate, uint64_t burst)
+{
+    if (NULL == b)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&(b->lock));
+    // settle what was earned at the old rate before switching
+    _bucket_refill(b, _shaper_now());
+    b->rate  = rate;
+    b->burst = _bucket_burst(rate, burst);
+    if (b->tokens > b->burst)
+    {
+        b->tokens = b->burst;
+    }
+    pthread_mutex_unlock(&(b->lock));
+}
+
+void
+shaper_bucket_destroy(shaper_bucket *b)
+{
+    if (NULL == b)
+    {
+        return;
+    }
+
+    if (NULL != b->sh)
+    {
+        pthread_mutex_lock(&(b->sh->lock));
+        if (NULL != b->prev)
+        {
+            b->prev->next = b->next;
+        }
+        else
+        {
+            b->sh->sessions[b->role] = b->next;
+        }
+        if (NULL != b->next)
+        {
+            b->next->prev = b->prev;
+        }
+        pthread_mutex_unlock(&(b->sh->lock));
+        b->sh = NULL;
+    }
+    pthread_mutex_destroy(&(b->lock));
+}
+
+uint64_t
+shaper_take(shaper_bucket *sess,
+            shaper_bucket *role,
+            uint64_t       want,
+            uint64_t *     wait)
+{
+    shaper_bucket *bs[2] = { sess, role };
+    uint64_t       grant = want;
+    uint64_t       need  = 0;
+    uint64_t       ns    = 0;
+    uint64_t       now   = _shaper_now();
+
+    if (NULL != wait)
+    {
+        *wait = 0;
+    }
+
+    // always session before role so two transfers never lock in opposite
+    // orders
+    for (int i = 0; i < 2; i++)
+    {
+        if (NULL != bs[i])
+        {
+            pthread_mutex_lock(&(bs[i]->lock));
+            _bucket_refill(bs[i], now);
+        }
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (NULL == bs[i] || 0 == bs[i]->rate)
+        {
+            continue;
+        }
+        // hold out for a whole quantum rather than dribble out tiny sends
+        need = (want < SHAPER_QUANTUM) ? want : SHAPER_QUANTUM;
+        if (bs[i]->tokens < need)
+        {
+            ns = (uint64_t)((need - bs[i]->tokens) * NSEC / bs[i]->rate) + 1;
+            if (NULL != wait && ns > *wait)
+            {
+                *wait = ns;
+            }
+            grant = 0;
+        }
+        else if (grant > (uint64_t)bs[i]->tokens)
+        {
+            grant = bs[i]->tokens;
+        }
+    }
+
+    for (int i = 1; i >= 0; i--)
+    {
+        if (NULL == bs[i])
+        {
+            continue;
+        }
+        if (0 != bs[i]->rate)
+        {
+            bs[i]->tokens -= grant;
+        }
+        pthread_mutex_unlock(&(bs[i]->lock));
+    }
+
+    return grant;
+}
+
+void
+shaper_refund(shaper_bucket *sess, shaper_bucket *role, uint64_t unused)
+{
+    shaper_bucket *bs[2] = { sess, role };
+
+    for (int i = 0; 0 < unused && i < 2; i++)
+    {
+        if (NULL == bs[i])
+        {
+            continue;
+        }
+        pthread_mutex_lock(&(bs[i]->lock));
+        if (0 != bs[i]->rate)
+        {
+            bs[i]->tokens += unused;
+            if (bs[i]->tokens > bs[i]->burst)
+            {
+                bs[i]->tokens = bs[i]->burst;
+            }
+        }
+        pthread_mutex_unlock(&(bs[i]->lock));
+    }
+}
+
+int
+shaper_sendfile(threadpool *   pool,
+                shaper_bucket *sess,
+                shaper_bucket *role,
+                int            sockfd,
+                int            filefd,
+                uint64_t       off,
+                uint64_t       len,
+                shaper_done    done,
+                void *         arg)
+{
+    shaper_xfer *x  = NULL;
+    struct stat  st = { 0 };
+
+    if (NULL == pool || NULL == done)
+    {
+        log_error("shaper_sendfile: NULL pool or callback");
+        return -1;
+    }
+
+    x = calloc(1, sizeof(struct shaper_xfer_));
+    if (NULL == x)
+    {
+        log_error("shaper_sendfile: couldn't calloc transfer");
+        return -1;
+    }
+    x->pool   = pool;
+    x->sess   = sess;
+    x->role   = role;
+    x->sockfd = sockfd;
+    x->filefd = filefd;
+    x->pos    = off;
+    x->left   = len;
+    x->done   = done;
+    x->arg    = arg;
+
+    // the file size only decides whether pages are dropped behind, so a
+    // failed fstat just keeps them
+    if (0 != fstat(filefd, &st))
+    {
+        st.st_size = 0;
+    }
+    iopolicy_read_begin(&(x->io), filefd, off, len, st.st_size);
+
+    if (0 != thpool_add_job(pool, _xfer_job, x))
+    {
+        free(x);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+shaper_destroy(shaper *sh)
+{
+    if (NULL == sh)
+    {
+        fprintf(stderr, "! shaper_destroy: NULL shaper\n");
+        return -1;
+    }
+
+    for (int i = 0; i < ROLE_MAX; i++)
+    {
+        pthread_mutex_destroy(&(sh->roles[i].lock));
+    }
+    pthread_mutex_destroy(&(sh->lock));
+    free(sh);
+    return 0;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static uint64_t
+_shaper_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static int
+_bucket_init(shaper_bucket *b, uint64_t rate, uint64_t burst)
+{
+    if (0 != pthread_mutex_init(&(b->lock), NULL))
+    {
+        log_error("_bucket_init: couldn't init mutex");
+        return -1;
+    }
+
+    b->rate   = rate;
+    b->burst  = _bucket_burst(rate, burst);
+    b->tokens = b->burst;
+    b->last   = _shaper_now();
+    b->sh     = NULL;
+    b->role   = 0;
+    b->prev   = NULL;
+    b->next   = NULL;
+    return 0;
+}
+
+static uint64_t
+_bucket_burst(uint64_t rate, uint64_t burst)
+{
+    if (0 == burst)
+    {
+        burst = rate / 4;
+    }
+
+    return (SHAPER_QUANTUM > burst) ? SHAPER_QUANTUM : burst;
+}
+
+static void
+_bucket_refill(shaper_bucket *b, uint64_t now)
+{
+    if (0 != b->rate && now > b->last)
+    {
+        b->tokens += (double)(now - b->last) * b->rate / NSEC;
+        if (b->tokens > b->burst)
+        {
+            b->tokens = b->burst;
+        }
+    }
+    b->last = now;
+}
+
+static void
+_xfer_job(void *xfer_in)
+{
+    shaper_xfer *x     = (shaper_xfer *)xfer_in;
+    uint64_t     grant = 0;
+    uint64_t     wait  = 0;
+    ssize_t      slen  = 0;
+
+    while (0 < x->left)
+    {
+        // capped at the readahead window, which is issued for the window
+        // after this one before anything is sent
+        grant = shaper_take(x->sess,
+                            x->role,
+                            iopolicy_read_next(&(x->io), x->pos, x->left),
+                            &wait);
+        if (0 == grant)
+        {
+            // park in the poller rather than sleep here; parking fails
+            // once the poller has stopped, as it would never run the timer
+            if (0 != tcp_netpoll_timer(wait, _xfer_wake, x))
+            {
+                _xfer_finish(x, -1);
+            }
+            return;
+        }
+
+        slen = sendfile(x->sockfd, x->filefd, &(x->pos), grant);
+        if (0 > slen && EINTR == errno)
+        {
+            shaper_refund(x->sess, x->role, grant);
+            continue;
+        }
+        if (0 > slen && EAGAIN == errno)
+        {
+            shaper_refund(x->sess, x->role, grant);
+            // the worker is given back while the client drains its socket;
+            // one that stops reading is failed after netpoll_iotimeout
+            if (0 != tcp_netpoll_writable(x->sockfd, _xfer_writable, x))
+            {
+                _xfer_finish(x, -1);
+            }
+            return;
+        }
+        if (0 >= slen)
+        {
+            log_perror("_xfer_job: sendfile error or unexpected end of file");
+            shaper_refund(x->sess, x->role, grant);
+            _xfer_finish(x, -1);
+            return;
+        }
+
+        shaper_refund(x->sess, x->role, grant - slen);
+        metrics_add(METRIC_BYTES_OUT, slen);
+        x->left -= slen;
+        x->sent += slen;
+    }
+
+    _xfer_finish(x, x->sent);
+}
+
+static void
+_xfer_wake(void *xfer_in)
+{
+    shaper_xfer *x = (shaper_xfer *)xfer_in;
+
+    // a full queue is retried a millisecond later rather than failing a
+    // transfer that is only waiting for a worker
+    if (0 != thpool_add_job(x->pool, _xfer_job, x)
+        && (EAGAIN != errno
+            || 0 != tcp_netpoll_timer(SHAPER_REQUEUE_NS, _xfer_wake, x)))
+    {
+        _xfer_finish(x, -1);
+    }
+}
+
+static void
+_xfer_writable(void *xfer_in, int ready)
+{
+    shaper_xfer *x = (shaper_xfer *)xfer_in;
+
+    if (!ready)
+    {
+        log_warn("_xfer_writable: client stopped reading");
+        _xfer_finish(x, -1);
+        return;
+    }
+
+    _xfer_wake(x);
+}
+
+static void
+_xfer_finish(shaper_xfer *x, int64_t sent)
+{
+    iopolicy_read_end(&(x->io), x->pos);
+    x->done(x->arg, sent);
+    free(x);
+}
+/* PRIVATE FUNCTION DEFINITIONS */
@@ -29,6 +29,12 @@ typedef struct job_
  *
  * @param lock - mutex to prevent race conditions on the queue
  *
+ * @param notify - signaled under @param lock when a job is queued or the
+ *        pool stops, so idle workers sleep instead of polling
+ *
+ * @param idle - broadcast once the queue is empty and no job is running,
+ *        for thpool_drain
+ *
  * @param queue - pointer to the head of the linked list / queue
  *
  * @param len - current number of job nodes in the queue
@@ -37,6 +43,8 @@ typedef struct job_
 typedef struct jobqueue_
 {
     pthread_mutex_t lock;
+    pthread_cond_t  notify;
+    pthread_cond_t  idle;
     ll *            queue;
     atomic_uint     len;
 } jobqueue;
@@ -55,6 +63,8 @@ typedef struct jobqueue_
  *
  * @param nthreads - number of worker threads in the pool
  *
+ * @param nbusy - jobs taken off the queue and not yet finished
+ *
  */
 typedef struct threadpool_
 {
@@ -62,9 +72,37 @@ typedef struct threadpool_
     jobqueue *  jq;
     atomic_bool keepalive;
     atomic_uint nthreads;
+    atomic_uint nbusy;
 } threadpool;
 /* STRUCTS */
 
+/**
+ * default for thpool_queue_max
+ */
+#define THPOOL_QUEUE_MAX 4096
+
+/**
+ * jobs a pool holds queued before thpool_add_job refuses more, so a burst
+ * is pushed back onto the callers, which run the work themselves or fail
+ * it, instead of growing the queue without bound; 0 for no limit
+ */
+extern unsigned int thpool_queue_max;
+
+/**
+ * @brief function pointer to be defined in the caller and provided to
+ *        thpool_drain; called for every job still queued once the drain
+ *        deadline has passed, so the job's owner can fail it and free
+ *        @param args instead of the job being silently dropped
+ *
+ * @param jobdef - function definition of the job that will not run
+ *
+ * @param args - pointer to args for the job function
+ *
+ * @return nothing
+ *
+ */
+typedef void (*jobcancel)(void (*jobdef)(void *), void *args);
+
 /**
  * @brief initilizes the thread pool
  *
@@ -84,7 +122,9 @@ threadpool *thpool_init(int num_threads);
  *
  * @param args - pointer to args for the job function
  *
- * @return 0 on success; nonzero on error
+ * @return 0 on success; nonzero on error, with errno set to EAGAIN if
+ *         thpool_queue_max jobs are already queued; @param args still
+ *         belongs to the caller then
  *
  */
 int thpool_add_job(threadpool *pool, void (*jobdef)(void *), void *args);
@@ -100,4 +140,24 @@ int thpool_add_job(threadpool *pool, void (*jobdef)(void *), void *args);
  */
 int thpool_destroy(threadpool *pool);
 
+/**
+ * @brief stops a thread pool gracefully; the workers keep running queued
+ *        jobs, including ones added meanwhile, until the queue is empty or
+ *        @param timeout_ns has passed; jobs still queued then are handed
+ *        to @param cancel, jobs already running are waited for, and the
+ *        pool is freed as by thpool_destroy
+ *
+ * @param pool - thread pool to be drained and freed
+ *
+ * @param timeout_ns - nanoseconds from now to keep running queued jobs
+ *
+ * @param cancel - called for each job left over; NULL runs them on the
+ *        calling thread instead
+ *
+ * @return number of jobs cancelled or run after the deadline on success;
+ *         -1 on error
+ *
+ */
+int thpool_drain(threadpool *pool, uint64_t timeout_ns, jobcancel cancel);
+
 #endif /* _THREADPOOL_H */
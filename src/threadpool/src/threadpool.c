@@ -1,14 +1,17 @@
 #include <threadpool.h>
+#include <log.h>
+#include <metrics.h>
+#include <trace.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
-#include <sched.h>
+#include <errno.h>
 #include <limits.h>
 
-#define MAX_NSEC 999999999
+unsigned int thpool_queue_max = THPOOL_QUEUE_MAX;
 
 /**
  * @brief custom free function to be supplied as a pointer
@@ -52,16 +55,20 @@ static int _jq_destroy(jobqueue *jq);
 static int _thread_joinall(threadpool *pool);
 
 /**
- * @brief helper function to implement an exponential backoff
- *        for worker threads waiting for a job
+ * @brief clears keepalive and wakes every idle worker so it sees it
  *
- * @param req - struct for nanosleep() that contains the current
- *        amount of time the thread is sleeping
+ * @param pool - pointer to thread pool
+ *
+ * @return nothing
  *
- * @return a struct timespec with the new amount of time for nanosleep()
+ */
+static void _thread_stopall(threadpool *pool);
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds, for the drain deadline
  *
  */
-static struct timespec _thread_exp_backoff(struct timespec req);
+static uint64_t _thread_now(void);
 
 /**
  * @brief function provided to worker threads; causes threads to either
@@ -100,14 +107,33 @@ thpool_add_job(threadpool *pool, void (*jobdef)(void *), void *args)
         goto ERR;
     }
 
-    j         = calloc(1, sizeof(struct job_));
+    j = calloc(1, sizeof(struct job_));
+    if (NULL == j)
+    {
+        fprintf(stderr, "! threadpool_add_job: couldn't calloc job\n");
+        ret = -1;
+        goto ERR;
+    }
     j->jobdef = jobdef;
     j->args   = args;
 
+    // one job needs one worker; the others stay asleep
     pthread_mutex_lock(&(jq->lock));
+    if (0 < thpool_queue_max && jq->len >= thpool_queue_max)
+    {
+        pthread_mutex_unlock(&(jq->lock));
+        free(j);
+        j     = NULL;
+        errno = EAGAIN;
+        ret   = -1;
+        goto ERR;
+    }
     push_back(jq->queue, j, f);
     jq->len++;
+    pthread_cond_signal(&(jq->notify));
     pthread_mutex_unlock(&(jq->lock));
+    metrics_add(METRIC_JOBS_ADDED, 1);
+    trace_job_enqueue(pool, j);
 
 ERR:
     return ret;
@@ -146,14 +172,14 @@ thpool_init(int nthreads)
 
     for (int i = 0; i < nthreads; i++)
     {
-#ifndef NDEBUG
-        fprintf(stderr, "\n ** starting thread %u **\n", i);
-#endif /* NDEBUG */
+        log_debug("threadpool_init: starting thread %u", i);
 
         err = pthread_create(&(pool->threads[i]), NULL, _thread_exec, pool);
         if (0 != err)
         {
             perror("! threadpool_init: couln't calloc jobqueue\n");
+            // only the workers already started are joined
+            pool->nthreads = i;
             goto ERR;
         }
     }
@@ -162,6 +188,10 @@ thpool_init(int nthreads)
     pool = NULL;
 
 ERR:
+    if (NULL != pool && NULL != pool->jq)
+    {
+        _thread_stopall(pool);
+    }
     err = _thread_joinall(pool);
     if (0 != err)
     {
@@ -195,7 +225,7 @@ thpool_destroy(threadpool *pool)
         goto ERR;
     }
 
-    pool->keepalive = 0;
+    _thread_stopall(pool);
 
     ret = _thread_joinall(pool);
     if (0 != ret)
@@ -217,6 +247,87 @@ ERR:
     pool = NULL;
     return ret;
 }
+
+int
+thpool_drain(threadpool *pool, uint64_t timeout_ns, jobcancel cancel)
+{
+    int             ret      = 0;
+    int             err      = 0;
+    uint64_t        deadline = 0;
+    struct timespec ts       = { 0 };
+    job *           j        = NULL;
+    jobqueue *      jq       = NULL;
+
+    if (NULL == pool || NULL == pool->jq)
+    {
+        fprintf(stderr, "! thpool_drain: NULL pool or jq\n");
+        return -1;
+    }
+    jq = pool->jq;
+
+    // nbusy is raised under the queue lock before len drops, so a job
+    // moving from the queue to a worker is never missed by both
+    deadline   = _thread_now() + timeout_ns;
+    ts.tv_sec  = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    pthread_mutex_lock(&(jq->lock));
+    while ((0 < jq->len || 0 < pool->nbusy) && ETIMEDOUT != err)
+    {
+        err = pthread_cond_timedwait(&(jq->idle), &(jq->lock), &ts);
+    }
+    pthread_mutex_unlock(&(jq->lock));
+
+    // jobs already running can't be interrupted, so the join still waits
+    // for them past the deadline
+    _thread_stopall(pool);
+    if (0 != _thread_joinall(pool))
+    {
+        fprintf(stderr, "! thpool_drain: error in joining threads\n");
+    }
+    pool->nthreads = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&(jq->lock));
+        j = (0 < jq->len) ? pop_front(jq->queue) : NULL;
+        if (NULL != j)
+        {
+            jq->len--;
+        }
+        pthread_mutex_unlock(&(jq->lock));
+        if (NULL == j)
+        {
+            break;
+        }
+
+        if (NULL != cancel)
+        {
+            cancel(j->jobdef, j->args);
+        }
+        else
+        {
+            trace_job_start(pool, j);
+            (j->jobdef)(j->args);
+        }
+        metrics_add(METRIC_JOBS_DONE, 1);
+        free(j);
+        j = NULL;
+        ret++;
+    }
+    if (0 < ret)
+    {
+        log_warn("thpool_drain: %d jobs %s after the deadline",
+                 ret,
+                 (NULL != cancel) ? "cancelled" : "run");
+    }
+
+    // the workers are joined already, so this only frees the pool
+    if (0 != thpool_destroy(pool))
+    {
+        ret = -1;
+    }
+    return ret;
+}
 /* PUBLIC FUNCTION DEFINTIONS */
 
 /* PRIVATE FUNCTION DEFINTIONS */
@@ -235,9 +346,11 @@ _jq_free_job(void *p)
 static jobqueue *
 _jq_init()
 {
-    jobqueue *ret = NULL;
-    jobqueue *jq  = NULL;
-    int       err = 0;
+    jobqueue *         ret    = NULL;
+    jobqueue *         jq     = NULL;
+    int                err    = 0;
+    int                ncond  = 0;
+    pthread_condattr_t attr;
 
     jq = calloc(1, sizeof(struct jobqueue_));
     if (NULL == jq)
@@ -260,11 +373,32 @@ _jq_init()
         goto ERR;
     }
 
+    // thpool_drain waits on idle against a CLOCK_MONOTONIC deadline
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    err = pthread_cond_init(&(jq->notify), &attr);
+    if (0 == err)
+    {
+        ncond++;
+        err = pthread_cond_init(&(jq->idle), &attr);
+    }
+    pthread_condattr_destroy(&attr);
+    if (0 != err)
+    {
+        fprintf(stderr, "! jq_init: couln't init condition variables\n");
+        goto ERR;
+    }
+
     ret = jq;
     jq  = NULL;
 ERR:
     if (NULL != jq)
     {
+        if (0 < ncond)
+        {
+            pthread_cond_destroy(&(jq->notify));
+        }
+
         err = ll_destroy(jq->queue);
         if (0 != err)
         {
@@ -307,6 +441,8 @@ _jq_destroy(jobqueue *jq)
     {
         perror("! jq_destroy: couln't destroy mutex\n");
     }
+    pthread_cond_destroy(&(jq->notify));
+    pthread_cond_destroy(&(jq->idle));
 
 ERR:
     free(jq);
@@ -327,9 +463,7 @@ _thread_joinall(threadpool *pool)
 
     for (uint i = 0; i < pool->nthreads; i++)
     {
-#ifndef NDEBUG
-        fprintf(stderr, " ** join thread %i **\n", i);
-#endif // NDEBUG
+        log_debug("_thread_joinall: joining thread %u", i);
         ret = pthread_join(pool->threads[i], NULL);
         if (0 != ret)
         {
@@ -341,36 +475,35 @@ RET:
     return ret;
 }
 
-static struct timespec
-_thread_exp_backoff(struct timespec req)
+static void
+_thread_stopall(threadpool *pool)
 {
-    req.tv_nsec = req.tv_nsec * 2;
-    if (MAX_NSEC < req.tv_nsec)
-    {
-        if (INT_MAX > req.tv_sec)
-        {
-            req.tv_sec++;
-            req.tv_nsec = 0;
-        }
-    }
+    // under the lock so a worker between its keepalive check and its wait
+    // can't miss the broadcast
+    pthread_mutex_lock(&(pool->jq->lock));
+    pool->keepalive = 0;
+    pthread_cond_broadcast(&(pool->jq->notify));
+    pthread_mutex_unlock(&(pool->jq->lock));
+}
 
-    return req;
+static uint64_t
+_thread_now(void)
+{
+    struct timespec ts = { 0 };
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static void *
 _thread_exec(void *threadpool_in)
 {
-    threadpool *    pool = (threadpool *)threadpool_in;
-    void *          ret  = NULL;
-    int             err  = 0;
-    struct timespec req  = { 0, 1 };
-    struct timespec rem  = { 0, 0 };
-    job *           j    = NULL;
-    jobqueue *      jq   = NULL;
-
-#ifndef NDEBUG
-    fprintf(stderr, " ** _thread_exec **\n");
-#endif // NDEBUG
+    threadpool *pool = (threadpool *)threadpool_in;
+    void *      ret  = NULL;
+    job *       j    = NULL;
+    jobqueue *  jq   = NULL;
+
+    log_debug("_thread_exec: worker started");
 
     if (pool == NULL || pool->jq == NULL)
     {
@@ -379,44 +512,42 @@ _thread_exec(void *threadpool_in)
     }
     jq = pool->jq;
 
-    while (pool->keepalive)
+    for (;;)
     {
-        if (0 >= jq->len)
+        // idle workers sleep until thpool_add_job or a stop wakes them,
+        // so work resubmitted from outside the pool, such as a transfer
+        // coming back from the poller's timers, is picked up at once
+        pthread_mutex_lock(&(jq->lock));
+        while (pool->keepalive && 0 == jq->len)
         {
-            err = nanosleep(&req, &rem);
-            if (0 != err)
-            {
-                perror("! _thread_exec: nanosleep terminated early\n");
-            }
-            req = _thread_exp_backoff(req);
-            sched_yield();
+            pthread_cond_wait(&(jq->notify), &(jq->lock));
         }
-        else
+        if (!pool->keepalive)
+        {
+            pthread_mutex_unlock(&(jq->lock));
+            break;
+        }
+        pool->nbusy++;
+        j = pop_front(jq->queue);
+        jq->len--;
+        pthread_mutex_unlock(&(jq->lock));
+
+        trace_job_start(pool, j);
+        (j->jobdef)(j->args);
+        metrics_add(METRIC_JOBS_DONE, 1);
+        free(j);
+        j = NULL;
+
+        // the last job to finish on an empty queue lets a drain go on
+        if (1 == atomic_fetch_sub(&(pool->nbusy), 1) && 0 == jq->len)
         {
             pthread_mutex_lock(&(jq->lock));
-            if (0 < jq->len)
-            {
-                j = pop_front(jq->queue);
-                jq->len--;
-            }
+            pthread_cond_broadcast(&(jq->idle));
             pthread_mutex_unlock(&(jq->lock));
-            if (NULL == j)
-            {
-#ifndef NDEBUG
-                fprintf(stderr, "! _thread_exec: jq empty\n");
-#endif // NDEBUG
-                goto ERR;
-            }
-
-            (j->jobdef)(j->args);
-            free(j);
-            j = NULL;
         }
     }
 
-#ifndef NDEBUG
-    fprintf(stderr, " ** _thread_exec done **\n");
-#endif // NDEBUG
+    log_debug("_thread_exec: worker done");
 
 ERR:
     return ret;
@@ -0,0 +1,54 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/**
+ * USDT static tracepoints on the request lifecycle, provider "capstone".
+ * Each probe is a single nop plus an ELF note until bpftrace or perf
+ * attaches to it; its arguments are left in registers or memory for the
+ * tracer to read, so keep them to values already at hand.
+ * They are compiled in when systemtap's sys/sdt.h is found at build time;
+ * without it, or with -DTRACE_NO_USDT, every trace_* call expands to
+ * nothing. See bench/latency.bt for a script that uses them.
+ *
+ *   probe            arguments                  fired by
+ *   accept           fd                         _tcp_acceptconn
+ *   conn__close      fd                         _tcp_releaseslot
+ *   request__parsed  fd, opcode, frame length   proto_conn_read
+ *   request__start   fd, opcode                 _conn_drain
+ *   response__sent   fd, opcode                 _conn_drain
+ *   job__enqueue     pool, job                  thpool_add_job
+ *   job__start       pool, job                  _thread_exec
+ *   file__open       rootfd, path, fd or -1     pathres_open
+ *
+ * response__sent fires when the request handler returns, which is after
+ * it has written its response.
+ */
+#if !defined(TRACE_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_USDT
+#define _trace1(name, a)       DTRACE_PROBE1(capstone, name, a)
+#define _trace2(name, a, b)    DTRACE_PROBE2(capstone, name, a, b)
+#define _trace3(name, a, b, c) DTRACE_PROBE3(capstone, name, a, b, c)
+#else
+#define _trace1(name, a)       ((void)0)
+#define _trace2(name, a, b)    ((void)0)
+#define _trace3(name, a, b, c) ((void)0)
+#endif // TRACE_USDT
+
+#define trace_accept(fd)             _trace1(accept, fd)
+#define trace_conn_close(fd)         _trace1(conn__close, fd)
+#define trace_request_start(fd, op)  _trace2(request__start, fd, op)
+#define trace_response_sent(fd, op)  _trace2(response__sent, fd, op)
+#define trace_job_enqueue(pool, job) _trace2(job__enqueue, pool, job)
+#define trace_job_start(pool, job)   _trace2(job__start, pool, job)
+#define trace_request_parsed(fd, op, len) \
+    _trace3(request__parsed, fd, op, len)
+#define trace_file_open(rootfd, path, fd) \
+    _trace3(file__open, rootfd, path, fd)
+
+#endif /* _TRACE_H */
@@ -0,0 +1,23 @@
+#ifndef _UNITS_H
+#define _UNITS_H
+
+#include <stdint.h>
+
+/**
+ * @brief parses a byte count, or a rate in bytes per second, with an
+ *        optional K, M or G suffix; every size and rate option uses this,
+ *        so the suffixes are powers of 1024 throughout
+ *
+ * @param str - start of the count; must begin with a digit
+ *
+ * @param end - set to the first character after the count and its suffix;
+ *        NULL if nothing may follow them
+ *
+ * @param bytes - set to the count
+ *
+ * @return 0 on success; -1 on a malformed count or one that overflows
+ *
+ */
+int units_bytes(const char *str, const char **end, uint64_t *bytes);
+
+#endif /* _UNITS_H */
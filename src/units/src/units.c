@@ -0,0 +1,62 @@
+#include <units.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+
+/* PUBLIC FUNCTION DEFINTIONS */
+int
+units_bytes(const char *str, const char **end, uint64_t *bytes)
+{
+    char *   e     = NULL;
+    uint64_t n     = 0;
+    int      shift = 0;
+
+    if (NULL == str || NULL == bytes)
+    {
+        return -1;
+    }
+
+    // strtoull would take a sign and wrap a negative count around
+    errno = 0;
+    n     = isdigit((unsigned char)*str) ? strtoull(str, &e, 10) : 0;
+    if (NULL == e || 0 != errno)
+    {
+        fprintf(stderr, "! units_bytes: bad size '%s'\n", str);
+        return -1;
+    }
+
+    switch (*e)
+    {
+        case 'G':
+            shift += 10;
+            // fall through
+        case 'M':
+            shift += 10;
+            // fall through
+        case 'K':
+            shift += 10;
+            e++;
+            break;
+        default:
+            break;
+    }
+    if (0 < shift && n > (UINT64_MAX >> shift))
+    {
+        fprintf(stderr, "! units_bytes: size too large '%s'\n", str);
+        return -1;
+    }
+    if (NULL == end && '\0' != *e)
+    {
+        fprintf(stderr, "! units_bytes: trailing '%s'\n", e);
+        return -1;
+    }
+
+    *bytes = n << shift;
+    if (NULL != end)
+    {
+        *end = e;
+    }
+    return 0;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
@@ -0,0 +1,172 @@
+#ifndef _UPLOAD_H
+#define _UPLOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ll.h>
+#include <pathres.h>
+
+/**
+ * name of the staging directory created beneath the server root; it has
+ * to live on the same filesystem as the destination for the commit
+ * rename to be atomic, and pathres refuses client paths that reach into it
+ */
+#define UPLOAD_STAGE_DIR PATHRES_STAGE_DIR
+
+/**
+ * @brief a byte range of an upload
+ *
+ * @param off - first byte of the range
+ *
+ * @param len - length of the range
+ *
+ */
+typedef struct upload_range_
+{
+    uint64_t off;
+    uint64_t len;
+} upload_range;
+
+/**
+ * @brief server wide table of uploads that have been opened but not yet
+ *        committed or aborted; uploads are looked up by ID so chunks for
+ *        the same upload can arrive on any connection and after the
+ *        client reconnects
+ *
+ * @param rootfd - server root from pathres_rootopen
+ *
+ * @param stagefd - staging directory beneath @param rootfd
+ *
+ * @param lock - protects @param uploads
+ *
+ * @param uploads - linked list of open uploads
+ *
+ */
+typedef struct upload_store_
+{
+    int             rootfd;
+    int             stagefd;
+    pthread_mutex_t lock;
+    ll *            uploads;
+} upload_store;
+
+/**
+ * @brief initializes the upload table and creates the staging directory;
+ *        staging files left over from a previous run are removed
+ *
+ * @param rootfd - server root from pathres_rootopen
+ *
+ * @return pointer to initialized upload table; NULL on error
+ *
+ */
+upload_store *upload_init(int rootfd);
+
+/**
+ * @brief opens a new upload; the staging file is preallocated to
+ *        @param size so chunks can be written at any offset in any order
+ *
+ * @param store - upload table
+ *
+ * @param path - destination path beneath the server root, nul terminated
+ *
+ * @param size - final size of the file
+ *
+ * @param overwrite - nonzero if an existing file at @param path may be
+ *        replaced at commit
+ *
+ * @param id - set to the ID of the new upload
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int upload_open(upload_store *store,
+                const char *  path,
+                uint64_t      size,
+                int           overwrite,
+                uint64_t *    id);
+
+/**
+ * @brief writes one chunk of an upload with pwrite(2); safe to call for
+ *        the same upload from several threads at once
+ *
+ * @param store - upload table
+ *
+ * @param id - upload ID from upload_open
+ *
+ * @param off - offset of the chunk in the file
+ *
+ * @param buf - chunk data
+ *
+ * @param len - length of @param buf
+ *
+ * @return 0 on success; nonzero on error or if the chunk would run past
+ *         the size given to upload_open
+ *
+ */
+int upload_write(upload_store *store,
+                 uint64_t      id,
+                 uint64_t      off,
+                 const void *  buf,
+                 size_t        len);
+
+/**
+ * @brief lists the ranges of an upload that have not been received yet;
+ *        lets a client that reconnects resend only what is missing
+ *
+ * @param store - upload table
+ *
+ * @param id - upload ID from upload_open
+ *
+ * @param ranges - array filled with up to @param max missing ranges
+ *
+ * @param max - length of @param ranges
+ *
+ * @return total number of missing ranges, which may be more than
+ *         @param max; -1 on error
+ *
+ */
+int upload_missing(upload_store *store,
+                   uint64_t      id,
+                   upload_range *ranges,
+                   int           max);
+
+/**
+ * @brief atomically moves a fully received upload to its destination
+ *        and forgets the ID
+ *
+ * @param store - upload table
+ *
+ * @param id - upload ID from upload_open
+ *
+ * @return 0 on success; -1 on error with errno set, EEXIST if the
+ *         destination exists and overwrite was not set, EAGAIN if parts
+ *         of the file are still missing
+ *
+ */
+int upload_commit(upload_store *store, uint64_t id);
+
+/**
+ * @brief discards an upload and its staging file
+ *
+ * @param store - upload table
+ *
+ * @param id - upload ID from upload_open
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int upload_abort(upload_store *store, uint64_t id);
+
+/**
+ * @brief aborts every open upload and frees the upload table
+ *
+ * @param store - upload table
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+int upload_destroy(upload_store *store);
+
+#endif /* _UPLOAD_H */
@@ -0,0 +1,659 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for O_PATH, fallocate and renameat2
+#endif
+#include <upload.h>
+#include <pathres.h>
+#include <flight.h>
+#include <iopolicy.h>
+#include <log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#define UPLOAD_NAME_LEN 24
+
+/**
+ * @brief one open upload
+ *
+ * @param id - upload ID handed to the client
+ *
+ * @param fd - staging file
+ *
+ * @param size - final size of the file
+ *
+ * @param overwrite - destination may be replaced at commit
+ *
+ * @param path - destination path beneath the server root
+ *
+ * @param name - staging file name beneath the staging directory
+ *
+ * @param lock - protects the extent list
+ *
+ * @param ext - sorted, non overlapping ranges received so far
+ *
+ * @param next - number of ranges in @param ext
+ *
+ * @param cap - allocated length of @param ext
+ *
+ * @param refs - the upload table plus every thread using the upload; the
+ *        last one closes and frees it
+ *
+ * @param wb - writeback of the staging file, kept bounded as chunks land
+ *
+ */
+typedef struct upload_
+{
+    uint64_t        id;
+    int             fd;
+    uint64_t        size;
+    int             overwrite;
+    char *          path;
+    char            name[UPLOAD_NAME_LEN];
+    pthread_mutex_t lock;
+    upload_range *  ext;
+    uint32_t        next;
+    uint32_t        cap;
+    atomic_uint     refs;
+    iopolicy_write  wb;
+} upload;
+
+/**
+ * @brief custom free function to be supplied as a pointer to the linked
+ *        list; drops the table's reference to the upload
+ *
+ * @param p - pointer to the node to be freed
+ *
+ * @return nothing
+ *
+ */
+static void _upload_free_node(void *p);
+
+/**
+ * @brief finds an upload by ID and takes a reference to it
+ *
+ * @param store - upload table
+ *
+ * @param id - upload ID
+ *
+ * @param unlink - nonzero to also remove it from the table
+ *
+ * @return the upload; NULL if there is no such ID
+ *
+ */
+static upload *_upload_get(upload_store *store, uint64_t id, int unlink);
+
+/**
+ * @brief drops one reference to an upload and frees it with the last one
+ *
+ * @param u - upload to release
+ *
+ * @return nothing
+ *
+ */
+static void _upload_release(upload *u);
+
+/**
+ * @brief records that [@param off, @param off + @param len) was received,
+ *        merging it with neighbouring ranges; caller holds u->lock
+ *
+ * @return 0 on success; nonzero on error
+ *
+ */
+static int _upload_mark(upload *u, uint64_t off, uint64_t len);
+
+/**
+ * @brief removes staging files left behind by a previous run
+ *
+ * @param store - upload table
+ *
+ * @return nothing
+ *
+ */
+static void _upload_sweep(upload_store *store);
+
+/* PUBLIC FUNCTION DEFINTIONS */
+upload_store *
+upload_init(int rootfd)
+{
+    upload_store *ret   = NULL;
+    upload_store *store = NULL;
+    int           err   = 0;
+
+    store = calloc(1, sizeof(struct upload_store_));
+    if (NULL == store)
+    {
+        fprintf(stderr, "! upload_init: couldn't calloc store\n");
+        goto ERR;
+    }
+    store->stagefd = -1;
+
+    err = mkdirat(rootfd, UPLOAD_STAGE_DIR, 0700);
+    if (0 != err && EEXIST != errno)
+    {
+        perror("! upload_init: couldn't create staging directory");
+        goto ERR;
+    }
+
+    store->stagefd = openat(
+        rootfd, UPLOAD_STAGE_DIR, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (0 > store->stagefd)
+    {
+        perror("! upload_init: couldn't open staging directory");
+        goto ERR;
+    }
+
+    store->uploads = ll_init();
+    if (NULL == store->uploads)
+    {
+        fprintf(stderr, "! upload_init: couldn't init upload list\n");
+        goto ERR;
+    }
+
+    err = pthread_mutex_init(&(store->lock), NULL);
+    if (0 != err)
+    {
+        perror("! upload_init: couldn't init mutex\n");
+        goto ERR;
+    }
+
+    store->rootfd = rootfd;
+    _upload_sweep(store);
+
+    ret   = store;
+    store = NULL;
+
+ERR:
+    if (NULL != store)
+    {
+        if (NULL != store->uploads)
+        {
+            ll_destroy(store->uploads);
+        }
+        if (0 <= store->stagefd)
+        {
+            close(store->stagefd);
+        }
+    }
+    free(store);
+    store = NULL;
+    return ret;
+}
+
+int
+upload_open(upload_store *store,
+            const char *  path,
+            uint64_t      size,
+            int           overwrite,
+            uint64_t *    id)
+{
+    int     ret = -1;
+    upload *u   = NULL;
+
+    if (NULL == store || NULL == path || NULL == id)
+    {
+        log_error("upload_open: NULL arguments");
+        goto ERR;
+    }
+
+    u = calloc(1, sizeof(struct upload_));
+    if (NULL == u)
+    {
+        log_error("upload_open: couldn't calloc upload");
+        goto ERR;
+    }
+    u->fd = -1;
+
+    // IDs are random so one client can't guess another's upload
+    if (sizeof(u->id) != getrandom(&(u->id), sizeof(u->id), 0))
+    {
+        log_perror("upload_open: getrandom error");
+        goto ERR;
+    }
+    snprintf(u->name, sizeof(u->name), "%016" PRIx64, u->id);
+
+    u->path = strdup(path);
+    if (NULL == u->path)
+    {
+        log_error("upload_open: couldn't copy path");
+        goto ERR;
+    }
+
+    u->fd = openat(store->stagefd,
+                   u->name,
+                   O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                   0644);
+    if (0 > u->fd)
+    {
+        log_perror("upload_open: couldn't create staging file");
+        goto ERR;
+    }
+
+    // reserve the space up front so parallel chunks don't fragment the
+    // file or fail half way with ENOSPC
+    if (0 < size && 0 != fallocate(u->fd, 0, 0, size)
+        && 0 != ftruncate(u->fd, size))
+    {
+        log_perror("upload_open: couldn't size staging file");
+        goto ERR;
+    }
+
+    if (0 != iopolicy_write_init(&(u->wb), u->fd))
+    {
+        goto ERR;
+    }
+
+    u->size      = size;
+    u->overwrite = overwrite;
+    pthread_mutex_init(&(u->lock), NULL);
+    atomic_init(&(u->refs), 1);
+
+    pthread_mutex_lock(&(store->lock));
+    ret = push_front(store->uploads, u, _upload_free_node);
+    pthread_mutex_unlock(&(store->lock));
+    if (0 != ret)
+    {
+        pthread_mutex_destroy(&(u->lock));
+        iopolicy_write_destroy(&(u->wb));
+        goto ERR;
+    }
+
+    *id = u->id;
+    u   = NULL;
+
+ERR:
+    if (NULL != u)
+    {
+        if (0 <= u->fd)
+        {
+            close(u->fd);
+            unlinkat(store->stagefd, u->name, 0);
+        }
+        free(u->path);
+    }
+    free(u);
+    u = NULL;
+    return ret;
+}
+
+int
+upload_write(upload_store *store,
+             uint64_t      id,
+             uint64_t      off,
+             const void *  buf,
+             size_t        len)
+{
+    int     ret   = -1;
+    upload *u     = NULL;
+    size_t  total = 0;
+    ssize_t wlen  = 0;
+
+    if (NULL == store || (NULL == buf && 0 < len))
+    {
+        log_error("upload_write: NULL arguments");
+        goto ERR;
+    }
+
+    u = _upload_get(store, id, 0);
+    if (NULL == u)
+    {
+        log_warn("upload_write: no upload %" PRIx64, id);
+        goto ERR;
+    }
+
+    if (off > u->size || len > u->size - off)
+    {
+        log_warn("upload_write: chunk past end of upload");
+        goto ERR;
+    }
+
+    while (total < len)
+    {
+        wlen = pwrite(u->fd, (const char *)buf + total, len - total, off + total);
+        if (0 > wlen)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            log_perror("upload_write: pwrite error");
+            goto ERR;
+        }
+        total += wlen;
+    }
+    flight_mark(FLIGHT_IO);
+    iopolicy_written(&(u->wb), off, len);
+
+    pthread_mutex_lock(&(u->lock));
+    ret = _upload_mark(u, off, len);
+    pthread_mutex_unlock(&(u->lock));
+
+ERR:
+    if (NULL != u)
+    {
+        _upload_release(u);
+    }
+    return ret;
+}
+
+int
+upload_missing(upload_store *store,
+               uint64_t      id,
+               upload_range *ranges,
+               int           max)
+{
+    int      ret = -1;
+    upload * u   = NULL;
+    uint64_t pos = 0;
+
+    if (NULL == store || (NULL == ranges && 0 < max))
+    {
+        log_error("upload_missing: NULL arguments");
+        goto ERR;
+    }
+
+    u = _upload_get(store, id, 0);
+    if (NULL == u)
+    {
+        goto ERR;
+    }
+
+    ret = 0;
+    pthread_mutex_lock(&(u->lock));
+    for (uint32_t i = 0; i <= u->next; i++)
+    {
+        uint64_t end = (i < u->next) ? u->ext[i].off : u->size;
+
+        if (pos < end)
+        {
+            if (ret < max)
+            {
+                ranges[ret].off = pos;
+                ranges[ret].len = end - pos;
+            }
+            ret++;
+        }
+        if (i < u->next)
+        {
+            pos = u->ext[i].off + u->ext[i].len;
+        }
+    }
+    pthread_mutex_unlock(&(u->lock));
+
+ERR:
+    if (NULL != u)
+    {
+        _upload_release(u);
+    }
+    return ret;
+}
+
+int
+upload_commit(upload_store *store, uint64_t id)
+{
+    int         ret      = -1;
+    int         err      = 0;
+    int         parentfd = -1;
+    upload *    u        = NULL;
+    const char *base     = NULL;
+    int         complete = 0;
+
+    if (NULL == store)
+    {
+        log_error("upload_commit: NULL store");
+        errno = EINVAL;
+        goto ERR;
+    }
+
+    u = _upload_get(store, id, 0);
+    if (NULL == u)
+    {
+        errno = ENOENT;
+        goto ERR;
+    }
+
+    pthread_mutex_lock(&(u->lock));
+    complete = (0 == u->size)
+               || (1 == u->next && 0 == u->ext[0].off
+                   && u->size == u->ext[0].len);
+    pthread_mutex_unlock(&(u->lock));
+    if (!complete)
+    {
+        errno = EAGAIN;
+        goto ERR;
+    }
+
+    parentfd = pathres_parent(store->rootfd, u->path, &base);
+    if (0 > parentfd)
+    {
+        goto ERR;
+    }
+
+    ret = renameat2(store->stagefd,
+                    u->name,
+                    parentfd,
+                    base,
+                    u->overwrite ? 0 : RENAME_NOREPLACE);
+    if (0 != ret)
+    {
+        goto ERR;
+    }
+
+    // the staging file is gone, forget the ID
+    _upload_release(_upload_get(store, id, 1));
+
+ERR:
+    err = errno;
+    if (0 <= parentfd)
+    {
+        close(parentfd);
+    }
+    if (NULL != u)
+    {
+        _upload_release(u);
+    }
+    errno = err;
+    return ret;
+}
+
+int
+upload_abort(upload_store *store, uint64_t id)
+{
+    int     ret = -1;
+    upload *u   = NULL;
+
+    if (NULL == store)
+    {
+        log_error("upload_abort: NULL store");
+        goto ERR;
+    }
+
+    u = _upload_get(store, id, 1);
+    if (NULL == u)
+    {
+        goto ERR;
+    }
+
+    ret = unlinkat(store->stagefd, u->name, 0);
+    _upload_release(u);
+
+ERR:
+    return ret;
+}
+
+int
+upload_destroy(upload_store *store)
+{
+    int   ret = 0;
+    node *n   = NULL;
+
+    if (NULL == store)
+    {
+        fprintf(stderr, "! upload_destroy: NULL store\n");
+        ret = -1;
+        goto ERR;
+    }
+
+    for (n = store->uploads->head; NULL != n; n = n->next)
+    {
+        unlinkat(store->stagefd, ((upload *)n->data)->name, 0);
+    }
+
+    ret = ll_destroy(store->uploads);
+    store->uploads = NULL;
+    pthread_mutex_destroy(&(store->lock));
+    close(store->stagefd);
+    free(store);
+    store = NULL;
+
+ERR:
+    return ret;
+}
+/* PUBLIC FUNCTION DEFINTIONS */
+
+/* PRIVATE FUNCTION DEFINTIONS */
+static void
+_upload_free_node(void *p)
+{
+    node *n = (node *)p;
+    _upload_release(n->data);
+    n->data = NULL;
+    n->next = NULL;
+    n->f    = NULL;
+    free(n);
+    return;
+}
+
+static upload *
+_upload_get(upload_store *store, uint64_t id, int unlink)
+{
+    upload *ret = NULL;
+    node *  n   = NULL;
+    uint    i   = 0;
+
+    pthread_mutex_lock(&(store->lock));
+    for (n = store->uploads->head; NULL != n; n = n->next, i++)
+    {
+        if (id == ((upload *)n->data)->id)
+        {
+            ret = n->data;
+            atomic_fetch_add(&(ret->refs), 1);
+            if (unlink)
+            {
+                // the node's free function drops the table's reference
+                ll_rm(store->uploads, i);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(store->lock));
+
+    return ret;
+}
+
+static void
+_upload_release(upload *u)
+{
+    if (NULL == u || 1 != atomic_fetch_sub(&(u->refs), 1))
+    {
+        return;
+    }
+
+    close(u->fd);
+    pthread_mutex_destroy(&(u->lock));
+    iopolicy_write_destroy(&(u->wb));
+    free(u->ext);
+    free(u->path);
+    free(u);
+    return;
+}
+
+static int
+_upload_mark(upload *u, uint64_t off, uint64_t len)
+{
+    uint64_t      end = off + len;
+    uint32_t      i   = 0;
+    uint32_t      j   = 0;
+    upload_range *ext = NULL;
+
+    if (0 == len)
+    {
+        return 0;
+    }
+
+    if (u->next == u->cap)
+    {
+        ext = realloc(u->ext, (u->cap ? u->cap * 2 : 8) * sizeof(*ext));
+        if (NULL == ext)
+        {
+            log_error("_upload_mark: couldn't grow extent list");
+            return -1;
+        }
+        u->ext = ext;
+        u->cap = u->cap ? u->cap * 2 : 8;
+    }
+
+    // skip ranges that end before this one starts, then fold in every
+    // range that overlaps or touches it
+    while (i < u->next && u->ext[i].off + u->ext[i].len < off)
+    {
+        i++;
+    }
+    for (j = i; j < u->next && u->ext[j].off <= end; j++)
+    {
+        if (u->ext[j].off < off)
+        {
+            off = u->ext[j].off;
+        }
+        if (u->ext[j].off + u->ext[j].len > end)
+        {
+            end = u->ext[j].off + u->ext[j].len;
+        }
+    }
+
+    memmove(&u->ext[i + 1], &u->ext[j], (u->next - j) * sizeof(*u->ext));
+    u->ext[i].off = off;
+    u->ext[i].len = end - off;
+    u->next       = u->next - (j - i) + 1;
+
+    return 0;
+}
+
+static void
+_upload_sweep(upload_store *store)
+{
+    int            fd  = -1;
+    DIR *          dir = NULL;
+    struct dirent *ent = NULL;
+
+    fd = openat(store->stagefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (0 > fd)
+    {
+        return;
+    }
+
+    dir = fdopendir(fd);
+    if (NULL == dir)
+    {
+        close(fd);
+        return;
+    }
+
+    while (NULL != (ent = readdir(dir)))
+    {
+        if (DT_REG == ent->d_type)
+        {
+            unlinkat(store->stagefd, ent->d_name, 0);
+        }
+    }
+
+    closedir(dir);
+    return;
+}
+/* PRIVATE FUNCTION DEFINITIONS */